@@ -0,0 +1,309 @@
+/* Admission control: per-address token buckets and the processing queue limit (see admit.h).
+
+A bucket is its token count and when it was last topped up. Tokens are only added when the
+address sends, for the time since then, so quiet addresses cost nothing. A frame that finds too
+few tokens takes none and is told how long until there are enough.
+
+The limits are plain words loaded atomically, a reload stores new ones while the workers run.
+Buckets keep their tokens across a reload and are cut down to a smaller burst as they are used.
+
+Reference:
+    https://en.wikipedia.org/wiki/Token_bucket
+*/
+#include "admit.h"
+#include "server.h"
+
+#include <sched.h>
+#include <time.h>
+
+int admit_active;
+int admit_queue_limit;
+
+struct admit_slot
+{
+    uint32_t key;    // IPv4 address, 0 for an empty slot
+    int lock;
+    double tokens;
+    uint64_t last;   // ns the bucket was last topped up
+} __attribute__((aligned(32)));
+
+struct admit_limits
+{
+    uint32_t rate;   // values per second per address, 0 for none
+    uint32_t burst;  // bucket size in values
+    uint32_t queue;  // frames queued for the processing threads, 0 for none
+};
+
+static struct
+{
+    const char *path;  // -l file, NULL without one
+    uint32_t rate;
+    uint32_t burst;
+    pthread_mutex_t claim_lock;  // held while a slot changes address
+    struct admit_slot slots[ADMIT_PEERS];
+} admit = { .claim_lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Frames this worker thread knows to be queued, from its last admit_depth() plus what it admitted since
+static __thread size_t depth;
+static __thread int depth_known;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void slot_lock(struct admit_slot *s){
+    // Held for a few loads and stores, only contended by one address's connections on two workers
+    while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE)){
+        sched_yield();
+    }
+}
+
+static void slot_unlock(struct admit_slot *s){
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+static int read_limits(const char *path, struct admit_limits *out, char *err, size_t err_len){
+    /* Parse a limits file: one "<name> <number>" per line, '#' starts a comment.
+
+    params:
+        path (char *): The file.
+        out (admit_limits *): Set to the limits in it (unset ones 0, burst defaults to rate).
+        err (char *): Set to what is wrong with it on error.
+        err_len (size_t): Room at err.
+
+    return:
+        0 on success, -1 on error.
+    */
+    char line[256];
+    int burst_set = 0;
+    int line_no = 0;
+    FILE *f = fopen(path, "r");
+
+    memset(out, 0, sizeof(*out));
+    if (f == NULL){
+        snprintf(err, err_len, "can't open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL){
+        char name[32];
+        char extra[2];
+        long long value;
+        char *hash = strchr(line, '#');
+
+        line_no++;
+        if (hash != NULL){
+            *hash = '\0';
+        }
+        int fields = sscanf(line, "%31s %lld %1s", name, &value, extra);
+        if (fields <= 0){
+            continue;
+        }
+        if (fields != 2 || value < 0 || value > ADMIT_MAX_LIMIT){
+            snprintf(err, err_len, "%s line %d: expected <name> <number from 0 to %d>", path, line_no, ADMIT_MAX_LIMIT);
+            fclose(f);
+            return -1;
+        }
+        if (strcmp(name, "rate") == 0){
+            out->rate = (uint32_t)value;
+        }
+        else if (strcmp(name, "burst") == 0){
+            out->burst = (uint32_t)value;
+            burst_set = 1;
+        }
+        else if (strcmp(name, "queue") == 0){
+            out->queue = (uint32_t)value;
+        }
+        else{
+            snprintf(err, err_len, "%s line %d: unknown limit '%s' (rate, burst or queue)", path, line_no, name);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+
+    if (!burst_set){
+        out->burst = out->rate;
+    }
+    if (out->rate > 0 && out->burst == 0){
+        snprintf(err, err_len, "%s: burst must be at least 1 with a rate", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void apply(const struct admit_limits *l){
+    // Publish new limits to the workers
+    __atomic_store_n(&admit.burst, l->burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&admit.rate, l->rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&admit_queue_limit, (int)l->queue, __ATOMIC_RELAXED);
+    __atomic_store_n(&admit_active, l->rate > 0 || l->queue > 0, __ATOMIC_RELAXED);
+}
+
+int admit_init(const char *path){
+    /* Load the -l limits. Must be called before any worker starts.
+
+    params:
+        path (char *): The limits file, NULL for no limits.
+
+    return:
+        0 on success, -1 if the file can't be read or is malformed.
+    */
+    struct admit_limits l;
+    char err[512];
+
+    admit.path = path;
+    if (path == NULL){
+        return 0;
+    }
+    if (read_limits(path, &l, err, sizeof(err)) == -1){
+        fprintf(stderr, "Limits: %s.\n", err);
+        return -1;
+    }
+    apply(&l);
+    return 0;
+}
+
+void admit_reload(void){
+    // SIGHUP: read the -l file again. A bad file leaves the limits as they were.
+    struct admit_limits l;
+    char err[512];
+
+    if (admit.path == NULL){
+        log_msg(LOG_WARN, "SIGHUP: no limits file (-l) to reload.\n");
+        return;
+    }
+    if (read_limits(admit.path, &l, err, sizeof(err)) == -1){
+        log_msg(LOG_ERROR, "Limits not reloaded, %s.\n", err);
+        return;
+    }
+    apply(&l);
+    log_msg(LOG_WARN, "Limits reloaded: rate %u values/s, burst %u, queue %u frames.\n", l.rate, l.burst, l.queue);
+}
+
+void admit_depth(size_t frames){
+    /* Tell admit_frame() how many frames are queued for the processing threads (pipeline_depth()),
+    once per pass of a worker's loop. Threads that never call it are never refused for the queue.
+    */
+    depth = frames;
+    depth_known = 1;
+}
+
+static struct admit_slot *find_slot(uint32_t key){
+    /* Find the address's bucket, or give it the empty slot or least recently used one of those
+    probed. Returned locked.
+
+    Only claims change a slot's key, and they take turns on admit.claim_lock, so two new
+    addresses never share a bucket or one address gets two (as in rudp.c).
+    */
+    uint32_t h = (key * 2654435769u) >> 20;
+
+    for (int probe = 0; probe < ADMIT_PROBES; probe++){
+        struct admit_slot *s = &admit.slots[(h + probe) & (ADMIT_PEERS - 1)];
+        slot_lock(s);
+        if (s->key == key){
+            return s;
+        }
+        int empty = s->key == 0;
+        slot_unlock(s);
+        if (empty){
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&admit.claim_lock);
+    while (1){
+        struct admit_slot *stalest = NULL;
+        uint64_t stalest_last = 0;
+
+        // Probe again, another claim may have given the address a bucket since
+        for (int probe = 0; probe < ADMIT_PROBES; probe++){
+            struct admit_slot *s = &admit.slots[(h + probe) & (ADMIT_PEERS - 1)];
+            slot_lock(s);
+            if (s->key == key || s->key == 0){
+                if (s->key == 0){
+                    s->key = key;
+                    s->last = 0;
+                }
+                pthread_mutex_unlock(&admit.claim_lock);
+                return s;
+            }
+            if (stalest == NULL || s->last < stalest_last){
+                stalest = s;
+                stalest_last = s->last;
+            }
+            slot_unlock(s);
+        }
+
+        // Its address may have sent since it was probed, then it is no longer the one to reuse
+        slot_lock(stalest);
+        if (stalest->last == stalest_last){
+            stalest->key = key;
+            stalest->last = 0;
+            pthread_mutex_unlock(&admit.claim_lock);
+            return stalest;
+        }
+        slot_unlock(stalest);
+    }
+}
+
+static uint32_t take_tokens(uint32_t sender, uint32_t cost, uint32_t rate, uint32_t burst){
+    // Spend 'cost' tokens from the sender's bucket. 0 if it had them, else ms until it will.
+    uint64_t now = now_ns();
+    uint32_t retry = 0;
+    struct admit_slot *s = find_slot(sender);
+
+    // A new bucket starts full
+    if (s->last == 0){
+        s->tokens = burst;
+    }
+    else{
+        s->tokens += (double)(now - s->last) * rate / 1e9;
+    }
+    if (s->tokens > burst){
+        s->tokens = burst;
+    }
+    s->last = now;
+
+    // A frame bigger than the whole bucket would never get in, it costs a full one
+    double need = cost < burst ? cost : burst;
+    if (s->tokens >= need){
+        s->tokens -= need;
+    }
+    else{
+        retry = (uint32_t)((need - s->tokens) * 1000.0 / rate) + 1;
+    }
+    slot_unlock(s);
+    return retry;
+}
+
+uint32_t admit_frame(uint32_t sender, uint32_t cost){
+    /* Decide whether a data frame is processed (call only while admit_limited()), and charge it
+    if it is. Once per frame, a frame asked about twice pays twice.
+
+    params:
+        sender (uint32_t): Who sent it, from agg_sender_of() (0, anything but IPv4, has no bucket).
+        cost (uint32_t): Values it carries.
+
+    return:
+        0 to process it, otherwise the milliseconds the sender should wait before sending it again.
+    */
+    uint32_t queue = (uint32_t)__atomic_load_n(&admit_queue_limit, __ATOMIC_RELAXED);
+    uint32_t rate = __atomic_load_n(&admit.rate, __ATOMIC_RELAXED);
+
+    // Shed load before it is queued, the frames already waiting are what keeps latency up
+    if (queue > 0 && depth_known && depth >= queue){
+        stats_count(STAT_OVERLOADED, 1);
+        return ADMIT_QUEUE_RETRY_MS;
+    }
+    if (rate > 0 && sender != 0){
+        uint32_t retry = take_tokens(sender, cost, rate, __atomic_load_n(&admit.burst, __ATOMIC_RELAXED));
+        if (retry > 0){
+            stats_count(STAT_RATE_LIMITED, 1);
+            return retry;
+        }
+    }
+    depth++;
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Admission control (-l), see admit.c.
+
+    Two limits keep one noisy producer (or a burst from everybody) from queueing up work the
+    server can't get through, they are read from the -l file and read again on SIGHUP:
+
+        rate <values/s>   every IPv4 address gets a token bucket filling at this rate, and a
+                          data frame costs one token per value it carries
+        burst <values>    the bucket's size (default one second of 'rate')
+        queue <frames>    -P/-D only: frames handed to the processing threads and not yet
+                          taken off their rings, counted over every worker
+
+    0 (or leaving a line out) means no limit. A data frame over either one is answered with
+    STATUS_BUSY and the milliseconds to wait before sending it again, without being processed.
+    Queries, key/value requests and version 1 frames (which have no status to say so) are
+    never refused.
+
+    Buckets live in a table shared by every worker, each slot with its own lock (SO_REUSEPORT
+    spreads one address's connections over all of them). ADMIT_PEERS is how many addresses are
+    tracked at once (a power of two), when the probed slots are full the one that sent least
+    recently is forgotten. Workers look at the queue once per pass, so it can run past the
+    limit by what they read in one.
+
+    admit_frame() takes the frame's tokens as it decides, so it is called once per frame: a
+    tcp frame whose processor is full keeps the decision it got (see queue_frame()).
+*/
+#define ADMIT_PEERS 4096
+#define ADMIT_PROBES 8
+#define ADMIT_QUEUE_RETRY_MS 10  // retry hint for frames refused because the queue is full
+#define ADMIT_MAX_LIMIT 1000000000
+
+extern int admit_active;
+extern int admit_queue_limit;
+
+int admit_init(const char *path);
+void admit_reload(void);
+void admit_depth(size_t frames);
+uint32_t admit_frame(uint32_t sender, uint32_t cost);
+
+static inline int admit_limited(void){
+    // 1 if any limit is set, a single load otherwise
+    return __atomic_load_n(&admit_active, __ATOMIC_RELAXED);
+}
+
+static inline int admit_queue_limited(void){
+    // 1 if the queue limit is set, so a worker has to tell admit_depth() where the queue stands
+    return __atomic_load_n(&admit_queue_limit, __ATOMIC_RELAXED) != 0;
+}
+
+#endif
@@ -0,0 +1,524 @@
+/* Running aggregates over the received values (see agg.h).
+
+Layout:
+    - A thread gets its shard the first time it records a value, and the shard is put on a
+      list the queries walk. The list lock is only taken to add a shard or to walk the list.
+    - Recording a value updates two summaries of the thread's shard: the sender's and the
+      current window's. A window is numbered by unix seconds / -W. When a thread sees a new
+      window number it folds the slot of the window before last into the global summary, under
+      the shard's lock, and reuses it. The global scope is that plus the two live windows.
+    - A query copies every shard's summaries for its scope into a fresh one, the way stats.c
+      merges the latency histograms. The writers keep going meanwhile: every counter, bucket
+      and register is stored and loaded with relaxed atomics (see histogram.h), so a query
+      never reads one torn, but it reads them one at a time. A result is not a snapshot, its
+      count, sum, quantiles and distinct estimate may be a few values apart from each other.
+      The shard's lock doesn't stop its owner recording into a window, it only keeps the
+      window's slot from being folded into the global summary and reused during the copy.
+    - Shards that no thread owns (agg_shard_new()) are filled from the write-ahead log by
+      recover.c and only counted by queries once published. A value whose window has already
+      been let go of (replayed late, or the clock went back) only counts globally.
+
+Reference:
+    https://algo.inria.fr/flajolet/Publications/FlFuGaMe07.pdf (HyperLogLog)
+*/
+#include "agg.h"
+#include "protocol.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#define AGG_HLL_REGISTERS (1 << AGG_HLL_BITS)
+
+static __thread struct agg_shard *thread_agg;
+static __thread int thread_agg_failed;  // no memory for this thread's shard, don't keep trying
+
+static struct
+{
+    int window_secs;
+    pthread_mutex_t lock;      // guards the list of shards
+    struct agg_shard *shards;
+} agg = { .window_secs = AGG_DEFAULT_WINDOW, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t hash_value(uint32_t value){
+    // splitmix64 finalizer, spreads every input bit over the whole word for the HyperLogLog
+    uint64_t h = value + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static int summary_init(struct agg_summary *s){
+    memset(s->hll, 0, sizeof(s->hll));
+    return histogram_init(&s->values, AGG_HIST_BITS);
+}
+
+static void summary_reset(struct agg_summary *s){
+    histogram_reset(&s->values);
+    memset(s->hll, 0, sizeof(s->hll));
+}
+
+static void hll_raise(uint8_t *reg, uint8_t rank){
+    // Registers are written by the summary's one writer and read by queries meanwhile
+    if (rank > *reg){
+        __atomic_store_n(reg, rank, __ATOMIC_RELAXED);
+    }
+}
+
+static void summary_merge(struct agg_summary *dst, const struct agg_summary *src){
+    histogram_merge(&dst->values, &src->values);
+    for (int i = 0; i < AGG_HLL_REGISTERS; i++){
+        hll_raise(&dst->hll[i], __atomic_load_n(&src->hll[i], __ATOMIC_RELAXED));
+    }
+}
+
+static uint64_t hll_estimate(const uint8_t *hll){
+    // Raw HyperLogLog estimate, with linear counting while many registers are still empty
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < AGG_HLL_REGISTERS; i++){
+        sum += ldexp(1.0, -hll[i]);
+        zeros += hll[i] == 0;
+    }
+    double m = AGG_HLL_REGISTERS;
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0){
+        estimate = m * log(m / zeros);
+    }
+    return (uint64_t)(estimate + 0.5);
+}
+
+static struct agg_shard *shard_create(void){
+    /* Set up the calling thread's shard and put it on the list.
+
+    return:
+        The shard, NULL if out of memory (the thread's values then go unaggregated).
+    */
+    struct agg_shard *shard = agg_shard_new();
+    if (shard == NULL){
+        log_msg(LOG_WARN, "Out of memory for aggregates, this thread's values won't be counted.\n");
+        return NULL;
+    }
+    agg_shard_publish(shard);
+    return shard;
+}
+
+static uint64_t window_now(void){
+    // Number of the tumbling window we're in
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec / agg.window_secs;
+}
+
+static struct agg_summary *sender_summary(struct agg_shard *shard, uint32_t sender){
+    // The sender's slot (claimed on first sight), NULL once every slot is taken by others
+    if (sender == 0){
+        return NULL;
+    }
+    if (shard->last != NULL && shard->last->addr == sender){
+        return &shard->last->summary;
+    }
+    uint32_t start = (uint32_t)(hash_value(sender) % AGG_SENDERS);
+    for (int probe = 0; probe < AGG_SENDERS; probe++){
+        struct agg_sender *slot = &shard->senders[(start + probe) % AGG_SENDERS];
+        if (slot->addr == 0){
+            __atomic_store_n(&slot->addr, sender, __ATOMIC_RELEASE);
+        }
+        if (slot->addr == sender){
+            shard->last = slot;
+            return &slot->summary;
+        }
+    }
+    return NULL;
+}
+
+void agg_init(int window_secs){
+    /* Set the -W window length. Must be called before any value is recorded.
+
+    params:
+        window_secs (int): Length of each tumbling window in seconds.
+    */
+    agg.window_secs = window_secs;
+}
+
+static void shard_record(struct agg_shard *shard, uint64_t window, uint32_t sender, const uint32_t *values, uint32_t count){
+    // Add values from tumbling window number 'window' to a shard only the caller writes to
+    struct agg_summary *current = &shard->windows[window & 1];
+    int late = 0;
+
+    // Moving into a new window takes over the slot of the one before last, once it's counted globally
+    if (shard->window_ids[window & 1] != window){
+        pthread_mutex_lock(&shard->lock);
+        if (window < shard->window_ids[window & 1]){
+            // Its slot has moved on already, keep the lock while recording into the global summary
+            current = &shard->global;
+            late = 1;
+        }
+        else{
+            if (shard->window_ids[window & 1] != 0){
+                summary_merge(&shard->global, current);
+            }
+            summary_reset(current);
+            shard->window_ids[window & 1] = window;
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+
+    struct agg_summary *from = sender_summary(shard, sender);
+
+    for (uint32_t i = 0; i < count; i++){
+        uint64_t h = hash_value(values[i]);
+        uint32_t reg = (uint32_t)(h >> (64 - AGG_HLL_BITS));
+        uint8_t rank = (uint8_t)__builtin_clzll((h << AGG_HLL_BITS) | (1ULL << (AGG_HLL_BITS - 1))) + 1;
+
+        histogram_record(&current->values, values[i]);
+        hll_raise(&current->hll[reg], rank);
+        if (from != NULL){
+            histogram_record(&from->values, values[i]);
+            hll_raise(&from->hll[reg], rank);
+        }
+    }
+    if (late){
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void agg_values(uint32_t sender, const uint32_t *values, uint32_t count){
+    /* Add a run of decoded values to the calling thread's shard.
+
+    params:
+        sender (uint32_t): Who sent them, from agg_sender_of() (0 if unknown).
+        values (uint32_t *): The values, host order.
+        count (uint32_t): How many there are.
+    */
+    struct agg_shard *shard = thread_agg;
+    if (shard == NULL){
+        if (thread_agg_failed){
+            return;
+        }
+        shard = thread_agg = shard_create();
+        if (shard == NULL){
+            thread_agg_failed = 1;
+            return;
+        }
+    }
+    shard_record(shard, window_now(), sender, values, count);
+}
+
+struct agg_shard *agg_shard_new(void){
+    /* A shard no thread owns, for state rebuilt from the log. Queries don't see it until it is
+    passed to agg_shard_publish().
+
+    return:
+        The shard, NULL if out of memory.
+    */
+    struct agg_shard *shard = calloc(1, sizeof(*shard));
+    if (shard == NULL){
+        return NULL;
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+    int failed = summary_init(&shard->global) || summary_init(&shard->windows[0]) || summary_init(&shard->windows[1]);
+    for (int i = 0; i < AGG_SENDERS && !failed; i++){
+        failed = summary_init(&shard->senders[i].summary);
+    }
+    if (failed){
+        agg_shard_free(shard);
+        return NULL;
+    }
+    return shard;
+}
+
+void agg_shard_free(struct agg_shard *shard){
+    // Only for shards that were never published
+    histogram_free(&shard->global.values);
+    histogram_free(&shard->windows[0].values);
+    histogram_free(&shard->windows[1].values);
+    for (int i = 0; i < AGG_SENDERS; i++){
+        histogram_free(&shard->senders[i].summary.values);
+    }
+    free(shard);
+}
+
+void agg_shard_publish(struct agg_shard *shard){
+    // Count the shard in every query from now on. Whoever fills it must be its only writer.
+    pthread_mutex_lock(&agg.lock);
+    shard->next = agg.shards;
+    agg.shards = shard;
+    pthread_mutex_unlock(&agg.lock);
+}
+
+void agg_shard_values(struct agg_shard *shard, uint32_t time, uint32_t sender, const uint32_t *values, uint32_t count){
+    /* Add a run of values received at 'time' to a shard from agg_shard_new().
+
+    params:
+        shard (agg_shard *): Shard the caller is the only writer of.
+        time (uint32_t): Unix seconds they were received, picks their window.
+        sender (uint32_t): Who sent them (0 if unknown).
+        values (uint32_t *): The values, host order.
+        count (uint32_t): How many there are.
+    */
+    shard_record(shard, time / agg.window_secs, sender, values, count);
+}
+
+void agg_shard_merge(struct agg_shard *dst, const struct agg_shard *src){
+    /* Add everything in one shard to another. Nothing may write to src meanwhile, and dst must
+    be the caller's (queries may be reading it).
+    */
+    pthread_mutex_lock(&dst->lock);
+    summary_merge(&dst->global, &src->global);
+    for (int w = 0; w < 2; w++){
+        uint64_t id = src->window_ids[w];
+        if (id == 0){
+            continue;
+        }
+        if (dst->window_ids[w] == id){
+            summary_merge(&dst->windows[w], &src->windows[w]);
+        }
+        else if (dst->window_ids[w] > id){
+            summary_merge(&dst->global, &src->windows[w]);
+        }
+        else{
+            if (dst->window_ids[w] != 0){
+                summary_merge(&dst->global, &dst->windows[w]);
+            }
+            summary_reset(&dst->windows[w]);
+            summary_merge(&dst->windows[w], &src->windows[w]);
+            dst->window_ids[w] = id;
+        }
+    }
+    pthread_mutex_unlock(&dst->lock);
+
+    // A sender that doesn't fit in dst any more is still in its global and window summaries
+    for (int i = 0; i < AGG_SENDERS; i++){
+        if (src->senders[i].addr != 0){
+            struct agg_summary *to = sender_summary(dst, src->senders[i].addr);
+            if (to != NULL){
+                summary_merge(to, &src->senders[i].summary);
+            }
+        }
+    }
+}
+
+static uint8_t *summary_encode(const struct agg_summary *s, uint8_t *p){
+    // count, sum, min, max, the used buckets as (index, count) pairs, then the registers
+    const struct histogram *h = &s->values;
+    uint64_t head[4] = { h->count, h->sum, h->min, h->max };
+    uint32_t used = 0;
+    uint8_t *used_at;
+
+    memcpy(p, head, sizeof(head));
+    used_at = p + sizeof(head);
+    p = used_at + sizeof(used);
+    for (int i = 0; i < h->num_buckets; i++){
+        if (h->buckets[i] != 0){
+            uint32_t index = i;
+            memcpy(p, &index, sizeof(index));
+            memcpy(p + sizeof(index), &h->buckets[i], sizeof(h->buckets[i]));
+            p += sizeof(index) + sizeof(h->buckets[i]);
+            used++;
+        }
+    }
+    memcpy(used_at, &used, sizeof(used));
+    memcpy(p, s->hll, sizeof(s->hll));
+    return p + sizeof(s->hll);
+}
+
+static const uint8_t *summary_decode(struct agg_summary *s, const uint8_t *p, const uint8_t *end){
+    // Merge one summary_encode()d summary into s, NULL if it is cut short or doesn't fit
+    struct histogram *h = &s->values;
+    uint64_t head[4];
+    uint32_t used;
+
+    if ((size_t)(end - p) < sizeof(head) + sizeof(used)){
+        return NULL;
+    }
+    memcpy(head, p, sizeof(head));
+    memcpy(&used, p + sizeof(head), sizeof(used));
+    p += sizeof(head) + sizeof(used);
+    if ((size_t)(end - p) < (size_t)used * 12 + sizeof(s->hll)){
+        return NULL;
+    }
+    for (uint32_t i = 0; i < used; i++, p += 12){
+        uint32_t index;
+        uint64_t n;
+        memcpy(&index, p, sizeof(index));
+        memcpy(&n, p + sizeof(index), sizeof(n));
+        if (index >= (uint32_t)h->num_buckets){
+            return NULL;
+        }
+        h->buckets[index] += n;
+    }
+    h->count += head[0];
+    h->sum += head[1];
+    if (head[2] < h->min){
+        h->min = head[2];
+    }
+    if (head[3] > h->max){
+        h->max = head[3];
+    }
+    for (int i = 0; i < AGG_HLL_REGISTERS; i++){
+        if (p[i] > s->hll[i]){
+            s->hll[i] = p[i];
+        }
+    }
+    return p + sizeof(s->hll);
+}
+
+uint8_t *agg_shard_encode(const struct agg_shard *shard, size_t *len){
+    /* Serialize a shard from agg_shard_new() for a snapshot (host order, only read back by this
+    build): -W, the precisions, the window numbers, then the global summary, both windows and
+    every sender's. Only the buckets in use are written.
+
+    params:
+        shard (agg_shard *): Shard nothing writes to meanwhile.
+        len (size_t *): Set to the encoded size.
+
+    return:
+        A malloc()ed buffer, NULL if out of memory.
+    */
+    uint32_t head[4] = { agg.window_secs, AGG_HIST_BITS, AGG_HLL_BITS, 0 };
+    size_t summary_max = 36 + (size_t)shard->global.values.num_buckets * 12 + sizeof(shard->global.hll);
+
+    for (int i = 0; i < AGG_SENDERS; i++){
+        head[3] += shard->senders[i].addr != 0;
+    }
+    uint8_t *buf = malloc(sizeof(head) + sizeof(shard->window_ids) + (3 + head[3]) * (sizeof(uint32_t) + summary_max));
+    if (buf == NULL){
+        return NULL;
+    }
+    uint8_t *p = buf;
+    memcpy(p, head, sizeof(head));
+    p += sizeof(head);
+    memcpy(p, shard->window_ids, sizeof(shard->window_ids));
+    p += sizeof(shard->window_ids);
+    p = summary_encode(&shard->global, p);
+    p = summary_encode(&shard->windows[0], p);
+    p = summary_encode(&shard->windows[1], p);
+    for (int i = 0; i < AGG_SENDERS; i++){
+        if (shard->senders[i].addr != 0){
+            memcpy(p, &shard->senders[i].addr, sizeof(uint32_t));
+            p = summary_encode(&shard->senders[i].summary, p + sizeof(uint32_t));
+        }
+    }
+    *len = p - buf;
+    return buf;
+}
+
+int agg_shard_decode(struct agg_shard *shard, const uint8_t *buf, size_t len){
+    /* Load an agg_shard_encode()d shard into a new one from agg_shard_new(). Windows saved under
+    a different -W only count globally.
+
+    return:
+        0 on success, -1 if the data is cut short or from a build with other precisions.
+    */
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+    uint32_t head[4];
+    uint64_t ids[2];
+
+    if (len < sizeof(head) + sizeof(ids)){
+        return -1;
+    }
+    memcpy(head, p, sizeof(head));
+    memcpy(ids, p + sizeof(head), sizeof(ids));
+    p += sizeof(head) + sizeof(ids);
+    if (head[1] != AGG_HIST_BITS || head[2] != AGG_HLL_BITS || head[3] > AGG_SENDERS){
+        return -1;
+    }
+    if ((p = summary_decode(&shard->global, p, end)) == NULL){
+        return -1;
+    }
+    for (int w = 0; w < 2; w++){
+        int keep = head[0] == (uint32_t)agg.window_secs && ids[w] != 0 && (ids[w] & 1) == (uint64_t)w;
+        if ((p = summary_decode(keep ? &shard->windows[w] : &shard->global, p, end)) == NULL){
+            return -1;
+        }
+        if (keep){
+            shard->window_ids[w] = ids[w];
+        }
+    }
+    for (uint32_t i = 0; i < head[3]; i++){
+        uint32_t addr;
+        if ((size_t)(end - p) < sizeof(addr)){
+            return -1;
+        }
+        memcpy(&addr, p, sizeof(addr));
+        struct agg_summary *to = sender_summary(shard, addr);
+        if (to == NULL || (p = summary_decode(to, p + sizeof(addr), end)) == NULL){
+            return -1;
+        }
+    }
+    return p == end ? 0 : -1;
+}
+
+int agg_query(int scope, uint32_t sender, struct agg_result *out){
+    /* Merge every thread's shard for one scope.
+
+    params:
+        scope (int): QUERY_GLOBAL, QUERY_SENDER or QUERY_WINDOW (the last complete window).
+        sender (uint32_t): The sender to report on for QUERY_SENDER.
+        out (agg_result *): Filled in with the merged summary (all zero if nothing matched).
+
+    return:
+        0 on success, -1 if out of memory.
+    */
+    struct agg_summary merged;
+    uint64_t last_window = window_now() - 1;
+    const double quantiles[4] = { 50, 90, 99, 99.9 };
+
+    memset(out, 0, sizeof(*out));
+    if (summary_init(&merged) == -1){
+        return -1;
+    }
+
+    pthread_mutex_lock(&agg.lock);
+    for (struct agg_shard *shard = agg.shards; shard != NULL; shard = shard->next){
+        if (scope == QUERY_GLOBAL){
+            pthread_mutex_lock(&shard->lock);
+            summary_merge(&merged, &shard->global);
+            for (int w = 0; w < 2; w++){
+                if (shard->window_ids[w] != 0){
+                    summary_merge(&merged, &shard->windows[w]);
+                }
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+        else if (scope == QUERY_WINDOW){
+            // A thread that saw nothing in that window has already moved on, or never got there
+            pthread_mutex_lock(&shard->lock);
+            if (shard->window_ids[last_window & 1] == last_window){
+                summary_merge(&merged, &shard->windows[last_window & 1]);
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+        else{
+            for (int i = 0; i < AGG_SENDERS; i++){
+                if (__atomic_load_n(&shard->senders[i].addr, __ATOMIC_ACQUIRE) == sender){
+                    summary_merge(&merged, &shard->senders[i].summary);
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&agg.lock);
+
+    out->count = merged.values.count;
+    out->sum = merged.values.sum;
+    if (out->count > 0){
+        out->min = (uint32_t)merged.values.min;
+        out->max = (uint32_t)merged.values.max;
+        out->distinct = hll_estimate(merged.hll);
+        for (int q = 0; q < 4; q++){
+            out->quantiles[q] = (uint32_t)histogram_percentile(&merged.values, quantiles[q]);
+        }
+    }
+    if (scope == QUERY_WINDOW){
+        out->window_start = (uint32_t)(last_window * agg.window_secs);
+        out->window_secs = agg.window_secs;
+    }
+    histogram_free(&merged.values);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#ifndef AGG_H
+#define AGG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+
+#include "histogram.h"
+
+/* Running aggregates over the received values, see agg.c.
+
+    Every thread that handles values (a worker, or a processing thread with -P) keeps its own
+    shard and is its only writer, so recording a value takes no lock and no atomic
+    read-modify-write (the shard's lock is only taken when a window rolls over). A REQ_QUERY
+    merges every shard when it is asked.
+
+    Each summary holds count, sum, min and max, approximate quantiles (a log-linear histogram,
+    within 1/2^(AGG_HIST_BITS-1) of the true value) and an approximate distinct count
+    (HyperLogLog with 2^AGG_HLL_BITS registers, about 1.04/sqrt(2^AGG_HLL_BITS) error). A
+    shard has one summary for everything, one per sender (IPv4 address, the first AGG_SENDERS
+    it sees) and one for each of the current and the last tumbling window of -W seconds.
+
+    With -D, state rebuilt from the write-ahead log at startup lives in shards no thread owns
+    (agg_shard_new()), which recover.c fills, snapshots with agg_shard_encode() and publishes.
+*/
+#define AGG_HIST_BITS 7
+#define AGG_HLL_BITS 11
+#define AGG_SENDERS 64
+#define AGG_DEFAULT_WINDOW 10
+
+struct agg_summary
+{
+    struct histogram values;
+    uint8_t hll[1 << AGG_HLL_BITS];
+};
+
+struct agg_sender
+{
+    uint32_t addr;  // 0 for a free slot
+    struct agg_summary summary;
+};
+
+struct agg_shard
+{
+    pthread_mutex_t lock;           // held to fold a window into 'global', and by queries reading either
+    struct agg_summary global;      // every window that has been folded in, the live ones aren't
+    struct agg_summary windows[2];  // window number n lives in windows[n & 1]
+    uint64_t window_ids[2];         // 0 for a slot never used
+    struct agg_sender senders[AGG_SENDERS];  // later senders only count globally
+    struct agg_sender *last;        // slot of the sender seen last, most runs come from one peer
+    struct agg_shard *next;
+};
+
+// What a query hands back, in host order (see query_result in protocol.h for the wire form)
+struct agg_result
+{
+    uint64_t count;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+    uint64_t distinct;
+    uint32_t quantiles[4];  // p50, p90, p99, p99.9
+    uint32_t window_start;  // unix seconds, QUERY_WINDOW only
+    uint32_t window_secs;
+};
+
+static inline uint32_t agg_sender_of(const struct sockaddr *addr){
+    // The key a peer's values are aggregated under, 0 for anything but IPv4
+    if (addr == NULL || addr->sa_family != AF_INET){
+        return 0;
+    }
+    return ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+}
+
+void agg_init(int window_secs);
+void agg_values(uint32_t sender, const uint32_t *values, uint32_t count);
+int agg_query(int scope, uint32_t sender, struct agg_result *out);
+
+struct agg_shard *agg_shard_new(void);
+void agg_shard_free(struct agg_shard *shard);
+void agg_shard_publish(struct agg_shard *shard);
+void agg_shard_values(struct agg_shard *shard, uint32_t time, uint32_t sender, const uint32_t *values, uint32_t count);
+void agg_shard_merge(struct agg_shard *dst, const struct agg_shard *src);
+uint8_t *agg_shard_encode(const struct agg_shard *shard, size_t *len);
+int agg_shard_decode(struct agg_shard *shard, const uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,342 @@
+/* Benchmarks for the wire format and the server's per-frame work, and loopback runs of the load
+generator against a real server. `make bench` builds all of it with BENCH_CFLAGS (-O2 unless
+given) and runs it.
+
+How-to:
+    ./benchmark [-s <server binary> -c <client binary>] [-d <seconds>] [-p <port>] [-l <label>]
+
+    Without -s/-c only the in-process benchmarks run. With them every loopback case starts the
+    server on 127.0.0.1:<port> (default 5690), runs the client's load generator (-b -j) against
+    it for -d seconds (default 2) and stops the server again.
+
+Output:
+    One JSON object per line, so two runs can be compared line by line. The first line
+    describes the run (the -l label, say the commit and flags, and the CPU count). In-process
+    benchmarks report ns per operation (one frame, or 4 KB for the crc), and ns per value when
+    an operation carries more than one. Loopback runs report what the client's -j prints:
+    throughput and latency percentiles in microseconds.
+
+Every in-process benchmark is timed over at least BENCH_MIN_NS and the best of BENCH_ROUNDS
+rounds is reported, which is the least disturbed by whatever else the machine was doing.
+*/
+#include "server.h"
+
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define BENCH_MIN_NS 200000000ULL
+#define BENCH_ROUNDS 3
+#define BENCH_MESSAGES 4096   // v1 frames encoded/decoded per pass, 20 KB stays in L1/L2
+#define BENCH_BATCH 64        // values per v2 batch frame
+#define BENCH_KEYS 65536
+
+struct bench
+{
+    const char *name;
+    void (*run)(uint64_t iters);
+    uint32_t values;  // values per operation, for ns_per_value (0: don't report it)
+};
+
+// Keeps the compiler from dropping work whose result is never used
+static volatile uint64_t sink;
+
+static struct client_message messages[BENCH_MESSAGES];
+static uint8_t batch_frame[sizeof(struct batch_request) + BENCH_BATCH * sizeof(uint32_t)];
+static uint32_t batch_values[BENCH_BATCH];
+static uint8_t crc_block[4096];
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void encode_v1(uint64_t iters){
+    // Pack values into version 1 frames the way the client does
+    for (uint64_t i = 0; i < iters; i++){
+        struct client_message *m = &messages[i % BENCH_MESSAGES];
+        m->version = PROTOCOL_V1;
+        m->data = htonl((uint32_t)i);
+    }
+    sink += messages[iters % BENCH_MESSAGES].data;
+}
+
+static void decode_v1(uint64_t iters){
+    // Check the version the way frame_length() does and unpack the data the way process_message() does
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iters; i++){
+        const struct client_message *m = &messages[i % BENCH_MESSAGES];
+        if (m->version == PROTOCOL_V1){
+            sum += ntohl(m->data);
+        }
+    }
+    sink += sum;
+}
+
+static void encode_v2_batch(uint64_t iters){
+    // Header plus BENCH_BATCH values swapped into network order
+    struct batch_request *req = (struct batch_request *)batch_frame;
+    for (uint64_t i = 0; i < iters; i++){
+        req->header.version = PROTOCOL_V2;
+        req->header.type = REQ_BATCH;
+        req->header.length = htons(sizeof(batch_frame) - sizeof(req->header));
+        req->header.id = htonl((uint32_t)i);
+        req->count = htonl(BENCH_BATCH);
+        batch_values[0] = (uint32_t)i;
+        swap_values(batch_frame + sizeof(*req), batch_values, ntohl(req->count));
+    }
+    sink += req->header.id;
+}
+
+static void decode_v2_batch(uint64_t iters){
+    // Find the frame's length and swap its values back, what a worker and process_values() do
+    uint32_t decoded[BENCH_BATCH];
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iters; i++){
+        long len = frame_length(batch_frame, sizeof(batch_frame));
+        uint32_t n = ntohl(((struct batch_request *)batch_frame)->count);
+        swap_values(decoded, batch_frame + sizeof(struct batch_request), n);
+        sum += len + decoded[i % BENCH_BATCH];
+    }
+    sink += sum;
+}
+
+static void process_v1(uint64_t iters){
+    // A whole version 1 frame through process_frame(): check, decode, aggregate, reply
+    uint8_t reply[MAX_REPLY_SIZE];
+    for (uint64_t i = 0; i < iters; i++){
+        const struct client_message *m = &messages[i % BENCH_MESSAGES];
+        sink += process_frame((const uint8_t *)m, sizeof(*m), 0x7f000001, reply);
+    }
+}
+
+static void process_v2_data(uint64_t iters){
+    uint8_t reply[MAX_REPLY_SIZE];
+    struct data_request req = { .header = { PROTOCOL_V2, REQ_DATA, htons(sizeof(uint32_t)), 0 } };
+    for (uint64_t i = 0; i < iters; i++){
+        req.header.id = (uint32_t)i;
+        req.data = messages[i % BENCH_MESSAGES].data;
+        sink += process_frame((const uint8_t *)&req, sizeof(req), 0x7f000001, reply);
+    }
+}
+
+static void process_v2_batch(uint64_t iters){
+    uint8_t reply[MAX_REPLY_SIZE];
+    for (uint64_t i = 0; i < iters; i++){
+        sink += process_frame(batch_frame, sizeof(batch_frame), 0x7f000001, reply);
+    }
+}
+
+static void process_kv_put(uint64_t iters){
+    uint8_t reply[MAX_REPLY_SIZE];
+    struct kv_request req = { .header = { PROTOCOL_V2, REQ_PUT, htons(2 * sizeof(uint32_t)), 0 } };
+    for (uint64_t i = 0; i < iters; i++){
+        req.key = htonl((uint32_t)(i % BENCH_KEYS));
+        req.value = htonl((uint32_t)i);
+        sink += process_frame((const uint8_t *)&req, sizeof(req), 0x7f000001, reply);
+    }
+}
+
+static void process_kv_get(uint64_t iters){
+    // Every key was stored by process_kv_put, which runs first
+    uint8_t reply[MAX_REPLY_SIZE];
+    struct kv_request req = { .header = { PROTOCOL_V2, REQ_GET, htons(sizeof(uint32_t)), 0 } };
+    for (uint64_t i = 0; i < iters; i++){
+        req.key = htonl((uint32_t)(i % BENCH_KEYS));
+        sink += process_frame((const uint8_t *)&req, sizeof(req) - sizeof(uint32_t), 0x7f000001, reply);
+    }
+}
+
+static void crc_4k(uint64_t iters){
+    // What the write-ahead log spends per 4 KB of records (-D)
+    uint32_t crc = 0;
+    for (uint64_t i = 0; i < iters; i++){
+        crc = wal_crc(crc, crc_block, sizeof(crc_block));
+    }
+    sink += crc;
+}
+
+static const struct bench benches[] = {
+    { "encode_v1", encode_v1, 0 },
+    { "decode_v1", decode_v1, 0 },
+    { "encode_v2_batch64", encode_v2_batch, BENCH_BATCH },
+    { "decode_v2_batch64", decode_v2_batch, BENCH_BATCH },
+    { "process_frame_v1", process_v1, 0 },
+    { "process_frame_v2_data", process_v2_data, 0 },
+    { "process_frame_v2_batch64", process_v2_batch, BENCH_BATCH },
+    { "process_frame_kv_put", process_kv_put, 0 },
+    { "process_frame_kv_get", process_kv_get, 0 },
+    { "wal_crc_4k", crc_4k, 0 },
+};
+
+static void run_bench(const struct bench *b){
+    /* Time one benchmark and print its line.
+
+    params:
+        b (bench *): The benchmark.
+    */
+    uint64_t iters = 1024;
+    double best = 0;
+
+    // Find an iteration count that takes at least BENCH_MIN_NS
+    while (1){
+        uint64_t start = now_ns();
+        b->run(iters);
+        uint64_t took = now_ns() - start;
+        if (took >= BENCH_MIN_NS){
+            best = (double)took / iters;
+            break;
+        }
+        iters = took > 0 && BENCH_MIN_NS / took < 16 ? iters * (BENCH_MIN_NS / took + 1) : iters * 16;
+    }
+    for (int r = 1; r < BENCH_ROUNDS; r++){
+        uint64_t start = now_ns();
+        b->run(iters);
+        double ns = (double)(now_ns() - start) / iters;
+        if (ns < best){
+            best = ns;
+        }
+    }
+
+    printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f",
+           b->name, (unsigned long long)iters, best, 1e9 / best);
+    if (b->values > 0){
+        printf(",\"ns_per_value\":%.3f", best / b->values);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static pid_t start_server(const char *server, const char *socktype, const char *port){
+    /* Start the server binary in the background with its output thrown away, and give it time
+    to bind.
+
+    return:
+        Its pid, -1 on error.
+    */
+    pid_t pid = fork();
+    if (pid == -1){
+        fprintf(stderr, "Failed to fork the server: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0){
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1){
+            dup2(null, STDOUT_FILENO);
+        }
+        execl(server, server, "-t", socktype, "-p", port, "-L", "error", (char *)NULL);
+        fprintf(stderr, "Failed to run %s: %s\n", server, strerror(errno));
+        _exit(127);
+    }
+    struct timespec wait = { 0, 300000000 };
+    nanosleep(&wait, NULL);
+    return pid;
+}
+
+static int run_load(const char *client, const char *socktype, const char *version, const char *port, const char *secs){
+    /* Run the client's load generator against the local server, its JSON line goes straight to
+    our stdout.
+
+    return:
+        0 if it ran, -1 if it couldn't be run or died. Lost frames are in its line already.
+    */
+    int status;
+    pid_t pid = fork();
+    if (pid == -1){
+        fprintf(stderr, "Failed to fork the client: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0){
+        execl(client, client, "-b", "-j", "-t", socktype, "-V", version, "-s", "127.0.0.1", "-p", port,
+              "-c", "4", "-i", "32", "-d", secs, (char *)NULL);
+        fprintf(stderr, "Failed to run %s: %s\n", client, strerror(errno));
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127){
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    const char *server = NULL;
+    const char *client = NULL;
+    const char *secs = "2";
+    const char *port = "5690";
+    const char *label = "";
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:d:p:l:")) != -1){
+        switch (opt){
+            case 's': server = optarg; break;
+            case 'c': client = optarg; break;
+            case 'd': secs = optarg; break;
+            case 'p': port = optarg; break;
+            case 'l': label = optarg; break;
+            default:
+                errno = 22;
+                fprintf(stderr, "Usage: %s [-s <server> -c <client>] [-d <seconds>] [-p <port>] [-l <label>]\n", argv[0]);
+                return -1;
+        }
+    }
+    if ((server == NULL) != (client == NULL) || atof(secs) <= 0){
+        errno = 22;
+        fprintf(stderr, "-s and -c go together, and -d must be more than 0 seconds.\n");
+        return -1;
+    }
+
+    printf("{\"name\":\"run\",\"label\":\"%s\",\"cpus\":%ld,\"time\":%ld}\n", label,
+           sysconf(_SC_NPROCESSORS_ONLN), (long)time(NULL));
+
+    // The server's own setup for what process_frame() touches, minus the threads
+    struct server_stats stats;
+    if (stats_init(&stats) == -1 || kv_init(BENCH_KEYS * 2) == -1){
+        fprintf(stderr, "Out of memory for the benchmarks.\n");
+        return -1;
+    }
+    stats_bind(&stats);
+    log_level = LOG_ERROR;
+    agg_init(AGG_DEFAULT_WINDOW);
+    for (int i = 0; i < BENCH_MESSAGES; i++){
+        messages[i].version = PROTOCOL_V1;
+        messages[i].data = htonl(i * 2654435761u);
+    }
+    for (int i = 0; i < BENCH_BATCH; i++){
+        batch_values[i] = i * 2654435761u;
+    }
+    for (size_t i = 0; i < sizeof(crc_block); i++){
+        crc_block[i] = (uint8_t)(i * 31);
+    }
+    encode_v2_batch(1);
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++){
+        run_bench(&benches[i]);
+    }
+
+    if (server == NULL){
+        return 0;
+    }
+
+    // Loopback: both transports, both wire versions, one server each so none inherits another's state
+    const char *socktypes[] = { "tcp", "udp" };
+    const char *versions[] = { "1", "2" };
+    for (int s = 0; s < 2; s++){
+        for (int v = 0; v < 2; v++){
+            pid_t pid = start_server(server, socktypes[s], port);
+            if (pid == -1){
+                return -1;
+            }
+            if (run_load(client, socktypes[s], versions[v], port, secs) == -1){
+                fprintf(stderr, "Loopback run over %s v%s failed.\n", socktypes[s], versions[v]);
+                failed = 1;
+            }
+            fflush(stdout);
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return failed ? -1 : 0;
+}
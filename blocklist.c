@@ -0,0 +1,147 @@
+/* Per-peer bad frame limit (see blocklist.h).
+
+Each slot of the table is one peer: its address and the time its block ends packed into one
+64 bit word, so the workers can check a peer without the lock (a word is either all the old
+peer or all the new one), plus the strike count, only touched under the lock.
+
+Times are whole seconds of CLOCK_MONOTONIC_COARSE, offset by one so 0 means never blocked.
+*/
+#include "blocklist.h"
+#include "log.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+int blocklist_active;
+
+struct block_slot
+{
+    uint64_t word;     // address << 32 | second its block ends, 0 for an empty slot
+    uint32_t strikes;  // bad frames since the peer was last quiet for BLOCK_SECONDS
+    uint32_t last;     // second of the last strike
+};
+
+static struct
+{
+    int limit;  // 0 when -e 0 turned blocking off
+    pthread_mutex_t lock;
+    struct block_slot slots[BLOCKLIST_SIZE];
+} blocks = { .limit = BLOCK_DEFAULT_LIMIT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec + 1;
+}
+
+static int peer_address(const struct sockaddr *addr, uint32_t *out){
+    // The IPv4 address to hold strikes against, -1 for anything else
+    if (addr == NULL || addr->sa_family != AF_INET){
+        return -1;
+    }
+    *out = ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+    return 0;
+}
+
+static uint32_t slot_of(uint32_t addr, int probe){
+    // Fibonacci hash so neighbouring addresses don't crowd one run of slots
+    return (((addr * 2654435769u) >> 20) + probe) & (BLOCKLIST_SIZE - 1);
+}
+
+void blocklist_init(int limit){
+    /* Set the -e limit. Must be called before any worker starts.
+
+    params:
+        limit (int): Bad frames a peer may send before it is blocked, 0 to never block.
+    */
+    blocks.limit = limit;
+}
+
+int blocklist_check(const struct sockaddr *addr){
+    /* Look a peer up without the lock (use blocklist_blocked(), which skips this while
+    nobody is blocked).
+
+    return:
+        1 if the peer is blocked right now, 0 otherwise.
+    */
+    uint32_t peer;
+    if (peer_address(addr, &peer) == -1){
+        return 0;
+    }
+    for (int probe = 0; probe < BLOCKLIST_PROBES; probe++){
+        uint64_t word = __atomic_load_n(&blocks.slots[slot_of(peer, probe)].word, __ATOMIC_RELAXED);
+        if (word == 0){
+            return 0;
+        }
+        if ((uint32_t)(word >> 32) == peer){
+            return (uint32_t)word >= now_seconds();
+        }
+    }
+    return 0;
+}
+
+int blocklist_strike(const struct sockaddr *addr){
+    /* Count one bad frame against the peer that sent it.
+
+    params:
+        addr (sockaddr *): Who sent it (anything but IPv4 is never blocked).
+
+    return:
+        1 if this strike got the peer blocked, 0 otherwise.
+    */
+    uint32_t peer;
+    uint32_t now;
+    struct block_slot *slot = NULL;
+    struct block_slot *stalest = NULL;
+    int blocked = 0;
+
+    if (blocks.limit == 0 || peer_address(addr, &peer) == -1){
+        return 0;
+    }
+
+    pthread_mutex_lock(&blocks.lock);
+    now = now_seconds();
+    for (int probe = 0; probe < BLOCKLIST_PROBES; probe++){
+        struct block_slot *s = &blocks.slots[slot_of(peer, probe)];
+        if (s->word == 0 || (uint32_t)(s->word >> 32) == peer){
+            slot = s;
+            break;
+        }
+        // Peers still blocked are never evicted
+        if ((uint32_t)s->word < now && (stalest == NULL || s->last < stalest->last)){
+            stalest = s;
+        }
+    }
+    if (slot == NULL){
+        slot = stalest;
+    }
+
+    // Every slot around this peer holds a blocked one, let this strike go
+    if (slot != NULL){
+        if (slot->word == 0 || (uint32_t)(slot->word >> 32) != peer || now - slot->last > BLOCK_SECONDS){
+            slot->strikes = 0;
+        }
+        if (slot->word == 0 || (uint32_t)(slot->word >> 32) != peer){
+            __atomic_store_n(&slot->word, (uint64_t)peer << 32, __ATOMIC_RELAXED);
+        }
+        slot->last = now;
+        if (++slot->strikes >= (uint32_t)blocks.limit){
+            __atomic_store_n(&slot->word, (uint64_t)peer << 32 | (now + BLOCK_SECONDS), __ATOMIC_RELAXED);
+            __atomic_store_n(&blocklist_active, 1, __ATOMIC_RELAXED);
+            slot->strikes = 0;
+            blocked = 1;
+        }
+    }
+    pthread_mutex_unlock(&blocks.lock);
+
+    if (blocked){
+        struct in_addr in = { .s_addr = htonl(peer) };
+        char name[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in, name, sizeof(name));
+        log_msg(LOG_WARN, "Blocking %s for %d seconds after %d bad frames.\n", name, BLOCK_SECONDS, blocks.limit);
+    }
+    return blocked;
+}
@@ -0,0 +1,50 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Per-peer bad frame limit (-e), see blocklist.c.
+
+    Every frame the server has to reject (see reject_frame()) is a strike against the IPv4
+    address that sent it. A peer that collects -e strikes without a quiet BLOCK_SECONDS
+    between them is blocked for BLOCK_SECONDS: its new TCP connections are closed as soon as
+    they are accepted and its datagrams are dropped unread.
+
+    The table is shared by every worker (SO_REUSEPORT spreads one peer's connections over all
+    of them). Strikes are rare and take a lock, the check on every accept/datagram is a load
+    while nobody has been blocked yet and a few lock-free probes after that.
+
+    BLOCKLIST_SIZE is how many peers are tracked at once (a power of two), when the probed
+    slots are full the stalest unblocked peer is forgotten.
+*/
+#define BLOCKLIST_SIZE 4096
+#define BLOCKLIST_PROBES 8
+#define BLOCK_SECONDS 60
+#define BLOCK_DEFAULT_LIMIT 10
+
+extern int blocklist_active;
+
+void blocklist_init(int limit);
+int blocklist_strike(const struct sockaddr *addr);
+int blocklist_check(const struct sockaddr *addr);
+
+static inline int blocklist_blocked(const struct sockaddr *addr){
+    // 1 if the peer is blocked, a single load until somebody has been
+    if (!__atomic_load_n(&blocklist_active, __ATOMIC_RELAXED)){
+        return 0;
+    }
+    return blocklist_check(addr);
+}
+
+static inline int blocklist_fd_blocked(int fd){
+    // Same for a connected socket whose peer address we weren't handed
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    if (!__atomic_load_n(&blocklist_active, __ATOMIC_RELAXED) || getpeername(fd, (struct sockaddr *)&peer, &len) == -1){
+        return 0;
+    }
+    return blocklist_check((struct sockaddr *)&peer);
+}
+
+#endif
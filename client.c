@@ -6,6 +6,45 @@ How-to:
     After running make. You can send message with the client executable
     ./client -x <32-bit unsigned int data> -t <udp/tcp> -s <ip> -p <number>
 
+    To stream many frames, repeat -x and/or give a total count. They are sent through the
+    client engine (client_engine.c) with many frames in flight at once
+    ./client -x 1 -x 2 -n 100000 -t tcp -s <ip> -p <number> [-c <connections>] [-i <in flight>]
+             [-T <threads>]
+
+    To measure the server, -b runs the built-in load generator (see loadgen.c)
+    ./client -b -t <udp/tcp> -s <ip> -p <number> [-c <connections>] [-i <in flight>]
+             [-r <msgs/sec>] [-d <seconds> | -n <count>] [-x <value> ...] [-j]
+
+    To send values from a file (or stdin with -f -), -f coalesces them into version 2 batch
+    frames of up to -B values each, one reply per batch
+    ./client -f <file|-> -t <udp/tcp> -s <ip> -p <number> [-B <values per batch>]
+             [-c <connections>] [-i <in flight>] [-T <threads>]
+
+    To ask the server for its running aggregates of the values it received (count, sum, min/max,
+    quantiles, distinct values), over everything, one sender's values (ours unless an address is
+    given) or the last complete -W window
+    ./client -q <global|sender[=<ip>]|window> -t <udp/tcp> -s <ip> -p <number>
+
+    To get, put or delete keys in the server's key/value store (uint32_t keys and values), repeat
+    -G, -P and -D in any order. They run in that order, one round trip at a time. With -n they
+    are cycled until -n were sent and only the round trip latencies are printed
+    ./client -G <key> -P <key>=<value> -D <key> -t <udp/tcp> -s <ip> -p <number> [-n <count>]
+
+    Give -s more than once (each as <ip>[:<port>], -p is the port for those without one) to
+    spread -x, -n, -f and -b across several servers. The client engine resolves each one once,
+    keeps -c connections open to each and sends every frame to the less loaded of two of them
+    (power of two choices). A server that keeps timing out is left out for a while (see
+    client_engine.h). -q and -G/-P/-D talk to a single server
+    ./client -x 1 -n 100000 -t tcp -s <ip>[:<port>] -s <ip>[:<port>] ... [-p <number>]
+
+    Over udp, -R makes -x/-n and -f reliable: every frame carries a sequence number and is
+    retransmitted (on a timer that follows the measured round trip time) until the server acks
+    it or 3 seconds pass, and the server never processes a retransmit twice (see protocol.h)
+    ./client -x 1 -n 100000 -t udp -R -s <ip> -p <number> [-c <connections>] [-i <in flight>]
+
+    Any of these take -V 2 to use the version 2 framing, where every frame carries a request
+    id that the server echoes back with a status (see protocol.h)
+
 What this does:
     This will establish a connection with the running server code on the port 
     and socket type provided. It will then send the provided data in a struct
@@ -33,8 +72,8 @@ Reference:
 #include "client.h"
 
 int main(int argc, char *argv[]){
-    // Check that the correct number of arguments were given     
-    if (argc != 9){
+    // Check that the required arguments were given     
+    if (argc < 7){
         // Set error to invalid arg
         errno = 22;
         fprintf(stderr, "Incorrect number of arguments.\n");
@@ -42,13 +81,44 @@ int main(int argc, char *argv[]){
     }
     
     // Save command line arguments in these
+    struct client_options opts;
     uint32_t data;
     char *socktype;
     char *ip;
     char *port;
     
     // Make sure the command line is correct and populate the needed data
-    command_line_check(argc, argv, &data, &port, &socktype, &ip);
+    command_line_check(argc, argv, &opts);
+
+    // The load generator handles its own connections and reporting
+    if (opts.bench){
+        return run_load(&opts);
+    }
+
+    // Values from a file or stdin go out in batches
+    if (opts.file != NULL){
+        return send_file(&opts);
+    }
+
+    // A query is one version 2 request with a bigger reply
+    if (opts.query){
+        return query_server(&opts);
+    }
+
+    // Key/value operations go one at a time, each waits for its reply
+    if (opts.num_kv_ops > 0){
+        return kv_requests(&opts);
+    }
+
+    // Several frames, several servers or retransmits: hand them all to the client engine (client_engine.c)
+    if (opts.count > 1 || opts.num_servers > 1 || opts.reliable){
+        return stream_values(&opts);
+    }
+
+    data = opts.values[0];
+    socktype = opts.socktype;
+    ip = opts.ip;
+    port = opts.port;
 
     // Prep socket address structures for holding needed socket flags/information
     struct addrinfo start_socket_addr, *res, *p;
@@ -67,11 +137,20 @@ int main(int argc, char *argv[]){
     /* 
         Custom structures packed to hold a 1 byte version number in both, and a 4 byte 
         data message in the client_message strucutre.
-        See packing details in client.h and reference to packing logic.
+        See packing details in protocol.h and reference to packing logic.
     */
     struct client_message send_message;
     struct server_message server_message_struct;
 
+    /* With -V 2 the value goes out as a version 2 data_request instead and the reply is a
+        reply_header that has to echo our request id. See protocol.h.
+    */
+    struct data_request send_request;
+    uint8_t reply[PROTOCOL_MAX_FRAME];
+    void *frame = &send_message;
+    int frame_len = sizeof(send_message);
+    int reply_len = sizeof(server_message_struct);
+
     // Fill socket addr with 0s
     memset(&start_socket_addr, 0, sizeof(start_socket_addr));
 
@@ -114,11 +193,22 @@ int main(int argc, char *argv[]){
     }
 
     /* Prep message by setting verion to 1 (1 byte) and encoding data
-        This struct is already packed to avoid padding. See client.h 
+        This struct is already packed to avoid padding. See protocol.h 
     */
     send_message.version = 1;
     send_message.data = htonl(data);
 
+    if (opts.version == PROTOCOL_V2){
+        send_request.header.version = PROTOCOL_V2;
+        send_request.header.type = REQ_DATA;
+        send_request.header.length = htons(sizeof(send_request.data));
+        send_request.header.id = htonl(1);
+        send_request.data = htonl(data);
+        frame = &send_request;
+        frame_len = sizeof(send_request);
+        reply_len = sizeof(struct reply_header);
+    }
+
     // connect if tcp
     if (strcmp(socktype, "tcp") == 0){
         // Attempt to connect 
@@ -129,17 +219,18 @@ int main(int argc, char *argv[]){
         }
 
         // Send message to server upon successful connection and read amount of bytes sent.
-        numbytes = send(sockfd, &send_message, sizeof(send_message), 0);
+        numbytes = send(sockfd, frame, frame_len, 0);
         if (numbytes == -1){ // -1 is an error occuring when sending
             fprintf(stderr, "Error sending message.\n");
             return -1;
         }
 
         // check if we have left over bytes and send them until we are done or get error
-        numbytes = sizeof(send_message) - numbytes;
-        if (numbytes > 0){
+        int left = frame_len - numbytes;
+        if (left > 0){
             // If fail, log how many bytes were sent
-            if (sendall(sockfd, &send_message, &numbytes) == -1) {
+            if (sendall(sockfd, (uint8_t *)frame + numbytes, &left) == -1) {
+                numbytes += left;
                 printf("Only sent %d bytes because of an error!\n", numbytes);
             } 
         }
@@ -149,9 +240,8 @@ int main(int argc, char *argv[]){
             Wait for 3 seconds receving data. If the struct is empty by the end 
             we know we haven't receive data back from sever... Return Error at that point.
         */
-        status = recvtimeout(sockfd, &server_message_struct, sizeof(server_message_struct), 3, 
+        status = recvtimeout(sockfd, reply, reply_len, RECV_TIMEOUT, 
                 NULL, NULL); // 3 second timeout
-
     } 
     // udp connection socket
     else if(strcmp(socktype, "udp") == 0){ 
@@ -159,7 +249,7 @@ int main(int argc, char *argv[]){
         addr_size = sizeof(their_addr);
 
         // Send message and check for error
-        if ((numbytes = sendto(sockfd, &send_message, sizeof(send_message), 0,
+        if ((numbytes = sendto(sockfd, frame, frame_len, 0,
             p->ai_addr, p->ai_addrlen)) == -1) {
             fprintf(stderr, "Failed to send message via udp.\n");
             exit(1);
@@ -170,9 +260,8 @@ int main(int argc, char *argv[]){
             Wait for 3 seconds receving data. If the struct is empty by the end 
             we know we haven't receive data back from sever... Return Error at that point.
         */
-        status = recvtimeout(sockfd, &server_message_struct, sizeof(server_message_struct), 3, 
+        status = recvtimeout(sockfd, reply, sizeof(reply), RECV_TIMEOUT, 
         (struct sockaddr *)&their_addr, &addr_size); // 3 second timeout
-
     }
     else{
         /* This shouldn't get here with the commmand line check...
@@ -195,13 +284,36 @@ int main(int argc, char *argv[]){
         return -1;
 
     } 
-    // We received data back. Check to make sure the struct is the correct version (1)
-    if (server_message_struct.version != 1){
-        fprintf(stderr, "Error: Incorrect version from server: {%d}. Please set response to 1.\n", 
-                server_message_struct.version);
+    // We received data back. Check to make sure the struct is the correct version (1 or 2 with -V)
+    memcpy(&server_message_struct, reply, sizeof(server_message_struct));
+    if (server_message_struct.version != opts.version){
+        fprintf(stderr, "Error: Incorrect version from server: {%d}. Please set response to %d.\n", 
+                server_message_struct.version, opts.version);
         return -1;
     }
 
+    // A version 2 reply has to be for our request and say it went through
+    if (opts.version == PROTOCOL_V2){
+        struct reply_header *header = (struct reply_header *)reply;
+        if (status < (int)sizeof(*header) || header->id != send_request.header.id){
+            fprintf(stderr, "Error: Reply from server doesn't match our request.\n");
+            return -1;
+        }
+        if (header->status == STATUS_BUSY){
+            // Over the server's limits, udp has the wait it asks for in the same datagram
+            uint32_t wait_ms = 0;
+            if (status >= (int)(sizeof(*header) + sizeof(wait_ms))){
+                memcpy(&wait_ms, reply + sizeof(*header), sizeof(wait_ms));
+            }
+            fprintf(stderr, "Error: Server is busy, try again in %u ms.\n", wait_ms ? ntohl(wait_ms) : ENGINE_BUSY_MS);
+            return -1;
+        }
+        if (header->status != STATUS_OK){
+            fprintf(stderr, "Error: Server rejected the message with status %d.\n", header->status);
+            return -1;
+        }
+    }
+
     /* Message was successful!!! */
 
     // Close connection to server
@@ -213,7 +325,7 @@ int main(int argc, char *argv[]){
     return 0;
 }
 
-void command_line_check(int argc, char *argv[], uint32_t *data, char **port, char **socktype, char **ip){
+void command_line_check(int argc, char *argv[], struct client_options *opts){
     /* 
     Read in the command line arguments and check to make sure the correct tags were passed, they are
     in the correct format, and nothing is missing. 
@@ -221,10 +333,10 @@ void command_line_check(int argc, char *argv[], uint32_t *data, char **port, cha
     params:
         argc (int): Number of command line args passed.
         argv (char *): The command line text.
-        data (uint32_t *): Pointer to where we will store the -x tag data.
-        port (char **): Pointer to where we will store the -p port number.
-        socktype (char **): Pointer to where we will store the -t socket type (udp or tcp).
-        ip (char **): Pointer to where we will store the ip/host address.
+        opts (client_options *): Where we store the -x values, -n count, -p port number,
+            -t socket type (udp or tcp), -s ip/host address, -V protocol version, the -f/-B
+            batch input, the -q query, the -G/-P/-D key/value operations, the -c/-i/-T streaming
+            settings and the -b load generator settings.
 
     return:
         void
@@ -232,28 +344,66 @@ void command_line_check(int argc, char *argv[], uint32_t *data, char **port, cha
     // Counters to make sure each arg is called once
     int opt;
     int temp_port;
+    int max_values = 0;
+    int max_kv_ops = 0;
+    int max_servers = 0;
+    int R = 0;
+    int k = 0;
+    int n = 0;
     int x = 0;
+    int c = 0;
+    int i = 0;
+    int T = 0;
+    int V = 0;
+    int f = 0;
+    int B = 0;
+    int q = 0;
+    int r = 0;
+    int d = 0;
     int t = 0;
     int s = 0;
     int p = 0;
 
+    memset(opts, 0, sizeof(*opts));
+    opts->connections = 1;
+    opts->version = PROTOCOL_V1;
+
     // Loop through all given arguments in command line
-    while ((opt = getopt(argc, argv, "x:t:s:p:")) != -1){
+    while ((opt = getopt(argc, argv, "x:t:s:p:n:bc:i:T:r:d:V:f:B:q:G:P:D:jR")) != -1){
         // Check if option matches a correct tag
         switch(opt) 
             { 
-                // Data tag
+                // Data tag, may be repeated to stream several values
                 case 'x': 
-                    *data = atoi(optarg);
+                    if (opts->num_values == max_values){
+                        max_values = max_values ? max_values * 2 : 4;
+                        opts->values = realloc(opts->values, max_values * sizeof(uint32_t));
+                        if (opts->values == NULL){
+                            fprintf(stderr, "Out of memory reading -x values.\n");
+                            exit(-1);
+                        }
+                    }
+                    opts->values[opts->num_values++] = atoi(optarg);
                     x++;
                     break; 
 
+                // Total number of frames to send over one connection
+                case 'n':
+                    opts->count = atol(optarg);
+                    if (opts->count < 1){
+                        errno = 22;
+                        fprintf(stderr, "Message count must be at least 1.\n");
+                        exit(-1);
+                    }
+                    n++;
+                    break;
+
                 // Socket type tag
                 case 't': 
-                    *socktype = optarg;
+                    opts->socktype = optarg;
 
                     // Make sure it's either udp or tcp
-                    if ((strcmp(*socktype, "udp") != 0) && (strcmp(*socktype, "tcp") != 0)){
+                    if ((strcmp(opts->socktype, "udp") != 0) && (strcmp(opts->socktype, "tcp") != 0)){
                         errno = 1;
                         fprintf(stderr, "Socket type not correct. Please use only udp or tcp.\n");
                         exit(-1);
@@ -263,11 +413,32 @@ void command_line_check(int argc, char *argv[], uint32_t *data, char **port, cha
                     t++;
                     break; 
 
-                // IP or Hostname tag
-                case 's':
-                    *ip = optarg;
+                // IP or Hostname tag, may be repeated (each with its own :port) to balance over servers
+                case 's':{
+                    char *colon = strchr(optarg, ':');
+                    if (colon != NULL){
+                        *colon = '\0';
+                        temp_port = atoi(colon + 1);
+                        if (temp_port < 1023 || temp_port > 65535){
+                            errno = 1;
+                            fprintf(stderr, "PORT number is out of range.\n");
+                            exit(-1);
+                        }
+                    }
+                    if (opts->num_servers == max_servers){
+                        max_servers = max_servers ? max_servers * 2 : 4;
+                        opts->servers = realloc(opts->servers, max_servers * sizeof(*opts->servers));
+                        if (opts->servers == NULL){
+                            fprintf(stderr, "Out of memory reading -s servers.\n");
+                            exit(-1);
+                        }
+                    }
+                    opts->servers[opts->num_servers].ip = optarg;
+                    opts->servers[opts->num_servers].port = colon != NULL ? colon + 1 : NULL;
+                    opts->num_servers++;
                     s++;
-                    break; 
+                    break;
+                }
 
                 // Port number tag
                 case 'p':
@@ -285,9 +456,160 @@ void command_line_check(int argc, char *argv[], uint32_t *data, char **port, cha
                     p++;
 
                     // Set commandline as por
-                    *port = optarg;
+                    opts->port = optarg;
                     break; 
 
+                // Run the load generator instead of sending once
+                case 'b':
+                    opts->bench = 1;
+                    break;
+
+                case 'j': // load generator results as JSON
+                    opts->json = 1;
+                    break;
+
+                // Reliable udp: sequence numbers, retransmits and server side deduplication
+                case 'R':
+                    opts->reliable = 1;
+                    R++;
+                    break;
+
+                // Connections (udp sockets for udp) for streaming or the load generator
+                case 'c':
+                    opts->connections = atoi(optarg);
+                    if (opts->connections < 1){
+                        errno = 22;
+                        fprintf(stderr, "Connection count must be at least 1.\n");
+                        exit(-1);
+                    }
+                    c++;
+                    break;
+
+                // Frames in flight per connection (the load generator's closed loop)
+                case 'i':
+                    opts->inflight = atoi(optarg);
+                    if (opts->inflight < 1){
+                        errno = 22;
+                        fprintf(stderr, "In flight count must be at least 1.\n");
+                        exit(-1);
+                    }
+                    i++;
+                    break;
+
+                // Client engine I/O threads when streaming
+                case 'T':
+                    opts->threads = atoi(optarg);
+                    if (opts->threads < 1){
+                        errno = 22;
+                        fprintf(stderr, "Thread count must be at least 1.\n");
+                        exit(-1);
+                    }
+                    T++;
+                    break;
+
+                // Load generator target rate in frames per second (open loop)
+                case 'r':
+                    opts->rate = atof(optarg);
+                    if (opts->rate <= 0){
+                        errno = 22;
+                        fprintf(stderr, "Rate must be greater than 0.\n");
+                        exit(-1);
+                    }
+                    r++;
+                    break;
+
+                // Load generator run time in seconds
+                case 'd':
+                    opts->duration = atof(optarg);
+                    if (opts->duration <= 0){
+                        errno = 22;
+                        fprintf(stderr, "Duration must be greater than 0.\n");
+                        exit(-1);
+                    }
+                    d++;
+                    break;
+
+                // Wire protocol version, see protocol.h
+                case 'V':
+                    opts->version = atoi(optarg);
+                    if (opts->version != PROTOCOL_V1 && opts->version != PROTOCOL_V2){
+                        errno = 22;
+                        fprintf(stderr, "Protocol version must be 1 or 2.\n");
+                        exit(-1);
+                    }
+                    V++;
+                    break;
+
+                // File (or - for stdin) of values to send in batches
+                case 'f':
+                    opts->file = optarg;
+                    f++;
+                    break;
+
+                // Most values per batch frame
+                case 'B':
+                    opts->batch = atoi(optarg);
+                    if (opts->batch < 1 || opts->batch > (int)PROTOCOL_MAX_BATCH){
+                        errno = 22;
+                        fprintf(stderr, "Batch size must be between 1 and %d.\n", (int)PROTOCOL_MAX_BATCH);
+                        exit(-1);
+                    }
+                    B++;
+                    break;
+
+                // Aggregates query: global, sender (ours), sender=<ip> or window
+                case 'q':
+                    if (strcmp(optarg, "global") == 0){
+                        opts->query = QUERY_GLOBAL + 1;
+                    }
+                    else if (strcmp(optarg, "window") == 0){
+                        opts->query = QUERY_WINDOW + 1;
+                    }
+                    else if (strcmp(optarg, "sender") == 0){
+                        opts->query = QUERY_SENDER + 1;
+                    }
+                    else if (strncmp(optarg, "sender=", 7) == 0 && inet_pton(AF_INET, optarg + 7, &opts->query_sender) == 1){
+                        opts->query = QUERY_SENDER + 1;
+                    }
+                    else{
+                        printf("-q must be global, sender, sender=<ipv4 address> or window\n");
+                        errno = 22;
+                        exit(-1);
+                    }
+                    q++;
+                    break;
+
+                // Key/value operations, may be repeated and mixed
+                case 'G':
+                case 'P':
+                case 'D':{
+                    char *end;
+                    struct kv_op op = { .type = opt == 'G' ? REQ_GET : opt == 'P' ? REQ_PUT : REQ_DELETE };
+                    op.key = strtoul(optarg, &end, 10);
+                    if (opt == 'P' && *end == '='){
+                        op.value = strtoul(end + 1, &end, 10);
+                    }
+                    else if (opt == 'P'){
+                        end = optarg;
+                    }
+                    if (*end != '\0' || !isdigit((unsigned char)*optarg)){
+                        printf("-%c takes %s\n", opt, opt == 'P' ? "<key>=<value>" : "<key>");
+                        errno = 22;
+                        exit(-1);
+                    }
+                    if (opts->num_kv_ops == max_kv_ops){
+                        max_kv_ops = max_kv_ops ? max_kv_ops * 2 : 8;
+                        opts->kv_ops = realloc(opts->kv_ops, max_kv_ops * sizeof(*opts->kv_ops));
+                        if (opts->kv_ops == NULL){
+                            fprintf(stderr, "Out of memory for key/value operations.\n");
+                            exit(-1);
+                        }
+                    }
+                    opts->kv_ops[opts->num_kv_ops++] = op;
+                    k++;
+                    break;
+                }
+
                 // Unkown tag
                 case '?': 
                     // Check for incorrect tags and exit
@@ -297,21 +619,119 @@ void command_line_check(int argc, char *argv[], uint32_t *data, char **port, cha
             } 
     }
 
-    // Make sure each command-line arg was called once
-    if (x != 1 || t != 1 || s != 1 || p != 1){
+    // Make sure each command-line arg was called once (-x at least once, -n is optional)
+    if ((x < 1 && !opts->bench && !f && !q && !k) || t != 1 || s < 1 || p > 1 || n > 1 || c > 1 || i > 1 || T > 1 || r > 1 || d > 1 || V > 1 || f > 1 || B > 1 || q > 1){
         printf("Incorrect Number of Argument types\n");
         errno = 22;
         exit(-1);
     }
+
+    // Servers without a :port use -p's, the single server paths use the first one
+    for (int j = 0; j < opts->num_servers; j++){
+        if (opts->servers[j].port == NULL){
+            if (!p){
+                printf("-p is needed unless every -s has a :port\n");
+                errno = 22;
+                exit(-1);
+            }
+            opts->servers[j].port = opts->port;
+        }
+    }
+    opts->ip = (char *)opts->servers[0].ip;
+    opts->port = (char *)opts->servers[0].port;
+    if ((q || k) && opts->num_servers > 1){
+        printf("-q, -G, -P and -D take a single -s\n");
+        errno = 22;
+        exit(-1);
+    }
+
+    // -r and -d only mean something to the load generator, -T only to the client engine
+    if (!opts->bench && (r || d || opts->json)){
+        printf("-r, -d and -j need -b\n");
+        errno = 22;
+        exit(-1);
+    }
+    if (opts->bench && T){
+        printf("-T can't be used with -b\n");
+        errno = 22;
+        exit(-1);
+    }
+
+    // -f replaces -x/-n as the source of values, and batches only exist in version 2
+    if (f && (x || n || opts->bench || (V && opts->version != PROTOCOL_V2))){
+        printf("-f can't be used with -x, -n, -b or -V 1\n");
+        errno = 22;
+        exit(-1);
+    }
+    if (q && (x || n || f || opts->bench || c || i || T || (V && opts->version != PROTOCOL_V2))){
+        printf("-q can't be used with -x, -n, -f, -b, -c, -i, -T or -V 1\n");
+        errno = 22;
+        exit(-1);
+    }
+    if (k && (x || f || q || opts->bench || c || i || T || (V && opts->version != PROTOCOL_V2))){
+        printf("-G, -P and -D can't be used with -x, -f, -q, -b, -c, -i, -T or -V 1\n");
+        errno = 22;
+        exit(-1);
+    }
+    if (R && (strcmp(opts->socktype, "udp") != 0 || q || k || opts->bench || (V && opts->version != PROTOCOL_V2))){
+        printf("-R needs -t udp and can't be used with -q, -G, -P, -D, -b or -V 1\n");
+        errno = 22;
+        exit(-1);
+    }
+    if (R){
+        opts->version = PROTOCOL_V2;
+    }
+    if (B && !f){
+        printf("-B needs -f\n");
+        errno = 22;
+        exit(-1);
+    }
+    if (f){
+        opts->version = PROTOCOL_V2;
+        if (!B){
+            opts->batch = PROTOCOL_MAX_BATCH;
+        }
+    }
+
+    // The load generator keeps one frame in flight per connection unless told otherwise
+    if (opts->bench && i == 0){
+        opts->inflight = 1;
+    }
+
+    // Without -n send each -x value (or run each key/value operation) once, the load generator
+    // runs for a duration instead
+    if (n == 0 && !opts->bench){
+        opts->count = k ? opts->num_kv_ops : opts->num_values;
+    }
+}
+
+const char *server_list(const struct client_options *opts){
+    /* The -s servers as "ip:port, ip:port" for the summaries (cut short if there are many).
+
+    Params:
+        opts (client_options *): Parsed command line.
+
+    Return:
+        A static string.
+    */
+    static char list[256];
+    size_t len = 0;
+
+    list[0] = '\0';
+    for (int i = 0; i < opts->num_servers && len < sizeof(list); i++){
+        len += snprintf(list + len, sizeof(list) - len, "%s%s:%s", i ? ", " : "", opts->servers[i].ip,
+                opts->servers[i].port);
+    }
+    return list;
 }
 
-int sendall(int socket, struct client_message *message, int *len)
+int sendall(int socket, const void *buf, int *len)
 {
     /* Loop attempting to send unsent bytes to server.
 
     Params:
         socket (int): socket fd we are sending on.
-        message (client_message *): pointer to struct containing message data. 
+        buf (void *): start of the bytes still to send.
         len (int *): pointer to length of remaining bytes unsent.
 
     Return:
@@ -320,11 +740,11 @@ int sendall(int socket, struct client_message *message, int *len)
     */
     int total = 0;        // how many bytes we've sent
     int bytesleft = *len; // how many we have left to send
-    int n;
+    int n = 0;
 
     // Keep sending data incrementing the bytes each time
     while(total < *len) {
-        n = send(socket, &message->data+total, bytesleft, 0);
+        n = send(socket, (const uint8_t *)buf + total, bytesleft, 0);
         if (n == -1) { break; }
         total += n;
         bytesleft -= n;
@@ -335,14 +755,14 @@ int sendall(int socket, struct client_message *message, int *len)
     return n==-1?-1:0; // return -1 on failure, 0 on success
 } 
 
-int recvtimeout(int s, struct server_message *message, int len, int timeout, struct sockaddr *addr, socklen_t *addr_len)
+int recvtimeout(int s, void *message, int len, int timeout, struct sockaddr *addr, socklen_t *addr_len)
 {
     /* Timeout for the allocated time and attempt to receive the data. 
 
     Params:
         s (int): Socket fd we a receiving a message on.
-        message (server_message *): Message we struct to store want we receive back from server.
-        len (int): length of message to recv.
+        message (void *): Where to store what we receive back from server.
+        len (int): length of message to recv (tcp waits for all of it, udp takes up to it).
         timeout (int): How many seconds to timeout the program for. 
         addr (sockaddr *): Struct containing socket address information.
         addr_len (socklen_t *): Length of socket addr storage.
@@ -371,9 +791,534 @@ int recvtimeout(int s, struct server_message *message, int len, int timeout, str
 
     // UDP will have an address 
     if (addr != NULL){
-        return recvfrom(s, message, 1024-1 , 0, addr, addr_len);
+        return recvfrom(s, message, len, 0, addr, addr_len);
+    }
+
+    // TCP is just the socket, a version 2 reply may arrive in pieces
+    return recv(s, message, len, MSG_WAITALL);
+}
+
+// Shared by stream_values() and the engine's I/O threads
+struct stream_state
+{
+    long acked;
+    long failed;
+    long timeouts;
+    uint64_t max_latency;
+};
+
+static void stream_done(void *arg, uint32_t value, int status, uint64_t latency_ns){
+    // Engine completion callback, runs on an I/O thread
+    struct stream_state *st = arg;
+    (void)value;
+
+    if (status == ENGINE_OK) __atomic_fetch_add(&st->acked, 1, __ATOMIC_RELAXED);
+    else if (status == ENGINE_TIMEOUT) __atomic_fetch_add(&st->timeouts, 1, __ATOMIC_RELAXED);
+    else __atomic_fetch_add(&st->failed, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&st->max_latency, __ATOMIC_RELAXED);
+    while (latency_ns > max && !__atomic_compare_exchange_n(&st->max_latency, &max, latency_ns, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+}
+
+int stream_values(struct client_options *opts)
+{
+    /* Send opts->count frames, cycling through the -x values, through the client engine:
+    -T I/O threads driving -c connections (udp sockets for udp) with up to -i frames each in
+    flight. Every frame gets its own RECV_TIMEOUT second timeout.
+
+    Params:
+        opts (client_options *): Server, values to send and how many frames in total.
+
+    Return:
+        0 if every frame was acked.
+        -1 on error or if any frame failed or timed out.
+    */
+    struct engine_config cfg;
+    struct client_engine *engine;
+    struct stream_state st;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.ip = opts->ip;
+    cfg.port = opts->port;
+    cfg.targets = opts->servers;
+    cfg.num_targets = opts->num_servers;
+    cfg.reliable = opts->reliable;
+    cfg.sock_type = strcmp(opts->socktype, "tcp") == 0 ? SOCK_STREAM : SOCK_DGRAM;
+    cfg.threads = opts->threads;
+    cfg.connections = opts->connections;
+    cfg.max_inflight = opts->inflight;
+    cfg.timeout_ms = RECV_TIMEOUT * 1000;
+    cfg.version = opts->version;
+
+    engine = engine_create(&cfg);
+    if (engine == NULL){
+        return -1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    for (long i = 0; i < opts->count; i++){
+        engine_submit(engine, opts->values[i % opts->num_values], stream_done, &st);
+    }
+
+    // Returns once every frame was acked, failed or timed out
+    engine_destroy(engine);
+
+    if (st.timeouts > 0){
+        fprintf(stderr, "Timeout... %ld of %ld frames were not acked. Check to make sure server is running on correct socket and port.\n",
+                st.timeouts, opts->count);
+        return -1;
+    }
+    if (st.failed > 0){
+        fprintf(stderr, "Error! %ld of %ld frames failed.\n", st.failed, opts->count);
+        return -1;
+    }
+
+    printf("sent %ld messages to server %s via %s (max latency %.3f ms)\n", st.acked, server_list(opts),
+            opts->socktype, st.max_latency / 1e6);
+    return 0;
+}
+
+// Shared by send_file() and the engine's I/O threads
+struct batch_state
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long outstanding;  // batches submitted and not completed yet
+    long acked;        // values in acked batches
+    long failed;       // batches that failed
+    long timeouts;     // batches that timed out
+};
+
+static void batch_done(void *arg, uint32_t count, int status, uint64_t latency_ns){
+    // Engine completion callback for one batch, runs on an I/O thread
+    struct batch_state *st = *(struct batch_state **)arg;
+    (void)latency_ns;
+
+    pthread_mutex_lock(&st->lock);
+    if (status == ENGINE_OK) st->acked += count;
+    else if (status == ENGINE_TIMEOUT) st->timeouts++;
+    else st->failed++;
+    st->outstanding--;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    // The batch's values were allocated right behind the state pointer
+    free(arg);
+}
+
+static uint32_t *new_batch(struct batch_state *st, int size){
+    // Allocate room for a batch: a pointer back to the state, then the values
+    struct batch_state **batch = malloc(sizeof(*batch) + size * sizeof(uint32_t));
+    if (batch == NULL){
+        fprintf(stderr, "Out of memory for a batch.\n");
+        exit(-1);
+    }
+    *batch = st;
+    return (uint32_t *)(batch + 1);
+}
+
+static void submit_batch(struct client_engine *engine, struct batch_state *st, uint32_t *values, int count, long window){
+    // Hand a filled batch to the engine, waiting while 'window' batches are already outstanding
+    pthread_mutex_lock(&st->lock);
+    while (st->outstanding >= window){
+        pthread_cond_wait(&st->cond, &st->lock);
+    }
+    st->outstanding++;
+    pthread_mutex_unlock(&st->lock);
+
+    if (engine_submit_batch(engine, values, count, batch_done, (struct batch_state **)values - 1) == -1){
+        batch_done((struct batch_state **)values - 1, 0, ENGINE_ERROR, 0);
+    }
+}
+
+int send_file(struct client_options *opts)
+{
+    /* Read whitespace (or comma) separated unsigned values from opts->file ("-" for stdin) and
+    send them through the client engine as REQ_BATCH frames of up to opts->batch values. A batch
+    goes out as soon as it is full, or early when the input pauses (a pipe or terminal with
+    nothing more to read yet) so values never sit in a half filled batch.
+
+    Params:
+        opts (client_options *): Server, input file and batch size.
+
+    Return:
+        0 if every batch was acked.
+        -1 on error or if any batch failed or timed out.
+    */
+    struct engine_config cfg;
+    struct client_engine *engine;
+    struct batch_state st;
+    char buf[65536];
+    uint64_t value = 0;
+    int in_value = 0;
+    long values = 0;
+    long batches = 0;
+    ssize_t n;
+    int fd;
+
+    fd = strcmp(opts->file, "-") == 0 ? STDIN_FILENO : open(opts->file, O_RDONLY);
+    if (fd == -1){
+        fprintf(stderr, "Can't open %s: %s\n", opts->file, strerror(errno));
+        return -1;
+    }
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.ip = opts->ip;
+    cfg.port = opts->port;
+    cfg.targets = opts->servers;
+    cfg.num_targets = opts->num_servers;
+    cfg.reliable = opts->reliable;
+    cfg.sock_type = strcmp(opts->socktype, "tcp") == 0 ? SOCK_STREAM : SOCK_DGRAM;
+    cfg.threads = opts->threads;
+    cfg.connections = opts->connections;
+    cfg.max_inflight = opts->inflight;
+    cfg.timeout_ms = RECV_TIMEOUT * 1000;
+    cfg.version = PROTOCOL_V2;
+
+    engine = engine_create(&cfg);
+    if (engine == NULL){
+        return -1;
+    }
+
+    // Enough batches to keep every connection busy without reading the whole input into memory
+    long window = (long)opts->connections * (opts->inflight ? opts->inflight : ENGINE_DEFAULT_INFLIGHT);
+
+    /* udp has no flow control and every socket lands on the same server socket, so keep what's
+        outstanding within about one default receive buffer (the kernel charges ~1KB per datagram
+        on top of its payload).
+    */
+    if (cfg.sock_type == SOCK_DGRAM){
+        long fit = UDP_BURST_BYTES / ((long)opts->batch * sizeof(uint32_t) + 1024);
+        if (fit < 1){
+            fit = 1;
+        }
+        if (fit < window){
+            window = fit;
+        }
+    }
+
+    memset(&st, 0, sizeof(st));
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    uint32_t *batch = new_batch(&st, opts->batch);
+    int count = 0;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0){
+        if (n == -1){
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error reading %s: %s\n", opts->file, strerror(errno));
+            return -1;
+        }
+
+        for (ssize_t i = 0; i < n; i++){
+            if (isdigit((unsigned char)buf[i])){
+                value = value * 10 + (buf[i] - '0');
+                if (value > UINT32_MAX){
+                    fprintf(stderr, "Value in %s doesn't fit in 32 bits.\n", opts->file);
+                    return -1;
+                }
+                in_value = 1;
+                continue;
+            }
+            if (!isspace((unsigned char)buf[i]) && buf[i] != ','){
+                fprintf(stderr, "Invalid character '%c' in %s.\n", buf[i], opts->file);
+                return -1;
+            }
+            if (in_value){
+                batch[count++] = (uint32_t)value;
+                values++;
+                value = 0;
+                in_value = 0;
+                if (count == opts->batch){
+                    submit_batch(engine, &st, batch, count, window);
+                    batches++;
+                    batch = new_batch(&st, opts->batch);
+                    count = 0;
+                }
+            }
+        }
+
+        // Nothing more to read right now: send what we have instead of waiting to fill the batch
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (count > 0 && poll(&pfd, 1, 0) == 0){
+            submit_batch(engine, &st, batch, count, window);
+            batches++;
+            batch = new_batch(&st, opts->batch);
+            count = 0;
+        }
+    }
+
+    // The input may end without a trailing separator
+    if (in_value){
+        batch[count++] = (uint32_t)value;
+        values++;
+    }
+    if (count > 0){
+        submit_batch(engine, &st, batch, count, window);
+        batches++;
+    }
+    else{
+        free((struct batch_state **)batch - 1);
+    }
+
+    // Returns once every batch was acked, failed or timed out
+    engine_destroy(engine);
+    if (fd != STDIN_FILENO){
+        close(fd);
+    }
+
+    if (st.timeouts > 0){
+        fprintf(stderr, "Timeout... %ld of %ld batches were not acked. Check to make sure server is running on correct socket and port.\n",
+                st.timeouts, batches);
+        return -1;
+    }
+    if (st.failed > 0){
+        fprintf(stderr, "Error! %ld of %ld batches failed.\n", st.failed, batches);
+        return -1;
+    }
+
+    printf("sent %ld values in %ld batches to server %s via %s\n", st.acked, batches, server_list(opts),
+            opts->socktype);
+    return 0;
+}
+
+static int connect_server(struct client_options *opts, int *tcp)
+{
+    /* Open one socket to the server, connected for udp too so recv() only sees its replies.
+
+    Params:
+        opts (client_options *): Server and socket type.
+        tcp (int *): Set to 1 for tcp, 0 for udp.
+
+    Return:
+        The socket, -1 on error.
+    */
+    struct addrinfo hints, *res;
+    int sockfd;
+    int status;
+
+    *tcp = strcmp(opts->socktype, "tcp") == 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = *tcp ? SOCK_STREAM : SOCK_DGRAM;
+    if ((status = getaddrinfo(opts->ip, opts->port, &hints, &res)) != 0){
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sockfd == -1 || connect(sockfd, res->ai_addr, res->ai_addrlen) != 0){
+        fprintf(stderr, "client: failed to connect with socket. Server may be listening on %s or different port.\n",
+                *tcp ? "UDP" : "TCP");
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    // Replies are small and each one is waited for, don't let Nagle hold the requests back
+    if (*tcp){
+        int one = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return sockfd;
+}
+
+static int round_trip(int sockfd, int tcp, const void *frame, int frame_len, uint8_t *reply, int reply_cap)
+{
+    /* Send one version 2 request and wait for its reply.
+
+    Params:
+        sockfd (int): Socket from connect_server().
+        tcp (int): 1 for tcp, 0 for udp.
+        frame (void *): The request.
+        frame_len (int): Its length.
+        reply (uint8_t *): Where to put the reply.
+        reply_cap (int): Room in 'reply', at least a reply_header.
+
+    Return:
+        Length of the reply, -1 on error or if it doesn't answer the request, -2 on timeout.
+    */
+    struct reply_header *header = (struct reply_header *)reply;
+    int left = frame_len;
+    int status;
+
+    if (sendall(sockfd, frame, &left) == -1){
+        fprintf(stderr, "Error sending message.\n");
+        return -1;
+    }
+
+    // udp gets the whole reply in one datagram, tcp reads the header and then its payload
+    status = recvtimeout(sockfd, reply, tcp ? (int)sizeof(*header) : reply_cap, RECV_TIMEOUT, NULL, NULL);
+    if (tcp && status == (int)sizeof(*header) && ntohs(header->length) > 0){
+        int more = ntohs(header->length);
+        if (more > reply_cap - status){
+            fprintf(stderr, "Error: Reply from server is larger than expected.\n");
+            return -1;
+        }
+        int got = recvtimeout(sockfd, reply + status, more, RECV_TIMEOUT, NULL, NULL);
+        status = got < 0 ? got : status + got;
+    }
+    if (status == -2){
+        fprintf(stderr, "Timeout... Check to make sure server is running on correct socket and port.\n");
+        return -2;
+    }
+    if (status < (int)sizeof(*header) || header->version != PROTOCOL_V2 ||
+            header->id != ((const struct request_header *)frame)->id){
+        fprintf(stderr, "Error: Reply from server doesn't match our request.\n");
+        return -1;
+    }
+    return status;
+}
+
+int query_server(struct client_options *opts)
+{
+    /* Send one REQ_QUERY and print the aggregates the server answers with (see agg.c on
+    the server side).
+
+    Params:
+        opts (client_options *): Server, socket type and the -q scope.
+
+    Return:
+        0 once the aggregates were printed.
+        -1 on error, timeout or if the server refused the query.
+    */
+    struct query_request request;
+    uint8_t reply[PROTOCOL_MAX_REPLY];
+    struct reply_header *header = (struct reply_header *)reply;
+    struct query_result result;
+    int tcp;
+    int sockfd = connect_server(opts, &tcp);
+    if (sockfd == -1){
+        return -1;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.header.version = PROTOCOL_V2;
+    request.header.type = REQ_QUERY;
+    request.header.length = htons(sizeof(request) - sizeof(request.header));
+    request.header.id = htonl(1);
+    request.scope = opts->query - 1;
+    request.sender = opts->query_sender;
+
+    int status = round_trip(sockfd, tcp, &request, sizeof(request), reply, sizeof(reply));
+    close(sockfd);
+    if (status < 0){
+        return -1;
+    }
+    if (header->status != STATUS_OK){
+        fprintf(stderr, "Error: Server rejected the query with status %d.\n", header->status);
+        return -1;
+    }
+    if (status < (int)(sizeof(*header) + sizeof(result))){
+        fprintf(stderr, "Error: Query reply from server is too short.\n");
+        return -1;
+    }
+    memcpy(&result, reply + sizeof(*header), sizeof(result));
+
+    if (request.scope == QUERY_WINDOW){
+        printf("window:   %u seconds from %u\n", ntohl(result.window_secs), ntohl(result.window_start));
+    }
+    printf("count:    %llu\n", (unsigned long long)be64toh(result.count));
+    printf("sum:      %llu\n", (unsigned long long)be64toh(result.sum));
+    printf("min/max:  %u / %u\n", ntohl(result.min), ntohl(result.max));
+    printf("p50/p90:  %u / %u\n", ntohl(result.quantiles[0]), ntohl(result.quantiles[1]));
+    printf("p99/p999: %u / %u\n", ntohl(result.quantiles[2]), ntohl(result.quantiles[3]));
+    printf("distinct: ~%llu\n", (unsigned long long)be64toh(result.distinct));
+    return 0;
+}
+
+int kv_requests(struct client_options *opts)
+{
+    /* Run the -G/-P/-D key/value operations in the order given, one round trip at a time over
+    one connection (or udp socket). With -n they are cycled through until that many were sent
+    and only a round trip latency summary is printed, otherwise every result is.
+
+    Params:
+        opts (client_options *): Server, socket type, the operations and -n.
+
+    Return:
+        0 if every operation got a reply (a GET/DELETE of a missing key still counts).
+        -1 on error, timeout or if the server refused an operation.
+    */
+    struct kv_request request;
+    uint8_t reply[PROTOCOL_MAX_REPLY];
+    struct reply_header *header = (struct reply_header *)reply;
+    struct histogram latency;
+    int verbose = opts->count <= opts->num_kv_ops;
+    long missing = 0;
+    int tcp;
+    int sockfd = connect_server(opts, &tcp);
+    if (sockfd == -1){
+        return -1;
     }
+    if (histogram_init(&latency, HISTOGRAM_DEFAULT_BITS) == -1){
+        fprintf(stderr, "Out of memory for the latency histogram.\n");
+        return -1;
+    }
+
+    request.header.version = PROTOCOL_V2;
+    for (long i = 0; i < opts->count; i++){
+        const struct kv_op *op = &opts->kv_ops[i % opts->num_kv_ops];
+        int frame_len = op->type == REQ_PUT ? sizeof(request) : sizeof(request) - sizeof(request.value);
+        struct timespec start, end;
+
+        request.header.type = op->type;
+        request.header.length = htons(frame_len - sizeof(request.header));
+        request.header.id = htonl((uint32_t)i);
+        request.key = htonl(op->key);
+        request.value = htonl(op->value);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = round_trip(sockfd, tcp, &request, frame_len, reply, sizeof(reply));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (status < 0){
+            close(sockfd);
+            return -1;
+        }
+        histogram_record(&latency, (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
 
-    // TCP is just the socket
-    return recv(s, message, len, 0);
-}
\ No newline at end of file
+        if (header->status == STATUS_NOT_FOUND){
+            missing++;
+            if (verbose){
+                printf("%s %u: not found\n", op->type == REQ_GET ? "get" : "delete", op->key);
+            }
+            continue;
+        }
+        if (header->status != STATUS_OK){
+            fprintf(stderr, "Error: Server rejected %s %u with status %d%s.\n", op->type == REQ_PUT ? "put" : 
+                    op->type == REQ_GET ? "get" : "delete", op->key, header->status,
+                    header->status == STATUS_FULL ? " (store full)" : "");
+            close(sockfd);
+            return -1;
+        }
+        if (op->type == REQ_GET){
+            uint32_t value;
+            if (status < (int)(sizeof(*header) + sizeof(value))){
+                fprintf(stderr, "Error: GET reply from server is too short.\n");
+                close(sockfd);
+                return -1;
+            }
+            memcpy(&value, reply + sizeof(*header), sizeof(value));
+            if (verbose){
+                printf("get %u: %u\n", op->key, ntohl(value));
+            }
+        }
+        else if (verbose){
+            printf("%s %u: ok\n", op->type == REQ_PUT ? "put" : "delete", op->key);
+        }
+    }
+    close(sockfd);
+
+    if (!verbose){
+        printf("%ld operations (%ld not found) on %s:%s via %s\n", opts->count, missing, opts->ip,
+                opts->port, opts->socktype);
+        printf("round trip (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                histogram_percentile(&latency, 50) / 1e3, histogram_percentile(&latency, 90) / 1e3,
+                histogram_percentile(&latency, 99) / 1e3, histogram_percentile(&latency, 99.9) / 1e3,
+                latency.max / 1e3);
+    }
+    histogram_free(&latency);
+    return 0;
+}
@@ -16,26 +16,71 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/tcp.h>
 
-/* Ref to pragma: https://gcc.gnu.org/onlinedocs/gcc-4.4.4/gcc/Structure_002dPacking-Pragmas.html
-This packing will help keep the message size as small as possible. This avoids any auto padding the 
-compiler may try to do. Thus we are left with a 5 byte client message and 1 byte server message.
-*/
-#pragma pack(1)
-struct client_message
+#include "client_engine.h"
+#include "protocol.h"
+#include "histogram.h"
+
+// How long (seconds) we wait for the server before calling it a timeout
+#define RECV_TIMEOUT 3
+
+// Batch bytes -f keeps outstanding over udp, about what a default socket buffer holds
+#define UDP_BURST_BYTES (128 * 1024)
+
+// One -G, -P or -D operation on the server's key/value store
+struct kv_op
 {
-    uint8_t version; // 1-byte version field 
-    uint32_t data;  // 4-byte unsigned int of user data, this will be encoded and decoded with htonl and ntohl
+    uint8_t type;      // REQ_GET, REQ_PUT or REQ_DELETE
+    uint32_t key;
+    uint32_t value;    // REQ_PUT only
 };
 
-#pragma pack(1)
-struct server_message
+/* Everything parsed from the command line. Repeating -x and/or passing -n turns the client
+    into a streaming client that sends all of the frames through the client engine.
+*/
+struct client_options
 {
-    uint8_t version; // 1-byte version field 
+    uint32_t *values;  // each -x value in the order given
+    int num_values;
+    long count;        // -n: how many frames to send in total, cycling through values (default: one of each)
+    char *port;
+    char *socktype;
+    char *ip;
+    struct engine_target *servers;  // each -s in the order given, its port or -p's
+    int num_servers;
+
+    int connections;   // -c: tcp connections or udp sockets per server to spread the frames over
+    int inflight;      // -i: frames kept outstanding per connection (0: engine default)
+    int threads;       // -T: client engine I/O threads when streaming
+    int version;       // -V: wire protocol version (PROTOCOL_V1 or PROTOCOL_V2)
+    char *file;        // -f: read values from this file ("-" for stdin) and send them in batches
+    int batch;         // -B: most values per batch frame
+    int query;         // -q: ask for the server's aggregates instead of sending values (QUERY_* + 1, 0 if not given)
+    uint32_t query_sender;  // -q sender=<ip>: whose values to ask about, network order (0: our own)
+    struct kv_op *kv_ops;   // each -G/-P/-D in the order given
+    int num_kv_ops;
+    int reliable;      // -R: reliable udp (sequence numbers and retransmits, see client_engine.h)
+
+    // Load generator (-b), see loadgen.c
+    int bench;
+    double rate;       // -r: open loop, target frames per second over all connections
+    double duration;   // -d: seconds to run for (when -n isn't given)
+    int json;          // -j: print the results as one JSON object (for make bench)
 };
 
-void command_line_check(int argc, char *argv[], uint32_t *data, char **port, char **socktype, char **ip);
-int sendall(int s, struct client_message *message, int *len);
-int recvtimeout(int s, struct server_message *message, int len, int timeout, struct sockaddr *addr, socklen_t *addr_len);
+void command_line_check(int argc, char *argv[], struct client_options *opts);
+const char *server_list(const struct client_options *opts);
+int sendall(int s, const void *buf, int *len);
+int stream_values(struct client_options *opts);
+int send_file(struct client_options *opts);
+int run_load(struct client_options *opts);
+int query_server(struct client_options *opts);
+int kv_requests(struct client_options *opts);
+int recvtimeout(int s, void *message, int len, int timeout, struct sockaddr *addr, socklen_t *addr_len);
 
 #endif
\ No newline at end of file
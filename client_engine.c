@@ -0,0 +1,1269 @@
+/* Asynchronous, multi-threaded client engine (see client_engine.h for the API).
+
+Layout:
+    - Each I/O thread owns a few connections, an epoll instance, an eventfd to be woken with
+      and a timer wheel. Nothing in a thread is touched by another thread except its queue.
+    - Producers hand requests to a thread (round robin) through a bounded lock-free
+      multi-producer/single-consumer queue. The thread only takes requests off the queue while
+      one of its connections has room, so a full engine pushes back on engine_submit().
+    - Requests in flight are kept in send order per connection. With version 1 frames the
+      server acks in order, so each ack completes the oldest request on its connection. With
+      version 2 every request carries an id (its node's index in the thread's pool plus a
+      generation count), so replies are matched directly in any order and a late reply for a
+      request that already timed out is recognised and ignored.
+    - Every request sits in its thread's timer wheel (1ms ticks). Expiring one is O(1) and
+      there is no per-request select()/poll(). A TCP connection whose request times out is
+      considered stuck: it is closed, its other requests fail, and it reconnects.
+    - With several servers every thread holds connections to each of them (connection k of
+      the engine goes to server k % servers). A request goes to the less loaded of two of the
+      thread's connections picked at random, falling back to a scan when neither has room.
+      Timeouts are counted per server across all threads; enough in a row eject the server
+      (its connections are skipped, but stay open) until its cooldown runs out.
+    - Reliable udp numbers every socket's frames from a random starting point, and keeps the
+      frames in flight in a ring indexed by sequence number so an ack finds its frame directly.
+      A frame's wheel timer fires at the socket's retransmit timeout instead of the request
+      timeout: it is sent again with the same sequence number and the timer re-armed with the
+      timeout doubled, until the request timeout (counted from the first send) runs out. A
+      socket retransmits at most ENGINE_RTO_BURST frames per tick, later ones wait a tick.
+    - A STATUS_BUSY reply (the server is over its -l limits) doesn't fail the request: its
+      timer is moved to the wait the reply asks for and it is sent again then, unless that is
+      past its timeout.
+
+Reference:
+    http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+    http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+    https://www.eecs.harvard.edu/~michaelm/postscripts/mythesis.pdf (power of two choices)
+*/
+#include "client.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <time.h>
+
+#define WHEEL_SLOTS 1024
+#define WHEEL_TICK_NS 1000000ULL
+#define ENGINE_OUT_SIZE (2 * PROTOCOL_MAX_FRAME)
+#define ENGINE_MAX_EVENTS 256
+#define ENGINE_RETRY_NS 100000000ULL
+#define ENGINE_IN_SIZE 4096
+#define ENGINE_RTO_BURST 32  // reliable udp retransmits a socket sends per wheel tick
+
+// Version 2 ids: low bits index the thread's node pool, the rest count reuses of the node
+#define ENGINE_ID_BITS 20
+#define ENGINE_ID_MASK ((1u << ENGINE_ID_BITS) - 1)
+
+// What a producer hands to an I/O thread
+struct engine_request
+{
+    uint32_t value;            // for a batch, the number of values
+    const uint32_t *values;    // batch values (owned by the caller until cb), NULL for one value
+    engine_callback cb;
+    void *arg;
+    uint64_t submitted;
+};
+
+// Bounded MPSC queue (Vyukov): a slot is free for position p when seq == p, full when seq == p + 1
+struct queue_slot
+{
+    size_t seq;
+    struct engine_request req;
+};
+
+struct mpsc_queue
+{
+    struct queue_slot *slots;
+    size_t mask;
+    size_t enqueue_pos __attribute__((aligned(64)));  // shared by the producers
+    size_t dequeue_pos __attribute__((aligned(64)));  // only the I/O thread
+};
+
+struct timer_node
+{
+    struct timer_node *next;
+    struct timer_node *prev;
+    uint64_t deadline;  // in ticks
+};
+
+struct timer_wheel
+{
+    struct timer_node slots[WHEEL_SLOTS];  // list heads
+    uint64_t tick;
+};
+
+struct engine_conn;
+
+// A server and its health, shared by every I/O thread
+struct engine_endpoint
+{
+    const char *ip;
+    const char *port;
+    struct sockaddr_storage addr;  // resolved once, reused for every (re)connect
+    socklen_t addr_len;
+    int timeouts;             // in a row, reset by any success
+    int ejections;            // in a row, doubles the cooldown
+    uint64_t ejected_until;   // now_ns() the server is back in the rotation
+    int reported;             // a failed connect at startup was already printed
+} __attribute__((aligned(64)));
+
+// A request that has been sent and is waiting for its ack (timer must stay the first member)
+struct inflight
+{
+    struct timer_node timer;
+    struct inflight *next;
+    struct inflight *prev;
+    struct engine_conn *conn;  // NULL while the node is free
+    uint32_t id;               // version 2 request id (reliable udp: sequence number), host order
+    int retries;               // reliable udp: times the frame was sent again
+    int busy;                  // refused with STATUS_BUSY, the timer sends it again instead of failing it
+    uint64_t sent;             // now_ns() of the first send
+    struct engine_request req;
+};
+
+struct engine_conn
+{
+    struct engine_endpoint *ep;
+    int fd;
+    int dead;          // closed, reconnect at retry_at
+    int connecting;    // non-blocking connect still in progress
+    int timed_out;     // a request expired, fail the connection once the wheel is done
+    uint64_t retry_at;
+    struct inflight *head;  // oldest request in flight
+    struct inflight *tail;
+    int outstanding;
+    size_t out_len;
+    size_t out_off;
+    size_t in_len;     // tcp bytes of a version 2 reply split across reads
+    struct inflight **window;  // reliable udp: frame in flight with sequence number s at [s % PROTOCOL_RUDP_WINDOW]
+    uint32_t next_seq;
+    uint64_t srtt;     // smoothed round trip time, ns (0 until measured)
+    uint64_t rttvar;
+    uint64_t rto;      // retransmit timeout, ns
+    uint64_t burst_tick;  // wheel tick of the last retransmit, and how many went out in it
+    int burst;
+    uint8_t out[ENGINE_OUT_SIZE];
+    uint8_t in[ENGINE_IN_SIZE];
+};
+
+struct engine_thread
+{
+    struct client_engine *engine;
+    pthread_t thread;
+    int epfd;
+    int wakefd;
+    int sleeping;      // set while (about to be) blocked in epoll_wait
+    struct mpsc_queue queue;
+
+    struct engine_conn *conns;
+    int num_conns;
+    struct inflight *nodes;
+    struct inflight *free_nodes;
+    long inflight;
+    struct timer_wheel wheel;
+    uint8_t *frame;    // udp frames are built here, tcp ones straight into the connection's buffer
+    uint32_t rng;      // xorshift state for picking connections
+};
+
+struct client_engine
+{
+    struct engine_config cfg;
+    struct engine_endpoint *endpoints;
+    int num_endpoints;
+    pthread_mutex_t eject_lock;    // so two threads can't eject the last two servers at once
+    struct engine_thread *threads;
+    size_t next_thread;
+    int stopping;
+};
+
+// Used by engine_send() to wait for its own completion
+struct engine_waiter
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int status;
+};
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int queue_init(struct mpsc_queue *q, size_t size){
+    // size must be a power of two
+    q->slots = calloc(size, sizeof(*q->slots));
+    if (q->slots == NULL){
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++){
+        q->slots[i].seq = i;
+    }
+    q->mask = size - 1;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+    return 0;
+}
+
+static int queue_push(struct mpsc_queue *q, const struct engine_request *req){
+    // Any thread. Returns -1 when the queue is full.
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    while (1){
+        struct queue_slot *slot = &q->slots[pos & q->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0){
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                slot->req = *req;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        }
+        else if (diff < 0){
+            return -1;
+        }
+        else{
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int queue_pop(struct mpsc_queue *q, struct engine_request *req){
+    // Owning I/O thread only. Returns -1 when the queue is empty.
+    struct queue_slot *slot = &q->slots[q->dequeue_pos & q->mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != q->dequeue_pos + 1){
+        return -1;
+    }
+    *req = slot->req;
+    __atomic_store_n(&slot->seq, q->dequeue_pos + q->mask + 1, __ATOMIC_RELEASE);
+    q->dequeue_pos++;
+    return 0;
+}
+
+static int queue_empty(struct mpsc_queue *q){
+    struct queue_slot *slot = &q->slots[q->dequeue_pos & q->mask];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->dequeue_pos + 1;
+}
+
+static void wheel_init(struct timer_wheel *w, uint64_t now){
+    for (int i = 0; i < WHEEL_SLOTS; i++){
+        w->slots[i].next = &w->slots[i];
+        w->slots[i].prev = &w->slots[i];
+    }
+    w->tick = now / WHEEL_TICK_NS;
+}
+
+static void wheel_add(struct timer_wheel *w, struct timer_node *n, uint64_t deadline_ns){
+    // Deadlines further out than WHEEL_SLOTS ticks just wrap around and get skipped until due
+    uint64_t deadline = deadline_ns / WHEEL_TICK_NS;
+    if (deadline <= w->tick){
+        deadline = w->tick + 1;
+    }
+    struct timer_node *head = &w->slots[deadline & (WHEEL_SLOTS - 1)];
+    n->deadline = deadline;
+    n->next = head->next;
+    n->prev = head;
+    head->next->prev = n;
+    head->next = n;
+}
+
+static void wheel_remove(struct timer_node *n){
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+}
+
+static void endpoint_ok(struct engine_endpoint *ep){
+    // A reply came back, the server is healthy (only written when it wasn't, the line stays shared)
+    if (__atomic_load_n(&ep->timeouts, __ATOMIC_RELAXED) != 0){
+        __atomic_store_n(&ep->timeouts, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&ep->ejections, __ATOMIC_RELAXED) != 0){
+        __atomic_store_n(&ep->ejections, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static int endpoint_ejected(struct engine_endpoint *ep, uint64_t now){
+    return __atomic_load_n(&ep->ejected_until, __ATOMIC_RELAXED) > now;
+}
+
+static void endpoint_timeout(struct client_engine *e, struct engine_endpoint *ep, uint64_t now){
+    /* Count a timeout against the server and eject it once ENGINE_EJECT_TIMEOUTS came in a
+    row, unless every other server is already out. */
+    if (__atomic_add_fetch(&ep->timeouts, 1, __ATOMIC_RELAXED) < ENGINE_EJECT_TIMEOUTS || e->num_endpoints == 1){
+        return;
+    }
+
+    pthread_mutex_lock(&e->eject_lock);
+    int out = 0;
+    for (int i = 0; i < e->num_endpoints; i++){
+        out += endpoint_ejected(&e->endpoints[i], now);
+    }
+    // Requests sent before the ejection still time out afterwards, they don't extend it
+    if (!endpoint_ejected(ep, now) && out + 1 < e->num_endpoints){
+        long ms = ENGINE_EJECT_MS;
+        for (int i = 0; i < ep->ejections && ms < ENGINE_MAX_EJECT_MS; i++){
+            ms *= 2;
+        }
+        if (ms > ENGINE_MAX_EJECT_MS) ms = ENGINE_MAX_EJECT_MS;
+        ep->ejections++;
+        __atomic_store_n(&ep->timeouts, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ep->ejected_until, now + (uint64_t)ms * 1000000ULL, __ATOMIC_RELAXED);
+        fprintf(stderr, "client: %s:%s keeps timing out, ejected for %ld ms\n", ep->ip, ep->port, ms);
+    }
+    pthread_mutex_unlock(&e->eject_lock);
+}
+
+static void complete(struct engine_thread *t, struct inflight *node, int status, uint64_t now){
+    // Finish a request: unlink it everywhere, run its callback and recycle the node
+    struct engine_conn *c = node->conn;
+
+    wheel_remove(&node->timer);
+    if (node->prev) node->prev->next = node->next;
+    else c->head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else c->tail = node->prev;
+    c->outstanding--;
+    t->inflight--;
+    node->conn = NULL;
+    if (status == ENGINE_OK){
+        endpoint_ok(c->ep);
+    }
+
+    node->req.cb(node->req.arg, node->req.value, status, now - node->req.submitted);
+
+    node->next = t->free_nodes;
+    t->free_nodes = node;
+}
+
+static void conn_fail(struct engine_thread *t, struct engine_conn *c, uint64_t now){
+    // Close a broken connection, fail what it had in flight and schedule a reconnect
+    while (c->head != NULL){
+        complete(t, c->head, ENGINE_ERROR, now);
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->dead = 1;
+    c->connecting = 0;
+    c->timed_out = 0;
+    c->out_len = 0;
+    c->out_off = 0;
+    c->in_len = 0;
+    c->retry_at = now + ENGINE_RETRY_NS;
+}
+
+static int conn_open(struct engine_thread *t, struct engine_conn *c, int wait){
+    /* Connect 'c' and register it with the thread's epoll.
+
+    Params:
+        wait (int): Block until connected (at startup, so a bad server is reported right away)
+            instead of finishing the connect from the event loop.
+
+    Return:
+        0 if connected or connecting, -1 on error.
+    */
+    struct client_engine *e = t->engine;
+    int one = 1;
+
+    c->fd = socket(AF_INET, e->cfg.sock_type | (wait ? 0 : SOCK_NONBLOCK), 0);
+    if (c->fd == -1){
+        return -1;
+    }
+    if (e->cfg.sock_type == SOCK_STREAM){
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // udp sockets are connected too so we only see acks from the server
+    c->connecting = 0;
+    if (connect(c->fd, (struct sockaddr *)&c->ep->addr, c->ep->addr_len) == -1){
+        if (errno != EINPROGRESS){
+            close(c->fd);
+            c->fd = -1;
+            return -1;
+        }
+        c->connecting = 1;
+    }
+    if (wait){
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1){
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->dead = 0;
+    return 0;
+}
+
+static void conn_flush(struct engine_thread *t, struct engine_conn *c){
+    // Write queued tcp frames until the socket is full
+    while (c->out_off < c->out_len){
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn_fail(t, c, now_ns());
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out_len = 0;
+    c->out_off = 0;
+}
+
+static int conn_ready(struct engine_conn *c, int max){
+    // Live and with room for another request (and its sequence number inside the window)
+    return !c->dead && !c->connecting && c->outstanding < max && ENGINE_OUT_SIZE - c->out_len >= PROTOCOL_MAX_FRAME
+            && (c->window == NULL || c->head == NULL || c->next_seq - c->head->id < PROTOCOL_RUDP_WINDOW);
+}
+
+static uint32_t next_random(struct engine_thread *t){
+    // xorshift32
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 17;
+    t->rng ^= t->rng << 5;
+    return t->rng;
+}
+
+static struct engine_conn *pick_conn(struct engine_thread *t, uint64_t now){
+    /* Pick the connection for the next request: the less loaded of two random ones, or if
+    neither will do, the least loaded of all. Connections to ejected servers are only used
+    when nothing else is connected.
+
+    Return:
+        The connection, or NULL if none has room.
+    */
+    struct engine_conn *best = NULL;
+    struct engine_conn *fallback = NULL;
+    int max = t->engine->cfg.max_inflight;
+    int healthy = 0;
+
+    if (t->num_conns > 2){
+        uint32_t r = next_random(t);
+        struct engine_conn *a = &t->conns[r % t->num_conns];
+        struct engine_conn *b = &t->conns[(r % t->num_conns + 1 + (r >> 16) % (t->num_conns - 1)) % t->num_conns];
+        int a_ok = conn_ready(a, max) && !endpoint_ejected(a->ep, now);
+        int b_ok = conn_ready(b, max) && !endpoint_ejected(b->ep, now);
+        if (a_ok && b_ok){
+            return a->outstanding <= b->outstanding ? a : b;
+        }
+        if (a_ok || b_ok){
+            return a_ok ? a : b;
+        }
+    }
+
+    for (int i = 0; i < t->num_conns; i++){
+        struct engine_conn *c = &t->conns[i];
+        if (c->dead || c->connecting){
+            continue;
+        }
+        if (endpoint_ejected(c->ep, now)){
+            if (conn_ready(c, max) && (fallback == NULL || c->outstanding < fallback->outstanding)){
+                fallback = c;
+            }
+            continue;
+        }
+        healthy = 1;
+        if (conn_ready(c, max) && (best == NULL || c->outstanding < best->outstanding)){
+            best = c;
+        }
+    }
+    return healthy ? best : fallback;
+}
+
+static size_t build_frame(struct engine_thread *t, struct inflight *node, uint8_t *buf){
+    /* Write the frame for node's request into buf (room for PROTOCOL_MAX_FRAME bytes).
+
+    Return:
+        The frame's length.
+    */
+    struct engine_request *req = &node->req;
+    struct request_header header;
+    uint32_t word;
+
+    if (t->engine->cfg.version != PROTOCOL_V2){
+        struct client_message frame;
+        frame.version = PROTOCOL_V1;
+        frame.data = htonl(req->value);
+        memcpy(buf, &frame, sizeof(frame));
+        return sizeof(frame);
+    }
+
+    // New generation for the node so a stale reply to its last request can't match (reliable
+    // udp numbers frames per socket instead, and a retransmit keeps its number)
+    if (!t->engine->cfg.reliable){
+        node->id = (node->id + (1u << ENGINE_ID_BITS)) | (uint32_t)(node - t->nodes);
+    }
+    header.version = PROTOCOL_V2;
+    header.id = htonl(node->id);
+    uint8_t flags = t->engine->cfg.reliable ? REQ_RELIABLE : 0;
+
+    if (req->values == NULL){
+        header.type = REQ_DATA | flags;
+        header.length = htons(sizeof(word));
+        word = htonl(req->value);
+    }
+    else{
+        // Count, then every value swapped to network order in one pass
+        header.type = REQ_BATCH | flags;
+        header.length = htons(sizeof(word) + req->value * sizeof(uint32_t));
+        word = htonl(req->value);
+        swap_values(buf + sizeof(header) + sizeof(word), req->values, req->value);
+    }
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), &word, sizeof(word));
+    return sizeof(header) + ntohs(header.length);
+}
+
+static void start_request(struct engine_thread *t, struct engine_conn *c, struct engine_request *req, uint64_t now){
+    // Send the frame for 'req' on 'c' and start its timer
+    struct inflight *node = t->free_nodes;
+
+    t->free_nodes = node->next;
+    node->req = *req;
+    node->conn = c;
+    node->next = NULL;
+    node->prev = c->tail;
+    if (c->tail) c->tail->next = node;
+    else c->head = node;
+    c->tail = node;
+    c->outstanding++;
+    t->inflight++;
+    node->sent = now;
+    node->busy = 0;
+
+    if (c->window != NULL){
+        // A lost datagram is sent again, so a failed send is just an early loss
+        node->id = c->next_seq++;
+        node->retries = 0;
+        c->window[node->id % PROTOCOL_RUDP_WINDOW] = node;
+        wheel_add(&t->wheel, &node->timer, now + c->rto);
+        if (send(c->fd, t->frame, build_frame(t, node, t->frame), 0) == -1){
+            // Nothing to do, the timer retransmits it
+        }
+        return;
+    }
+
+    wheel_add(&t->wheel, &node->timer, now + (uint64_t)t->engine->cfg.timeout_ms * 1000000ULL);
+    if (t->engine->cfg.sock_type == SOCK_STREAM){
+        c->out_len += build_frame(t, node, c->out + c->out_len);
+    }
+    else if (send(c->fd, t->frame, build_frame(t, node, t->frame), 0) == -1){
+        complete(t, node, ENGINE_ERROR, now);
+    }
+}
+
+static void rtt_sample(struct engine_conn *c, uint64_t rtt){
+    // Fold a round trip into the socket's retransmit timeout (RFC 6298)
+    if (c->srtt == 0){
+        c->srtt = rtt;
+        c->rttvar = rtt / 2;
+    }
+    else{
+        uint64_t diff = c->srtt > rtt ? c->srtt - rtt : rtt - c->srtt;
+        c->rttvar = (3 * c->rttvar + diff) / 4;
+        c->srtt = (7 * c->srtt + rtt) / 8;
+    }
+    c->rto = c->srtt + (4 * c->rttvar > WHEEL_TICK_NS ? 4 * c->rttvar : WHEEL_TICK_NS);
+    if (c->rto < ENGINE_RTO_MIN_MS * 1000000ULL) c->rto = ENGINE_RTO_MIN_MS * 1000000ULL;
+    if (c->rto > ENGINE_RTO_MAX_MS * 1000000ULL) c->rto = ENGINE_RTO_MAX_MS * 1000000ULL;
+}
+
+static struct inflight *window_find(struct engine_conn *c, uint32_t seq){
+    // The reliable frame in flight on 'c' with this sequence number, NULL if it isn't any more
+    struct inflight *node = c->window[seq % PROTOCOL_RUDP_WINDOW];
+    return node != NULL && node->conn == c && node->id == seq ? node : NULL;
+}
+
+static void handle_rudp_ack(struct engine_thread *t, struct engine_conn *c, uint32_t seq, const struct rudp_ack *ack, uint64_t now){
+    // Complete the frames before 'seq' the server says it is done with (their replies were lost)
+    uint64_t sack = be64toh(ack->sack);
+    struct inflight *node;
+
+    for (uint32_t i = 0; sack != 0; i++, sack >>= 1){
+        if ((sack & 1) && (node = window_find(c, seq - 1 - i)) != NULL){
+            complete(t, node, ENGINE_OK, now);
+        }
+    }
+}
+
+static void retransmit(struct engine_thread *t, struct inflight *node, uint64_t now){
+    // Send a reliable frame again and back its timer off, but not past the request's timeout
+    struct engine_conn *c = node->conn;
+    uint64_t deadline = node->sent + (uint64_t)t->engine->cfg.timeout_ms * 1000000ULL;
+    uint64_t rto = c->rto << (node->retries < 10 ? node->retries + 1 : 10);
+    uint64_t tick = now / WHEEL_TICK_NS;
+
+    wheel_remove(&node->timer);
+    if (c->burst_tick != tick){
+        c->burst_tick = tick;
+        c->burst = 0;
+    }
+    if (c->burst == ENGINE_RTO_BURST){
+        /* Frames sent together time out together: sent again all at once they would overflow
+        the server's socket buffer at the same place every time, so the rest wait a tick. */
+        wheel_add(&t->wheel, &node->timer, now + WHEEL_TICK_NS);
+        return;
+    }
+    c->burst++;
+
+    if (rto > ENGINE_RTO_MAX_MS * 1000000ULL) rto = ENGINE_RTO_MAX_MS * 1000000ULL;
+    node->retries++;
+    wheel_add(&t->wheel, &node->timer, now + rto < deadline ? now + rto : deadline);
+    if (send(c->fd, t->frame, build_frame(t, node, t->frame), 0) == -1){
+        // Lost again, the timer tries once more
+    }
+}
+
+static int busy_wait(struct engine_thread *t, struct inflight *node, const struct reply_header *reply, size_t len, uint64_t now){
+    /* The server refused the request for now (STATUS_BUSY): have its timer send it again once
+    the wait the server asked for is up, unless that is past the request's timeout.
+
+    Return:
+        1 if it will be sent again, 0 if it fails now.
+    */
+    uint64_t deadline = node->sent + (uint64_t)t->engine->cfg.timeout_ms * 1000000ULL;
+    uint32_t wait_ms = ENGINE_BUSY_MS;
+
+    if (len >= sizeof(*reply) + sizeof(wait_ms) && ntohs(reply->length) == sizeof(wait_ms)){
+        memcpy(&wait_ms, reply + 1, sizeof(wait_ms));
+        wait_ms = ntohl(wait_ms);
+    }
+    if (now + wait_ms * 1000000ULL >= deadline){
+        return 0;
+    }
+    node->busy = 1;
+    wheel_remove(&node->timer);
+    wheel_add(&t->wheel, &node->timer, now + wait_ms * 1000000ULL);
+    return 1;
+}
+
+static void resend(struct engine_thread *t, struct inflight *node, uint64_t now){
+    // Send a request the server was too busy for again, timed out as usual from its first send
+    struct engine_conn *c = node->conn;
+    uint64_t deadline = node->sent + (uint64_t)t->engine->cfg.timeout_ms * 1000000ULL;
+
+    wheel_remove(&node->timer);
+    if (c->window != NULL){
+        // Same sequence number (the server forgot it), and no round trip sample from it (Karn)
+        node->busy = 0;
+        node->retries++;
+        wheel_add(&t->wheel, &node->timer, now + c->rto < deadline ? now + c->rto : deadline);
+        if (send(c->fd, t->frame, build_frame(t, node, t->frame), 0) == -1){
+            // The timer retransmits it
+        }
+        return;
+    }
+    if (t->engine->cfg.sock_type == SOCK_STREAM){
+        if (ENGINE_OUT_SIZE - c->out_len < PROTOCOL_MAX_FRAME){
+            // No room behind the frames still going out, try on the next tick
+            wheel_add(&t->wheel, &node->timer, now + WHEEL_TICK_NS);
+            return;
+        }
+        node->busy = 0;
+        wheel_add(&t->wheel, &node->timer, deadline);
+        c->out_len += build_frame(t, node, c->out + c->out_len);
+        return;
+    }
+    node->busy = 0;
+    wheel_add(&t->wheel, &node->timer, deadline);
+    if (send(c->fd, t->frame, build_frame(t, node, t->frame), 0) == -1){
+        complete(t, node, ENGINE_ERROR, now);
+    }
+}
+
+static void handle_reply(struct engine_thread *t, struct engine_conn *c, struct reply_header *reply, size_t len, uint64_t now){
+    // Complete the request a version 2 reply belongs to, if it is still in flight on 'c'
+    uint32_t id = ntohl(reply->id);
+    size_t idx = id & ENGINE_ID_MASK;
+    size_t pool = (size_t)t->num_conns * t->engine->cfg.max_inflight;
+
+    if (c->window != NULL){
+        struct inflight *node = window_find(c, id);
+        if (node != NULL && reply->status == STATUS_BUSY && busy_wait(t, node, reply, len, now)){
+            return;
+        }
+        if (node != NULL){
+            // Karn: a retransmitted frame's reply could be to any of its copies, don't time it
+            if (node->retries == 0){
+                rtt_sample(c, now - node->sent);
+            }
+            complete(t, node, reply->status == STATUS_OK ? ENGINE_OK : ENGINE_ERROR, now);
+        }
+        if (len >= sizeof(*reply) + sizeof(struct rudp_ack) && ntohs(reply->length) == sizeof(struct rudp_ack)){
+            handle_rudp_ack(t, c, id, (struct rudp_ack *)(reply + 1), now);
+        }
+        return;
+    }
+
+    if (idx >= pool || t->nodes[idx].id != id || t->nodes[idx].conn != c){
+        // Late reply for a request that already timed out (or garbage), nothing is waiting on it
+        return;
+    }
+    if (reply->status == STATUS_BUSY && busy_wait(t, &t->nodes[idx], reply, len, now)){
+        return;
+    }
+    complete(t, &t->nodes[idx], reply->status == STATUS_OK ? ENGINE_OK : ENGINE_ERROR, now);
+}
+
+static int parse_replies(struct engine_thread *t, struct engine_conn *c, uint64_t now){
+    /* Handle every complete version 2 reply in c->in and keep any partial one.
+
+    Return:
+        0 on success, -1 if the stream is out of sync (the connection must be failed).
+    */
+    size_t off = 0;
+
+    while (c->in_len - off >= sizeof(struct reply_header)){
+        struct reply_header *reply = (struct reply_header *)(c->in + off);
+        size_t len = sizeof(*reply) + ntohs(reply->length);
+        if (reply->version != PROTOCOL_V2 || len > sizeof(c->in)){
+            return -1;
+        }
+        if (c->in_len - off < len){
+            break;
+        }
+        handle_reply(t, c, reply, len, now);
+        off += len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+static void read_acks(struct engine_thread *t, struct engine_conn *c){
+    /* Drain the socket. A version 1 ack completes the oldest request on this connection, a
+    version 2 reply completes the request with its id. */
+    uint8_t buf[4096];
+    int tcp = t->engine->cfg.sock_type == SOCK_STREAM;
+    int v2 = t->engine->cfg.version == PROTOCOL_V2;
+
+    while (!c->dead){
+        // Version 2 tcp replies are reassembled in c->in, everything else is handled straight from buf
+        uint8_t *dst = v2 && tcp ? c->in + c->in_len : buf;
+        size_t room = v2 && tcp ? sizeof(c->in) - c->in_len : sizeof(buf);
+        ssize_t n = recv(c->fd, dst, room, 0);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && tcp) conn_fail(t, c, now_ns());
+            return;
+        }
+        if (n == 0 && tcp){
+            conn_fail(t, c, now_ns());
+            return;
+        }
+
+        uint64_t now = now_ns();
+        if (v2 && tcp){
+            c->in_len += n;
+            if (parse_replies(t, c, now) == -1){
+                conn_fail(t, c, now);
+                return;
+            }
+            continue;
+        }
+        if (v2){
+            // One reply per datagram
+            if (n >= (ssize_t)sizeof(struct reply_header) && buf[0] == PROTOCOL_V2){
+                handle_reply(t, c, (struct reply_header *)buf, n, now);
+            }
+            continue;
+        }
+
+        ssize_t acks = tcp ? n : 1;
+        for (ssize_t i = 0; i < acks && c->head != NULL; i++){
+            complete(t, c->head, buf[i] == PROTOCOL_V1 ? ENGINE_OK : ENGINE_ERROR, now);
+        }
+    }
+}
+
+static void expire(struct engine_thread *t, struct inflight *node, uint64_t now){
+    struct engine_conn *c = node->conn;
+    if (node->busy && now < node->sent + (uint64_t)t->engine->cfg.timeout_ms * 1000000ULL){
+        resend(t, node, now);
+        return;
+    }
+    if (c->window != NULL && now < node->sent + (uint64_t)t->engine->cfg.timeout_ms * 1000000ULL){
+        retransmit(t, node, now);
+        return;
+    }
+    complete(t, node, ENGINE_TIMEOUT, now);
+    endpoint_timeout(t->engine, c->ep, now);
+    if (t->engine->cfg.sock_type == SOCK_STREAM){
+        // Failing the connection here would unlink timers the wheel walk still holds
+        c->timed_out = 1;
+    }
+}
+
+static void wheel_advance(struct engine_thread *t, uint64_t now){
+    // Expire every request whose deadline tick has passed
+    struct timer_wheel *w = &t->wheel;
+    uint64_t now_tick = now / WHEEL_TICK_NS;
+
+    // After a long sleep visit each slot once instead of every missed tick
+    if (now_tick - w->tick > WHEEL_SLOTS){
+        w->tick = now_tick - WHEEL_SLOTS;
+    }
+
+    while (w->tick < now_tick){
+        w->tick++;
+        struct timer_node *head = &w->slots[w->tick & (WHEEL_SLOTS - 1)];
+        struct timer_node *n = head->next;
+        while (n != head){
+            struct timer_node *next = n->next;
+            if (n->deadline <= now_tick){
+                expire(t, (struct inflight *)n, now);
+            }
+            n = next;
+        }
+    }
+
+    for (int i = 0; i < t->num_conns; i++){
+        if (t->conns[i].timed_out){
+            conn_fail(t, &t->conns[i], now);
+        }
+    }
+}
+
+static void *engine_thread_main(void *arg){
+    /* I/O thread: move queued requests onto connections, read acks, expire timers. Exits once
+    the engine is stopping and everything it was given has completed. */
+    struct engine_thread *t = arg;
+    struct client_engine *e = t->engine;
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    struct engine_request req;
+
+    while (1){
+        uint64_t now = now_ns();
+
+        // Bring dead connections back
+        int alive = 0;
+        for (int i = 0; i < t->num_conns; i++){
+            struct engine_conn *c = &t->conns[i];
+            if (c->dead && now >= c->retry_at && conn_open(t, c, 0) == -1){
+                c->retry_at = now + ENGINE_RETRY_NS;
+            }
+            alive += !c->dead;
+        }
+
+        // Nothing is connected: fail what's queued rather than holding it until the server is back
+        if (alive == 0){
+            while (queue_pop(&t->queue, &req) == 0){
+                req.cb(req.arg, req.value, ENGINE_ERROR, now - req.submitted);
+            }
+        }
+
+        // Only take requests while a connection has room, otherwise they wait in the queue
+        struct engine_conn *c;
+        while ((c = pick_conn(t, now)) != NULL && queue_pop(&t->queue, &req) == 0){
+            start_request(t, c, &req, now);
+        }
+        if (e->cfg.sock_type == SOCK_STREAM){
+            for (int i = 0; i < t->num_conns; i++){
+                if (!t->conns[i].dead && !t->conns[i].connecting && t->conns[i].out_len > 0){
+                    conn_flush(t, &t->conns[i]);
+                }
+            }
+        }
+
+        wheel_advance(t, now_ns());
+
+        if (__atomic_load_n(&e->stopping, __ATOMIC_ACQUIRE) && t->inflight == 0 && queue_empty(&t->queue)){
+            break;
+        }
+
+        // Tick the wheel while anything is in flight, otherwise sleep until woken
+        int timeout = -1;
+        for (int i = 0; i < t->num_conns; i++){
+            if (t->conns[i].dead){
+                timeout = ENGINE_RETRY_NS / 1000000;
+            }
+        }
+        if (t->inflight > 0){
+            timeout = 1;
+        }
+
+        // Tell producers we may sleep, then look at the queue once more (pairs with engine_submit)
+        __atomic_store_n(&t->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!queue_empty(&t->queue) && pick_conn(t, now_ns()) != NULL){
+            timeout = 0;
+        }
+
+        int n = epoll_wait(t->epfd, events, ENGINE_MAX_EVENTS, timeout);
+        __atomic_store_n(&t->sleeping, 0, __ATOMIC_RELAXED);
+        if (n == -1 && errno != EINTR){
+            fprintf(stderr, "Error waiting on epoll.\n");
+            break;
+        }
+
+        for (int i = 0; i < n; i++){
+            if (events[i].data.ptr == NULL){
+                uint64_t count;
+                if (read(t->wakefd, &count, sizeof(count)) == -1){
+                    // Nothing to do, we were woken either way
+                }
+                continue;
+            }
+            c = events[i].data.ptr;
+            if (c->dead){
+                continue;
+            }
+            if (c->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0){
+                    conn_fail(t, c, now_ns());
+                    continue;
+                }
+                c->connecting = 0;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+                read_acks(t, c);
+            }
+            if (!c->dead && (events[i].events & EPOLLOUT) && c->out_len > 0){
+                conn_flush(t, c);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int thread_init(struct client_engine *e, struct engine_thread *t, int first, int num_conns){
+    /* Set up one I/O thread's queue, connections, node pool and wheel.
+
+    Params:
+        first (int): The engine-wide number of the thread's first connection, which picks its server.
+        num_conns (int): Connections the thread gets.
+
+    Return:
+        0 on success, -1 on error.
+    */
+    struct epoll_event ev;
+
+    t->engine = e;
+    t->rng = (uint32_t)(now_ns() ^ (uint64_t)(t - e->threads + 1) * 2654435761u) | 1;
+    t->num_conns = num_conns;
+    t->epfd = epoll_create1(0);
+    t->wakefd = eventfd(0, EFD_NONBLOCK);
+    t->conns = calloc(num_conns, sizeof(*t->conns));
+    t->nodes = calloc((size_t)num_conns * e->cfg.max_inflight, sizeof(*t->nodes));
+    t->frame = malloc(PROTOCOL_MAX_FRAME);
+
+    // Closed until conn_open(), so a failed setup only closes what it opened
+    for (int i = 0; t->conns != NULL && i < num_conns; i++){
+        t->conns[i].fd = -1;
+    }
+    if (t->epfd == -1 || t->wakefd == -1 || t->conns == NULL || t->nodes == NULL || t->frame == NULL
+            || queue_init(&t->queue, ENGINE_QUEUE_SIZE) == -1){
+        return -1;
+    }
+
+    for (int i = 0; i < num_conns * e->cfg.max_inflight; i++){
+        t->nodes[i].id = i;
+        t->nodes[i].next = t->free_nodes;
+        t->free_nodes = &t->nodes[i];
+    }
+    wheel_init(&t->wheel, now_ns());
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wakefd, &ev) == -1){
+        return -1;
+    }
+
+    for (int i = 0; i < num_conns; i++){
+        struct engine_conn *c = &t->conns[i];
+        c->ep = &e->endpoints[(first + i) % e->num_endpoints];
+        if (e->cfg.reliable){
+            c->window = calloc(PROTOCOL_RUDP_WINDOW, sizeof(*c->window));
+            if (c->window == NULL){
+                return -1;
+            }
+            c->next_seq = next_random(t);
+            c->rto = ENGINE_RTO_INITIAL_MS * 1000000ULL;
+        }
+        if (conn_open(t, c, 1) == 0){
+            continue;
+        }
+        if (e->num_endpoints == 1){
+            fprintf(stderr, "client: failed to connect with socket. Server may be listening on UDP or different port.\n");
+            return -1;
+        }
+        // One server being down shouldn't stop us using the others, keep retrying it
+        if (!c->ep->reported){
+            fprintf(stderr, "client: failed to connect to %s:%s, retrying in the background.\n", c->ep->ip, c->ep->port);
+            c->ep->reported = 1;
+        }
+        c->dead = 1;
+        c->retry_at = now_ns() + ENGINE_RETRY_NS;
+    }
+    return 0;
+}
+
+static int resolve(struct client_engine *e, struct engine_endpoint *ep, const char *ip, const char *port){
+    /* Look the server up once, every (re)connect to it reuses the cached address.
+
+    Return:
+        0 on success, -1 if it doesn't resolve.
+    */
+    struct addrinfo hints, *res;
+    int status;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = e->cfg.sock_type;
+    if ((status = getaddrinfo(ip, port, &hints, &res)) != 0){
+        fprintf(stderr, "getaddrinfo %s: %s\n", ip, gai_strerror(status));
+        return -1;
+    }
+    ep->ip = ip;
+    ep->port = port;
+    memcpy(&ep->addr, res->ai_addr, res->ai_addrlen);
+    ep->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void wake(struct engine_thread *t){
+    uint64_t one = 1;
+    if (write(t->wakefd, &one, sizeof(one)) == -1){
+        // The eventfd is already signalled
+    }
+}
+
+static void engine_free(struct client_engine *e, int inited, int started){
+    /* Stop and join the I/O threads, then free everything engine_create() set up. Also its error
+    path, where only some of the threads got that far.
+
+    Params:
+        inited (int): Threads thread_init() was called for (the first ones).
+        started (int): Threads that are running.
+    */
+    __atomic_store_n(&e->stopping, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < started; i++){
+        wake(&e->threads[i]);
+    }
+    for (int i = 0; i < started; i++){
+        pthread_join(e->threads[i].thread, NULL);
+    }
+    for (int i = 0; i < inited; i++){
+        struct engine_thread *t = &e->threads[i];
+        for (int j = 0; t->conns != NULL && j < t->num_conns; j++){
+            if (t->conns[j].fd != -1) close(t->conns[j].fd);
+            free(t->conns[j].window);
+        }
+        if (t->epfd != -1) close(t->epfd);
+        if (t->wakefd != -1) close(t->wakefd);
+        free(t->conns);
+        free(t->nodes);
+        free(t->frame);
+        free(t->queue.slots);
+    }
+    pthread_mutex_destroy(&e->eject_lock);
+    free(e->endpoints);
+    free(e->threads);
+    free(e);
+}
+
+struct client_engine *engine_create(const struct engine_config *cfg){
+    /* Resolve the servers, open the connections and start the I/O threads.
+
+    Params:
+        cfg (engine_config *): Server address(es) and sizing, zero fields get the defaults.
+
+    Return:
+        The engine, or NULL on error.
+    */
+    struct client_engine *e = calloc(1, sizeof(*e));
+
+    if (e == NULL){
+        return NULL;
+    }
+    e->cfg = *cfg;
+    e->num_endpoints = cfg->num_targets > 0 ? cfg->num_targets : 1;
+    if (e->cfg.threads < 1) e->cfg.threads = 1;
+    if (e->cfg.connections < 1) e->cfg.connections = 1;
+    if (e->cfg.connections * e->num_endpoints < e->cfg.threads){
+        e->cfg.connections = (e->cfg.threads + e->num_endpoints - 1) / e->num_endpoints;
+    }
+    if (e->cfg.max_inflight < 1) e->cfg.max_inflight = ENGINE_DEFAULT_INFLIGHT;
+    if (e->cfg.timeout_ms < 1) e->cfg.timeout_ms = ENGINE_DEFAULT_TIMEOUT_MS;
+    if (e->cfg.version != PROTOCOL_V2) e->cfg.version = PROTOCOL_V1;
+    if (e->cfg.sock_type != SOCK_DGRAM) e->cfg.reliable = 0;
+    if (e->cfg.reliable){
+        e->cfg.version = PROTOCOL_V2;
+        if (e->cfg.max_inflight > PROTOCOL_RUDP_WINDOW) e->cfg.max_inflight = PROTOCOL_RUDP_WINDOW;
+    }
+
+    // Every request a thread has in flight needs its own id
+    int total = e->cfg.connections * e->num_endpoints;
+    int per_thread = (total + e->cfg.threads - 1) / e->cfg.threads;
+    if ((long)per_thread * e->cfg.max_inflight > ENGINE_ID_MASK + 1L){
+        e->cfg.max_inflight = (ENGINE_ID_MASK + 1L) / per_thread;
+    }
+
+    e->endpoints = aligned_alloc(64, e->num_endpoints * sizeof(*e->endpoints));
+    if (e->endpoints == NULL){
+        free(e);
+        return NULL;
+    }
+    memset(e->endpoints, 0, e->num_endpoints * sizeof(*e->endpoints));
+    for (int i = 0; i < e->num_endpoints; i++){
+        const char *ip = cfg->num_targets > 0 ? cfg->targets[i].ip : cfg->ip;
+        const char *port = cfg->num_targets > 0 ? cfg->targets[i].port : cfg->port;
+        if (resolve(e, &e->endpoints[i], ip, port) == -1){
+            free(e->endpoints);
+            free(e);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&e->eject_lock, NULL);
+
+    e->threads = calloc(e->cfg.threads, sizeof(*e->threads));
+    if (e->threads == NULL){
+        engine_free(e, 0, 0);
+        return NULL;
+    }
+    int first = 0;
+    int alive = 0;
+    for (int i = 0; i < e->cfg.threads; i++){
+        // Spread the connections evenly, the first threads take the remainder
+        int conns = total / e->cfg.threads + (i < total % e->cfg.threads);
+        if (thread_init(e, &e->threads[i], first, conns) == -1){
+            fprintf(stderr, "Failed to set up client engine.\n");
+            engine_free(e, i + 1, 0);
+            return NULL;
+        }
+        for (int j = 0; j < conns; j++){
+            alive += !e->threads[i].conns[j].dead;
+        }
+        first += conns;
+    }
+    if (alive == 0){
+        fprintf(stderr, "client: failed to connect to any server.\n");
+        engine_free(e, e->cfg.threads, 0);
+        return NULL;
+    }
+    for (int i = 0; i < e->cfg.threads; i++){
+        if (pthread_create(&e->threads[i].thread, NULL, engine_thread_main, &e->threads[i]) != 0){
+            fprintf(stderr, "Failed to start client engine thread.\n");
+            engine_free(e, e->cfg.threads, i);
+            return NULL;
+        }
+    }
+    return e;
+}
+
+static int submit(struct client_engine *e, struct engine_request *req){
+    /* Hand a request to the next I/O thread (round robin). Blocks (yielding) while that thread's
+    queue is full.
+
+    Return:
+        0 once queued, -1 if the engine is shutting down.
+    */
+    size_t idx = __atomic_fetch_add(&e->next_thread, 1, __ATOMIC_RELAXED) % e->cfg.threads;
+    struct engine_thread *t = &e->threads[idx];
+
+    if (__atomic_load_n(&e->stopping, __ATOMIC_ACQUIRE)){
+        return -1;
+    }
+
+    req->submitted = now_ns();
+    while (queue_push(&t->queue, req) == -1){
+        wake(t);
+        sched_yield();
+    }
+
+    // Only pay for the eventfd write when the thread might be asleep (pairs with the thread's fence)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&t->sleeping, __ATOMIC_RELAXED)){
+        wake(t);
+    }
+    return 0;
+}
+
+int engine_submit(struct client_engine *e, uint32_t value, engine_callback cb, void *arg){
+    /* Queue a value to be sent. cb runs on an I/O thread once it is acked, fails or times out.
+
+    Return:
+        0 once queued, -1 if the engine is shutting down.
+    */
+    struct engine_request req;
+
+    req.value = value;
+    req.values = NULL;
+    req.cb = cb;
+    req.arg = arg;
+    return submit(e, &req);
+}
+
+int engine_submit_batch(struct client_engine *e, const uint32_t *values, uint32_t count, engine_callback cb, void *arg){
+    /* Queue up to PROTOCOL_MAX_BATCH values to go out as one REQ_BATCH frame with a single
+    reply (version 2 only). 'values' must stay valid until cb runs, cb gets 'count' as its value.
+
+    Return:
+        0 once queued, -1 if the engine is shutting down or the batch can't be sent.
+    */
+    struct engine_request req;
+
+    if (e->cfg.version != PROTOCOL_V2 || count == 0 || count > PROTOCOL_MAX_BATCH){
+        return -1;
+    }
+    req.value = count;
+    req.values = values;
+    req.cb = cb;
+    req.arg = arg;
+    return submit(e, &req);
+}
+
+static void waiter_done(void *arg, uint32_t value, int status, uint64_t latency_ns){
+    struct engine_waiter *w = arg;
+    (void)value;
+    (void)latency_ns;
+
+    pthread_mutex_lock(&w->lock);
+    w->status = status;
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int engine_send(struct client_engine *e, uint32_t value){
+    /* Send a value and wait for its ack.
+
+    Return:
+        ENGINE_OK, ENGINE_ERROR or ENGINE_TIMEOUT.
+    */
+    struct engine_waiter w;
+
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.done = 0;
+    w.status = ENGINE_ERROR;
+
+    if (engine_submit(e, value, waiter_done, &w) == -1){
+        return ENGINE_ERROR;
+    }
+
+    pthread_mutex_lock(&w.lock);
+    while (!w.done){
+        pthread_cond_wait(&w.cond, &w.lock);
+    }
+    pthread_mutex_unlock(&w.lock);
+
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+    return w.status;
+}
+
+void engine_destroy(struct client_engine *e){
+    // Wait for every submitted request to complete, then stop the threads and free everything
+    engine_free(e, e->cfg.threads, e->cfg.threads);
+}
@@ -0,0 +1,100 @@
+#ifndef CLIENT_ENGINE_H
+#define CLIENT_ENGINE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Asynchronous client engine.
+
+    Keeps many requests in flight over many connections from a few I/O threads. Any thread
+    can submit a value; the engine picks a connection, sends the frame, matches the ack back
+    to the request (in send order for version 1, by request id for version 2) and calls its
+    completion callback (on the I/O thread) with one of the statuses below. Each I/O thread
+    times requests out from a timer wheel instead of a select() per message. engine_send() is
+    a blocking wrapper over the same path.
+
+    Several servers can be given as targets. Each one is resolved once, when the engine is
+    created, and gets its own pool of 'connections' that stay open (and reconnect) for the
+    life of the engine. Every request goes to the less loaded of two connections picked at
+    random (power of two choices on requests outstanding), so a slow server gets less of the
+    load. A server whose requests time out ENGINE_EJECT_TIMEOUTS times in a row is taken out
+    of the rotation for ENGINE_EJECT_MS, doubled every time it happens again until one of its
+    requests succeeds (at most ENGINE_MAX_EJECT_MS). The last server standing is never ejected.
+
+    With 'reliable' over udp every frame carries a sequence number (REQ_RELIABLE, see
+    protocol.h) and is retransmitted until it is acked or its timeout runs out, so a lost
+    datagram costs a retransmit instead of a failed request. The retransmit timer of each
+    socket follows its measured round trip time (RFC 6298, starting at ENGINE_RTO_INITIAL_MS,
+    doubled for every retransmit of the same frame), and at most PROTOCOL_RUDP_WINDOW sequence
+    numbers are in flight per socket. Every reply also acks the 64 frames before it that the
+    server is done with, so frames whose own replies were lost complete without being resent.
+
+    A version 2 request the server refuses with STATUS_BUSY (over its admission limits) is sent
+    again after the wait the reply asks for, as long as that is within its timeout.
+
+    Usage:
+        struct engine_config cfg = { .ip = "127.0.0.1", .port = "5000", .sock_type = SOCK_STREAM };
+        // or several servers: .targets = (struct engine_target[]){ { "10.0.0.1", "5000" }, { "10.0.0.2", "5000" } }, .num_targets = 2
+        struct client_engine *e = engine_create(&cfg);
+        engine_submit(e, 42, on_done, ctx);    // async
+        engine_submit_batch(e, values, n, on_done, ctx);  // async, one frame (version 2 only)
+        engine_send(e, 43);                    // blocking
+        engine_destroy(e);                     // waits for everything submitted
+*/
+
+// Completion statuses, same meaning as recvtimeout()'s return values
+#define ENGINE_OK 0
+#define ENGINE_ERROR -1
+#define ENGINE_TIMEOUT -2
+
+// Defaults for anything left 0 in engine_config
+#define ENGINE_DEFAULT_TIMEOUT_MS 3000
+#define ENGINE_DEFAULT_INFLIGHT 64
+#define ENGINE_QUEUE_SIZE 65536
+
+// Taking servers that keep timing out out of the rotation
+#define ENGINE_EJECT_TIMEOUTS 5
+#define ENGINE_EJECT_MS 1000
+#define ENGINE_MAX_EJECT_MS 30000
+
+// Reliable udp retransmit timer
+#define ENGINE_RTO_INITIAL_MS 200
+#define ENGINE_RTO_MIN_MS 2
+#define ENGINE_RTO_MAX_MS 1000
+
+// Wait before sending a request again after a STATUS_BUSY reply that doesn't say how long
+#define ENGINE_BUSY_MS 10
+
+typedef void (*engine_callback)(void *arg, uint32_t value, int status, uint64_t latency_ns);
+
+// One server to spread requests over
+struct engine_target
+{
+    const char *ip;
+    const char *port;
+};
+
+struct engine_config
+{
+    const char *ip;     // the server when there are no targets
+    const char *port;
+    const struct engine_target *targets;  // servers to balance over (must outlive engine_create)
+    int num_targets;
+    int sock_type;      // SOCK_STREAM or SOCK_DGRAM
+    int threads;        // I/O threads (default 1)
+    int connections;    // connections/udp sockets per server, spread over the threads (default one per thread)
+    int max_inflight;   // per connection (default ENGINE_DEFAULT_INFLIGHT)
+    int timeout_ms;     // per request (default ENGINE_DEFAULT_TIMEOUT_MS)
+    int version;        // wire protocol, PROTOCOL_V1 (default) or PROTOCOL_V2 (acks matched by request id)
+    int reliable;       // udp only: sequence numbers and retransmits (implies PROTOCOL_V2)
+};
+
+struct client_engine;
+
+struct client_engine *engine_create(const struct engine_config *cfg);
+int engine_submit(struct client_engine *e, uint32_t value, engine_callback cb, void *arg);
+int engine_submit_batch(struct client_engine *e, const uint32_t *values, uint32_t count, engine_callback cb, void *arg);
+int engine_send(struct client_engine *e, uint32_t value);
+void engine_destroy(struct client_engine *e);
+
+#endif
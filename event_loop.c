@@ -0,0 +1,692 @@
+/* Non-blocking, edge-triggered epoll reactor for the TCP side of the server.
+
+The listening socket and every accepted connection are non-blocking and registered with
+EPOLLET, so each wakeup must drain the socket until EAGAIN (or until the per-wakeup read budget
+runs out, in which case the connection goes on a ready list and is revisited after the next
+epoll_wait). A single stalled peer only ever holds its own buffers, never the loop.
+
+With -P the values are handed to the processing threads (pipeline.c). A connection whose
+processor is full, or whose reply buffer is all promised to replies still being processed,
+stops reading and goes on a stalled list. The pipeline's eventfd is in the epoll set, and when
+it fires the replies that came back are queued and every stalled connection gets another go.
+
+Reference:
+    https://man7.org/linux/man-pages/man7/epoll.7.html
+*/
+#define _GNU_SOURCE  // accept4()
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+
+
+static int set_nonblocking(int fd){
+    /* Switch a socket to non-blocking mode.
+
+    params:
+        fd (int): socket to change.
+
+    return:
+        0 on success, -1 on error.
+    */
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1){
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void release_closed(struct reactor *r, struct connection *conn){
+    // Queue a closed connection to be freed, once it is on neither the ready nor the stalled list
+    if (conn->fd == -1 && !conn->ready && !conn->stalled){
+        conn->next_closed = r->closed_head;
+        r->closed_head = conn;
+    }
+}
+
+static void connection_close(struct reactor *r, struct connection *conn){
+    /* Close a client connection. Closing the fd also removes it from the epoll set. The
+    state itself is freed at the end of the loop pass since later events from the same
+    epoll_wait batch (or the ready/stalled lists) may still point at it.
+    */
+    log_msg(LOG_DEBUG, "Closing connection %d.\n", conn->fd);
+    stats_count(STAT_CLOSES, 1);
+    close(conn->fd);
+    conn->fd = -1;
+    release_closed(r, conn);
+}
+
+static void connection_free(struct reactor *r, struct connection *conn){
+    // Give the connection (and its large frame ring, if it has one) back to the worker's pools
+    if (conn->in != conn->in_small){
+        pool_put(&r->bigs, conn->in);
+    }
+    pool_put(&r->conns, conn);
+}
+
+static void mark_ready(struct reactor *r, struct connection *conn){
+    // Queue the connection for another read pass after the next epoll_wait
+    if (conn->ready){
+        return;
+    }
+    conn->ready = 1;
+    conn->next_ready = r->ready_head;
+    r->ready_head = conn;
+}
+
+static void mark_stalled(struct reactor *r, struct connection *conn){
+    // Revisit the connection the next time the pipeline wakes us
+    if (conn->stalled){
+        return;
+    }
+    conn->stalled = 1;
+    conn->next_stalled = r->stalled_head;
+    r->stalled_head = conn;
+}
+
+static void reply_queued(struct connection *conn, uint64_t received){
+    // A reply went into 'out', its ack is timed from the oldest frame still waiting in there
+    if (conn->out_frames++ == 0){
+        conn->out_since = received;
+    }
+}
+
+static size_t out_room(struct connection *conn){
+    // Room left in 'out' for new replies
+    return CONN_OUT_SIZE - conn->out_len - conn->out_reserved;
+}
+
+static int connection_flush(struct connection *conn){
+    /* Write out as many queued acks as the socket will take.
+
+    return:
+        1 if the ack buffer is now empty.
+        0 if the socket is full and we must wait for EPOLLOUT.
+        -1 on a send error (connection should be closed).
+    */
+    while (conn->out_sent < conn->out_len){
+        TRACE_BEGIN(ack);
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        TRACE_END(TRACE_ACK, ack);
+        stats_count(STAT_SEND_CALLS, 1);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            stats_count(STAT_SEND_ERRORS, 1);
+            return -1;
+        }
+        stats_count(STAT_BYTES_OUT, n);
+        conn->out_sent += n;
+    }
+
+    // Everything went out, reuse the buffer from the start
+    if (conn->out_frames > 0){
+        stats_latency(conn->out_since, conn->out_frames);
+        conn->out_frames = 0;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    return 1;
+}
+
+static uint8_t *ring_peek(struct connection *conn, size_t len, uint8_t *scratch){
+    /* Get 'len' contiguous bytes from the front of the receive ring.
+
+    return:
+        A pointer into the ring, or into scratch if the bytes wrap around its end.
+    */
+    size_t off = conn->in_head & (conn->in_cap - 1);
+    size_t first = conn->in_cap - off;
+
+    if (len <= first){
+        return conn->in + off;
+    }
+    memcpy(scratch, conn->in + off, first);
+    memcpy(scratch + first, conn->in, len - first);
+    return scratch;
+}
+
+static int ring_grow(struct reactor *r, struct connection *conn){
+    // Move the unread bytes into a pooled ring big enough for any frame, -1 if none is left
+    size_t used = conn->in_tail - conn->in_head;
+    uint8_t *big = pool_get(&r->bigs);
+
+    if (big == NULL){
+        log_msg(LOG_WARN, "No large frame buffer left for connection %d.\n", conn->fd);
+        stats_count(STAT_POOL_EMPTY, 1);
+        return -1;
+    }
+    // ring_peek() reassembles wrapped bytes straight into big, otherwise copy them over
+    uint8_t *data = ring_peek(conn, used, big);
+    if (data != big){
+        memcpy(big, data, used);
+    }
+    conn->in = big;
+    conn->in_cap = CONN_BIG_SIZE;
+    conn->in_head = 0;
+    conn->in_tail = used;
+    return 0;
+}
+
+static int queue_reply(struct reactor *r, struct connection *conn, const uint8_t *reply, int reply_len,
+                       const uint8_t *values, uint32_t count){
+    /* Hand a checked frame's values to the connection's processor (-P). With ACK_RECEIPT its
+    reply is queued right away, with ACK_PROCESSED room is set aside for it in 'out' and the
+    processor hands it back through reply_ready() once the values have been displayed.
+
+    return:
+        1 once queued, 0 if the processor is full.
+    */
+    int deferred = pipeline_ack_policy(r->pipeline) == ACK_PROCESSED;
+
+    // A rejected frame has no values, but its reply still has to wait its turn behind the others
+    if (count > 0 || deferred){
+        struct pipe_msg *m = pipeline_reserve(r->pipeline, r->worker->id, conn->proc, count, deferred ? reply_len : 0, 0);
+        if (m == NULL){
+            stats_count(STAT_PIPELINE_FULL, 1);
+            return 0;
+        }
+        m->owner = conn;
+        m->sender = conn->peer;
+        m->received = conn->rx_time;
+        if (deferred){
+            memcpy(pipe_msg_reply(m), reply, reply_len);
+        }
+        memcpy(pipe_msg_values(m), values, (size_t)count * sizeof(uint32_t));
+        pipeline_commit(r->pipeline, r->worker->id, conn->proc);
+        r->queued = 1;
+    }
+
+    if (deferred){
+        conn->pending++;
+        conn->out_reserved += reply_len;
+    }
+    else{
+        memcpy(conn->out + conn->out_len, reply, reply_len);
+        conn->out_len += reply_len;
+        reply_queued(conn, conn->rx_time);
+    }
+    return 1;
+}
+
+static int queue_frame(struct reactor *r, struct connection *conn, const uint8_t *frame, size_t len){
+    /* Check a frame and queue it for the connection's processor (-P), see queue_reply().
+
+    A frame is checked once. check_frame() has already run its key/value request and counted
+    it, and charged its values to the -l limits (admit_frame()), so when the processor is full
+    the result is held on the connection and the retry queues that instead of checking the
+    frame again: an admitted frame stays admitted and a refused one keeps its STATUS_BUSY.
+
+    return:
+        1 once queued, 0 if the processor is full, -1 if the frame is invalid.
+    */
+    if (conn->held_len == 0){
+        const uint8_t *values;
+        TRACE_BEGIN(check);
+        int reply_len = check_frame(frame, len, conn->peer, conn->held_reply, &values, &conn->held_count);
+        TRACE_END(TRACE_CHECK, check);
+
+        if (reply_len == -1){
+            return -1;
+        }
+        conn->held_len = reply_len;
+        // An offset, the frame may be peeked from elsewhere next time (wrapped, or the ring grown)
+        conn->held_values = conn->held_count > 0 ? (size_t)(values - frame) : 0;
+    }
+    if (queue_reply(r, conn, conn->held_reply, conn->held_len, frame + conn->held_values, conn->held_count) == 0){
+        return 0;
+    }
+    conn->held_len = 0;
+    return 1;
+}
+
+static void reject(struct reactor *r, struct connection *conn, const uint8_t *frame, size_t len){
+    /* Answer a frame frame_length() refused with its error reply, behind every reply the
+    connection is already owed. The connection is closed once they are all out. If the
+    processor's ring is full right then the error reply is skipped, the close still happens.
+    */
+    uint8_t reply[MAX_REPLY_SIZE];
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+
+    if (getpeername(conn->fd, (struct sockaddr *)&peer, &peer_len) == -1){
+        peer.ss_family = AF_UNSPEC;
+    }
+    int reply_len = reject_frame(frame, len, (struct sockaddr *)&peer, reply);
+    if (reply_len == 0){
+        return;
+    }
+    if (r->pipeline != NULL){
+        queue_reply(r, conn, reply, reply_len, reply, 0);
+        return;
+    }
+    memcpy(conn->out + conn->out_len, reply, reply_len);
+    conn->out_len += reply_len;
+    reply_queued(conn, conn->rx_time);
+}
+
+static void reply_ready(void *arg, struct pipe_msg *m){
+    // pipeline_drain() callback: a processor is done with a frame, queue the reply it was owed
+    struct reactor *r = arg;
+    struct connection *conn = m->owner;
+
+    conn->pending--;
+    conn->out_reserved -= m->reply_len;
+    if (conn->fd == -1){
+        // Nobody left to send it to, the last reply frees the connection
+        if (conn->pending == 0 && conn->orphaned){
+            connection_free(r, conn);
+        }
+        return;
+    }
+    memcpy(conn->out + conn->out_len, pipe_msg_reply(m), m->reply_len);
+    conn->out_len += m->reply_len;
+    reply_queued(conn, m->received);
+    mark_stalled(r, conn);
+}
+
+static int parse_frames(struct reactor *r, struct connection *conn){
+    /* Handle every complete frame in the receive ring (either protocol version), in place,
+    while there is room to queue its reply.
+
+    return:
+        0 to keep the connection, 1 if the pipeline is full, -1 if it sent a bad frame.
+    */
+    while (out_room(conn) >= MAX_REPLY_SIZE){
+        size_t used = conn->in_tail - conn->in_head;
+        if (used == 0){
+            // Empty, start over at the front so the next frames are less likely to wrap
+            conn->in_head = 0;
+            conn->in_tail = 0;
+            return 0;
+        }
+
+        // The length is in the first few bytes, which may themselves wrap
+        size_t peek = used < sizeof(struct request_header) ? used : sizeof(struct request_header);
+        TRACE_BEGIN(decode);
+        long len = frame_length(ring_peek(conn, peek, r->scratch), peek);
+        TRACE_END(TRACE_DECODE, decode);
+        if (len == -1){
+            reject(r, conn, ring_peek(conn, peek, r->scratch), peek);
+            return -1;
+        }
+        if (len == 0 || (size_t)len > used){
+            // Wait for the rest, in a bigger ring if this frame can't fit in the current one
+            if ((size_t)len > conn->in_cap){
+                return ring_grow(r, conn);
+            }
+            return 0;
+        }
+
+        const uint8_t *frame = ring_peek(conn, len, r->scratch);
+        if (r->pipeline != NULL){
+            int queued = queue_frame(r, conn, frame, len);
+            if (queued != 1){
+                return queued == 0 ? 1 : -1;
+            }
+        }
+        else{
+            int reply_len = process_frame(frame, len, conn->peer, conn->out + conn->out_len);
+            if (reply_len == -1){
+                return -1;
+            }
+            conn->out_len += reply_len;
+            reply_queued(conn, conn->rx_time);
+        }
+        conn->in_head += len;
+        stats_count(STAT_FRAMES, 1);
+    }
+    return 0;
+}
+
+static int connection_read(struct reactor *r, struct connection *conn){
+    /* Pull bytes off the socket, cut them into frames and queue a reply per frame. Stops on
+    EAGAIN, on EOF, when the reply buffer is full (backpressure, resumed once replies drain)
+    or when the read budget is used up.
+
+    return:
+        0 to keep the connection, -1 to close it.
+    */
+    int budget = CONN_READ_BUDGET;
+
+    conn->read_blocked = 0;
+    while (1){
+        int parsed = parse_frames(r, conn);
+        if (parsed == -1){
+            // Drop only this client (after its earlier replies), everyone else keeps being served
+            conn->closing = 1;
+            conn->in_head = conn->in_tail;
+            break;
+        }
+        if (parsed == 1){
+            // The processor is full, the pipeline wakes us once it has made room
+            conn->read_blocked = 1;
+            mark_stalled(r, conn);
+            break;
+        }
+
+        // Complete frames are waiting on reply space, try to make room
+        if (out_room(conn) < MAX_REPLY_SIZE){
+            // If the client isn't taking replies wait for EPOLLOUT
+            int flushed = connection_flush(conn);
+            if (flushed == -1){
+                return -1;
+            }
+            if (flushed == 0){
+                conn->read_blocked = 1;
+                break;
+            }
+            // The rest is promised to replies still being processed, reply_ready() restarts us
+            if (out_room(conn) < MAX_REPLY_SIZE){
+                conn->read_blocked = 1;
+                break;
+            }
+            continue;
+        }
+        if (conn->closing){
+            break;
+        }
+
+        // Budget spent while the socket may still hold data, come back after other clients
+        if (budget-- == 0){
+            mark_ready(r, conn);
+            break;
+        }
+
+        // Fill the free part of the ring, which is two pieces when it wraps around the end
+        struct iovec iov[2];
+        size_t tail = conn->in_tail & (conn->in_cap - 1);
+        size_t free_bytes = conn->in_cap - (conn->in_tail - conn->in_head);
+        iov[0].iov_base = conn->in + tail;
+        iov[0].iov_len = conn->in_cap - tail < free_bytes ? conn->in_cap - tail : free_bytes;
+        iov[1].iov_base = conn->in;
+        iov[1].iov_len = free_bytes - iov[0].iov_len;
+
+        TRACE_BEGIN(recv);
+        ssize_t n = readv(conn->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        TRACE_END(TRACE_RECV, recv);
+        stats_count(STAT_RECV_CALLS, 1);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            log_msg(LOG_WARN, "Error receiving message from client.\n");
+            stats_count(STAT_RECV_ERRORS, 1);
+            return -1;
+        }
+        if (n == 0){
+            // Client is done sending, finish flushing its replies then close
+            conn->closing = 1;
+            break;
+        }
+        conn->in_tail += n;
+        conn->rx_time = stats_now();
+        stats_count(STAT_BYTES_IN, n);
+    }
+
+    return connection_flush(conn) == -1 ? -1 : 0;
+}
+
+static void accept_connections(struct reactor *r){
+    /* Accept every pending connection on the worker's (edge-triggered) listening socket
+    and register it with the worker's epoll instance.
+    */
+    struct sockaddr_storage their_addr;
+    socklen_t addr_size;
+    int one = 1;
+
+    while (1){
+        addr_size = sizeof(their_addr);
+        TRACE_BEGIN(accept);
+        int fd = accept4(r->worker->sockfd, (struct sockaddr *)&their_addr, &addr_size, SOCK_NONBLOCK);
+        TRACE_END(TRACE_ACCEPT, accept);
+        if (fd == -1){
+            if (errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK){
+                // Out of fds or memory, the remaining clients stay queued in the backlog
+                log_msg(LOG_WARN, "Error accepting connection: %s\n", strerror(errno));
+                stats_count(STAT_ACCEPT_ERRORS, 1);
+            }
+            return;
+        }
+
+        // Peers over the bad frame limit (-e) are turned away for a while
+        if (blocklist_blocked((struct sockaddr *)&their_addr)){
+            stats_count(STAT_BLOCKED_DROPS, 1);
+            close(fd);
+            continue;
+        }
+        log_msg(LOG_DEBUG, "Accepted connection %d on worker %d.\n", fd, r->worker->id);
+
+        // Replies are only a few bytes each, don't let Nagle hold them back
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        // At the -C limit the new client is turned away, the ones already connected keep going
+        struct connection *conn = pool_get(&r->conns);
+        if (conn == NULL){
+            log_msg(LOG_WARN, "Connection limit of %d reached.\n", r->worker->opts->max_conns);
+            stats_count(STAT_POOL_EMPTY, 1);
+            close(fd);
+            continue;
+        }
+
+        stats_count(STAT_ACCEPTS, 1);
+
+        // Only the header needs clearing, the buffers are only read after being written
+        memset(conn, 0, offsetof(struct connection, in_small));
+        conn->fd = fd;
+        conn->peer = agg_sender_of((struct sockaddr *)&their_addr);
+        conn->in = conn->in_small;
+        conn->in_cap = sizeof(conn->in_small);
+        if (r->pipeline != NULL){
+            conn->proc = pipeline_processor(r->pipeline, r->next_proc++);
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1){
+            log_msg(LOG_WARN, "Error adding connection to epoll.\n");
+            close(fd);
+            connection_free(r, conn);
+            continue;
+        }
+    }
+}
+
+static void handle_event(struct reactor *r, struct connection *conn, uint32_t events){
+    /* Service one epoll event for a client connection. */
+    if (events & EPOLLERR){
+        connection_close(r, conn);
+        return;
+    }
+
+    if (events & EPOLLOUT){
+        int flushed = connection_flush(conn);
+        if (flushed == -1){
+            connection_close(r, conn);
+            return;
+        }
+        // Acks drained, pick reading back up where backpressure stopped it
+        if (flushed == 1 && conn->read_blocked){
+            events |= EPOLLIN;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)){
+        if (connection_read(r, conn) == -1){
+            connection_close(r, conn);
+            return;
+        }
+    }
+
+    // Wait for the replies still with a processor before closing too
+    if (conn->closing && conn->out_len == 0 && conn->pending == 0){
+        connection_close(r, conn);
+    }
+}
+
+static void pipeline_wakeup(struct reactor *r){
+    /* The pipeline's eventfd fired: queue every reply that came back, then give each stalled
+    connection another go (flushing them, and reading again if they had stopped).
+    */
+    pipeline_clear(r->pipeline, r->worker->id);
+    pipeline_drain(r->pipeline, r->worker->id, reply_ready, r);
+
+    struct connection *conn = r->stalled_head;
+    r->stalled_head = NULL;
+    while (conn != NULL){
+        struct connection *next = conn->next_stalled;
+        conn->stalled = 0;
+        if (conn->fd == -1){
+            release_closed(r, conn);
+        }
+        else{
+            handle_event(r, conn, EPOLLOUT);
+        }
+        conn = next;
+    }
+}
+
+int tcp_event_loop(struct worker *w){
+    /* Run the TCP server for one worker: listen once with a real backlog and serve every
+    client that lands on this worker's socket from a single epoll loop. Only returns on a
+    setup error.
+
+    params:
+        w (worker *): Worker owning the bound (not yet listening) TCP socket.
+
+    return:
+        -1 on error.
+    */
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    struct reactor reactor = { .worker = w, .pipeline = w->pipeline };
+    struct reactor *r = &reactor;
+    int listenfd = w->sockfd;
+
+    if (set_nonblocking(listenfd) == -1){
+        fprintf(stderr, "Error making listening socket non-blocking.\n");
+        return -1;
+    }
+
+    r->scratch = malloc(PROTOCOL_MAX_FRAME);
+    if (r->scratch == NULL){
+        fprintf(stderr, "Out of memory for the reactor.\n");
+        return -1;
+    }
+
+    // Every connection this worker will ever hold, and their large frame rings
+    int max_conns = w->opts->max_conns;
+    if (pool_init(&r->conns, sizeof(struct connection), max_conns) == -1
+            || pool_init(&r->bigs, CONN_BIG_SIZE, max_conns / POOL_BIG_SHARE + 1) == -1){
+        return -1;
+    }
+
+    if (listen(listenfd, LISTEN_BACKLOG) == -1){
+        fprintf(stderr, "Error seting up accept connection on socket.\n");
+        return -1;
+    }
+
+    r->epfd = epoll_create1(0);
+    if (r->epfd == -1){
+        fprintf(stderr, "Error creating epoll instance.\n");
+        return -1;
+    }
+
+    // The listener is the only registration with a NULL pointer
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1){
+        fprintf(stderr, "Error adding listening socket to epoll.\n");
+        close(r->epfd);
+        return -1;
+    }
+
+    // The pipeline's eventfd is registered with the reactor itself as its pointer
+    if (r->pipeline != NULL){
+        ev.events = EPOLLIN;
+        ev.data.ptr = r;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, pipeline_wake_fd(r->pipeline, w->id), &ev) == -1){
+            fprintf(stderr, "Error adding the pipeline to epoll.\n");
+            close(r->epfd);
+            return -1;
+        }
+    }
+
+    while (1){
+        // Don't sleep while some connection still has unread data from its last pass
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, r->ready_head != NULL ? 0 : -1);
+        stats_count(STAT_WAIT_CALLS, 1);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "Error waiting on epoll.\n");
+            close(r->epfd);
+            return -1;
+        }
+
+        // The -l queue limit goes by how much was waiting for the processors when the pass started
+        if (r->pipeline != NULL && admit_queue_limited()){
+            admit_depth(pipeline_depth(r->pipeline));
+        }
+
+        // Give the connections that hit their read budget last time another pass
+        struct connection *conn = r->ready_head;
+        r->ready_head = NULL;
+        while (conn != NULL){
+            struct connection *next = conn->next_ready;
+            conn->ready = 0;
+            if (conn->fd == -1){
+                release_closed(r, conn);
+            }
+            else{
+                handle_event(r, conn, EPOLLIN);
+            }
+            conn = next;
+        }
+
+        for (int i = 0; i < n; i++){
+            conn = events[i].data.ptr;
+            if (conn == NULL){
+                accept_connections(r);
+            }
+            else if (events[i].data.ptr == r){
+                pipeline_wakeup(r);
+            }
+            else if (conn->fd != -1){
+                handle_event(r, conn, events[i].events);
+            }
+        }
+
+        // Processors that may have gone to sleep have work from this pass
+        if (r->queued){
+            pipeline_kick(r->pipeline, w->id);
+            r->queued = 0;
+        }
+
+        // Nothing refers to the connections closed this pass anymore, except replies still being processed
+        while (r->closed_head != NULL){
+            conn = r->closed_head;
+            r->closed_head = conn->next_closed;
+            if (conn->pending > 0){
+                conn->orphaned = 1;
+            }
+            else{
+                connection_free(r, conn);
+            }
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "server.h"
+#include "pipeline.h"
+#include "pool.h"
+
+/* Sizing for the TCP reactor.
+    LISTEN_BACKLOG is handed to listen() once at startup (the kernel clamps it to somaxconn).
+    CONN_IN_SIZE is the receive ring each connection starts with (a power of two). A connection
+        that sends a bigger frame than that (a large batch) moves to a pooled ring of CONN_BIG_SIZE.
+    CONN_OUT_SIZE holds pending replies when the client is slow to read them back.
+    CONN_READ_BUDGET caps the recv() calls per wakeup so one busy client can't starve the rest.
+*/
+#define LISTEN_BACKLOG 4096
+#define MAX_EVENTS 256
+#define CONN_IN_SIZE 8192
+#define CONN_BIG_SIZE 65536  // smallest power of two >= PROTOCOL_MAX_FRAME
+#define CONN_OUT_SIZE (MAX_REPLY_SIZE * 8)
+#define CONN_READ_BUDGET 16
+
+/* Per-connection state for the reactor. Frames can arrive split across reads and acks can be
+    partially written, so both directions keep a buffer and an offset into it.
+
+    Incoming bytes go into a ring: recv() fills the free space (both pieces of it when it wraps,
+    with one readv()) and frames are handed to process_frame() by pointer straight out of the
+    ring. Nothing is ever shifted down, the only copy is of a frame that happens to wrap around
+    the end of the ring, which is put back together in the reactor's scratch buffer.
+
+    With -P a frame's values go to the connection's processor instead. When the ack waits for
+    them (ACK_PROCESSED) room for it is set aside in 'out' until the processor hands it back, and
+    the connection is only freed once every reply it is owed has come back.
+*/
+struct connection
+{
+    int fd;
+    int closing;       // peer hung up (or sent a bad frame), close once acks are flushed
+    int read_blocked;  // stopped reading because the ack buffer was full
+    int ready;         // on the ready list waiting for another read pass
+    int stalled;       // on the stalled list waiting on the pipeline
+    int orphaned;      // closed and dropped by the loop, freed when its last pending reply is back
+    int proc;          // processor that handles this connection's values (-P)
+    uint32_t peer;     // agg_sender_of() the peer
+    uint32_t pending;  // frames with a processor whose reply hasn't come back yet
+    uint32_t out_frames;  // replies in 'out', for the latency stats
+    uint64_t out_since;   // stats_now() of the read that brought the oldest of them
+    uint64_t rx_time;     // stats_now() of the last read
+    struct connection *next_ready;
+    struct connection *next_stalled;
+    struct connection *next_closed;
+
+    uint8_t *in;       // receive ring: in_small, or a ring from 'bigs' once a frame didn't fit in it
+    size_t in_cap;     // power of two
+    size_t in_head;    // where the next frame starts (free running, masked with in_cap - 1)
+    size_t in_tail;    // where the next recv() writes (free running)
+    size_t out_len;    // bytes of replies queued in 'out'
+    size_t out_sent;   // bytes of 'out' already written to the socket
+    size_t out_reserved;  // bytes of 'out' set aside for pending replies
+    int held_len;         // reply to the frame at in_head, checked but not yet queued (-P), 0 for none
+    uint32_t held_count;  // its values
+    size_t held_values;   // where they start in the frame
+    uint8_t in_small[CONN_IN_SIZE];
+    uint8_t out[CONN_OUT_SIZE];
+    uint8_t held_reply[MAX_REPLY_SIZE];
+};
+
+// One reactor per worker thread, nothing in here is shared between workers
+struct reactor
+{
+    struct worker *worker;
+    int epfd;
+    uint8_t *scratch;                // PROTOCOL_MAX_FRAME bytes to reassemble a frame that wraps a ring
+    struct pipeline *pipeline;       // NULL unless -P
+    int queued;                      // work was handed to the pipeline this pass
+    uint32_t next_proc;              // round robin for assigning connections to processors
+    struct connection *ready_head;   // connections that still had data when their read budget ran out
+    struct connection *stalled_head; // connections to revisit when the pipeline wakes us
+    struct connection *closed_head;  // closed this pass, freed once no pending event can point at them
+    struct pool conns;               // -C connections
+    struct pool bigs;                // CONN_BIG_SIZE rings for connections with large frames
+};
+
+int tcp_event_loop(struct worker *w);
+
+#endif
@@ -0,0 +1,139 @@
+/* The version 2 request handlers the server ships with (see handlers.h).
+
+Data and batch frames only say where their values are, check_frame() decides what happens to
+them. Queries and key/value requests carry no values and are answered right here by whichever
+worker read them.
+*/
+#include "handlers.h"
+#include "server.h"
+
+static int bad_length(struct reply_header *rep){
+    // Reply to a payload that doesn't fit its request type
+    rep->status = STATUS_BAD_LENGTH;
+    stats_count(STAT_BAD_LENGTH, 1);
+    return sizeof(*rep);
+}
+
+int handle_data(const uint8_t *frame, size_t payload, uint32_t sender, struct reply_header *rep,
+                const uint8_t **values, uint32_t *count){
+    // REQ_DATA: one value. Reliable udp data is data like any other here, rudp.c has already deduplicated it.
+    (void)sender;
+    if (payload != sizeof(uint32_t)){
+        return bad_length(rep);
+    }
+    *values = (const uint8_t *)&((const struct data_request *)frame)->data;
+    *count = 1;
+    return sizeof(*rep);
+}
+
+int handle_batch(const uint8_t *frame, size_t payload, uint32_t sender, struct reply_header *rep,
+                 const uint8_t **values, uint32_t *count){
+    // REQ_BATCH: a count and that many values, one reply acks the whole batch
+    uint32_t n;
+
+    (void)sender;
+    if (payload < sizeof(n)){
+        return bad_length(rep);
+    }
+    n = ntohl(((const struct batch_request *)frame)->count);
+    if (n > PROTOCOL_MAX_BATCH || payload != sizeof(n) + (size_t)n * sizeof(uint32_t)){
+        return bad_length(rep);
+    }
+    *values = frame + sizeof(struct batch_request);
+    *count = n;
+    return sizeof(*rep);
+}
+
+int handle_query(const uint8_t *frame, size_t payload, uint32_t sender, struct reply_header *rep,
+                 const uint8_t **values, uint32_t *count){
+    /* REQ_QUERY: fill in the reply from the merged aggregates (see agg.c).
+
+    return:
+        Length of the reply in bytes.
+    */
+    const struct query_request *query = (const struct query_request *)frame;
+    struct query_result *result = (struct query_result *)(rep + 1);
+    struct agg_result agg;
+
+    (void)values;
+    (void)count;
+    if (payload != sizeof(*query) - sizeof(struct request_header)){
+        return bad_length(rep);
+    }
+
+    uint32_t who = query->sender ? ntohl(query->sender) : sender;
+    if (query->scope > QUERY_WINDOW){
+        rep->status = STATUS_BAD_TYPE;
+        stats_count(STAT_BAD_TYPE, 1);
+        return sizeof(*rep);
+    }
+    if (agg_query(query->scope, who, &agg) == -1){
+        log_msg(LOG_WARN, "Out of memory answering a query.\n");
+    }
+    stats_count(STAT_QUERIES, 1);
+
+    result->count = htobe64(agg.count);
+    result->sum = htobe64(agg.sum);
+    result->min = htonl(agg.min);
+    result->max = htonl(agg.max);
+    result->distinct = htobe64(agg.distinct);
+    for (int q = 0; q < 4; q++){
+        result->quantiles[q] = htonl(agg.quantiles[q]);
+    }
+    result->window_start = htonl(agg.window_start);
+    result->window_secs = htonl(agg.window_secs);
+    rep->length = htons(sizeof(*result));
+    return sizeof(*rep) + sizeof(*result);
+}
+
+int handle_kv(const uint8_t *frame, size_t payload, uint32_t sender, struct reply_header *rep,
+              const uint8_t **values, uint32_t *count){
+    /* REQ_GET, REQ_PUT and REQ_DELETE: run them on the store (see kv.c) and fill in the reply.
+
+    return:
+        Length of the reply in bytes.
+    */
+    const struct kv_request *kv = (const struct kv_request *)frame;
+    uint32_t value;
+
+    (void)sender;
+    (void)values;
+    (void)count;
+
+    // A PUT carries a key and a value, the others just the key. Nothing past the header is read before this.
+    if (payload != (kv->header.type == REQ_PUT ? 2 : 1) * sizeof(uint32_t)){
+        return bad_length(rep);
+    }
+    uint32_t key = ntohl(kv->key);
+
+    switch (kv->header.type){
+        case REQ_GET:
+            stats_count(STAT_KV_GETS, 1);
+            if (kv_get(key, &value) == -1){
+                rep->status = STATUS_NOT_FOUND;
+                break;
+            }
+            value = htonl(value);
+            memcpy(rep + 1, &value, sizeof(value));
+            rep->length = htons(sizeof(value));
+            return sizeof(*rep) + sizeof(value);
+
+        case REQ_PUT:
+            stats_count(STAT_KV_PUTS, 1);
+            if (kv_put(key, ntohl(kv->value)) == -1){
+                rep->status = STATUS_FULL;
+            }
+            break;
+
+        default:
+            stats_count(STAT_KV_DELETES, 1);
+            if (kv_delete(key) == -1){
+                rep->status = STATUS_NOT_FOUND;
+            }
+            break;
+    }
+    if (rep->status != STATUS_OK){
+        stats_count(STAT_KV_MISSES, 1);
+    }
+    return sizeof(*rep);
+}
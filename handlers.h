@@ -0,0 +1,47 @@
+#ifndef HANDLERS_H
+#define HANDLERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/* Version 2 request handlers, see handlers.c.
+
+    SERVER_HANDLERS lists every request type the server answers and the function that answers
+    it. check_frame() expands it into the cases of one switch on the type byte, so dispatch is
+    a jump table the compiler builds, and two handlers claiming the same type don't compile.
+    A new request type is a #define in protocol.h, its handler in a source file of its own
+    (added to SERVER_SRCS) and one line here; the loops never see it. Version 1 frames carry no
+    type, check_frame() handles them before the switch.
+
+    Every handler has the same signature:
+        frame (uint8_t *): The whole frame, exactly frame_length() bytes, header included.
+        payload (size_t): Bytes after the request_header.
+        sender (uint32_t): Who sent it, from agg_sender_of().
+        rep (reply_header *): The reply, with version, id and STATUS_OK already filled in. At
+            least MAX_REPLY_SIZE bytes.
+        values (uint8_t **): Set to the frame's network order values, if it carries any.
+        count (uint32_t *): Set to how many values it carries, 0 (as it comes in) for none.
+
+    It returns the reply's length in bytes and counts its own rejects (STAT_BAD_LENGTH ...).
+    Values it hands back are not processed by the handler: check_frame() puts them through
+    the -l limits and they are processed inline or by a processing thread (-P).
+*/
+#define SERVER_HANDLERS(HANDLER) \
+    HANDLER(REQ_DATA, handle_data) \
+    HANDLER(REQ_DATA | REQ_RELIABLE, handle_data) \
+    HANDLER(REQ_BATCH, handle_batch) \
+    HANDLER(REQ_BATCH | REQ_RELIABLE, handle_batch) \
+    HANDLER(REQ_QUERY, handle_query) \
+    HANDLER(REQ_GET, handle_kv) \
+    HANDLER(REQ_PUT, handle_kv) \
+    HANDLER(REQ_DELETE, handle_kv)
+
+#define HANDLER_DECLARE(type, fn) \
+    int fn(const uint8_t *frame, size_t payload, uint32_t sender, struct reply_header *rep, \
+           const uint8_t **values, uint32_t *count);
+SERVER_HANDLERS(HANDLER_DECLARE)
+#undef HANDLER_DECLARE
+
+#endif
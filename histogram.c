@@ -0,0 +1,148 @@
+/* Log-linear (HDR-style) histogram, see histogram.h for the bucket layout.
+
+Reference:
+    http://hdrhistogram.org/
+*/
+#include "histogram.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int bucket_index(int bits, uint64_t value){
+    /* Map a value to its bucket.
+        [0, 2^bits) -> the value itself
+        above that  -> 2^bits + (exponent-1) * 2^(bits-1) + (top bits of value - 2^(bits-1))
+    */
+    uint64_t half = 1ULL << (bits - 1);
+    if (value < (1ULL << bits)){
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (bits - 1);
+    return (int)((1ULL << bits) + (shift - 1) * half + ((value >> shift) - half));
+}
+
+static uint64_t bucket_value(int bits, int index){
+    // Highest value that lands in bucket 'index' (what HdrHistogram reports as the value)
+    uint64_t half = 1ULL << (bits - 1);
+    if (index < (1 << bits)){
+        return index;
+    }
+    int shift = (int)((index - (1ULL << bits)) / half) + 1;
+    uint64_t top = (index - (1ULL << bits)) % half + half;
+    return ((top + 1) << shift) - 1;
+}
+
+int histogram_init(struct histogram *h, int bits){
+    /* Allocate an empty histogram.
+
+    params:
+        h (histogram *): Histogram to set up.
+        bits (int): Precision, see histogram.h (2 to 16).
+
+    return:
+        0 on success, -1 if out of memory or bits is out of range.
+    */
+    memset(h, 0, sizeof(*h));
+    if (bits < 2 || bits > 16){
+        return -1;
+    }
+    h->bits = bits;
+    h->num_buckets = (1 << bits) + (64 - bits) * (1 << (bits - 1));
+    h->buckets = calloc(h->num_buckets, sizeof(uint64_t));
+    if (h->buckets == NULL){
+        return -1;
+    }
+    h->min = UINT64_MAX;
+    return 0;
+}
+
+void histogram_free(struct histogram *h){
+    free(h->buckets);
+    h->buckets = NULL;
+}
+
+void histogram_reset(struct histogram *h){
+    // Only while nothing merges it (agg.c resets a window under the lock its queries take)
+    memset(h->buckets, 0, h->num_buckets * sizeof(uint64_t));
+    h->count = 0;
+    h->sum = 0;
+    h->max = 0;
+    h->min = UINT64_MAX;
+}
+
+static inline void add(uint64_t *field, uint64_t n){
+    // Only the histogram's writer adds, a relaxed store so a merge on another thread reads it whole
+    __atomic_store_n(field, *field + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t get(const uint64_t *field){
+    // A field another thread may be writing
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+void histogram_record(struct histogram *h, uint64_t value){
+    histogram_record_n(h, value, 1);
+}
+
+void histogram_record_n(struct histogram *h, uint64_t value, uint64_t count){
+    // Record the same value 'count' times (a batch of frames that share one latency)
+    if (count == 0){
+        return;
+    }
+    add(&h->buckets[bucket_index(h->bits, value)], count);
+    add(&h->count, count);
+    add(&h->sum, value * count);
+    if (value < h->min){
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > h->max){
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src){
+    // Both histograms must have been set up with the same bits. src may be recorded into meanwhile.
+    for (int i = 0; i < dst->num_buckets; i++){
+        add(&dst->buckets[i], get(&src->buckets[i]));
+    }
+    add(&dst->count, get(&src->count));
+    add(&dst->sum, get(&src->sum));
+    uint64_t min = get(&src->min);
+    uint64_t max = get(&src->max);
+    if (min < dst->min){
+        __atomic_store_n(&dst->min, min, __ATOMIC_RELAXED);
+    }
+    if (max > dst->max){
+        __atomic_store_n(&dst->max, max, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile){
+    /* Value at or below which 'percentile' percent of the recorded values fall.
+
+    params:
+        h (histogram *): Histogram to read.
+        percentile (double): 0 to 100, e.g. 99.9.
+
+    return:
+        The (bucket upper bound) value, capped at the exact max. 0 if nothing was recorded.
+    */
+    if (h->count == 0){
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (target == 0){
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < h->num_buckets; i++){
+        seen += h->buckets[i];
+        if (seen >= target){
+            uint64_t value = bucket_value(h->bits, i);
+            return value > h->max ? h->max : value;
+        }
+    }
+    return h->max;
+}
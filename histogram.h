@@ -0,0 +1,38 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* HDR-style log-linear histogram of uint64_t values (nanoseconds for latencies).
+
+    Values below 2^bits get their own bucket. Above that every power of two is split into
+    2^(bits-1) equal buckets, so any recorded value is reported within 1/2^(bits-1) of
+    itself (bits = 8 gives < 0.8% error) over the whole 64 bit range in a fixed, small
+    array. Two histograms with the same bits can be merged by adding their buckets.
+
+    One thread records into a histogram, others may merge it while it does. Every field is
+    written and read with relaxed atomics, so each is read whole, but not all at the same
+    moment: the count, sum and buckets of such a merge may be a few values apart.
+*/
+#define HISTOGRAM_DEFAULT_BITS 8
+
+struct histogram
+{
+    int bits;
+    int num_buckets;
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t *buckets;
+};
+
+int histogram_init(struct histogram *h, int bits);
+void histogram_free(struct histogram *h);
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_record_n(struct histogram *h, uint64_t value, uint64_t count);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+
+#endif
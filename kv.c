@@ -0,0 +1,270 @@
+/* Sharded key/value store (see kv.h).
+
+Layout:
+    - A key's 64 bit hash picks its shard (top bits) and its home bucket in that shard. It is
+      stored in the first free slot from its home bucket on (linear probing a bucket at a time).
+    - Every bucket counts the keys that went past it because it was full ('overflow'). A lookup
+      stops at the first bucket without the key whose count is 0, so a miss is usually one line
+      too. Deleting a key takes one off every bucket between its home and where it was, so
+      nothing is left behind (no tombstones) and keys never move once stored.
+    - Writers hold the shard lock and wrap every change to a bucket in seq++ ... seq++. Readers
+      load seq, read the bucket, and go again if seq was odd or changed meanwhile.
+
+All tables live in one mmap()ed slab, pages are only touched as keys land in them.
+
+Reference:
+    https://www.hpl.hp.com/techreports/2012/HPL-2012-68.pdf (seqlocks with C11 atomics)
+    https://engineering.fb.com/2019/04/25/developer-tools/f14/ (overflow counts)
+*/
+#include "kv.h"
+
+#include <stdio.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+static struct
+{
+    struct kv_shard shards[KV_SHARDS];
+    void *slab;
+    size_t slab_size;
+} kv;
+
+static inline uint64_t kv_hash(uint32_t key){
+    // Fibonacci hashing, the high bits of the product depend on every bit of the key
+    return (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct kv_shard *kv_shard_of(uint64_t hash){
+    return &kv.shards[hash >> 58];
+}
+
+static inline uint32_t kv_home(const struct kv_shard *shard, uint64_t hash){
+    return (uint32_t)(hash >> 24) & shard->mask;
+}
+
+static inline void bucket_begin(struct kv_bucket *b){
+    // Readers that start now see an odd count and wait, ones already reading see it change
+    __atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void bucket_end(struct kv_bucket *b){
+    __atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int bucket_find(const struct kv_bucket *b, uint8_t used, uint32_t key){
+    // Slot holding 'key' in a bucket the caller may write to, -1 if none
+    for (int s = 0; s < KV_BUCKET_SLOTS; s++){
+        if ((used & (1 << s)) && b->keys[s] == key){
+            return s;
+        }
+    }
+    return -1;
+}
+
+static void overflow_add(struct kv_shard *shard, uint32_t from, uint32_t to, int delta){
+    // Count a key in home bucket 'from' and stored in 'to' in (or out of) every bucket in between
+    for (uint32_t i = from; i != to; i = (i + 1) & shard->mask){
+        struct kv_bucket *b = &shard->buckets[i];
+        if (b->overflow == 255){
+            continue;
+        }
+        bucket_begin(b);
+        __atomic_store_n(&b->overflow, b->overflow + delta, __ATOMIC_RELAXED);
+        bucket_end(b);
+    }
+}
+
+int kv_init(uint32_t max_keys){
+    /* Map the tables for about 'max_keys' keys. Must be called before any worker starts.
+
+    params:
+        max_keys (uint32_t): -K, 1 to KV_MAX_KEYS.
+
+    return:
+        0 on success, -1 if the tables couldn't be mapped.
+    */
+    // Each shard takes its share plus an eighth, hashing never splits keys exactly evenly
+    uint32_t share = (max_keys + KV_SHARDS - 1) / KV_SHARDS;
+    uint32_t limit = share + share / 8 + KV_BUCKET_SLOTS;
+
+    // At most 7/8 of the slots are ever used, so probes stay short and an insert always ends
+    uint32_t buckets = 1;
+    while ((uint64_t)buckets * KV_BUCKET_SLOTS * 7 < (uint64_t)limit * 8){
+        buckets <<= 1;
+    }
+
+    kv.slab_size = (size_t)KV_SHARDS * buckets * sizeof(struct kv_bucket);
+    kv.slab = mmap(NULL, kv.slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (kv.slab == MAP_FAILED){
+        kv.slab = NULL;
+        fprintf(stderr, "Failed to map a key/value store of %zu bytes.\n", kv.slab_size);
+        return -1;
+    }
+
+    for (int i = 0; i < KV_SHARDS; i++){
+        struct kv_shard *shard = &kv.shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = (struct kv_bucket *)kv.slab + (size_t)i * buckets;
+        shard->mask = buckets - 1;
+        shard->size = 0;
+        shard->limit = limit;
+    }
+    return 0;
+}
+
+int kv_get(uint32_t key, uint32_t *value){
+    /* Look a key up without taking any lock.
+
+    params:
+        key (uint32_t): Key to look for.
+        value (uint32_t *): Set to its value when found.
+
+    return:
+        0 if found, -1 if the key isn't stored.
+    */
+    uint64_t hash = kv_hash(key);
+    struct kv_shard *shard = kv_shard_of(hash);
+    uint32_t i = kv_home(shard, hash);
+
+    for (uint32_t probe = 0; probe <= shard->mask; probe++){
+        const struct kv_bucket *b = &shard->buckets[i];
+        uint32_t seq;
+        uint8_t overflow = 0;
+        int found = 0;
+        uint32_t v = 0;
+
+        do{
+            seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1){
+                // A writer is in the middle of it, it only takes a few stores (unless it was preempted)
+                sched_yield();
+                continue;
+            }
+            uint8_t used = __atomic_load_n(&b->used, __ATOMIC_RELAXED);
+            overflow = __atomic_load_n(&b->overflow, __ATOMIC_RELAXED);
+            found = 0;
+            for (int s = 0; s < KV_BUCKET_SLOTS; s++){
+                if ((used & (1 << s)) && __atomic_load_n(&b->keys[s], __ATOMIC_RELAXED) == key){
+                    v = __atomic_load_n(&b->values[s], __ATOMIC_RELAXED);
+                    found = 1;
+                    break;
+                }
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || __atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq);
+
+        if (found){
+            *value = v;
+            return 0;
+        }
+        if (overflow == 0){
+            return -1;
+        }
+        i = (i + 1) & shard->mask;
+    }
+    return -1;
+}
+
+int kv_put(uint32_t key, uint32_t value){
+    /* Insert a key or overwrite its value.
+
+    params:
+        key (uint32_t): Key to store.
+        value (uint32_t): Its value.
+
+    return:
+        0 on success, -1 if it is a new key and its shard is full.
+    */
+    uint64_t hash = kv_hash(key);
+    struct kv_shard *shard = kv_shard_of(hash);
+    uint32_t home = kv_home(shard, hash);
+    uint32_t i = home;
+    int64_t free_bucket = -1;
+
+    pthread_mutex_lock(&shard->lock);
+
+    // Look for the key, remembering the first bucket with room on the way
+    while (1){
+        struct kv_bucket *b = &shard->buckets[i];
+        int s = bucket_find(b, b->used, key);
+        if (s != -1){
+            bucket_begin(b);
+            __atomic_store_n(&b->values[s], value, __ATOMIC_RELAXED);
+            bucket_end(b);
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+        if (free_bucket == -1 && b->used != (1 << KV_BUCKET_SLOTS) - 1){
+            free_bucket = i;
+        }
+        if (b->overflow == 0){
+            break;
+        }
+        i = (i + 1) & shard->mask;
+    }
+
+    if (shard->size >= shard->limit){
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    // Every bucket on the way was full: keep going to the first one with room
+    while (free_bucket == -1){
+        i = (i + 1) & shard->mask;
+        if (shard->buckets[i].used != (1 << KV_BUCKET_SLOTS) - 1){
+            free_bucket = i;
+        }
+    }
+
+    // Mark the path first so a reader never stops short of a key it could see
+    overflow_add(shard, home, (uint32_t)free_bucket, 1);
+
+    struct kv_bucket *b = &shard->buckets[free_bucket];
+    int s = __builtin_ctz(~b->used);
+    bucket_begin(b);
+    __atomic_store_n(&b->keys[s], key, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->values[s], value, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->used, b->used | (1 << s), __ATOMIC_RELAXED);
+    bucket_end(b);
+    shard->size++;
+
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+int kv_delete(uint32_t key){
+    /* Remove a key.
+
+    params:
+        key (uint32_t): Key to remove.
+
+    return:
+        0 if it was removed, -1 if it wasn't stored.
+    */
+    uint64_t hash = kv_hash(key);
+    struct kv_shard *shard = kv_shard_of(hash);
+    uint32_t home = kv_home(shard, hash);
+    uint32_t i = home;
+
+    pthread_mutex_lock(&shard->lock);
+    while (1){
+        struct kv_bucket *b = &shard->buckets[i];
+        int s = bucket_find(b, b->used, key);
+        if (s != -1){
+            bucket_begin(b);
+            __atomic_store_n(&b->used, b->used & ~(1 << s), __ATOMIC_RELAXED);
+            bucket_end(b);
+            overflow_add(shard, home, i, -1);
+            shard->size--;
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+        if (b->overflow == 0){
+            break;
+        }
+        i = (i + 1) & shard->mask;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return -1;
+}
@@ -0,0 +1,48 @@
+#ifndef KV_H
+#define KV_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* In-memory uint32_t key/value store behind REQ_GET, REQ_PUT and REQ_DELETE, see kv.c.
+
+    Keys are spread over KV_SHARDS shards, each a flat open addressing table of cache line sized
+    buckets holding KV_BUCKET_SLOTS keys and their values side by side. A lookup hashes once and
+    usually reads one line. Writers take their shard's lock, readers take no lock at all: every
+    bucket has a sequence count (a seqlock) that a reader checks before and after reading it,
+    and reads it again if a writer got in between.
+
+    The tables are mapped once at startup for -K keys (KV_DEFAULT_KEYS by default) and never
+    grow, so a reader never sees a table being moved. A PUT of a new key into a full shard is
+    answered with STATUS_FULL.
+*/
+#define KV_SHARDS 64
+#define KV_BUCKET_SLOTS 7
+#define KV_DEFAULT_KEYS (1 << 20)
+#define KV_MAX_KEYS (1 << 28)
+
+struct kv_bucket
+{
+    uint32_t seq;       // odd while a writer is changing the bucket
+    uint8_t used;       // bit i set while slot i holds a key
+    uint8_t overflow;   // keys that hash to or before this bucket but live after it (sticks at 255)
+    uint16_t pad;
+    uint32_t keys[KV_BUCKET_SLOTS];
+    uint32_t values[KV_BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+struct kv_shard
+{
+    pthread_mutex_t lock;  // writers only
+    struct kv_bucket *buckets;
+    uint32_t mask;         // number of buckets - 1
+    uint32_t size;         // keys stored
+    uint32_t limit;        // most keys the shard takes, keeps every probe short
+} __attribute__((aligned(64)));
+
+int kv_init(uint32_t max_keys);
+int kv_get(uint32_t key, uint32_t *value);
+int kv_put(uint32_t key, uint32_t value);
+int kv_delete(uint32_t key);
+
+#endif
@@ -0,0 +1,358 @@
+/* Checks of the key/value store (kv.c) against a reference model and under concurrent use.
+`make test` builds it with TEST_CFLAGS (-O2 unless given) and runs it, e.g.
+make test TEST_CFLAGS="-O1 -g -fsanitize=thread -Wno-tsan" to have ThreadSanitizer watch the
+lock-free reads (gcc warns that it can't model the seqlock's fences, the loads and stores they
+order are all atomic).
+
+How-to:
+    ./kv_stress [-d <seconds>] [-n <model operations>] [-s <seed>]
+
+What it checks:
+    - Model: -n (default 30000) random GETs, PUTs and DELETEs from one thread, every answer
+      compared with a plain array holding what the store should. Keys are drawn from four times as
+      many as the store takes, so shards fill up and PUTs of new keys are refused STATUS_FULL.
+    - Stress: KV_STRESS_WRITERS threads PUT and DELETE their own keys while KV_STRESS_READERS
+      threads GET everyone's for -d seconds (default 2). Every value carries a check of the key
+      it was stored under, so a reader that took a value from the wrong slot or a half changed
+      bucket notices. KV_STRESS_STABLE keys are only ever overwritten, never deleted, so a reader
+      must find them every time however much the buckets around them churn. At the end each
+      writer's keys must hold exactly what it last stored.
+
+The store is set up for KV_STRESS_KEYS keys, small enough that buckets fill and keys probe past
+them (the overflow counts) all the time.
+
+Output:
+    One line per phase, exit 0 if nothing was wrong.
+*/
+#include "kv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#define KV_STRESS_KEYS 4096
+#define KV_STRESS_WRITERS 4
+#define KV_STRESS_READERS 4
+#define KV_STRESS_STABLE 512   // keys 0 .. 511, writer key % KV_STRESS_WRITERS overwrites them
+#define KV_STRESS_OWN 2048     // churned keys per writer, together more than the store takes
+#define KV_STRESS_FIRST 100000 // writer w churns keys from KV_STRESS_FIRST + w * KV_STRESS_OWN
+
+struct writer
+{
+    pthread_t thread;
+    int id;
+    uint32_t rng;
+    uint32_t present[KV_STRESS_OWN];  // 1 if the key is stored
+    uint32_t values[KV_STRESS_OWN];   // and its value
+    uint64_t puts;
+    uint64_t deletes;
+    uint64_t full;
+};
+
+struct reader
+{
+    pthread_t thread;
+    uint32_t rng;
+    uint64_t reads;
+    uint64_t torn;     // values that don't belong to their key
+    uint64_t missing;  // stable keys not found
+};
+
+static int stopping;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t *state){
+    // xorshift32, the state must not be 0
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static uint32_t make_value(uint32_t key, uint32_t gen){
+    // A value for 'key': which write it was in the top half, a check of the key in the bottom
+    return gen << 16 | ((key * 2654435761u) >> 16);
+}
+
+static int value_fits(uint32_t key, uint32_t value){
+    return (value & 0xffff) == ((key * 2654435761u) >> 16);
+}
+
+static int model_check(int ops, uint32_t seed){
+    /* Run 'ops' random operations on the store and on a model of it and compare every answer.
+    Leaves the store empty.
+
+    return:
+        Number of disagreements.
+    */
+    const uint32_t range = 4 * KV_STRESS_KEYS;
+    uint8_t *present = calloc(range, 1);
+    uint32_t *values = calloc(range, sizeof(uint32_t));
+    uint32_t rng = seed | 1;
+    int wrong = 0;
+    int full = 0;
+
+    if (present == NULL || values == NULL){
+        fprintf(stderr, "Out of memory for the model.\n");
+        free(present);
+        free(values);
+        return 1;
+    }
+    for (int op = 0; op < ops; op++){
+        uint32_t key = next_random(&rng) % range;
+        uint32_t value;
+        int r;
+
+        switch (next_random(&rng) % 3){
+            case 0:
+                r = kv_get(key, &value);
+                if (r != (present[key] ? 0 : -1) || (r == 0 && value != values[key])){
+                    fprintf(stderr, "model: GET %u gave %d/%u, expected %d/%u\n", key, r, value,
+                            present[key] ? 0 : -1, values[key]);
+                    wrong++;
+                }
+                break;
+
+            case 1:
+                value = next_random(&rng);
+                r = kv_put(key, value);
+                if (r == -1){
+                    // Only a new key can be refused, and only because its shard is full
+                    if (present[key]){
+                        fprintf(stderr, "model: PUT %u of a stored key refused\n", key);
+                        wrong++;
+                    }
+                    full++;
+                    break;
+                }
+                present[key] = 1;
+                values[key] = value;
+                break;
+
+            default:
+                r = kv_delete(key);
+                if (r != (present[key] ? 0 : -1)){
+                    fprintf(stderr, "model: DELETE %u gave %d, expected %d\n", key, r, present[key] ? 0 : -1);
+                    wrong++;
+                }
+                present[key] = 0;
+                break;
+        }
+    }
+
+    // Every key must still agree, then empty the store for the stress phase
+    for (uint32_t key = 0; key < range; key++){
+        uint32_t value;
+        int r = kv_get(key, &value);
+        if (r != (present[key] ? 0 : -1) || (r == 0 && value != values[key])){
+            fprintf(stderr, "model: key %u is %s at the end\n", key, r == 0 ? "wrong" : "missing");
+            wrong++;
+        }
+        if (present[key]){
+            kv_delete(key);
+        }
+    }
+    printf("model: %d operations, %d refused as full, %d wrong\n", ops, full, wrong);
+    free(present);
+    free(values);
+    return wrong;
+}
+
+static void *writer_main(void *arg){
+    // Churn this writer's keys and overwrite its share of the stable ones until stopped
+    struct writer *w = arg;
+    uint32_t gen = 0;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)){
+        uint32_t r = next_random(&w->rng);
+        gen++;
+
+        if (r % 8 == 0){
+            uint32_t key = (r >> 8) % KV_STRESS_STABLE;
+            key -= key % KV_STRESS_WRITERS;
+            key += w->id;
+            if (key < KV_STRESS_STABLE){
+                kv_put(key, make_value(key, gen));
+                w->puts++;
+            }
+            continue;
+        }
+
+        uint32_t i = (r >> 8) % KV_STRESS_OWN;
+        uint32_t key = KV_STRESS_FIRST + w->id * KV_STRESS_OWN + i;
+        if (r % 8 < 5){
+            uint32_t value = make_value(key, gen);
+            if (kv_put(key, value) == -1){
+                w->full++;
+                continue;
+            }
+            w->present[i] = 1;
+            w->values[i] = value;
+            w->puts++;
+        }
+        else{
+            kv_delete(key);
+            w->present[i] = 0;
+            w->deletes++;
+        }
+    }
+    return NULL;
+}
+
+static void *reader_main(void *arg){
+    // Read stable and churned keys until stopped, checking every value found
+    struct reader *r = arg;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)){
+        uint32_t x = next_random(&r->rng);
+        uint32_t key;
+        uint32_t value;
+
+        if (x % 2 == 0){
+            key = (x >> 8) % KV_STRESS_STABLE;
+        }
+        else{
+            key = KV_STRESS_FIRST + (x >> 8) % (KV_STRESS_WRITERS * KV_STRESS_OWN);
+        }
+        r->reads++;
+        if (kv_get(key, &value) == -1){
+            r->missing += key < KV_STRESS_STABLE;
+            continue;
+        }
+        if (!value_fits(key, value)){
+            r->torn++;
+        }
+    }
+    return NULL;
+}
+
+static int stress(double secs, uint32_t seed){
+    /* Run the writers and readers for 'secs' seconds, then check what the writers left.
+
+    return:
+        Number of problems seen.
+    */
+    struct writer *writers = calloc(KV_STRESS_WRITERS, sizeof(*writers));
+    struct reader readers[KV_STRESS_READERS];
+    uint64_t reads = 0, torn = 0, missing = 0, puts = 0, deletes = 0, full = 0;
+    int wrong = 0;
+
+    if (writers == NULL){
+        fprintf(stderr, "Out of memory for the writers.\n");
+        return 1;
+    }
+    memset(readers, 0, sizeof(readers));
+    for (uint32_t key = 0; key < KV_STRESS_STABLE; key++){
+        if (kv_put(key, make_value(key, 0)) == -1){
+            fprintf(stderr, "stress: stable key %u refused\n", key);
+            free(writers);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < KV_STRESS_WRITERS; i++){
+        writers[i].id = i;
+        writers[i].rng = (seed + 2 * i + 1) * 2654435761u | 1;
+        if (pthread_create(&writers[i].thread, NULL, writer_main, &writers[i]) != 0){
+            fprintf(stderr, "Failed to start writer %d.\n", i);
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < KV_STRESS_READERS; i++){
+        readers[i].rng = (seed + 2 * i + 2) * 2654435761u | 1;
+        if (pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]) != 0){
+            fprintf(stderr, "Failed to start reader %d.\n", i);
+            exit(-1);
+        }
+    }
+
+    struct timespec pause = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) };
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < KV_STRESS_READERS; i++){
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+        torn += readers[i].torn;
+        missing += readers[i].missing;
+    }
+    for (int i = 0; i < KV_STRESS_WRITERS; i++){
+        struct writer *w = &writers[i];
+        pthread_join(w->thread, NULL);
+        puts += w->puts;
+        deletes += w->deletes;
+        full += w->full;
+
+        // Quiet now: every key holds exactly what its writer last stored
+        for (uint32_t k = 0; k < KV_STRESS_OWN; k++){
+            uint32_t key = KV_STRESS_FIRST + i * KV_STRESS_OWN + k;
+            uint32_t value;
+            int r = kv_get(key, &value);
+            if (r != (w->present[k] ? 0 : -1) || (r == 0 && value != w->values[k])){
+                fprintf(stderr, "stress: key %u is %s at the end\n", key, r == 0 ? "wrong" : "missing");
+                wrong++;
+            }
+        }
+    }
+    for (uint32_t key = 0; key < KV_STRESS_STABLE; key++){
+        uint32_t value;
+        if (kv_get(key, &value) == -1 || !value_fits(key, value)){
+            fprintf(stderr, "stress: stable key %u is wrong at the end\n", key);
+            wrong++;
+        }
+    }
+
+    printf("stress: %d writers, %d readers, %.1f s: %llu reads, %llu puts (%llu refused as full), "
+           "%llu deletes, %llu torn, %llu missing, %d wrong at the end\n",
+           KV_STRESS_WRITERS, KV_STRESS_READERS, secs, (unsigned long long)reads, (unsigned long long)puts,
+           (unsigned long long)full, (unsigned long long)deletes, (unsigned long long)torn,
+           (unsigned long long)missing, wrong);
+    free(writers);
+    return (int)(torn + missing) + wrong;
+}
+
+int main(int argc, char *argv[]){
+    double secs = 2;
+    int ops = 30000;
+    uint32_t seed = (uint32_t)now_ns();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:s:")) != -1){
+        switch (opt){
+            case 'd': secs = atof(optarg); break;
+            case 'n': ops = atoi(optarg); break;
+            case 's': seed = (uint32_t)strtoul(optarg, NULL, 10); break;
+            default:
+                errno = 22;
+                fprintf(stderr, "Usage: %s [-d <seconds>] [-n <model operations>] [-s <seed>]\n", argv[0]);
+                return -1;
+        }
+    }
+    if (secs <= 0 || ops < 0){
+        errno = 22;
+        fprintf(stderr, "-d must be more than 0 seconds and -n at least 0.\n");
+        return -1;
+    }
+
+    if (kv_init(KV_STRESS_KEYS) == -1){
+        return -1;
+    }
+    printf("seed %u (-s to repeat)\n", seed);
+    int problems = model_check(ops, seed);
+    problems += stress(secs, seed);
+    if (problems > 0){
+        fprintf(stderr, "kv_stress: FAILED\n");
+        return 1;
+    }
+    printf("kv_stress: ok\n");
+    return 0;
+}
@@ -0,0 +1,534 @@
+/* Built-in load generator for the client (-b).
+
+Opens -c tcp connections (or connected udp sockets) to each -s server and drives them from one
+epoll loop with the same framing as a normal client (version 1, or version 2 with -V 2).
+Two modes:
+    closed loop (default): every connection keeps -i frames outstanding and sends the next one
+        as soon as an ack comes back.
+    open loop (-r): frames are scheduled at a fixed total rate regardless of how fast acks come
+        back. Latency is measured from when a frame was *scheduled*, not when we got around to
+        sending it, so a stalled server shows up in the numbers instead of quietly lowering the
+        send rate (coordinated omission).
+The run lasts -d seconds or -n frames. A frame that isn't acked within RECV_TIMEOUT seconds
+counts as a timeout, just like recvtimeout() in a one-shot client. Every ack's latency goes
+into a log-linear histogram that is summarised at the end, as text or with -j as one line of
+JSON (what make bench collects).
+
+Version 1 acks carry no request id, so they are matched to frames in send order per
+connection. Version 2 frames are numbered per connection and the id in each reply picks the
+frame it belongs to, so replies may come back in any order (or not at all, for lost udp
+datagrams) without throwing off the other frames' latencies.
+*/
+#include "client.h"
+#include "histogram.h"
+
+#include <sys/epoll.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+#define LOAD_OUT_SIZE 65536
+#define LOAD_DEFAULT_DURATION 10
+#define LOAD_OPEN_LOOP_WINDOW 16384
+#define LOAD_MAX_EVENTS 256
+
+// One connection (or udp socket) of the load generator
+struct load_conn
+{
+    int fd;
+    int dead;
+    uint64_t *sent_at;       // scheduled send time of frame 'seq' at [seq % cap]
+    uint8_t *done;           // frame at [seq % cap] was answered out of order (version 2)
+    uint32_t head;           // seq of the oldest frame not yet answered
+    uint32_t next;           // seq of the next frame to send (its version 2 request id)
+    uint32_t outstanding;
+    uint32_t cap;
+    size_t out_len;          // tcp bytes waiting to be written
+    size_t out_off;
+    size_t in_len;           // tcp bytes of a version 2 reply split across reads
+    uint8_t out[LOAD_OUT_SIZE];
+    uint8_t in[PROTOCOL_MAX_FRAME];
+};
+
+struct load_state
+{
+    struct client_options *opts;
+    int tcp;
+    int v2;
+    int epfd;
+    struct load_conn *conns;
+    struct histogram latency;
+    long limit;              // frames to send, -1 when running for a duration
+    long sent;
+    long acked;
+    long timeouts;
+    long errors;
+    long busy;               // errors that were STATUS_BUSY (the server's -l limits)
+    uint64_t last_ack;
+    int closed_loop;
+    int stop_sending;
+};
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void conn_kill(struct load_state *st, struct load_conn *c){
+    // A tcp connection that errored or timed out is closed, its outstanding frames are lost
+    st->errors += c->outstanding;
+    c->outstanding = 0;
+    c->dead = 1;
+    close(c->fd);
+}
+
+static int conn_flush(struct load_state *st, struct load_conn *c){
+    // Write as much of the pending tcp data as the socket takes, -1 if the connection died
+    while (c->out_off < c->out_len){
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            conn_kill(st, c);
+            return -1;
+        }
+        c->out_off += n;
+    }
+    c->out_len = 0;
+    c->out_off = 0;
+    return 0;
+}
+
+static int send_frame(struct load_state *st, struct load_conn *c, uint64_t scheduled){
+    /* Send one frame on 'c' and remember when it was scheduled.
+
+    return:
+        0 if sent, -1 if the connection can't take another frame right now.
+    */
+    struct client_message frame;
+    struct data_request request;
+    struct client_options *opts = st->opts;
+    uint32_t value = opts->num_values ? opts->values[st->sent % opts->num_values] : (uint32_t)st->sent;
+    void *buf = &frame;
+    size_t len = sizeof(frame);
+
+    // The window is full until the oldest frame is answered, even if later ones were
+    if (c->dead || c->next - c->head == c->cap){
+        return -1;
+    }
+
+    if (st->v2){
+        request.header.version = PROTOCOL_V2;
+        request.header.type = REQ_DATA;
+        request.header.length = htons(sizeof(request.data));
+        request.header.id = htonl(c->next);
+        request.data = htonl(value);
+        buf = &request;
+        len = sizeof(request);
+    }
+    else{
+        frame.version = PROTOCOL_V1;
+        frame.data = htonl(value);
+    }
+
+    if (st->tcp && LOAD_OUT_SIZE - c->out_len < len){
+        return -1;
+    }
+    if (st->tcp){
+        memcpy(c->out + c->out_len, buf, len);
+        c->out_len += len;
+    }
+    else if (send(c->fd, buf, len, 0) == -1){
+        st->errors++;
+        return -1;
+    }
+
+    c->sent_at[c->next % c->cap] = scheduled;
+    c->done[c->next % c->cap] = 0;
+    c->next++;
+    c->outstanding++;
+    st->sent++;
+    if (st->limit >= 0 && st->sent >= st->limit){
+        st->stop_sending = 1;
+    }
+    return 0;
+}
+
+static void skip_done(struct load_conn *c){
+    // Move head past the frames that were already answered out of order
+    while (c->head != c->next && c->done[c->head % c->cap]){
+        c->head++;
+    }
+}
+
+static void answer(struct load_state *st, struct load_conn *c, uint32_t seq, int status, uint64_t now){
+    // Frame 'seq' got its ack/reply (STATUS_*): record its latency and free its slot
+    if (seq - c->head >= c->next - c->head || c->done[seq % c->cap]){
+        // Not outstanding: a late reply to a frame that already timed out
+        return;
+    }
+    if (status != STATUS_OK){
+        st->errors++;
+        st->busy += status == STATUS_BUSY;
+    }
+    else{
+        histogram_record(&st->latency, now - c->sent_at[seq % c->cap]);
+        st->acked++;
+        st->last_ack = now;
+    }
+    c->done[seq % c->cap] = 1;
+    c->outstanding--;
+    skip_done(c);
+}
+
+static void handle_replies(struct load_state *st, struct load_conn *c, uint8_t *buf, size_t len, uint64_t now){
+    // Match version 2 replies in buf by id, returns with any partial tcp reply moved to c->in
+    size_t off = 0;
+
+    while (len - off >= sizeof(struct reply_header)){
+        struct reply_header *reply = (struct reply_header *)(buf + off);
+        size_t reply_len = sizeof(*reply) + ntohs(reply->length);
+        if (reply->version != PROTOCOL_V2 || reply_len > sizeof(c->in)){
+            st->errors++;
+            if (st->tcp) conn_kill(st, c);
+            return;
+        }
+        if (len - off < reply_len){
+            break;
+        }
+        answer(st, c, ntohl(reply->id), reply->status, now);
+        off += reply_len;
+        if (!st->tcp){
+            // One reply per datagram
+            return;
+        }
+    }
+    memmove(c->in, buf + off, len - off);
+    c->in_len = len - off;
+}
+
+static void read_acks(struct load_state *st, struct load_conn *c){
+    // Drain every ack the socket holds and record each frame's latency
+    uint8_t buf[4096];
+
+    while (!c->dead){
+        // Version 2 tcp replies continue from whatever partial reply is left in c->in
+        uint8_t *dst = st->v2 && st->tcp ? c->in + c->in_len : buf;
+        size_t room = st->v2 && st->tcp ? sizeof(c->in) - c->in_len : sizeof(buf);
+        ssize_t n = recv(c->fd, dst, room, 0);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK){
+                if (st->tcp) conn_kill(st, c);
+                else st->errors++;
+            }
+            return;
+        }
+        if (n == 0 && st->tcp){
+            conn_kill(st, c);
+            return;
+        }
+
+        uint64_t now = now_ns();
+        if (st->v2){
+            if (st->tcp){
+                handle_replies(st, c, c->in, c->in_len + n, now);
+            }
+            else{
+                handle_replies(st, c, buf, n, now);
+            }
+            continue;
+        }
+
+        // udp gets one ack per datagram, tcp a run of 1 byte acks
+        ssize_t acks = st->tcp ? n : 1;
+        for (ssize_t i = 0; i < acks; i++){
+            if (c->outstanding == 0){
+                st->errors++;
+                continue;
+            }
+            answer(st, c, c->head, buf[i] == PROTOCOL_V1 ? STATUS_OK : STATUS_BAD_VERSION, now);
+        }
+    }
+}
+
+static void expire(struct load_state *st, struct load_conn *c, uint64_t now){
+    // Frames older than RECV_TIMEOUT are timeouts. On tcp that means the connection is stuck.
+    while (!c->dead && c->outstanding > 0 && now - c->sent_at[c->head % c->cap] > RECV_TIMEOUT * 1000000000ULL){
+        st->timeouts++;
+        c->done[c->head % c->cap] = 1;
+        c->outstanding--;
+        skip_done(c);
+        if (st->tcp){
+            conn_kill(st, c);
+        }
+    }
+}
+
+static void top_up(struct load_state *st, struct load_conn *c){
+    // Closed loop: keep -i frames outstanding on the connection
+    uint64_t now = now_ns();
+    while (!st->stop_sending && c->outstanding < (uint32_t)st->opts->inflight){
+        if (send_frame(st, c, now) == -1){
+            break;
+        }
+    }
+    if (st->tcp && !c->dead){
+        conn_flush(st, c);
+    }
+}
+
+static void free_addrs(struct addrinfo **res, int count){
+    for (int i = 0; i < count; i++){
+        freeaddrinfo(res[i]);
+    }
+    free(res);
+}
+
+static int open_conns(struct load_state *st){
+    /* Resolve each server once and open every connection, connection i to server i % servers.
+
+    return:
+        0 on success, -1 on error.
+    */
+    struct client_options *opts = st->opts;
+    struct addrinfo hints, **addrs, *res;
+    int status;
+    int one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = st->tcp ? SOCK_STREAM : SOCK_DGRAM;
+    addrs = calloc(opts->num_servers, sizeof(*addrs));
+    if (addrs == NULL){
+        return -1;
+    }
+    for (int i = 0; i < opts->num_servers; i++){
+        if ((status = getaddrinfo(opts->servers[i].ip, opts->servers[i].port, &hints, &addrs[i])) != 0){
+            fprintf(stderr, "getaddrinfo %s: %s\n", opts->servers[i].ip, gai_strerror(status));
+            free_addrs(addrs, i);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < opts->connections; i++){
+        struct load_conn *c = &st->conns[i];
+        res = addrs[i % opts->num_servers];
+        c->cap = st->closed_loop ? (uint32_t)opts->inflight : LOAD_OPEN_LOOP_WINDOW;
+        c->sent_at = calloc(c->cap, sizeof(uint64_t));
+        c->done = calloc(c->cap, sizeof(uint8_t));
+        c->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (c->sent_at == NULL || c->done == NULL || c->fd == -1){
+            fprintf(stderr, "client: failed to create socket\n");
+            free_addrs(addrs, opts->num_servers);
+            return -1;
+        }
+
+        // udp sockets are connected too so we only see acks from the server
+        if (connect(c->fd, res->ai_addr, res->ai_addrlen) != 0){
+            fprintf(stderr, "client: failed to connect with socket. Server may be listening on UDP or different port.\n");
+            free_addrs(addrs, opts->num_servers);
+            return -1;
+        }
+        if (st->tcp){
+            setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(st->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1){
+            fprintf(stderr, "Error adding connection to epoll.\n");
+            free_addrs(addrs, opts->num_servers);
+            return -1;
+        }
+    }
+
+    free_addrs(addrs, opts->num_servers);
+    return 0;
+}
+
+static void report(struct load_state *st, uint64_t start){
+    // Print the run summary, latencies in microseconds
+    struct client_options *opts = st->opts;
+    uint64_t end = st->last_ack > start ? st->last_ack : now_ns();
+    double elapsed = (end - start) / 1e9;
+
+    if (opts->json){
+        printf("{\"name\":\"load_%s_v%d\",\"connections\":%d,\"inflight\":%d,\"rate\":%.0f,"
+               "\"sent\":%ld,\"acked\":%ld,\"timeouts\":%ld,\"errors\":%ld,\"busy\":%ld,\"seconds\":%.3f,"
+               "\"msgs_per_sec\":%.0f,\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+               "\"p99.9\":%.1f,\"max\":%.1f,\"mean\":%.1f}}\n",
+               opts->socktype, opts->version, opts->connections, st->closed_loop ? opts->inflight : 0,
+               st->closed_loop ? 0 : opts->rate, st->sent, st->acked, st->timeouts, st->errors, st->busy, elapsed,
+               elapsed > 0 ? st->acked / elapsed : 0.0,
+               histogram_percentile(&st->latency, 50) / 1e3,
+               histogram_percentile(&st->latency, 90) / 1e3,
+               histogram_percentile(&st->latency, 99) / 1e3,
+               histogram_percentile(&st->latency, 99.9) / 1e3,
+               st->latency.max / 1e3,
+               st->latency.count ? (double)st->latency.sum / st->latency.count / 1e3 : 0.0);
+        return;
+    }
+
+    printf("load: %s v%d %s, %d connection(s), ", opts->socktype, opts->version, server_list(opts),
+            opts->connections);
+    if (st->closed_loop){
+        printf("closed loop with %d in flight each\n", opts->inflight);
+    }
+    else{
+        printf("open loop at %.0f msg/s\n", opts->rate);
+    }
+    printf("sent %ld, acked %ld, timeouts %ld, errors %ld (%ld busy) in %.3f s\n",
+            st->sent, st->acked, st->timeouts, st->errors, st->busy, elapsed);
+    printf("throughput: %.0f msg/s\n", elapsed > 0 ? st->acked / elapsed : 0.0);
+    printf("latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+            histogram_percentile(&st->latency, 50) / 1e3,
+            histogram_percentile(&st->latency, 90) / 1e3,
+            histogram_percentile(&st->latency, 99) / 1e3,
+            histogram_percentile(&st->latency, 99.9) / 1e3,
+            st->latency.max / 1e3,
+            st->latency.count ? (double)st->latency.sum / st->latency.count / 1e3 : 0.0);
+}
+
+int run_load(struct client_options *opts){
+    /* Run the load generator described by opts and print the results.
+
+    Params:
+        opts (client_options *): Parsed command line with -b set.
+
+    Return:
+        0 if every frame was acked, -1 otherwise.
+    */
+    struct load_state st;
+    struct epoll_event events[LOAD_MAX_EVENTS];
+
+    memset(&st, 0, sizeof(st));
+    st.opts = opts;
+    st.tcp = strcmp(opts->socktype, "tcp") == 0;
+    st.v2 = opts->version == PROTOCOL_V2;
+    st.closed_loop = opts->rate <= 0;
+    st.limit = opts->count > 0 ? opts->count : -1;
+    if (st.limit < 0 && opts->duration <= 0){
+        opts->duration = LOAD_DEFAULT_DURATION;
+    }
+
+    // -c is per server, from here on it counts every connection
+    opts->connections *= opts->num_servers;
+    st.conns = calloc(opts->connections, sizeof(*st.conns));
+    st.epfd = epoll_create1(0);
+    if (st.conns == NULL || st.epfd == -1 || histogram_init(&st.latency, HISTOGRAM_DEFAULT_BITS) == -1){
+        fprintf(stderr, "Out of memory for load generator.\n");
+        return -1;
+    }
+    if (open_conns(&st) == -1){
+        return -1;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = opts->duration > 0 ? start + (uint64_t)(opts->duration * 1e9) : UINT64_MAX;
+    uint64_t interval = st.closed_loop ? 0 : (uint64_t)(1e9 / opts->rate);
+    uint64_t next_due = start;
+    uint64_t last_expire = start;
+    int next_conn = 0;
+
+    if (st.closed_loop){
+        for (int i = 0; i < opts->connections; i++){
+            top_up(&st, &st.conns[i]);
+        }
+    }
+
+    while (1){
+        uint64_t now = now_ns();
+        if (now >= end){
+            st.stop_sending = 1;
+        }
+
+        long outstanding = 0;
+        int alive = 0;
+        for (int i = 0; i < opts->connections; i++){
+            outstanding += st.conns[i].outstanding;
+            alive += !st.conns[i].dead;
+        }
+        if (alive == 0 || (st.stop_sending && outstanding == 0)){
+            break;
+        }
+
+        // Open loop: send everything that's due, spread round robin over the connections
+        if (!st.closed_loop){
+            while (!st.stop_sending && next_due <= now){
+                int tries = 0;
+                while (tries < opts->connections && send_frame(&st, &st.conns[next_conn], next_due) == -1){
+                    next_conn = (next_conn + 1) % opts->connections;
+                    tries++;
+                }
+                if (tries == opts->connections){
+                    // Every connection is full, the frame stays due and its wait counts as latency
+                    break;
+                }
+                next_conn = (next_conn + 1) % opts->connections;
+                next_due += interval;
+            }
+            if (st.tcp){
+                for (int i = 0; i < opts->connections; i++){
+                    if (!st.conns[i].dead) conn_flush(&st, &st.conns[i]);
+                }
+            }
+        }
+
+        int timeout = 10;
+        if (!st.closed_loop && !st.stop_sending && next_due > now){
+            uint64_t wait_ms = (next_due - now) / 1000000;
+            timeout = wait_ms < 10 ? (int)wait_ms : 10;
+        }
+
+        int n = epoll_wait(st.epfd, events, LOAD_MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR){
+            fprintf(stderr, "Error waiting on epoll.\n");
+            return -1;
+        }
+        for (int i = 0; i < n; i++){
+            struct load_conn *c = events[i].data.ptr;
+            if (c->dead){
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+                read_acks(&st, c);
+            }
+            if (!c->dead && st.tcp && (events[i].events & EPOLLOUT)){
+                conn_flush(&st, c);
+            }
+            if (!c->dead && st.closed_loop){
+                top_up(&st, c);
+            }
+        }
+
+        // Look for timed out frames every 10ms or so
+        now = now_ns();
+        if (now - last_expire >= 10000000ULL){
+            for (int i = 0; i < opts->connections; i++){
+                expire(&st, &st.conns[i], now);
+                if (st.closed_loop && !st.conns[i].dead){
+                    top_up(&st, &st.conns[i]);
+                }
+            }
+            last_expire = now;
+        }
+    }
+
+    report(&st, start);
+
+    for (int i = 0; i < opts->connections; i++){
+        if (!st.conns[i].dead){
+            close(st.conns[i].fd);
+        }
+        free(st.conns[i].sent_at);
+        free(st.conns[i].done);
+    }
+    free(st.conns);
+    histogram_free(&st.latency);
+    close(st.epfd);
+
+    return (st.timeouts == 0 && st.errors == 0 && st.acked == st.sent) ? 0 : -1;
+}
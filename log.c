@@ -0,0 +1,441 @@
+/* Asynchronous, batched logging (see log.h).
+
+Layout:
+    - Each thread registers a log_thread the first time it logs. It holds two byte rings (stdout
+      and stderr), each with a single producer (that thread) and a single consumer (the
+      flusher), so adding a line is a memcpy and a release store, no lock.
+    - The flusher wakes every LOG_FLUSH_MS, or early when a producer pushes a ring past a
+      quarter full, and hands every thread's pending bytes to the kernel with one writev() per stream.
+    - A line that doesn't fit is dropped, never waited for. The flusher reports how many were
+      lost on stderr.
+    - The received values (log_values) are the hot one. They are formatted by hand rather than
+      through printf(), can be sampled (-s: one line every n values, 0 for none) and/or summed
+      up once every few seconds by the flusher (-A) instead.
+*/
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#define LOG_MAX_LINE 1024
+#define LOG_IOV_MAX 1024
+
+int log_level = LOG_INFO;
+
+struct log_ring
+{
+    char *buf;
+    size_t cap;        // power of two
+    size_t head;       // flusher: bytes written out so far
+    size_t tail;       // producer: bytes added so far
+    uint64_t dropped;  // lines that didn't fit
+};
+
+struct log_thread
+{
+    struct log_ring out;
+    struct log_ring err;
+    uint64_t values;        // values seen by this thread, for the -A summary
+    uint64_t value_sum;
+    uint64_t sample_count;  // values since the last one that was logged
+    struct log_thread *next;
+};
+
+static struct
+{
+    int sample;
+    int summary_secs;
+    int wakefd;
+    int stopping;
+    pthread_t flusher;
+    pthread_mutex_t lock;       // only guards registering threads
+    struct log_thread *threads;
+    uint64_t dropped_reported;
+} logger = { .sample = 1, .wakefd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct log_thread *self;
+
+int log_parse_level(const char *name){
+    /* Level for a -L argument.
+
+    return:
+        LOG_*, or -1 if the name isn't one.
+    */
+    const char *names[] = { "error", "warn", "info", "debug" };
+    for (int i = 0; i < 4; i++){
+        if (strcmp(name, names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct log_thread *log_self(void){
+    // This thread's buffers, allocated and registered with the flusher on first use
+    if (self != NULL){
+        return self;
+    }
+
+    struct log_thread *t = calloc(1, sizeof(*t));
+    if (t == NULL){
+        return NULL;
+    }
+    t->out.cap = LOG_RING_SIZE;
+    t->err.cap = LOG_ERR_RING_SIZE;
+    t->out.buf = malloc(t->out.cap);
+    t->err.buf = malloc(t->err.cap);
+    if (t->out.buf == NULL || t->err.buf == NULL){
+        free(t->out.buf);
+        free(t->err.buf);
+        free(t);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&logger.lock);
+    t->next = logger.threads;
+    logger.threads = t;
+    pthread_mutex_unlock(&logger.lock);
+    self = t;
+    return t;
+}
+
+static void ring_put(struct log_ring *r, const char *data, size_t len, uint32_t lines){
+    /* Producer only. Append 'len' bytes holding 'lines' lines, or drop them all if they don't fit. */
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t used = r->tail - head;
+
+    if (len > r->cap - used){
+        __atomic_store_n(&r->dropped, r->dropped + lines, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t pos = r->tail & (r->cap - 1);
+    size_t first = r->cap - pos < len ? r->cap - pos : len;
+    memcpy(r->buf + pos, data, first);
+    memcpy(r->buf, data + first, len - first);
+    __atomic_store_n(&r->tail, r->tail + len, __ATOMIC_RELEASE);
+
+    // Don't wait for the timer once a quarter of the buffer is used (only the write that crosses signals)
+    if (used < r->cap / 4 && used + len >= r->cap / 4 && logger.wakefd != -1){
+        uint64_t one = 1;
+        if (write(logger.wakefd, &one, sizeof(one)) == -1){
+            // Already signalled
+        }
+    }
+}
+
+void log_write(int level, const char *fmt, ...){
+    /* Format a line (printf style, the caller supplies the newline) and queue it. Use log_msg(),
+    which skips the call entirely when 'level' is turned off.
+    */
+    char line[LOG_MAX_LINE];
+    struct log_thread *t = log_self();
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0){
+        return;
+    }
+    if (len >= (int)sizeof(line)){
+        len = sizeof(line) - 1;
+    }
+
+    // Before log_init() (or if this thread's buffers couldn't be had) write it straight out
+    if (t == NULL || logger.wakefd == -1){
+        if (write(level <= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO, line, len) == -1){
+            // Nowhere left to report it
+        }
+        return;
+    }
+    ring_put(level <= LOG_WARN ? &t->err : &t->out, line, len, 1);
+}
+
+static char *format_value(char *p, int32_t value){
+    // Append "the sent number is: <value>\n" (value printed like %d) at p, return the new end
+    static const char prefix[] = "the sent number is: ";
+    char digits[11];
+    int n = 0;
+    uint32_t v = value < 0 ? -(uint32_t)value : (uint32_t)value;
+
+    memcpy(p, prefix, sizeof(prefix) - 1);
+    p += sizeof(prefix) - 1;
+    if (value < 0){
+        *p++ = '-';
+    }
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    while (n > 0){
+        *p++ = digits[--n];
+    }
+    *p++ = '\n';
+    return p;
+}
+
+void log_values(const uint32_t *values, uint32_t count){
+    /* Log received values (already in host order), one "the sent number is" line each, subject to
+    the sampling and summary settings from log_init(). Lines are formatted into a local block and
+    queued a block at a time.
+
+    params:
+        values (uint32_t *): The values.
+        count (uint32_t): How many there are.
+    */
+    char block[4096];
+    char *p = block;
+    uint32_t lines = 0;
+    struct log_thread *t = log_self();
+
+    if (t == NULL){
+        return;
+    }
+
+    // Counted with relaxed stores, the flusher only needs a recent value for the summary
+    if (logger.summary_secs > 0){
+        uint64_t sum = t->value_sum;
+        for (uint32_t i = 0; i < count; i++){
+            sum += values[i];
+        }
+        __atomic_store_n(&t->value_sum, sum, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->values, t->values + count, __ATOMIC_RELAXED);
+    }
+
+    if (log_level < LOG_INFO || logger.sample == 0){
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++){
+        if (++t->sample_count < (uint64_t)logger.sample){
+            continue;
+        }
+        t->sample_count = 0;
+
+        // Longest line is 20 + 11 + 1 bytes
+        if (p - block > (long)sizeof(block) - 32){
+            ring_put(&t->out, block, p - block, lines);
+            p = block;
+            lines = 0;
+        }
+        p = format_value(p, (int32_t)values[i]);
+        lines++;
+    }
+    if (lines > 0){
+        ring_put(&t->out, block, p - block, lines);
+    }
+}
+
+static void write_all(int fd, struct iovec *iov, int count){
+    // writev() everything in iov, picking up after partial writes
+    while (count > 0){
+        ssize_t n = writev(fd, iov, count);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void flush_stream(int fd, int err){
+    /* Write out what every thread has queued for one stream (stdout, or stderr if 'err'), up to
+    LOG_IOV_MAX pieces per writev().
+    */
+    struct iovec iov[LOG_IOV_MAX];
+    struct log_ring *rings[LOG_IOV_MAX / 2];
+    size_t tails[LOG_IOV_MAX / 2];
+    int count = 0;
+    int nrings = 0;
+
+    pthread_mutex_lock(&logger.lock);
+    struct log_thread *t = logger.threads;
+    pthread_mutex_unlock(&logger.lock);
+
+    // Threads are only ever added at the front, so the list from here on is stable
+    while (t != NULL){
+        struct log_ring *r = err ? &t->err : &t->out;
+        size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        size_t used = tail - r->head;
+        t = t->next;
+        if (used == 0){
+            continue;
+        }
+
+        // A ring's bytes are one or two pieces depending on whether they wrap
+        size_t pos = r->head & (r->cap - 1);
+        size_t first = r->cap - pos < used ? r->cap - pos : used;
+        iov[count].iov_base = r->buf + pos;
+        iov[count++].iov_len = first;
+        if (used > first){
+            iov[count].iov_base = r->buf;
+            iov[count++].iov_len = used - first;
+        }
+        rings[nrings] = r;
+        tails[nrings++] = tail;
+
+        if (nrings == LOG_IOV_MAX / 2){
+            write_all(fd, iov, count);
+            for (int i = 0; i < nrings; i++){
+                __atomic_store_n(&rings[i]->head, tails[i], __ATOMIC_RELEASE);
+            }
+            count = 0;
+            nrings = 0;
+        }
+    }
+    if (nrings > 0){
+        write_all(fd, iov, count);
+        for (int i = 0; i < nrings; i++){
+            __atomic_store_n(&rings[i]->head, tails[i], __ATOMIC_RELEASE);
+        }
+    }
+}
+
+uint64_t log_dropped(void){
+    // Lines dropped so far by every thread because their buffer was full
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&logger.lock);
+    for (struct log_thread *t = logger.threads; t != NULL; t = t->next){
+        dropped += __atomic_load_n(&t->out.dropped, __ATOMIC_RELAXED);
+        dropped += __atomic_load_n(&t->err.dropped, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&logger.lock);
+    return dropped;
+}
+
+static void report(uint64_t *last_values, uint64_t *last_sum){
+    // The -A summary line and the dropped line count, written by the flusher itself
+    char line[LOG_MAX_LINE];
+    uint64_t values = 0;
+    uint64_t sum = 0;
+    uint64_t dropped = log_dropped();
+
+    pthread_mutex_lock(&logger.lock);
+    for (struct log_thread *t = logger.threads; t != NULL; t = t->next){
+        values += __atomic_load_n(&t->values, __ATOMIC_RELAXED);
+        sum += __atomic_load_n(&t->value_sum, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&logger.lock);
+
+    if (last_values != NULL && values != *last_values){
+        uint64_t n = values - *last_values;
+        int len = snprintf(line, sizeof(line), "received %llu values in the last %d s (%llu total), mean %.1f\n",
+                           (unsigned long long)n, logger.summary_secs, (unsigned long long)values,
+                           (double)(sum - *last_sum) / n);
+        if (write(STDOUT_FILENO, line, len) == -1){
+            // Nowhere to report it
+        }
+        *last_values = values;
+        *last_sum = sum;
+    }
+
+    if (dropped != logger.dropped_reported){
+        int len = snprintf(line, sizeof(line), "log buffers full, dropped %llu lines\n",
+                           (unsigned long long)(dropped - logger.dropped_reported));
+        if (write(STDERR_FILENO, line, len) == -1){
+            // Nowhere to report it
+        }
+        logger.dropped_reported = dropped;
+    }
+}
+
+static uint64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *flusher_main(void *arg){
+    // Background thread: write out every thread's buffers until log_shutdown()
+    struct pollfd pfd = { .fd = logger.wakefd, .events = POLLIN };
+    uint64_t next_summary = now_ms() + (uint64_t)logger.summary_secs * 1000;
+    uint64_t last_values = 0;
+    uint64_t last_sum = 0;
+    (void)arg;
+
+    while (!__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE)){
+        if (poll(&pfd, 1, LOG_FLUSH_MS) > 0){
+            uint64_t count;
+            if (read(logger.wakefd, &count, sizeof(count)) == -1){
+                // Raced with another read, nothing to do
+            }
+        }
+        flush_stream(STDOUT_FILENO, 0);
+        flush_stream(STDERR_FILENO, 1);
+
+        uint64_t now = now_ms();
+        if (logger.summary_secs > 0 && now >= next_summary){
+            report(&last_values, &last_sum);
+            next_summary = now + (uint64_t)logger.summary_secs * 1000;
+        }
+        else{
+            report(NULL, NULL);
+        }
+    }
+
+    flush_stream(STDOUT_FILENO, 0);
+    flush_stream(STDERR_FILENO, 1);
+    return NULL;
+}
+
+int log_init(int level, int sample, int summary_secs){
+    /* Set the logging options and start the flusher. Call before any thread logs.
+
+    params:
+        level (int): Most verbose level written, LOG_*.
+        sample (int): Log one received value in this many, 0 for none.
+        summary_secs (int): Print a summary of the received values this often, 0 for never.
+
+    return:
+        0 on success, -1 on error.
+    */
+    log_level = level;
+    logger.sample = sample;
+    logger.summary_secs = summary_secs;
+
+    // Anything printf()'d so far must come out before the flusher's writes
+    fflush(stdout);
+
+    logger.wakefd = eventfd(0, EFD_NONBLOCK);
+    if (logger.wakefd == -1){
+        fprintf(stderr, "Error creating the log eventfd.\n");
+        return -1;
+    }
+    if (pthread_create(&logger.flusher, NULL, flusher_main, NULL) != 0){
+        fprintf(stderr, "Failed to start the log flusher.\n");
+        close(logger.wakefd);
+        logger.wakefd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void log_shutdown(void){
+    // Stop the flusher once it has written out everything queued so far
+    if (logger.wakefd == -1){
+        return;
+    }
+    __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.flusher, NULL);
+}
@@ -0,0 +1,38 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+/* Asynchronous logging for the server, see log.c.
+
+    Every thread that logs gets its own preallocated buffers and only ever copies its lines into
+    them, a background flusher writes everything out with one writev() per stream every
+    LOG_FLUSH_MS (sooner when a buffer is a quarter full). Nothing that logs ever waits on the
+    terminal or the disk: when a buffer is full the line is dropped and counted instead.
+
+    Levels: LOG_ERROR and LOG_WARN go to stderr, LOG_INFO (the received values) and LOG_DEBUG to
+    stdout. log_msg() costs one compare when its level is turned off.
+
+    LOG_RING_SIZE / LOG_ERR_RING_SIZE are each thread's stdout / stderr buffer (powers of two).
+*/
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_RING_SIZE (4 * 1024 * 1024)
+#define LOG_ERR_RING_SIZE (64 * 1024)
+#define LOG_FLUSH_MS 10
+
+extern int log_level;
+
+#define log_msg(level, ...) do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+int log_parse_level(const char *name);
+int log_init(int level, int sample, int summary_secs);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_values(const uint32_t *values, uint32_t count);
+uint64_t log_dropped(void);
+void log_shutdown(void);
+
+#endif
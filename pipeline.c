@@ -0,0 +1,592 @@
+/* Staged receive/process pipeline (see pipeline.h).
+
+Layout:
+    - work[w][p] carries records from worker w to processor p, done[p][w] brings replies back.
+      Each ring has exactly one producer and one consumer, so a push or pop is a couple of
+      plain loads and stores plus one release store, no locks and no read-modify-write.
+    - Records are variable length (a frame's values are copied in whole) and never wrap: when
+      one doesn't fit before the end of the ring the rest of the end is marked unused.
+    - Each side only publishes its position once per record and reads the other side's position
+      only when its cached copy says the ring looks full (or empty).
+    - Processors sleep on an eventfd. A worker only writes to it when the processor said it
+      may be asleep, the same handshake the client engine uses. Workers have an eventfd in their
+      event loop that processors write once per pass when they handed back replies.
+    - A producer that finds a ring full flags it, and the consumer wakes the producer once it
+      has made room. That is the backpressure: the worker stops reading until then.
+    - With -D a processor writes replies into done[p][w] as usual but doesn't publish them.
+      It notes where they end along with the LSN that has to be on disk first (a mark), and
+      publishes up to a mark once wal_synced() has passed it. The syncer wakes processors that
+      have marks waiting after every sync.
+
+Reference:
+    https://www.1024cores.net/home/lock-free-algorithms/queues/unbounded-spsc-queue
+*/
+#include "pipeline.h"
+
+#include <sys/eventfd.h>
+
+#define CACHE_LINE 64
+
+struct pipe_ring
+{
+    // Producer side
+    size_t tail __attribute__((aligned(CACHE_LINE)));  // published end of the committed records
+    size_t tail_local;   // end of the records written so far
+    size_t head_cache;   // last head seen
+    size_t reserved;     // size of the record being written
+    int producer_waiting;  // set by a producer that found the ring full
+    size_t pushed;       // work rings: records committed, for pipeline_depth()
+
+    // Consumer side
+    size_t head __attribute__((aligned(CACHE_LINE)));  // published start of the unread records
+    size_t head_local;
+    size_t tail_cache;
+    size_t popped;       // work rings: records handled
+
+    uint8_t *buf __attribute__((aligned(CACHE_LINE)));
+};
+
+struct waker
+{
+    int fd;        // eventfd
+    int sleeping;  // processors only: may be blocked on fd
+} __attribute__((aligned(CACHE_LINE)));
+
+// -D: replies written to one done ring, waiting for the log to be synced
+struct pipe_marks
+{
+    uint64_t lsn[PIPE_MARKS];   // publish up to tail[i] once this much of the log is on disk
+    size_t tail[PIPE_MARKS];
+    int first;
+    int count;
+};
+
+struct processor
+{
+    struct pipeline *pl;
+    int id;
+    pthread_t thread;
+    uint64_t lsn;              // -D: end of the last record this processor appended
+    struct pipe_marks *marks;  // -D: [worker]
+    int waiting;               // -D: marks waiting on a sync, read by the syncer
+};
+
+struct pipeline
+{
+    int workers;
+    int processors;
+    int ack_policy;
+    int durable;                  // -D: acks wait for the write-ahead log
+    struct pipe_ring *work;       // [worker * processors + proc]
+    struct pipe_ring *done;       // [proc * workers + worker]
+    struct waker *worker_wakers;
+    struct waker *proc_wakers;
+    struct processor *procs;
+};
+
+static int ring_init(struct pipe_ring *r){
+    memset(r, 0, sizeof(*r));
+    r->buf = malloc(PIPE_RING_SIZE);
+    return r->buf == NULL ? -1 : 0;
+}
+
+static void *ring_reserve(struct pipe_ring *r, size_t size){
+    /* Producer only. Make room for a contiguous record of 'size' bytes (a multiple of 8).
+
+    return:
+        Where to write it, or NULL if the ring is full (the ring is then flagged so the
+        consumer wakes this producer once it has made room).
+    */
+    size_t pos = r->tail_local & (PIPE_RING_SIZE - 1);
+    size_t skip = PIPE_RING_SIZE - pos < size ? PIPE_RING_SIZE - pos : 0;
+    size_t end = r->tail_local + skip + size;
+
+    if (end - r->head_cache > PIPE_RING_SIZE){
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (end - r->head_cache > PIPE_RING_SIZE){
+            // Flag it, then look once more in case the consumer made room in between (pairs with ring_release)
+            __atomic_store_n(&r->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            r->head_cache = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+            if (end - r->head_cache > PIPE_RING_SIZE){
+                return NULL;
+            }
+        }
+    }
+
+    if (skip > 0){
+        // The record goes at the start, tell the consumer to skip what is left of the end
+        *(uint32_t *)(r->buf + pos) = 0;
+        r->tail_local += skip;
+        pos = 0;
+    }
+    r->reserved = size;
+    return r->buf + pos;
+}
+
+static void ring_commit(struct pipe_ring *r){
+    // Producer only. Publish the record from the last ring_reserve().
+    r->tail_local += r->reserved;
+    __atomic_store_n(&r->tail, r->tail_local, __ATOMIC_RELEASE);
+}
+
+static void ring_write(struct pipe_ring *r){
+    // Producer only. Keep the record from the last ring_reserve() without publishing it yet.
+    r->tail_local += r->reserved;
+}
+
+static void ring_publish(struct pipe_ring *r, size_t tail){
+    // Producer only. Publish every record written up to 'tail' (a past tail_local).
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+static struct pipe_msg *ring_front(struct pipe_ring *r){
+    // Consumer only. The oldest unread record, or NULL if there is none.
+    while (1){
+        if (r->head_local == r->tail_cache){
+            r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            if (r->head_local == r->tail_cache){
+                return NULL;
+            }
+        }
+        size_t pos = r->head_local & (PIPE_RING_SIZE - 1);
+        struct pipe_msg *m = (struct pipe_msg *)(r->buf + pos);
+        if (m->size != 0){
+            return m;
+        }
+        r->head_local += PIPE_RING_SIZE - pos;
+    }
+}
+
+static void ring_pop(struct pipe_ring *r, struct pipe_msg *m){
+    // Consumer only. Done with the front record, its space is given back by ring_release().
+    r->head_local += m->size;
+}
+
+static int ring_release(struct pipe_ring *r){
+    /* Consumer only. Give every popped record's space back to the producer.
+
+    return:
+        1 if the producer was waiting for room and should be woken.
+    */
+    if (r->head_local == r->head){
+        return 0;
+    }
+    __atomic_store_n(&r->head, r->head_local, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->producer_waiting, __ATOMIC_SEQ_CST)){
+        return __atomic_exchange_n(&r->producer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+static int ring_empty(struct pipe_ring *r){
+    return r->head_local == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static void signal_fd(int fd){
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == -1){
+        // The eventfd is already signalled
+    }
+}
+
+static void wake_processor(struct waker *wk){
+    // Only pay for the eventfd write when the processor may be asleep (pairs with processor_main)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wk->sleeping, __ATOMIC_RELAXED)){
+        signal_fd(wk->fd);
+    }
+}
+
+static void mark_replies(struct processor *p, int worker){
+    // -D: everything written to the worker's done ring so far goes back once the log is synced up to p->lsn
+    struct pipe_ring *ring = &p->pl->done[p->id * p->pl->workers + worker];
+    struct pipe_marks *mk = &p->marks[worker];
+    int last = (mk->first + mk->count - 1) % PIPE_MARKS;
+
+    if (mk->count == 0 ? ring->tail_local == ring->tail : mk->tail[last] == ring->tail_local){
+        return;
+    }
+    // Out of marks: the newest one waits a little longer and covers these too
+    if (mk->count == PIPE_MARKS){
+        mk->lsn[last] = p->lsn;
+        mk->tail[last] = ring->tail_local;
+        return;
+    }
+    last = (mk->first + mk->count) % PIPE_MARKS;
+    mk->lsn[last] = p->lsn;
+    mk->tail[last] = ring->tail_local;
+    mk->count++;
+    __atomic_store_n(&p->waiting, p->waiting + 1, __ATOMIC_SEQ_CST);
+}
+
+static int publish_synced(struct processor *p){
+    /* -D: publish every reply whose frames are now on disk and wake the workers they belong to.
+
+    return:
+        Number of workers that got replies.
+    */
+    struct pipeline *pl = p->pl;
+    int woken = 0;
+
+    if (p->waiting == 0){
+        return 0;
+    }
+    uint64_t synced = wal_synced();
+    for (int w = 0; w < pl->workers; w++){
+        struct pipe_marks *mk = &p->marks[w];
+        if (mk->count == 0 || mk->lsn[mk->first] > synced){
+            continue;
+        }
+        size_t tail = 0;
+        while (mk->count > 0 && mk->lsn[mk->first] <= synced){
+            tail = mk->tail[mk->first];
+            mk->first = (mk->first + 1) % PIPE_MARKS;
+            mk->count--;
+            __atomic_store_n(&p->waiting, p->waiting - 1, __ATOMIC_SEQ_CST);
+        }
+        ring_publish(&pl->done[p->id * pl->workers + w], tail);
+        signal_fd(pl->worker_wakers[w].fd);
+        woken++;
+    }
+    return woken;
+}
+
+static void wake_synced(void *arg){
+    // wal_notify() callback, on the syncer thread: wake every processor with replies waiting on a sync
+    struct pipeline *pl = arg;
+    for (int i = 0; i < pl->processors; i++){
+        if (__atomic_load_n(&pl->procs[i].waiting, __ATOMIC_SEQ_CST)){
+            signal_fd(pl->proc_wakers[i].fd);
+        }
+    }
+}
+
+static struct pipe_msg *reply_reserve(struct processor *p, int worker, struct pipe_msg *m){
+    /* Room for the reply to record m on the ring back to 'worker'. When the worker is behind on
+    taking replies this waits for it, the worker is woken first so it can't be asleep. With -D
+    the ring may be full of replies waiting on a sync instead, they're published as it ends.
+    */
+    struct pipeline *pl = p->pl;
+    struct pipe_ring *ring = &pl->done[p->id * pl->workers + worker];
+    struct waker *self = &pl->proc_wakers[p->id];
+    size_t size = sizeof(*m) + PIPE_ALIGN(m->addr_len) + PIPE_ALIGN(m->reply_len);
+    struct pipe_msg *reply;
+
+    while ((reply = ring_reserve(ring, size)) == NULL){
+        if (pl->durable){
+            mark_replies(p, worker);
+            publish_synced(p);
+        }
+        signal_fd(pl->worker_wakers[worker].fd);
+        __atomic_store_n(&self->sleeping, 1, __ATOMIC_SEQ_CST);
+        if ((reply = ring_reserve(ring, size)) == NULL){
+            uint64_t count;
+            if (read(self->fd, &count, sizeof(count)) == -1 && errno != EINTR){
+                log_msg(LOG_WARN, "Error waiting on processor eventfd.\n");
+            }
+        }
+        __atomic_store_n(&self->sleeping, 0, __ATOMIC_RELAXED);
+        if (reply != NULL){
+            break;
+        }
+    }
+
+    reply->size = size;
+    reply->count = 0;
+    reply->owner = m->owner;
+    reply->reply_len = m->reply_len;
+    reply->addr_len = m->addr_len;
+    reply->flags = m->flags;
+    reply->received = m->received;
+    memcpy(pipe_msg_addr(reply), pipe_msg_addr(m), m->addr_len);
+    memcpy(pipe_msg_reply(reply), pipe_msg_reply(m), m->reply_len);
+    return reply;
+}
+
+static int processor_pass(struct processor *p){
+    /* Handle everything currently queued for this processor by every worker.
+
+    return:
+        Number of records handled.
+    */
+    struct pipeline *pl = p->pl;
+    int handled = 0;
+
+    for (int w = 0; w < pl->workers; w++){
+        struct pipe_ring *ring = &pl->work[w * pl->processors + p->id];
+        struct pipe_ring *back = &pl->done[p->id * pl->workers + w];
+        int replies = 0;
+        struct pipe_msg *m;
+
+        while ((m = ring_front(ring)) != NULL){
+            process_values(pipe_msg_values(m), m->count, m->sender);
+            if (pl->durable && m->count > 0){
+                p->lsn = wal_append(m->sender, pipe_msg_values(m), m->count);
+            }
+            if (m->reply_len > 0){
+                reply_reserve(p, w, m);
+                if (pl->durable){
+                    ring_write(back);
+                }
+                else{
+                    ring_commit(back);
+                }
+                replies++;
+            }
+            ring_pop(ring, m);
+            __atomic_store_n(&ring->popped, ring->popped + 1, __ATOMIC_RELEASE);
+            handled++;
+
+            // Hand room back now and then so a worker blocked on this ring isn't held up by a long pass
+            if ((handled & 255) == 0 && ring_release(ring)){
+                signal_fd(pl->worker_wakers[w].fd);
+            }
+        }
+        if (ring_release(ring)){
+            signal_fd(pl->worker_wakers[w].fd);
+        }
+        if (replies > 0 && pl->durable){
+            mark_replies(p, w);
+        }
+        else if (replies > 0){
+            signal_fd(pl->worker_wakers[w].fd);
+        }
+    }
+    return handled;
+}
+
+static void *processor_main(void *arg){
+    // Thread entry point for one processor, never returns
+    struct processor *p = arg;
+    struct pipeline *pl = p->pl;
+    struct waker *self = &pl->proc_wakers[p->id];
+
+    TRACE_THREAD("processor %d", p->id);
+    while (1){
+        int busy = processor_pass(p);
+        if (pl->durable){
+            busy += publish_synced(p);
+        }
+        if (busy > 0){
+            continue;
+        }
+
+        // Tell workers we may sleep, then look at every ring once more (pairs with wake_processor)
+        __atomic_store_n(&self->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int idle = 1;
+        for (int w = 0; w < pl->workers && idle; w++){
+            idle = ring_empty(&pl->work[w * pl->processors + p->id]);
+        }
+        if (idle){
+            uint64_t count;
+            if (read(self->fd, &count, sizeof(count)) == -1 && errno != EINTR){
+                log_msg(LOG_WARN, "Error waiting on processor eventfd.\n");
+            }
+        }
+        __atomic_store_n(&self->sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+struct pipeline *pipeline_create(int workers, int processors, int ack_policy){
+    /* Set up the rings between every worker and processor and start the processors.
+
+    params:
+        workers (int): Number of I/O workers that will feed the pipeline.
+        processors (int): Processing threads to start.
+        ack_policy (int): ACK_PROCESSED or ACK_RECEIPT.
+
+    return:
+        The pipeline, or NULL on error.
+    */
+    struct pipeline *pl = calloc(1, sizeof(*pl));
+    if (pl == NULL){
+        fprintf(stderr, "Out of memory for the pipeline.\n");
+        return NULL;
+    }
+    pl->workers = workers;
+    pl->processors = processors;
+    pl->ack_policy = ack_policy;
+    pl->durable = wal_enabled();
+    pl->work = aligned_alloc(CACHE_LINE, (size_t)workers * processors * sizeof(*pl->work));
+    pl->done = aligned_alloc(CACHE_LINE, (size_t)workers * processors * sizeof(*pl->done));
+    pl->worker_wakers = aligned_alloc(CACHE_LINE, workers * sizeof(*pl->worker_wakers));
+    pl->proc_wakers = aligned_alloc(CACHE_LINE, processors * sizeof(*pl->proc_wakers));
+    pl->procs = calloc(processors, sizeof(*pl->procs));
+    if (!pl->work || !pl->done || !pl->worker_wakers || !pl->proc_wakers || !pl->procs){
+        fprintf(stderr, "Out of memory for the pipeline.\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < workers * processors; i++){
+        if (ring_init(&pl->work[i]) == -1 || ring_init(&pl->done[i]) == -1){
+            fprintf(stderr, "Out of memory for the pipeline.\n");
+            return NULL;
+        }
+    }
+
+    // Workers poll theirs from their event loop, processors block on theirs
+    for (int i = 0; i < workers; i++){
+        pl->worker_wakers[i].sleeping = 0;
+        pl->worker_wakers[i].fd = eventfd(0, EFD_NONBLOCK);
+        if (pl->worker_wakers[i].fd == -1){
+            fprintf(stderr, "Error creating worker eventfd.\n");
+            return NULL;
+        }
+    }
+    for (int i = 0; i < processors; i++){
+        pl->proc_wakers[i].sleeping = 0;
+        pl->proc_wakers[i].fd = eventfd(0, 0);
+        if (pl->proc_wakers[i].fd == -1){
+            fprintf(stderr, "Error creating processor eventfd.\n");
+            return NULL;
+        }
+    }
+
+    if (pl->durable){
+        wal_notify(wake_synced, pl);
+    }
+    for (int i = 0; i < processors; i++){
+        pl->procs[i].pl = pl;
+        pl->procs[i].id = i;
+        if (pl->durable && (pl->procs[i].marks = calloc(workers, sizeof(struct pipe_marks))) == NULL){
+            fprintf(stderr, "Out of memory for the pipeline.\n");
+            return NULL;
+        }
+        if (pthread_create(&pl->procs[i].thread, NULL, processor_main, &pl->procs[i]) != 0){
+            fprintf(stderr, "Failed to start processor %d.\n", i);
+            return NULL;
+        }
+    }
+    return pl;
+}
+
+int pipeline_ack_policy(struct pipeline *pl){
+    return pl->ack_policy;
+}
+
+int pipeline_processors(struct pipeline *pl){
+    return pl->processors;
+}
+
+size_t pipeline_queued(struct pipeline *pl, int worker, int proc){
+    // Bytes waiting on the ring from 'worker' to 'proc', read from any thread (for the stats)
+    struct pipe_ring *r = &pl->work[worker * pl->processors + proc];
+    return __atomic_load_n(&r->tail, __ATOMIC_RELAXED) - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+}
+
+size_t pipeline_depth(struct pipeline *pl){
+    /* Records waiting on every work ring, from any thread. Each count is read on its own while
+    the rings move, so it is an estimate (used for the -l queue limit).
+    */
+    size_t depth = 0;
+    for (int i = 0; i < pl->workers * pl->processors; i++){
+        struct pipe_ring *r = &pl->work[i];
+        // Handled first: a record is pushed before it is popped, so this can't go below zero
+        size_t popped = __atomic_load_n(&r->popped, __ATOMIC_ACQUIRE);
+        depth += __atomic_load_n(&r->pushed, __ATOMIC_RELAXED) - popped;
+    }
+    return depth;
+}
+
+int pipeline_processor(struct pipeline *pl, uint32_t key){
+    // Everything with the same key goes to the same processor, so it is handled in order
+    return (int)(key % (uint32_t)pl->processors);
+}
+
+int pipeline_wake_fd(struct pipeline *pl, int worker){
+    /* The worker's eventfd (non-blocking). It becomes readable when a processor handed replies
+    back or made room on a ring the worker found full. The worker then calls pipeline_clear()
+    and pipeline_drain(), in that order so nothing signalled in between is missed.
+    */
+    return pl->worker_wakers[worker].fd;
+}
+
+void pipeline_clear(struct pipeline *pl, int worker){
+    // Reset the worker's eventfd
+    uint64_t count;
+    if (read(pl->worker_wakers[worker].fd, &count, sizeof(count)) == -1){
+        // Wasn't signalled
+    }
+}
+
+struct pipe_msg *pipeline_reserve(struct pipeline *pl, int worker, int proc, uint32_t count, size_t reply_len, size_t addr_len){
+    /* Start a work record from 'worker' to processor 'proc'. The caller fills in the address,
+    reply and values (see pipe_msg_*()) and then calls pipeline_commit().
+
+    params:
+        pl (pipeline *): The pipeline.
+        worker (int): Calling worker's id.
+        proc (int): Processor to hand it to, from pipeline_processor().
+        count (uint32_t): Values the record will carry.
+        reply_len (size_t): Bytes of reply to send back once processed, 0 if already acked.
+        addr_len (size_t): Bytes of peer address to send it to (udp).
+
+    return:
+        The record with its header filled in, or NULL if that processor's ring is full. The
+        worker's eventfd is signalled once it has room again.
+    */
+    struct pipe_ring *ring = &pl->work[worker * pl->processors + proc];
+    size_t size = sizeof(struct pipe_msg) + PIPE_ALIGN(addr_len) + PIPE_ALIGN(reply_len) + PIPE_ALIGN((size_t)count * sizeof(uint32_t));
+    struct pipe_msg *m = ring_reserve(ring, size);
+
+    if (m == NULL){
+        return NULL;
+    }
+    m->size = size;
+    m->count = count;
+    m->owner = NULL;
+    m->reply_len = reply_len;
+    m->addr_len = addr_len;
+    m->sender = 0;
+    m->flags = 0;
+    m->received = 0;
+    return m;
+}
+
+void pipeline_commit(struct pipeline *pl, int worker, int proc){
+    // Make the record from the last pipeline_reserve() visible to its processor
+    struct pipe_ring *ring = &pl->work[worker * pl->processors + proc];
+    __atomic_store_n(&ring->pushed, ring->pushed + 1, __ATOMIC_RELAXED);
+    ring_commit(ring);
+}
+
+void pipeline_kick(struct pipeline *pl, int worker){
+    // Wake any processor that may be asleep with records from this worker waiting (call once per pass)
+    for (int p = 0; p < pl->processors; p++){
+        if (!ring_empty(&pl->work[worker * pl->processors + p])){
+            wake_processor(&pl->proc_wakers[p]);
+        }
+    }
+}
+
+int pipeline_drain(struct pipeline *pl, int worker, pipe_reply_fn fn, void *arg){
+    /* Take every reply the processors handed back to this worker.
+
+    params:
+        pl (pipeline *): The pipeline.
+        worker (int): Calling worker's id.
+        fn (pipe_reply_fn): Called with each reply record, which is only valid during the call.
+        arg (void *): Passed to fn.
+
+    return:
+        Number of replies handled.
+    */
+    int handled = 0;
+
+    for (int p = 0; p < pl->processors; p++){
+        struct pipe_ring *ring = &pl->done[p * pl->workers + worker];
+        struct pipe_msg *m;
+        while ((m = ring_front(ring)) != NULL){
+            fn(arg, m);
+            ring_pop(ring, m);
+            handled++;
+        }
+        if (ring_release(ring)){
+            // The processor is (about to be) blocked waiting for room on this ring
+            signal_fd(pl->proc_wakers[p].fd);
+        }
+    }
+    return handled;
+}
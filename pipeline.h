@@ -0,0 +1,78 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "server.h"
+
+/* Staged receive/process pipeline (-P), see pipeline.c.
+
+    The I/O workers only cut frames, check them and build the replies. The values themselves are
+    copied into a work record and handed to one of -P processing threads, which decode and
+    display them. Every (worker, processor) pair has its own single-producer/single-consumer
+    ring in each direction: work goes out on one, and with ACK_PROCESSED the replies come back
+    on the other once the values have been handled.
+
+    In durable mode (-D) a processor also appends the values to the write-ahead log (wal.h),
+    and a reply only goes back to the worker once the log sync covering its frame is done.
+
+    PIPE_RING_SIZE is the size of each ring (a power of two, holds several of the largest
+    records). When a processor's ring is full the worker stops reading from whatever wanted to
+    push to it until the processor catches up.
+*/
+#define MAX_PROCESSORS 64
+#define PIPE_RING_SIZE (512 * 1024)
+#define PIPE_MARKS 16  // -D: syncs a processor's replies to one worker can be waiting on
+
+// When a pipelined frame is acked (-a)
+#define ACK_PROCESSED 0  // after its values were displayed (default, same meaning as without -P)
+#define ACK_RECEIPT 1    // as soon as the worker has queued its values
+
+/* One record on a ring, followed by addr_len bytes of peer address, reply_len bytes of reply
+    and count network order values, each part starting on an 8 byte boundary.
+*/
+struct pipe_msg
+{
+    uint32_t size;       // whole record in bytes, 0 marks the unused end of the ring
+    uint32_t count;      // values carried
+    void *owner;         // the worker's connection the reply belongs to (tcp only)
+    uint16_t reply_len;  // 0 if the frame was already acked
+    uint16_t addr_len;   // udp peer to send the reply to
+    uint32_t sender;     // agg_sender_of() the peer, who the values are aggregated under
+    uint32_t flags;      // PIPE_*
+    uint64_t received;   // stats_now() when the frame was read, to time its ack
+};
+
+#define PIPE_RELIABLE 1  // the reply answers a reliable udp frame, its id is the sequence number (rudp.h)
+
+#define PIPE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static inline uint8_t *pipe_msg_addr(struct pipe_msg *m){
+    return (uint8_t *)(m + 1);
+}
+
+static inline uint8_t *pipe_msg_reply(struct pipe_msg *m){
+    return pipe_msg_addr(m) + PIPE_ALIGN(m->addr_len);
+}
+
+static inline uint8_t *pipe_msg_values(struct pipe_msg *m){
+    return pipe_msg_reply(m) + PIPE_ALIGN(m->reply_len);
+}
+
+struct pipeline;
+
+// Called for every reply a processor hands back to a worker
+typedef void (*pipe_reply_fn)(void *arg, struct pipe_msg *m);
+
+struct pipeline *pipeline_create(int workers, int processors, int ack_policy);
+int pipeline_ack_policy(struct pipeline *pl);
+int pipeline_processors(struct pipeline *pl);
+size_t pipeline_queued(struct pipeline *pl, int worker, int proc);
+size_t pipeline_depth(struct pipeline *pl);
+int pipeline_processor(struct pipeline *pl, uint32_t key);
+int pipeline_wake_fd(struct pipeline *pl, int worker);
+void pipeline_clear(struct pipeline *pl, int worker);
+struct pipe_msg *pipeline_reserve(struct pipeline *pl, int worker, int proc, uint32_t count, size_t reply_len, size_t addr_len);
+void pipeline_commit(struct pipeline *pl, int worker, int proc);
+void pipeline_kick(struct pipeline *pl, int worker);
+int pipeline_drain(struct pipeline *pl, int worker, pipe_reply_fn fn, void *arg);
+
+#endif
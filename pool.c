@@ -0,0 +1,41 @@
+/* Fixed-size object pools (see pool.h).
+
+The slab is mmap()ed rather than malloc()ed: it is reserved in one piece up front, starts out
+as untouched zero pages, and never mixes with the heap the rest of the process allocates from.
+*/
+#include "pool.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+int pool_init(struct pool *p, size_t size, uint32_t count){
+    /* Map the slab for 'count' objects of at least 'size' bytes each.
+
+    params:
+        p (pool *): Pool to set up.
+        size (size_t): Bytes per object (rounded up to a cache line).
+        count (uint32_t): How many objects the pool holds, at least 1.
+
+    return:
+        0 on success, -1 if the slab couldn't be mapped.
+    */
+    p->size = (size + 63) & ~(size_t)63;
+    p->count = count;
+    p->fresh = 0;
+    p->used = 0;
+    p->free_head = NULL;
+    p->slab = mmap(NULL, p->size * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p->slab == MAP_FAILED){
+        p->slab = NULL;
+        fprintf(stderr, "Failed to map a pool of %u objects of %zu bytes.\n", count, p->size);
+        return -1;
+    }
+    return 0;
+}
+
+void pool_destroy(struct pool *p){
+    if (p->slab != NULL){
+        munmap(p->slab, p->size * p->count);
+        p->slab = NULL;
+    }
+}
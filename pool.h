@@ -0,0 +1,69 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fixed-size object pools for per-connection state, see pool.c.
+
+    A pool is one slab of 'count' objects of 'size' bytes, mapped when its worker starts. Taking
+    and giving back an object is a couple of pointer moves on a freelist threaded through the
+    free objects themselves. Each worker owns its pools and is the only thread that touches
+    them, so there is no lock and no malloc() on the accept/close paths.
+
+    Objects that have never been handed out are taken in slab order before the freelist, so a
+    page is only touched (and counted against the process) once a connection first needs it.
+    Memory use is bounded by the slab and stays flat however fast connections come and go:
+    the most recently freed object is the next one handed out, still warm in the cache.
+
+    DEFAULT_MAX_CONNS is the -C default (per worker).
+    POOL_BIG_SHARE: one connection in this many may hold a large frame buffer at a time.
+*/
+#define DEFAULT_MAX_CONNS 1024
+#define MAX_CONNS_LIMIT (1 << 20)
+#define POOL_BIG_SHARE 8
+
+struct pool_free
+{
+    struct pool_free *next;
+};
+
+struct pool
+{
+    uint8_t *slab;
+    size_t size;              // bytes per object, a multiple of 64
+    uint32_t count;
+    uint32_t fresh;           // objects handed out from the slab so far
+    uint32_t used;            // objects out right now
+    struct pool_free *free_head;
+};
+
+int pool_init(struct pool *p, size_t size, uint32_t count);
+void pool_destroy(struct pool *p);
+
+static inline void *pool_get(struct pool *p){
+    // An uninitialised object, NULL when all 'count' are in use
+    void *obj;
+    if (p->free_head != NULL){
+        obj = p->free_head;
+        p->free_head = p->free_head->next;
+    }
+    else if (p->fresh < p->count){
+        obj = p->slab + (size_t)p->fresh++ * p->size;
+    }
+    else{
+        return NULL;
+    }
+    p->used++;
+    return obj;
+}
+
+static inline void pool_put(struct pool *p, void *obj){
+    // Give back an object from pool_get()
+    struct pool_free *f = obj;
+    f->next = p->free_head;
+    p->free_head = f;
+    p->used--;
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Wire format shared by the client and the server.
+
+    Version 1 (the original assignment framing):
+        client -> server: client_message, 1 byte version (1) + 4 byte data, 5 bytes.
+        server -> client: server_message, 1 byte version (1).
+        Acks carry nothing to tell them apart, so they can only be matched in send order.
+
+    Version 2:
+        client -> server: request_header (8 bytes) followed by 'length' bytes of payload.
+        server -> client: reply_header (8 bytes) followed by 'length' bytes of payload.
+        The request id is opaque to the server and echoed back untouched in the reply, so a
+        client can keep many requests outstanding on one socket and match replies in any
+        order (and tell exactly which udp datagrams were lost). 'status' says how the request
+        went. Multi-byte fields are in network order.
+
+    The server tells the two apart by the first byte and serves both on the same socket.
+
+    Reliable udp: a REQ_DATA or REQ_BATCH with REQ_RELIABLE or'd into its type uses 'id' as a
+    sequence number, counted per client socket from any starting point. The client keeps at
+    most PROTOCOL_RUDP_WINDOW sequence numbers between its oldest unacked frame and its next
+    one and retransmits a frame (same sequence number) until it is acked. The server remembers
+    which of the last PROTOCOL_RUDP_WINDOW sequence numbers each peer (address and port) has
+    sent, so a retransmit of a frame it already has is never processed twice: it is acked again
+    if the frame is done, or dropped while it is still being processed. The reply to every
+    reliable frame carries an rudp_ack whose bit i says whether id - 1 - i is done too, so one
+    reply also acks the frames just before it whose own replies were lost. Over tcp the flag is
+    ignored.
+
+    Ref to pragma: https://gcc.gnu.org/onlinedocs/gcc-4.4.4/gcc/Structure_002dPacking-Pragmas.html
+    This packing will help keep the message size as small as possible. This avoids any auto padding
+    the compiler may try to do.
+*/
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+
+// Version 2 request types
+#define REQ_DATA 1   // payload: one uint32_t, same meaning as client_message.data
+#define REQ_BATCH 2  // payload: uint32_t count, then count uint32_t values, acked with one reply
+#define REQ_QUERY 3  // payload: query_request, reply payload: query_result (the server's aggregates)
+#define REQ_GET 4     // payload: kv_request without 'value', reply payload: the uint32_t value
+#define REQ_PUT 5     // payload: kv_request, insert or overwrite
+#define REQ_DELETE 6  // payload: kv_request without 'value'
+#define REQ_RELIABLE 0x80  // or'd into REQ_DATA/REQ_BATCH over udp: 'id' is a sequence number, reply payload: rudp_ack
+
+// Sequence numbers a reliable udp sender may have between its oldest unacked frame and its next one
+#define PROTOCOL_RUDP_WINDOW 1024
+
+// query_request scopes
+#define QUERY_GLOBAL 0  // every value received since the server started
+#define QUERY_SENDER 1  // every value from one IPv4 address ('sender', 0 for the one asking)
+#define QUERY_WINDOW 2  // every value received in the last complete tumbling window (-W)
+
+// Version 2 reply statuses
+#define STATUS_OK 0
+#define STATUS_BAD_TYPE 1    // unknown request type
+#define STATUS_BAD_LENGTH 2  // payload length doesn't fit the request type
+#define STATUS_BAD_VERSION 3 // not a version the server speaks, sent as a version 2 reply with id 0
+#define STATUS_TOO_LARGE 4   // payload over PROTOCOL_MAX_PAYLOAD
+#define STATUS_NOT_FOUND 5   // REQ_GET/REQ_DELETE of a key that isn't stored
+#define STATUS_FULL 6        // REQ_PUT of a new key with the store at its -K capacity
+#define STATUS_BUSY 7        // not processed, over the server's limits: reply payload is the uint32_t ms to wait before retrying
+/* The last two (and STATUS_BAD_LENGTH for a udp datagram that isn't exactly one frame) mean the
+    server could not find where the frame ends: the reply is the last thing sent on that tcp
+    connection before it is closed. Version 1 frames get no such reply, they have no status.
+*/
+
+/* Largest version 2 request (header + payload) either side will send or accept: a full udp
+    datagram over IPv4. Replies are never larger than PROTOCOL_MAX_REPLY.
+*/
+#define PROTOCOL_MAX_FRAME 65507
+#define PROTOCOL_MAX_PAYLOAD (PROTOCOL_MAX_FRAME - sizeof(struct request_header))
+#define PROTOCOL_MAX_BATCH ((PROTOCOL_MAX_PAYLOAD - sizeof(uint32_t)) / sizeof(uint32_t))
+#define PROTOCOL_MAX_REPLY 2048
+
+#pragma pack(push, 1)
+struct client_message
+{
+    uint8_t version; // 1-byte version field
+    uint32_t data;  // 4-byte unsigned int of user data, this will be encoded and decoded with htonl and ntohl
+};
+
+struct server_message
+{
+    uint8_t version; // 1-byte version field
+};
+
+struct request_header
+{
+    uint8_t version;  // PROTOCOL_V2
+    uint8_t type;     // REQ_*
+    uint16_t length;  // payload bytes after this header
+    uint32_t id;      // chosen by the client, echoed in the reply
+};
+
+struct reply_header
+{
+    uint8_t version;  // PROTOCOL_V2
+    uint8_t status;   // STATUS_*
+    uint16_t length;  // payload bytes after this header
+    uint32_t id;      // the request's id
+};
+
+// A version 2 REQ_DATA request, the v2 counterpart of client_message
+struct data_request
+{
+    struct request_header header;
+    uint32_t data;
+};
+
+// A version 2 REQ_BATCH request, 'count' network order uint32_t values follow it
+struct batch_request
+{
+    struct request_header header;
+    uint32_t count;
+};
+
+/* A version 2 REQ_GET, REQ_PUT or REQ_DELETE request on the server's key/value store. GET and
+    DELETE carry only the key (payload length 4).
+*/
+struct kv_request
+{
+    struct request_header header;
+    uint32_t key;
+    uint32_t value;
+};
+
+// Reply payload to a REQ_RELIABLE frame
+struct rudp_ack
+{
+    uint64_t sack;  // bit i: sequence number id - 1 - i is done too
+};
+
+// A version 2 REQ_QUERY request
+struct query_request
+{
+    struct request_header header;
+    uint8_t scope;    // QUERY_*
+    uint8_t pad[3];
+    uint32_t sender;  // QUERY_SENDER: IPv4 address in network order, 0 for the one asking
+};
+
+/* Reply payload to a REQ_QUERY. Quantiles are within about 1.6% of the true value and
+    'distinct' within a few percent. min, max and the quantiles are 0 while count is 0.
+*/
+struct query_result
+{
+    uint64_t count;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+    uint64_t distinct;      // approximate number of different values
+    uint32_t quantiles[4];  // p50, p90, p99, p99.9
+    uint32_t window_start;  // QUERY_WINDOW: unix time the window started, else 0
+    uint32_t window_secs;   // QUERY_WINDOW: its length, else 0
+};
+#pragma pack(pop)
+
+static inline void swap_values(void *dst, const void *src, size_t count){
+    /* ntohl()/htonl() a run of 'count' uint32_t values from src into dst (either may be unaligned).
+
+    With SSE2 (always there on x86-64) four values are swapped at a time: swap the bytes in
+    each 16 bit lane, then swap the two lanes of each 32 bit value. Whatever is left over, or
+    every value on other targets, goes through ntohl().
+    */
+    const uint8_t *in = src;
+    uint8_t *out = dst;
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i < (count & ~(size_t)3); i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i * sizeof(uint32_t)));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)(out + i * sizeof(uint32_t)), v);
+    }
+#endif
+    for (; i < count; i++){
+        uint32_t v;
+        memcpy(&v, in + i * sizeof(uint32_t), sizeof(v));
+        v = ntohl(v);
+        memcpy(out + i * sizeof(uint32_t), &v, sizeof(v));
+    }
+}
+
+#endif
@@ -0,0 +1,507 @@
+/* Rebuilding the aggregates from the write-ahead log (see recover.h).
+
+Layout:
+    - A snapshot is a snapshot_header followed by agg_shard_encode() of the aggregates of every
+      record that ends at or before header.lsn. It is written to a .tmp file, synced and
+      renamed into place, so a crash leaves either the old snapshot or the new one.
+    - recover_init() runs after wal_init() and before anything is appended. It loads the
+      newest intact snapshot (older ones are the fallback) and hands the segments holding the
+      rest of the log to the replay threads. The result becomes the checkpoint's shard, and a
+      copy of it is published for the queries.
+    - The checkpoint thread is the only one that touches its shard. It only reads bytes that
+      wal_synced() has passed, so the segment being appended to is safe to map.
+
+Reference:
+    https://man7.org/linux/man-pages/man2/mmap.2.html
+    https://lwn.net/Articles/457667/ (rename() and fsync() for atomic replacement)
+*/
+#include "recover.h"
+#include "wal.h"
+#include "agg.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "AGGSNAP1"
+#define REPLAY_CHUNK 1024  // values decoded per agg_shard_values() call
+
+struct snapshot_header
+{
+    char magic[8];
+    uint64_t lsn;     // covers every record that ends at or before this
+    uint64_t length;  // bytes of encoded shard that follow
+    uint32_t crc;     // wal_crc() of them
+    uint32_t pad;
+};
+
+// Segments split between the replay threads
+struct replay
+{
+    int dirfd;
+    const struct wal_segment *segments;
+    int count;
+    int next;        // next segment to take (atomic)
+    uint64_t from;   // replay the records in [from, to)
+    uint64_t to;
+};
+
+struct replay_thread
+{
+    struct replay *job;
+    pthread_t thread;
+    struct agg_shard *shard;
+    uint64_t records;
+    uint64_t values;
+    int failed;
+};
+
+static struct
+{
+    int dirfd;
+    int interval;              // -X
+    struct agg_shard *shard;   // the checkpoint's own copy of the aggregates
+    uint64_t lsn;              // every record before this is in 'shard'
+    uint64_t saved;            // LSN of the last snapshot written
+    pthread_t thread;
+} ckpt = { .dirfd = -1 };
+
+static int replay_segment(int dirfd, const struct wal_segment *seg, uint64_t from, uint64_t to,
+                          struct agg_shard *shard, uint64_t *records, uint64_t *values){
+    /* Add the records of one segment that lie in [from, to) to a shard.
+
+    params:
+        dirfd (int): The log directory.
+        seg (wal_segment *): Segment to read.
+        from (uint64_t), to (uint64_t): LSN range, 'from' is the start of a record.
+        shard (agg_shard *): Shard the caller is the only writer of.
+        records (uint64_t *), values (uint64_t *): Incremented by what was replayed.
+
+    return:
+        0 on success (a damaged record only ends the segment early), -1 if it can't be mapped.
+    */
+    uint64_t end = seg->start + seg->size < to ? seg->start + seg->size : to;
+    uint32_t chunk[REPLAY_CHUNK];
+    char name[64];
+
+    if (from < seg->start){
+        from = seg->start;
+    }
+    if (from >= end){
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "wal-%016" PRIx64 ".log", seg->start);
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1){
+        return -1;
+    }
+    size_t len = end - seg->start;
+    uint8_t *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return -1;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    size_t off = from - seg->start;
+    while (len - off >= sizeof(struct wal_record)){
+        struct wal_record rec;
+        memcpy(&rec, map + off, sizeof(rec));
+        const uint8_t *p = map + off + sizeof(rec);
+        if (rec.count > (len - off - sizeof(rec)) / sizeof(uint32_t)){
+            break;
+        }
+        uint32_t crc = wal_crc(0, &rec.count, sizeof(rec) - sizeof(rec.crc));
+        if (wal_crc(crc, p, (size_t)rec.count * sizeof(uint32_t)) != rec.crc){
+            break;
+        }
+
+        for (uint32_t done = 0; done < rec.count; ){
+            uint32_t n = rec.count - done < REPLAY_CHUNK ? rec.count - done : REPLAY_CHUNK;
+            for (uint32_t i = 0; i < n; i++, p += sizeof(uint32_t)){
+                uint32_t value;
+                memcpy(&value, p, sizeof(value));
+                chunk[i] = ntohl(value);
+            }
+            agg_shard_values(shard, rec.time, rec.sender, chunk, n);
+            done += n;
+        }
+        off += sizeof(rec) + (size_t)rec.count * sizeof(uint32_t);
+        (*records)++;
+        *values += rec.count;
+    }
+    if (off < len){
+        log_msg(LOG_WARN, "Log segment %s has a damaged record at LSN %" PRIx64 ", skipping its last %zu bytes.\n",
+                name, seg->start + off, len - off);
+    }
+    munmap(map, len);
+    return 0;
+}
+
+static void *replay_main(void *arg){
+    // Replay thread entry point: take segments until there are none left
+    struct replay_thread *t = arg;
+    struct replay *job = t->job;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count){
+        if (replay_segment(job->dirfd, &job->segments[i], job->from, job->to, t->shard, &t->records, &t->values) == -1){
+            fprintf(stderr, "Can't map log segment %016" PRIx64 ": %s\n", job->segments[i].start, strerror(errno));
+            t->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+static int replay_parallel(const struct wal_segment *segments, int count, uint64_t from, uint64_t to,
+                           uint64_t *records, uint64_t *values){
+    /* Replay [from, to) into the checkpoint's shard, spreading the segments over the CPUs.
+
+    return:
+        Number of segments read, -1 on error.
+    */
+    struct replay job = { .dirfd = ckpt.dirfd, .from = from, .to = to };
+    struct replay_thread threads[RECOVER_MAX_THREADS];
+    int failed = 0;
+
+    // Only the segments that overlap the range, they're sorted
+    int first = 0;
+    while (first < count && segments[first].start + segments[first].size <= from){
+        first++;
+    }
+    job.segments = segments + first;
+    while (first + job.count < count && job.segments[job.count].start < to){
+        job.count++;
+    }
+    if (job.count == 0){
+        return 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < 1 ? 1 : cpus > RECOVER_MAX_THREADS ? RECOVER_MAX_THREADS : (int)cpus;
+    if (nthreads > job.count){
+        nthreads = job.count;
+    }
+
+    memset(threads, 0, sizeof(threads));
+    int started = 0;
+    for (int i = 0; i < nthreads; i++){
+        threads[i].job = &job;
+        if ((threads[i].shard = agg_shard_new()) == NULL){
+            fprintf(stderr, "Out of memory for replaying the log.\n");
+            break;
+        }
+        if (pthread_create(&threads[i].thread, NULL, replay_main, &threads[i]) != 0){
+            fprintf(stderr, "Failed to start log replay thread %d.\n", i);
+            agg_shard_free(threads[i].shard);
+            break;
+        }
+        started++;
+    }
+    if (started < nthreads){
+        // The threads already running use job and threads[], which live on this stack
+        for (int i = 0; i < started; i++){
+            pthread_join(threads[i].thread, NULL);
+            agg_shard_free(threads[i].shard);
+        }
+        return -1;
+    }
+    for (int i = 0; i < nthreads; i++){
+        pthread_join(threads[i].thread, NULL);
+        agg_shard_merge(ckpt.shard, threads[i].shard);
+        agg_shard_free(threads[i].shard);
+        *records += threads[i].records;
+        *values += threads[i].values;
+        failed |= threads[i].failed;
+    }
+    return failed ? -1 : job.count;
+}
+
+static int list_snapshots(uint64_t **lsns){
+    /* LSNs of every snapshot in the log directory, newest first.
+
+    return:
+        How many there are, -1 on error.
+    */
+    DIR *d = wal_opendir(ckpt.dirfd);
+    struct dirent *entry;
+    int count = 0;
+    int cap = 0;
+
+    *lsns = NULL;
+    if (d == NULL){
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL){
+        uint64_t lsn;
+        char tail;
+        if (sscanf(entry->d_name, "snap-%16" SCNx64 ".ag%c", &lsn, &tail) != 2 || tail != 'g' || strlen(entry->d_name) != 25){
+            continue;
+        }
+        if (count == cap){
+            cap = cap ? cap * 2 : 8;
+            uint64_t *grown = realloc(*lsns, cap * sizeof(uint64_t));
+            if (grown == NULL){
+                closedir(d);
+                return -1;
+            }
+            *lsns = grown;
+        }
+        // Insertion sort, there are only ever a couple
+        int i = count++;
+        for (; i > 0 && (*lsns)[i - 1] < lsn; i--){
+            (*lsns)[i] = (*lsns)[i - 1];
+        }
+        (*lsns)[i] = lsn;
+    }
+    closedir(d);
+    return count;
+}
+
+static int load_snapshot(uint64_t lsn, struct agg_shard *shard){
+    /* Decode one snapshot into an empty shard.
+
+    return:
+        0 on success, -1 if it can't be read or is damaged.
+    */
+    struct snapshot_header head;
+    struct stat st;
+    char name[64];
+    int ok = 0;
+
+    snprintf(name, sizeof(name), "snap-%016" PRIx64 ".agg", lsn);
+    int fd = openat(ckpt.dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1){
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(head)){
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return -1;
+    }
+    memcpy(&head, map, sizeof(head));
+    if (memcmp(head.magic, SNAPSHOT_MAGIC, sizeof(head.magic)) == 0 && head.lsn == lsn &&
+        head.length == st.st_size - sizeof(head) && wal_crc(0, map + sizeof(head), head.length) == head.crc){
+        ok = agg_shard_decode(shard, map + sizeof(head), head.length) == 0;
+    }
+    munmap(map, st.st_size);
+    return ok ? 0 : -1;
+}
+
+static int write_full(int fd, const void *buf, size_t len){
+    const uint8_t *p = buf;
+    while (len > 0){
+        ssize_t n = write(fd, p, len);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int save_snapshot(void){
+    /* Write the checkpoint's shard out as the snapshot at ckpt.lsn and remove the older ones.
+
+    return:
+        0 on success, -1 on error (the previous snapshot is left as it was).
+    */
+    struct snapshot_header head = { .lsn = ckpt.lsn };
+    char tmp[64], name[64];
+    size_t len;
+    uint64_t *lsns;
+
+    uint8_t *body = agg_shard_encode(ckpt.shard, &len);
+    if (body == NULL){
+        return -1;
+    }
+    memcpy(head.magic, SNAPSHOT_MAGIC, sizeof(head.magic));
+    head.length = len;
+    head.crc = wal_crc(0, body, len);
+
+    snprintf(name, sizeof(name), "snap-%016" PRIx64 ".agg", ckpt.lsn);
+    snprintf(tmp, sizeof(tmp), "snap-%016" PRIx64 ".agg.tmp", ckpt.lsn);
+    int fd = openat(ckpt.dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1){
+        free(body);
+        return -1;
+    }
+    int failed = write_full(fd, &head, sizeof(head)) == -1 || write_full(fd, body, len) == -1 || fdatasync(fd) == -1;
+    close(fd);
+    free(body);
+    if (failed || renameat(ckpt.dirfd, tmp, ckpt.dirfd, name) == -1 || fsync(ckpt.dirfd) == -1){
+        unlinkat(ckpt.dirfd, tmp, 0);
+        return -1;
+    }
+
+    // The new one is durable, the older ones are only in the way now
+    int count = list_snapshots(&lsns);
+    for (int i = 0; i < count; i++){
+        if (lsns[i] < ckpt.lsn){
+            snprintf(name, sizeof(name), "snap-%016" PRIx64 ".agg", lsns[i]);
+            unlinkat(ckpt.dirfd, name, 0);
+        }
+    }
+    free(lsns);
+    return 0;
+}
+
+static void catch_up(void){
+    // Replay everything synced since the checkpoint last looked into its shard
+    uint64_t synced = wal_synced();
+    uint64_t records = 0;
+    uint64_t values = 0;
+    struct wal_segment *segments;
+
+    if (synced == ckpt.lsn){
+        return;
+    }
+    int count = wal_list(ckpt.dirfd, &segments);
+    if (count == -1){
+        log_msg(LOG_WARN, "Can't list the log segments for a snapshot: %s\n", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < count; i++){
+        if (replay_segment(ckpt.dirfd, &segments[i], ckpt.lsn, synced, ckpt.shard, &records, &values) == -1){
+            // Everything before this segment is in, take it from here next time
+            log_msg(LOG_WARN, "Can't map log segment %016" PRIx64 " for a snapshot: %s\n", segments[i].start, strerror(errno));
+            if (segments[i].start > ckpt.lsn){
+                ckpt.lsn = segments[i].start;
+            }
+            free(segments);
+            return;
+        }
+    }
+    free(segments);
+    ckpt.lsn = synced;
+}
+
+static void *checkpoint_main(void *arg){
+    // Thread entry point: keep up with the log and write a snapshot every -X seconds, never returns
+    (void)arg;
+
+    while (1){
+        if (ckpt.lsn > ckpt.saved){
+            if (save_snapshot() == 0){
+                ckpt.saved = ckpt.lsn;
+                log_msg(LOG_DEBUG, "Wrote the snapshot of the aggregates at LSN %" PRIx64 ".\n", ckpt.lsn);
+            }
+            else{
+                log_msg(LOG_WARN, "Failed to write a snapshot of the aggregates: %s\n", strerror(errno));
+            }
+        }
+        sleep(ckpt.interval);
+        catch_up();
+    }
+    return NULL;
+}
+
+int recover_init(const char *dir, int snapshot_secs){
+    /* Rebuild the aggregates from the snapshot and the log in 'dir', publish them for the
+    queries and start the checkpoint thread. Must be called after wal_init() and before the
+    pipeline is created.
+
+    params:
+        dir (char *): -D directory.
+        snapshot_secs (int): -X, seconds between snapshots, 0 for none.
+
+    return:
+        0 on success, -1 on error.
+    */
+    struct timespec t0, t1;
+    struct wal_segment *segments;
+    uint64_t *lsns;
+    uint64_t end = wal_synced();
+    uint64_t records = 0;
+    uint64_t values = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ckpt.interval = snapshot_secs;
+    ckpt.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ckpt.dirfd == -1){
+        fprintf(stderr, "Can't open the log directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    // Newest snapshot first, falling back to an older one (or none) if it doesn't check out
+    int nsnaps = list_snapshots(&lsns);
+    if (nsnaps == -1){
+        fprintf(stderr, "Can't list the snapshots in %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i <= nsnaps; i++){
+        if ((ckpt.shard = agg_shard_new()) == NULL){
+            fprintf(stderr, "Out of memory for the aggregates.\n");
+            return -1;
+        }
+        if (i == nsnaps){
+            ckpt.lsn = 0;
+            break;
+        }
+        if (lsns[i] <= end && load_snapshot(lsns[i], ckpt.shard) == 0){
+            ckpt.lsn = lsns[i];
+            break;
+        }
+        fprintf(stderr, "Snapshot snap-%016" PRIx64 ".agg is damaged or ahead of the log, ignoring it.\n", lsns[i]);
+        agg_shard_free(ckpt.shard);
+    }
+    free(lsns);
+    ckpt.saved = ckpt.lsn;
+
+    int count = wal_list(ckpt.dirfd, &segments);
+    if (count == -1){
+        fprintf(stderr, "Can't list the log segments in %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    int replayed = replay_parallel(segments, count, ckpt.lsn, end, &records, &values);
+    free(segments);
+    if (replayed == -1){
+        return -1;
+    }
+    uint64_t snapshot_lsn = ckpt.lsn;
+    ckpt.lsn = end;
+
+    // Without snapshots nothing else needs the shard, otherwise the checkpoint keeps adding to it
+    if (snapshot_secs == 0){
+        agg_shard_publish(ckpt.shard);
+        ckpt.shard = NULL;
+    }
+    else{
+        struct agg_shard *copy = agg_shard_new();
+        if (copy == NULL){
+            fprintf(stderr, "Out of memory for the aggregates.\n");
+            return -1;
+        }
+        agg_shard_merge(copy, ckpt.shard);
+        agg_shard_publish(copy);
+        if (pthread_create(&ckpt.thread, NULL, checkpoint_main, NULL) != 0){
+            fprintf(stderr, "Failed to start the checkpoint thread.\n");
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("Recovered %" PRIu64 " values (%" PRIu64 " records in %d segments after the snapshot at LSN %" PRIx64 ") in %.1f ms.\n",
+           values, records, replayed, snapshot_lsn, (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef RECOVER_H
+#define RECOVER_H
+
+#include <stdint.h>
+
+/* Rebuilding the aggregates from the write-ahead log when the server starts with -D, see
+    recover.c.
+
+    A restart loads the newest snapshot of the aggregates in the log directory and replays only
+    the records logged after it. Segments are mmap()ed instead of read() into the heap, and are
+    scanned in parallel (one thread per CPU, at most RECOVER_MAX_THREADS), each thread into a
+    shard of its own that is merged in at the end. Every record is checked against its crc, a
+    damaged one ends its segment (that's where a crash tore the last batch).
+
+    A checkpoint thread keeps its own copy of the aggregates by replaying whatever was synced
+    since it last looked, and every -X seconds (RECOVER_DEFAULT_SNAPSHOT_SECS by default, 0 for
+    never) writes it out as snap-<lsn>.agg in place of the previous one. So a restart costs the
+    snapshot plus at most -X seconds of log, however long the log is.
+*/
+#define RECOVER_DEFAULT_SNAPSHOT_SECS 60
+#define RECOVER_MAX_SNAPSHOT_SECS 86400
+#define RECOVER_MAX_THREADS 16
+
+int recover_init(const char *dir, int snapshot_secs);
+
+#endif
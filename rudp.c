@@ -0,0 +1,318 @@
+/* Reliable udp: per-peer duplicate detection and acks (see rudp.h).
+
+A slot's bits are indexed by sequence number modulo the window, so moving the window on is
+just clearing the bits of the numbers it leaves behind. Sequence numbers are compared by their
+32 bit difference from the end of the window, so they may wrap.
+
+Times are whole seconds of CLOCK_MONOTONIC_COARSE, only used to pick a slot to reuse.
+*/
+#include "rudp.h"
+#include "server.h"
+
+#include <sched.h>
+#include <time.h>
+
+#define RUDP_WORDS (PROTOCOL_RUDP_WINDOW / 64)
+
+struct rudp_slot
+{
+    uint64_t key;    // address << 16 | port, 0 for an empty slot
+    int lock;
+    uint32_t last;   // second the peer last sent a reliable frame, 0 for a new slot
+    uint32_t high;   // highest sequence number seen, the window ends there
+    uint64_t seen[RUDP_WORDS];
+    uint64_t done[RUDP_WORDS];
+} __attribute__((aligned(64)));
+
+static struct rudp_slot slots[RUDP_PEERS];
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;  // held while a slot changes peer
+
+static uint32_t now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+static void slot_lock(struct rudp_slot *s){
+    // Held for a few loads and stores, only contended if one peer's datagrams reach two workers
+    while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE)){
+        sched_yield();
+    }
+}
+
+static void slot_unlock(struct rudp_slot *s){
+    __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t peer_key(const struct sockaddr *peer){
+    // The slot key for an IPv4 peer, 0 for anything else
+    const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+    if (peer == NULL || peer->sa_family != AF_INET){
+        return 0;
+    }
+    return (uint64_t)ntohl(in->sin_addr.s_addr) << 16 | ntohs(in->sin_port);
+}
+
+static struct rudp_slot *find_slot(uint64_t key, int claim){
+    /* Find the peer's slot and return it locked. With 'claim' a peer without one gets an empty
+    slot, or the stalest of the probed ones.
+
+    Only claims change a slot's key, and they take turns on claim_lock, so two threads never
+    take the same slot or give one peer two of them. Lookups that find the peer don't take it.
+
+    return:
+        The locked slot, NULL if the peer has none (and claim is 0).
+    */
+    uint32_t h = (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+
+    for (int probe = 0; probe < RUDP_PROBES; probe++){
+        struct rudp_slot *s = &slots[(h + probe) & (RUDP_PEERS - 1)];
+        slot_lock(s);
+        if (s->key == key){
+            return s;
+        }
+        int empty = s->key == 0;
+        slot_unlock(s);
+        if (empty){
+            break;
+        }
+    }
+    if (!claim){
+        return NULL;
+    }
+
+    pthread_mutex_lock(&claim_lock);
+    while (1){
+        struct rudp_slot *stalest = NULL;
+        uint32_t stalest_last = 0;
+
+        // Probe again, another claim may have given the peer a slot since
+        for (int probe = 0; probe < RUDP_PROBES; probe++){
+            struct rudp_slot *s = &slots[(h + probe) & (RUDP_PEERS - 1)];
+            slot_lock(s);
+            if (s->key == key || s->key == 0){
+                if (s->key == 0){
+                    s->key = key;
+                    s->last = 0;
+                }
+                pthread_mutex_unlock(&claim_lock);
+                return s;
+            }
+            if (stalest == NULL || s->last < stalest_last){
+                stalest = s;
+                stalest_last = s->last;
+            }
+            slot_unlock(s);
+        }
+
+        // Its peer may have sent since it was probed, then it is no longer the one to reuse
+        slot_lock(stalest);
+        if (stalest->last == stalest_last){
+            stalest->key = key;
+            stalest->last = 0;
+            pthread_mutex_unlock(&claim_lock);
+            return stalest;
+        }
+        slot_unlock(stalest);
+    }
+}
+
+static int test_bit(const uint64_t *bits, uint32_t seq){
+    uint32_t i = seq % PROTOCOL_RUDP_WINDOW;
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void set_bit(uint64_t *bits, uint32_t seq){
+    uint32_t i = seq % PROTOCOL_RUDP_WINDOW;
+    bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static void clear_bit(uint64_t *bits, uint32_t seq){
+    uint32_t i = seq % PROTOCOL_RUDP_WINDOW;
+    bits[i / 64] &= ~(1ULL << (i % 64));
+}
+
+static void slide(struct rudp_slot *s, uint32_t seq){
+    /* End the window at seq (ahead of it): the numbers it takes in reuse the bits of the ones it
+    leaves behind. A new slot (or one that moves a whole window) starts out empty. */
+    if (s->last == 0 || seq - s->high >= PROTOCOL_RUDP_WINDOW){
+        memset(s->seen, 0, sizeof(s->seen));
+        memset(s->done, 0, sizeof(s->done));
+    }
+    else{
+        for (uint32_t n = s->high + 1; n != seq + 1; n++){
+            clear_bit(s->seen, n);
+            clear_bit(s->done, n);
+        }
+    }
+    s->high = seq;
+}
+
+static int in_window(struct rudp_slot *s, uint32_t seq){
+    return s->high - seq < PROTOCOL_RUDP_WINDOW;
+}
+
+static void fill_ack(struct rudp_slot *s, uint32_t seq, struct rudp_ack *ack){
+    // Which of the 64 sequence numbers before seq are done, network order
+    uint64_t sack = 0;
+    for (uint32_t i = 0; i < 64; i++){
+        uint32_t n = seq - 1 - i;
+        if (in_window(s, n) && test_bit(s->done, n)){
+            sack |= 1ULL << i;
+        }
+    }
+    ack->sack = htobe64(sack);
+}
+
+int rudp_receive(const struct sockaddr *peer, uint32_t seq, int deferred, struct rudp_ack *ack){
+    /* Record a reliable frame from 'peer' and say what to do with it.
+
+    params:
+        peer (sockaddr *): Who sent it (anything but IPv4 is never deduplicated).
+        seq (uint32_t): Its sequence number (host order).
+        deferred (int): 1 if it is done only once rudp_done() is called for it, 0 if it is done now.
+        ack (rudp_ack *): Set to the peer's ack state, to send back in the reply.
+
+    return:
+        RUDP_NEW, RUDP_DUPLICATE or RUDP_PENDING.
+    */
+    uint64_t key = peer_key(peer);
+    int verdict = RUDP_NEW;
+
+    if (key == 0){
+        ack->sack = 0;
+        return RUDP_NEW;
+    }
+
+    struct rudp_slot *s = find_slot(key, 1);
+    int32_t ahead = (int32_t)(seq - s->high);
+    if (s->last == 0 || ahead > 0 || ahead <= -2 * PROTOCOL_RUDP_WINDOW){
+        // New peer, further along, or a new client on an old port
+        slide(s, seq);
+    }
+    s->last = now_seconds() + 1;
+
+    if (!in_window(s, seq) || test_bit(s->done, seq)){
+        verdict = RUDP_DUPLICATE;
+    }
+    else if (test_bit(s->seen, seq)){
+        verdict = RUDP_PENDING;
+    }
+    else{
+        set_bit(s->seen, seq);
+        if (!deferred){
+            set_bit(s->done, seq);
+        }
+    }
+    fill_ack(s, seq, ack);
+    slot_unlock(s);
+
+    if (verdict != RUDP_NEW){
+        stats_count(STAT_DUPLICATES, 1);
+    }
+    return verdict;
+}
+
+void rudp_done(const struct sockaddr *peer, uint32_t seq){
+    /* A deferred reliable frame has been handled and its reply is going out: retransmits of it
+    are acked from now on instead of dropped.
+
+    params:
+        peer (sockaddr *): Who sent it.
+        seq (uint32_t): Its sequence number (host order).
+    */
+    uint64_t key = peer_key(peer);
+    struct rudp_slot *s;
+
+    if (key == 0 || (s = find_slot(key, 0)) == NULL){
+        return;
+    }
+    if (in_window(s, seq) && test_bit(s->seen, seq)){
+        set_bit(s->done, seq);
+    }
+    slot_unlock(s);
+}
+
+void rudp_forget(const struct sockaddr *peer, uint32_t seq){
+    /* A reliable frame was refused without being processed (STATUS_BUSY): its retransmit is a
+    new frame, not a duplicate.
+
+    params:
+        peer (sockaddr *): Who sent it.
+        seq (uint32_t): Its sequence number (host order).
+    */
+    uint64_t key = peer_key(peer);
+    struct rudp_slot *s;
+
+    if (key == 0 || (s = find_slot(key, 0)) == NULL){
+        return;
+    }
+    if (in_window(s, seq)){
+        clear_bit(s->seen, seq);
+        clear_bit(s->done, seq);
+    }
+    slot_unlock(s);
+}
+
+int rudp_reply(uint8_t *reply, int reply_len, const struct rudp_ack *ack){
+    /* Append the ack state to the reply of a reliable frame (status replies included).
+
+    return:
+        The reply's new length.
+    */
+    struct reply_header *rep = (struct reply_header *)reply;
+    if (reply_len != sizeof(*rep)){
+        return reply_len;
+    }
+    memcpy(rep + 1, ack, sizeof(*ack));
+    rep->length = htons(sizeof(*ack));
+    return sizeof(*rep) + sizeof(*ack);
+}
+
+int rudp_duplicate(const uint8_t *frame, uint8_t *reply, const struct rudp_ack *ack){
+    /* Write the reply to a retransmit of a frame that is already done.
+
+    return:
+        Length of the reply in bytes.
+    */
+    struct reply_header *rep = (struct reply_header *)reply;
+    rep->version = PROTOCOL_V2;
+    rep->status = STATUS_OK;
+    rep->length = 0;
+    rep->id = ((const struct request_header *)frame)->id;
+    return rudp_reply(reply, sizeof(*rep), ack);
+}
+
+int rudp_process(const uint8_t *frame, size_t len, const struct sockaddr *peer, uint8_t *reply){
+    /* process_frame() for a datagram handled inline: a reliable frame is only processed the
+    first time it arrives, and its reply carries the ack state.
+
+    params:
+        frame (uint8_t *): The datagram, exactly one frame.
+        len (size_t): Its length.
+        peer (sockaddr *): Who sent it.
+        reply (uint8_t *): Where to write the reply, at least MAX_REPLY_SIZE bytes.
+
+    return:
+        Length of the reply in bytes, 0 if there is none to send.
+        -1 if the frame is invalid and the sender should be dropped.
+    */
+    struct rudp_ack ack;
+    int reply_len;
+
+    if (!rudp_reliable(frame, len)){
+        return process_frame(frame, len, agg_sender_of(peer), reply);
+    }
+    switch (rudp_receive(peer, ntohl(((const struct request_header *)frame)->id), 0, &ack)){
+        case RUDP_DUPLICATE:
+            return rudp_duplicate(frame, reply, &ack);
+        case RUDP_PENDING:
+            return 0;
+    }
+    reply_len = process_frame(frame, len, agg_sender_of(peer), reply);
+    if (reply_len > 0 && ((struct reply_header *)reply)->status == STATUS_BUSY){
+        rudp_forget(peer, ntohl(((const struct request_header *)frame)->id));
+        return reply_len;
+    }
+    return reply_len > 0 ? rudp_reply(reply, reply_len, &ack) : reply_len;
+}
@@ -0,0 +1,50 @@
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+/* Server side of reliable udp (REQ_RELIABLE frames, see protocol.h), see rudp.c.
+
+    Every peer (IPv4 address and port) that sends reliable frames gets a slot with a window of
+    the PROTOCOL_RUDP_WINDOW sequence numbers up to the highest one it has sent, and two bits
+    for each: seen (received) and done (acked). The udp loops call rudp_receive() before
+    handling a reliable frame, which says whether it is new, a duplicate to ack again, or a
+    duplicate of one still in flight to drop. A frame that is processed inline is done as soon
+    as it is seen; with -P and ACK_PROCESSED it is done once its reply comes back from the
+    processor (rudp_done()), which under -D means once it is on disk. One refused with
+    STATUS_BUSY (admit.h) is forgotten again (rudp_forget()), so its retransmit is processed.
+
+    A client never has more than a window in flight, so nothing it still retransmits can be
+    behind the window: a frame up to a window further back is an old duplicate and is acked.
+    Anything further back than that must come from a new client that got the same port (its
+    slot starts over there), and a new client ahead of the window just moves it on.
+
+    RUDP_PEERS is how many peers are tracked at once (a power of two). When the probed slots
+    are full the one that was quiet the longest is reused. Slots are shared by the workers and
+    each has its own lock, but SO_REUSEPORT sends a peer's datagrams to the same worker anyway.
+*/
+#define RUDP_PEERS 4096
+#define RUDP_PROBES 8
+
+// What rudp_receive() makes of a reliable frame
+#define RUDP_NEW 0        // process it
+#define RUDP_DUPLICATE 1  // already done, ack it again without processing it
+#define RUDP_PENDING 2    // already seen and not done yet, drop it (the client will retransmit)
+
+int rudp_receive(const struct sockaddr *peer, uint32_t seq, int deferred, struct rudp_ack *ack);
+void rudp_done(const struct sockaddr *peer, uint32_t seq);
+void rudp_forget(const struct sockaddr *peer, uint32_t seq);
+int rudp_reply(uint8_t *reply, int reply_len, const struct rudp_ack *ack);
+int rudp_duplicate(const uint8_t *frame, uint8_t *reply, const struct rudp_ack *ack);
+int rudp_process(const uint8_t *frame, size_t len, const struct sockaddr *peer, uint8_t *reply);
+
+static inline int rudp_reliable(const uint8_t *frame, size_t len){
+    // 1 if the frame is a version 2 REQ_RELIABLE one
+    return len >= sizeof(struct request_header) && frame[0] == PROTOCOL_V2
+            && (((const struct request_header *)frame)->type & REQ_RELIABLE);
+}
+
+#endif
@@ -5,7 +5,10 @@ This is the server portion of the Client/Server CSPB 3753 assignment.
 
 How-to: 
     After running make. You can receive messages with the server executable
-    ./server -t <socktype> -p <number>
+    ./server -t <socktype> -p <number> [-w <workers>] [-b <udp batch>] [-u]
+             [-P <processors> [-a processed|receipt]] [-L <level>] [-s <n>] [-A <seconds>]
+             [-m <stats port>] [-e <bad frames>] [-C <connections>] [-W <seconds>]
+             [-K <keys>] [-D <wal dir> [-G <usec>] [-S <segment MB>] [-X <seconds>]] [-l <limits>]
 
 What this does:
     This will start a server on the socktype and port specified. The server
@@ -15,6 +18,67 @@ What this does:
     received. The server will then return to a listening state waiting for
     the next message. 
 
+    With -w the server starts that many worker threads. Each one binds its own socket
+    to the same port with SO_REUSEPORT and runs its own loop, so the kernel spreads
+    clients across them and the workers share nothing on the hot path.
+
+    UDP workers pull up to -b datagrams per recvmmsg() and send all of their acks back
+    with one sendmmsg(), see udp_loop.c.
+
+    With -P the workers only do the network side: they check each frame, build its reply and
+    hand its values to a pool of processing threads over lock-free rings (see pipeline.c), so
+    displaying values never holds up draining the sockets. -a picks when the ack goes out: once
+    the values were displayed (processed, the default) or as soon as they were queued (receipt).
+
+    Nothing the loops print goes through stdio: lines are copied into per-thread buffers and
+    a background thread writes them out in big blocks (see log.c). -L sets how much is logged
+    (error, warn, info or debug; the received values are info), -s logs only one received
+    value in n (0 for none) and -A prints a summary of the received values every so many
+    seconds instead.
+
+    Every worker keeps its own counters (frames, bytes, rejects by reason, errors, syscalls) and
+    a receive-to-ack latency histogram, see stats.c. -m serves them all on 127.0.0.1:<port> in
+    the Prometheus text format, and SIGUSR1 writes the same report to stderr.
+
+    A bad frame only ever costs the peer that sent it: it is answered with an error status (see
+    reject_frame()) and its connection is closed, or just the datagram dropped. After -e bad
+    frames (default 10, 0 for no limit) the peer is blocked for a minute, see blocklist.c.
+
+    Each TCP worker takes its connections (and the big buffers a few of them borrow for large
+    frames) from pools sized by -C when it starts (see pool.h), so accepting, serving and closing
+    clients never touches the heap. A client beyond the -C limit is closed right after accept.
+
+    Every value is also added to running aggregates (count, sum, min/max, quantiles and an
+    approximate distinct count) globally, per sender and per -W second tumbling window. Each
+    thread that handles values keeps its own and a REQ_QUERY frame merges them, see agg.c.
+
+    REQ_GET, REQ_PUT and REQ_DELETE frames work on an in-memory uint32_t key/value store of up
+    to -K keys, answered by the worker that read them. Lookups take no lock, see kv.c.
+
+    -D makes every acked value durable: processing threads append the values of each frame to a
+    write-ahead log in that directory, and a frame is only acked once the fdatasync() covering it
+    is done. Frames from every client that arrive within -G microseconds (default 500) share one
+    sync. The log goes into -S MB segments (default 64), see wal.c. -D runs the workers as with
+    -P (one processing thread unless -P says otherwise) and always acks once processed.
+
+    A restart with -D rebuilds the aggregates from the newest snapshot in the log directory and
+    the log after it, scanning the segments through mmap() on every CPU. A snapshot is written
+    every -X seconds (default 60, 0 for none), see recover.c.
+
+    -l reads admission limits from a file: a token bucket of values per second for every client
+    address and a cap on the frames queued for the processing threads. Data frames over either
+    are answered STATUS_BUSY with how long to wait, instead of being processed, so a noisy
+    client can't hold up the others. SIGHUP rereads the file, see admit.c.
+
+    -u runs the whole receive/ack path of every worker on io_uring instead (see uring_loop.c).
+    When the kernel can't do that the server says so and uses the loops above.
+
+    Every loop accepts both wire versions on the same socket (see protocol.h): the original
+    5 byte version 1 frames, and version 2 frames with a request id that is echoed back in a
+    reply_header along with a status. frame_length() and process_frame() below are the only
+    places that know the framing. Each version 2 request type has its own handler, listed in
+    handlers.h and dispatched by one switch in check_frame().
+
 What wasn't completed:
     n/a - I believe everything required for the sever portion was completed.
 
@@ -25,10 +89,18 @@ Reference:
 
 */
 #include "server.h"
+#include "event_loop.h"
+#include "udp_loop.h"
+#include "uring_loop.h"
+#include "pipeline.h"
 
+#include <signal.h>
+
+// The benchmarks (bench.c) link everything below but bring their own main()
+#ifndef SERVER_NO_MAIN
 int main(int argc, char *argv[]){
     // Check that the correct number of arguments were given 
-    if (argc != 5){
+    if (argc < 5){
         // Set error to invalid arg
         errno = 22;
         fprintf(stderr,"Incorrect number of arguments.\n");
@@ -36,61 +108,152 @@ int main(int argc, char *argv[]){
     }
 
     // Filter each command line arg and make sure they are correct
-    char *socktype;
-    char *port;
+    struct server_options opts;
 
     // Make sure the command line is correct and populate the needed data
-    command_line_check(argc, argv, &port, &socktype);
+    command_line_check(argc, argv, &opts);
+
+    // Check the kernel can run the io_uring loop before any worker relies on it
+    if (opts.use_uring && !uring_supported()){
+        fprintf(stderr, "io_uring is not supported by this kernel, falling back to %s.\n",
+                opts.sock_type == SOCK_STREAM ? "epoll" : "recvmmsg");
+        opts.use_uring = 0;
+    }
+
+    // SIGUSR1, SIGUSR2 and SIGHUP are only taken by the stats thread (through a signalfd), block them before any thread starts
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    // make profile builds: time the cycle counter before anything records a span
+    TRACE_INIT();
+
+    blocklist_init(opts.bad_limit);
+    if (admit_init(opts.limits) == -1){
+        return -1;
+    }
+    agg_init(opts.window_secs);
+    if (kv_init(opts.kv_keys) == -1){
+        return -1;
+    }
+
+    // The log's syncer has to run before any processor appends to it, and what it already holds
+    // has to be counted again before anything new is
+    if (opts.wal_dir != NULL){
+        if (wal_init(opts.wal_dir, opts.group_usec, opts.segment_mb) == -1 ||
+            recover_init(opts.wal_dir, opts.snapshot_secs) == -1){
+            return -1;
+        }
+    }
+
+    // Processing threads are shared by every worker, start them first
+    struct pipeline *pipeline = NULL;
+    if (opts.processors > 0){
+        pipeline = pipeline_create(opts.workers, opts.processors, opts.ack_policy);
+        if (pipeline == NULL){
+            return -1;
+        }
+    }
 
     /* Start server and listen */
-    // A storage structure to hold our IPv4 strucutres
-    struct sockaddr_storage their_addr;
-    socklen_t addr_size;
+    // Cache line aligned so no two workers' stats share a line
+    struct worker *workers = aligned_alloc(64, opts.workers * sizeof(*workers));
+    if (workers == NULL){
+        fprintf(stderr, "Out of memory for workers.\n");
+        return -1;
+    }
+    memset(workers, 0, opts.workers * sizeof(*workers));
+
+    // Bind every worker's socket up front so a bad port fails before anything starts
+    for (int i = 0; i < opts.workers; i++){
+        workers[i].id = i;
+        workers[i].opts = &opts;
+        workers[i].pipeline = pipeline;
+        if (stats_init(&workers[i].stats) == -1){
+            fprintf(stderr, "Out of memory for worker stats.\n");
+            return -1;
+        }
+        workers[i].sockfd = open_server_socket(&opts);
+        if (workers[i].sockfd == -1){
+            return -1;
+        }
+    }
 
-    // Prep socket address structures for holding needed socket flags/information   
-    struct addrinfo start_socket_addr, *res, *p;
+    // Scrapes (-m), SIGUSR1 dumps and SIGUSR2 trace dumps
+    if (stats_start(opts.stats_port, workers, opts.workers, pipeline) == -1){
+        return -1;
+    }
 
-    // Prep variables to hold socket information, bytes returned, and status checking
-    int sockfd, new_fd;
-    int numbytes;
-    int status;
+    if (opts.workers > 1){
+        printf("Starting %s server on port: %s with %d workers...\n", opts.socktype, opts.port, opts.workers);
+    }
+    else{
+        printf("Starting %s server on port: %s...\n", opts.socktype, opts.port);
+    }
+    if (pipeline != NULL){
+        printf("Handing values to %d processing threads, acking on %s.\n", opts.processors,
+               opts.ack_policy == ACK_RECEIPT ? "receipt" : "processing");
+    }
 
-    /* 
-        Custom structures packed to hold a 1 byte version number in both, and a 4 byte 
-        data message in the client_message strucutre.
-        See packing details in server.h and reference to packing logic.
+    // Everything from here on logs through the flusher
+    if (log_init(opts.log_level, opts.log_sample, opts.log_summary) == -1){
+        return -1;
+    }
+
+    for (int i = 0; i < opts.workers; i++){
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0){
+            fprintf(stderr, "Failed to start worker %d.\n", i);
+            return -1;
+        }
+    }
+
+    // Workers only come back on a fatal error
+    for (int i = 0; i < opts.workers; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    log_shutdown();
+
+    return -1;
+}
+#endif
+
+int open_server_socket(struct server_options *opts){
+    /* Create a socket of the requested type and bind it to the server port. SO_REUSEPORT lets
+    every worker bind its own socket to the same port and the kernel balances between them.
+
+    params:
+        opts (server_options *): Parsed command line (port and socket type).
+
+    return:
+        The bound socket, or -1 on error.
     */
-    struct client_message client_response_struct;
-    struct server_message server_send_struct;
-    uint32_t data;
+    // Prep socket address structures for holding needed socket flags/information   
+    struct addrinfo start_socket_addr, *res, *p;
+    int sockfd;
+    int status;
+    int one = 1;
 
     // Fill socket addr with 0s
     memset(&start_socket_addr, 0, sizeof(start_socket_addr));
 
-    // Set to IPv4
+    // Set to IPv4 and udp or tcp
     start_socket_addr.ai_family = AF_INET;  
-
-    // Set socktype depending on udp or tcp
-    if (strcmp(socktype, "udp") == 0){
-        start_socket_addr.ai_socktype = SOCK_DGRAM;
-    }
-    else if (strcmp(socktype, "tcp") == 0){
-        start_socket_addr.ai_socktype = SOCK_STREAM;
-    }
+    start_socket_addr.ai_socktype = opts->sock_type;
 
     // Set to auto IP (current IP on machine)
     start_socket_addr.ai_flags = AI_PASSIVE;    
 
-
     // Setup struct - this includes the DNS and service name lookups
     // Also gives pointer to linked-list of results (pointer will be res parameter).
-    if ((status = getaddrinfo(NULL, port, &start_socket_addr, &res)) != 0) {
+    if ((status = getaddrinfo(NULL, opts->port, &start_socket_addr, &res)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-        return 1;
+        return -1;
     }
 
-    // make a socket, bind it, and listen on it
-
     // loop through all the results and bind to the first we can
     for(p = res; p != NULL; p = p->ai_next) {
         // Attempt to make a socket using the first result viable
@@ -100,6 +263,11 @@ int main(int argc, char *argv[]){
             continue;
         }
 
+        // Share the port with the other workers
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1){
+            fprintf(stderr, "Failed to set SO_REUSEPORT on socket.\n");
+        }
+
         // Attempt to bind to this socket
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(sockfd);
@@ -109,120 +277,50 @@ int main(int argc, char *argv[]){
         break;
     }
 
-    // Free linked list and accept an incoming connection:
+    // Free linked list
     freeaddrinfo(res);
 
-    printf("Starting %s server on port: %s...\n", socktype, port);
-    while (1){
-        // Get size of all structs in storage 
-        addr_size = sizeof(their_addr);
-        // Check what socket we are listening on
-        if (strcmp(socktype, "tcp") == 0){
-            // Prep connection on socket with only 1 request in the queue at a time
-            status = listen(sockfd, 1);
-            if (status == -1){
-                fprintf(stderr, "Error seting up accept connection on socket.\n");
-                return -1;
-            }
-
-            // Accept a message by awaiting a connection on a socket (this is was "waits" for a message)
-            new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &addr_size);
-            if (new_fd == -1){
-                fprintf(stderr, "Error seting up connection on socket.\n");
-                return -1;
-            }
-
-            // Read the bytes from the message and store into client response message
-            status = recv(new_fd, &client_response_struct, sizeof(client_response_struct), 0);
-            if (status == -1){
-                fprintf(stderr, "Error receiving message from client.\n");
-                return -1;
-            }
-
-            // Check that the version of the message is correct
-            if (client_response_struct.version != 1){
-                fprintf(stderr, "Incorrect message version.. please set it to 1.\n");
-                return -1;
-            }
-
-            // Decode and Display message to terminal
-            data = ntohl(client_response_struct.data);
-            printf("the sent number is: %d\n", data);
-
-            // Send message back and check for error
-            server_send_struct.version = 1;
-            if ((numbytes = send(new_fd, &server_send_struct, sizeof(server_send_struct), 0)) == -1){
-                fprintf(stderr,"Failed to send back to client.\n");
-                exit(1);
-            } 
+    // Check that we were able to bind to one of the results
+    if (p == NULL){
+        fprintf(stderr, "Failed to bind to any socket on port %s.\n", opts->port);
+        return -1;
+    }
 
-            // check if the one byte was sent 
-            numbytes = sizeof(server_send_struct) - numbytes;
-
-            // If it does fail, try send again since it's only one byte
-            if (numbytes > 0){
-                numbytes = send(new_fd, &server_send_struct, sizeof(server_send_struct), 0);
-                // If fails a second time, return error.
-                if (numbytes <= 0) {
-                    fprintf(stderr,"Error sending confirmation struct back to client\n");
-                    return -1;
-                } 
-            }
-            
-        }
-        else if (strcmp(socktype, "udp") == 0){
-            // Accept any message coming in on socket (UDP doesn't need to prep listen on socket)
-            // Receives faster but possible of data loss
-            new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &addr_size);
-
-            // Receive message coming in and write it to the client message struct
-            if ((numbytes = recvfrom(sockfd, &client_response_struct, sizeof(client_response_struct), 0,
-                (struct sockaddr *)&their_addr, &addr_size)) == -1) {
-                fprintf(stderr,"recvfrom");
-                exit(1);
-            }
-
-            // Make sure the version is correct
-            if (client_response_struct.version != 1){
-                fprintf(stderr, "Error: Incorrect client version number. Please set to 1.\n");
-                return -1;
-            }
-
-            // Display message to terminal
-            data = ntohl(client_response_struct.data);
-            printf("the sent number is: %d\n", data);
-
-            // Send received message back to server 
-            server_send_struct.version = 1;
-            status = sendto(sockfd, &server_send_struct, sizeof(server_send_struct), 0,
-            (struct sockaddr *)&their_addr, addr_size);
-
-            // Check if failed to send the one byte
-            if (status <= 0){
-                // Try sending again
-                status = sendto(sockfd, &server_send_struct, sizeof(server_send_struct), 0,
-                    (struct sockaddr *)&their_addr, addr_size);
-
-                // If still failed, return error
-                if (status <= 0){
-                    fprintf(stderr, "Error sending confirmation message back to client.\n");
-                    return -1;
-                }
-            }
-        }
-        else{
-            // This should never happen, should be caught by command line function
-            fprintf(stderr, "Not correct socket type. Please user udp or tcp...\n");
-        }
+    return sockfd;
+}
+
+void *worker_main(void *arg){
+    /* Thread entry point for one worker, runs the loop for its socket type on its own socket.
+
+    params:
+        arg (worker *): This worker's state.
+
+    return:
+        NULL once the loop fails.
+    */
+    struct worker *w = arg;
+
+    // Everything this thread counts goes to this worker's stats
+    stats_bind(&w->stats);
+    TRACE_THREAD("worker %d", w->id);
+
+    // Both socket types run on io_uring when -u is given
+    if (w->opts->use_uring){
+        uring_server_loop(w);
+        return NULL;
     }
-    // Close connection and end server
-    close(new_fd);
-    printf("Closed client connection\n");
 
-    return 0;
+    // TCP clients are served by the epoll reactor (see event_loop.c), it only returns on error
+    if (w->opts->sock_type == SOCK_STREAM){
+        tcp_event_loop(w);
+    }
+    else{
+        udp_server_loop(w);
+    }
+    return NULL;
 }
 
-void command_line_check(int argc, char *argv[], char **port, char **socktype){
+void command_line_check(int argc, char *argv[], struct server_options *opts){
     /* 
     Read in the command line arguments and check to make sure the correct tags were passed, they are
     in the correct format, and nothing is missing. 
@@ -230,8 +328,12 @@ void command_line_check(int argc, char *argv[], char **port, char **socktype){
     params:
         argc (int): Number of command line args passed.
         argv (char *): The command line text.
-        port (char **): Pointer to where we will store the -p port number.
-        socktype (char **): Pointer to where we will store the -t socket type (udp or tcp).
+        opts (server_options *): Where we store the -p port number, the -t socket type
+            (udp or tcp), the -w worker count, the -b udp batch size, the -u io_uring switch,
+            the -P processing thread count, the -a ack policy, the -L/-s/-A logging options,
+            the -m stats port, the -e bad frame limit, the -C connection limit, the -W
+            aggregate window, the -K key/value store size, the -D/-G/-S/-X write-ahead log and
+            the -l limits file.
 
     return:
         void
@@ -239,17 +341,54 @@ void command_line_check(int argc, char *argv[], char **port, char **socktype){
     // Make sure each arg is called once
     int t = 0;
     int p = 0;
+    int w = 0;
+    int b = 0;
+    int a = 0;
+    int P = 0;
+    int L = 0;
+    int s = 0;
+    int A = 0;
+    int m = 0;
+    int e = 0;
+    int C = 0;
+    int W = 0;
+    int K = 0;
+    int G = 0;
+    int S = 0;
+    int X = 0;
+    int l = 0;
     int opt;
 
+    // Defaults for the optional tags
+    memset(opts, 0, sizeof(*opts));
+    opts->workers = 1;
+    opts->batch = UDP_DEFAULT_BATCH;
+    opts->ack_policy = ACK_PROCESSED;
+    opts->log_level = LOG_INFO;
+    opts->log_sample = 1;
+    opts->bad_limit = BLOCK_DEFAULT_LIMIT;
+    opts->max_conns = DEFAULT_MAX_CONNS;
+    opts->window_secs = AGG_DEFAULT_WINDOW;
+    opts->kv_keys = KV_DEFAULT_KEYS;
+    opts->group_usec = WAL_DEFAULT_GROUP_USEC;
+    opts->segment_mb = WAL_DEFAULT_SEGMENT_MB;
+    opts->snapshot_secs = RECOVER_DEFAULT_SNAPSHOT_SECS;
+
     // Loop through all given arguments in command line
-    while ((opt = getopt(argc, argv, "t:p:")) != -1){
+    while ((opt = getopt(argc, argv, "t:p:w:b:uP:a:L:s:A:m:e:C:W:K:D:G:S:X:l:")) != -1){
         switch(opt) 
             { 
                 case 't': // udp or tcp
-                    *socktype = optarg;
+                    opts->socktype = optarg;
 
                     // Make sure it's either udp or tcp
-                    if ((strcmp(*socktype, "udp") != 0) && (strcmp(*socktype, "tcp") != 0)){
+                    if (strcmp(opts->socktype, "udp") == 0){
+                        opts->sock_type = SOCK_DGRAM;
+                    }
+                    else if (strcmp(opts->socktype, "tcp") == 0){
+                        opts->sock_type = SOCK_STREAM;
+                    }
+                    else{
                         errno = 1;
                         fprintf(stderr,"Socket type not correct. Please use only udp or tcp.");
                         exit(-1);
@@ -261,7 +400,7 @@ void command_line_check(int argc, char *argv[], char **port, char **socktype){
 
                 case 'p': // port number
                     // Save string to port
-                    *port = optarg;
+                    opts->port = optarg;
 
                     // Convert string to int
                     int port_check = atoi(optarg);
@@ -276,6 +415,182 @@ void command_line_check(int argc, char *argv[], char **port, char **socktype){
                     p++;
                     break; 
 
+                case 'w': // number of worker threads
+                    opts->workers = atoi(optarg);
+                    if (opts->workers < 1 || opts->workers > MAX_WORKERS){
+                        errno = 22;
+                        fprintf(stderr, "Worker count must be between 1 and %d.\n", MAX_WORKERS);
+                        exit(-1);
+                    }
+                    w++;
+                    break;
+
+                case 'b': // datagrams per recvmmsg/sendmmsg
+                    opts->batch = atoi(optarg);
+                    if (opts->batch < 1 || opts->batch > UDP_MAX_BATCH){
+                        errno = 22;
+                        fprintf(stderr, "UDP batch size must be between 1 and %d.\n", UDP_MAX_BATCH);
+                        exit(-1);
+                    }
+                    b++;
+                    break;
+
+                case 'u': // use the io_uring backend
+                    opts->use_uring = 1;
+                    break;
+
+                case 'P': // processing threads
+                    opts->processors = atoi(optarg);
+                    if (opts->processors < 1 || opts->processors > MAX_PROCESSORS){
+                        errno = 22;
+                        fprintf(stderr, "Processor count must be between 1 and %d.\n", MAX_PROCESSORS);
+                        exit(-1);
+                    }
+                    P++;
+                    break;
+
+                case 'a': // when pipelined frames are acked
+                    if (strcmp(optarg, "processed") == 0){
+                        opts->ack_policy = ACK_PROCESSED;
+                    }
+                    else if (strcmp(optarg, "receipt") == 0){
+                        opts->ack_policy = ACK_RECEIPT;
+                    }
+                    else{
+                        errno = 22;
+                        fprintf(stderr, "Ack policy must be processed or receipt.\n");
+                        exit(-1);
+                    }
+                    a++;
+                    break;
+
+                case 'L': // log level
+                    opts->log_level = log_parse_level(optarg);
+                    if (opts->log_level == -1){
+                        errno = 22;
+                        fprintf(stderr, "Log level must be error, warn, info or debug.\n");
+                        exit(-1);
+                    }
+                    L++;
+                    break;
+
+                case 's': // log one value in n
+                    opts->log_sample = atoi(optarg);
+                    if (opts->log_sample < 0 || (opts->log_sample == 0 && strcmp(optarg, "0") != 0)){
+                        errno = 22;
+                        fprintf(stderr, "Sample rate must be a number of values (0 for none).\n");
+                        exit(-1);
+                    }
+                    s++;
+                    break;
+
+                case 'A': // summary interval
+                    opts->log_summary = atoi(optarg);
+                    if (opts->log_summary < 1){
+                        errno = 22;
+                        fprintf(stderr, "Summary interval must be at least 1 second.\n");
+                        exit(-1);
+                    }
+                    A++;
+                    break;
+
+                case 'm': // stats port
+                    opts->stats_port = optarg;
+                    int stats_port = atoi(optarg);
+                    if (stats_port < 1023 || stats_port > 65535){
+                        errno = 22;
+                        fprintf(stderr, "Stats port number is out of range.\n");
+                        exit(-1);
+                    }
+                    m++;
+                    break;
+
+                case 'e': // bad frames per peer before it is blocked
+                    opts->bad_limit = atoi(optarg);
+                    if (opts->bad_limit < 0 || (opts->bad_limit == 0 && strcmp(optarg, "0") != 0)){
+                        errno = 22;
+                        fprintf(stderr, "Bad frame limit must be a number of frames (0 to never block).\n");
+                        exit(-1);
+                    }
+                    e++;
+                    break;
+
+                case 'C': // connections per worker
+                    opts->max_conns = atoi(optarg);
+                    if (opts->max_conns < 1 || opts->max_conns > MAX_CONNS_LIMIT){
+                        errno = 22;
+                        fprintf(stderr, "Connection limit must be between 1 and %d.\n", MAX_CONNS_LIMIT);
+                        exit(-1);
+                    }
+                    C++;
+                    break;
+
+                case 'W': // aggregate window length
+                    opts->window_secs = atoi(optarg);
+                    if (opts->window_secs < 1){
+                        errno = 22;
+                        fprintf(stderr, "Window length must be at least 1 second.\n");
+                        exit(-1);
+                    }
+                    W++;
+                    break;
+
+                case 'K': // key/value store size
+                    opts->kv_keys = atoi(optarg);
+                    if (opts->kv_keys < 1 || opts->kv_keys > KV_MAX_KEYS){
+                        errno = 22;
+                        fprintf(stderr, "Key/value store size must be between 1 and %d keys.\n", KV_MAX_KEYS);
+                        exit(-1);
+                    }
+                    K++;
+                    break;
+
+                case 'D': // write-ahead log directory
+                    if (opts->wal_dir != NULL){
+                        errno = 22;
+                        fprintf(stderr, "-D given more than once.\n");
+                        exit(-1);
+                    }
+                    opts->wal_dir = optarg;
+                    break;
+
+                case 'G': // group commit delay
+                    opts->group_usec = atoi(optarg);
+                    if (opts->group_usec < 0 || opts->group_usec > WAL_MAX_GROUP_USEC ||
+                        (opts->group_usec == 0 && strcmp(optarg, "0") != 0)){
+                        errno = 22;
+                        fprintf(stderr, "Group commit delay must be between 0 and %d microseconds.\n", WAL_MAX_GROUP_USEC);
+                        exit(-1);
+                    }
+                    G++;
+                    break;
+
+                case 'S': // log segment size
+                    opts->segment_mb = atoi(optarg);
+                    if (opts->segment_mb < 1 || opts->segment_mb > WAL_MAX_SEGMENT_MB){
+                        errno = 22;
+                        fprintf(stderr, "Segment size must be between 1 and %d MB.\n", WAL_MAX_SEGMENT_MB);
+                        exit(-1);
+                    }
+                    S++;
+                    break;
+
+                case 'X': // snapshot interval
+                    opts->snapshot_secs = atoi(optarg);
+                    if (opts->snapshot_secs < 0 || opts->snapshot_secs > RECOVER_MAX_SNAPSHOT_SECS ||
+                        (opts->snapshot_secs == 0 && strcmp(optarg, "0") != 0)){
+                        errno = 22;
+                        fprintf(stderr, "Snapshot interval must be between 0 and %d seconds.\n", RECOVER_MAX_SNAPSHOT_SECS);
+                        exit(-1);
+                    }
+                    X++;
+                    break;
+
+                case 'l': // admission limits file
+                    opts->limits = optarg;
+                    l++;
+                    break;
+
                 case '?': // unknown
                     // Check for incorrect tags and exit
                     errno = 22;
@@ -284,9 +599,269 @@ void command_line_check(int argc, char *argv[], char **port, char **socktype){
     }
 
     // Make sure each command-line arg was called once
-    if (t != 1 || p != 1){
+    if (t != 1 || p != 1 || w > 1 || b > 1 || a > 1 || P > 1 || L > 1 || s > 1 || A > 1 || m > 1 || e > 1 || C > 1 || W > 1 || K > 1 || G > 1 || S > 1 || X > 1 || l > 1){
         printf("Incorrect Number of Argument types\n");
         errno = 22;
         exit(-1);
     }
-}
\ No newline at end of file
+
+    // The ack policy only means something with processing threads
+    if (a && !P && opts->wal_dir == NULL){
+        errno = 22;
+        fprintf(stderr, "-a needs -P.\n");
+        exit(-1);
+    }
+
+    // The io_uring loops process inline
+    if (P && opts->use_uring){
+        errno = 22;
+        fprintf(stderr, "-P can't be combined with -u.\n");
+        exit(-1);
+    }
+
+    if ((G || S || X) && opts->wal_dir == NULL){
+        errno = 22;
+        fprintf(stderr, "-G, -S and -X need -D.\n");
+        exit(-1);
+    }
+
+    // Acks wait for the log in the processing threads, which the io_uring loops don't use
+    if (opts->wal_dir != NULL){
+        if (opts->use_uring){
+            errno = 22;
+            fprintf(stderr, "-D can't be combined with -u.\n");
+            exit(-1);
+        }
+        if (opts->ack_policy == ACK_RECEIPT){
+            errno = 22;
+            fprintf(stderr, "-D acks once the values are on disk, it can't be combined with -a receipt.\n");
+            exit(-1);
+        }
+        if (!P){
+            opts->processors = 1;
+        }
+    }
+}
+void process_message(struct client_message *message, struct server_message *reply){
+    /* Decode and display one client message and fill in the ack to send back. Only called for
+    version 1 frames, frame_length() has already rejected any other version.
+
+    params:
+        message (client_message *): Frame received from the client (still in network order).
+        reply (server_message *): Where to write the ack for this frame.
+    */
+    uint32_t data;
+
+    // Decode and Display message to terminal
+    data = ntohl(message->data);
+    stats_count(STAT_VALUES, 1);
+    log_values(&data, 1);
+
+    reply->version = 1;
+}
+
+long frame_length(const uint8_t *buf, size_t len){
+    /* Work out how long the frame starting at buf is from as much of it as we have so far.
+
+    params:
+        buf (uint8_t *): Start of the frame.
+        len (size_t): Bytes available at buf (may be less than the whole frame).
+
+    return:
+        The frame's total length in bytes (which may be more than len).
+        0 if more bytes are needed before the length is known.
+        -1 if this can't be the start of a valid frame.
+    */
+    if (len == 0){
+        return 0;
+    }
+    if (buf[0] == PROTOCOL_V1){
+        return sizeof(struct client_message);
+    }
+    if (buf[0] != PROTOCOL_V2){
+        return -1;
+    }
+    if (len < sizeof(struct request_header)){
+        return 0;
+    }
+
+    uint16_t payload = ntohs(((struct request_header *)buf)->length);
+    if (payload > PROTOCOL_MAX_PAYLOAD){
+        return -1;
+    }
+    return sizeof(struct request_header) + payload;
+}
+
+int reject_frame(const uint8_t *buf, size_t len, const struct sockaddr *peer, uint8_t *reply){
+    /* Deal with a frame frame_length() refused (or a udp datagram that isn't exactly one frame):
+    count it, hold it against the peer that sent it (see blocklist.c) and write the error reply
+    telling the peer why. The caller drops the datagram, or closes the connection once that reply
+    and the ones before it are sent; the rest of the server never notices.
+
+    params:
+        buf (uint8_t *): Start of the bad frame.
+        len (size_t): Bytes available at buf.
+        peer (sockaddr *): Who sent it, NULL if unknown.
+        reply (uint8_t *): Where to write the reply, at least MAX_REPLY_SIZE bytes.
+
+    return:
+        Length of the reply in bytes, 0 if there is none to send (version 1 frames carry no status).
+    */
+    struct reply_header *rep = (struct reply_header *)reply;
+    const struct request_header *req = (const struct request_header *)buf;
+
+    rep->version = PROTOCOL_V2;
+    rep->length = 0;
+    rep->id = 0;
+    if (len > 0 && buf[0] != PROTOCOL_V1 && buf[0] != PROTOCOL_V2){
+        log_msg(LOG_WARN, "Incorrect message version.. please set it to 1 or 2.\n");
+        stats_count(STAT_BAD_VERSION, 1);
+        rep->status = STATUS_BAD_VERSION;
+    }
+    else if (len >= sizeof(*req) && buf[0] == PROTOCOL_V2 && ntohs(req->length) > PROTOCOL_MAX_PAYLOAD){
+        log_msg(LOG_WARN, "Frame payload of %u bytes is too large.\n", ntohs(req->length));
+        stats_count(STAT_TOO_LARGE, 1);
+        rep->status = STATUS_TOO_LARGE;
+        rep->id = req->id;
+    }
+    else{
+        log_msg(LOG_WARN, "Datagram of %zu bytes is not one whole frame.\n", len);
+        stats_count(STAT_BAD_LENGTH, 1);
+        rep->status = STATUS_BAD_LENGTH;
+        if (len >= sizeof(*req)){
+            rep->id = req->id;
+        }
+    }
+
+    if (blocklist_strike(peer)){
+        stats_count(STAT_PEERS_BLOCKED, 1);
+    }
+    return len > 0 && buf[0] == PROTOCOL_V1 ? 0 : sizeof(*rep);
+}
+
+void process_values(const uint8_t *values, uint32_t count, uint32_t sender){
+    /* Decode, display and aggregate a run of values (a REQ_BATCH frame's, or the one value of
+    any other frame). The values are byte swapped a chunk at a time with swap_values()
+    (vectorized) and handed to the logger and the aggregates (agg.c) a chunk at a time.
+
+    params:
+        values (uint8_t *): 'count' network order uint32_t values, not necessarily aligned.
+        count (uint32_t): How many there are.
+        sender (uint32_t): Who sent them, from agg_sender_of().
+    */
+    uint32_t decoded[1024];
+    TRACE_BEGIN(process);
+
+    for (uint32_t done = 0; done < count; ){
+        uint32_t n = count - done < 1024 ? count - done : 1024;
+        swap_values(decoded, values + (size_t)done * sizeof(uint32_t), n);
+        log_values(decoded, n);
+        agg_values(sender, decoded, n);
+        done += n;
+    }
+    TRACE_END(TRACE_PROCESS, process);
+}
+
+int check_frame(const uint8_t *frame, size_t len, uint32_t sender, uint8_t *reply, const uint8_t **values, uint32_t *count){
+    /* Check one complete frame of either version and write the reply to send back, without
+    touching its values. The I/O side of process_frame(), used on its own when the values are
+    handed to a processing thread (-P).
+
+    params:
+        frame (uint8_t *): The frame, exactly frame_length() bytes.
+        len (size_t): Its length.
+        sender (uint32_t): Who sent it, from agg_sender_of() (what a QUERY_SENDER for 0 reports on).
+        reply (uint8_t *): Where to write the reply, at least MAX_REPLY_SIZE bytes.
+        values (uint8_t **): Set to the frame's network order values.
+        count (uint32_t *): Set to how many there are (0 if the frame is rejected with a status).
+
+    return:
+        Length of the reply in bytes.
+        -1 if the frame is invalid and the sender should be dropped.
+    */
+    *count = 0;
+    if (frame[0] == PROTOCOL_V1){
+        ((struct server_message *)reply)->version = PROTOCOL_V1;
+        *values = (const uint8_t *)&((struct client_message *)frame)->data;
+        *count = 1;
+        stats_count(STAT_VALUES, 1);
+        return sizeof(struct server_message);
+    }
+
+    const struct request_header *req = (const struct request_header *)frame;
+    struct reply_header *rep = (struct reply_header *)reply;
+    size_t payload = len - sizeof(*req);
+    int reply_len;
+
+    // The id goes back exactly as it came, the client decides what it means
+    rep->version = PROTOCOL_V2;
+    rep->status = STATUS_OK;
+    rep->length = 0;
+    rep->id = req->id;
+
+    // One case per handler in handlers.h, unknown types fall through to the default
+    switch (req->type){
+#define HANDLER_CASE(type, fn) \
+        case type: \
+            reply_len = fn(frame, payload, sender, rep, values, count); \
+            break;
+        SERVER_HANDLERS(HANDLER_CASE)
+#undef HANDLER_CASE
+
+        default:
+            // A well formed frame we don't understand, the stream is still in sync
+            rep->status = STATUS_BAD_TYPE;
+            stats_count(STAT_BAD_TYPE, 1);
+            reply_len = sizeof(*rep);
+            break;
+    }
+
+    // Over the -l limits: the values are refused, the client is told when to try again
+    if (*count > 0 && admit_limited()){
+        uint32_t retry = admit_frame(sender, *count);
+        if (retry > 0){
+            *count = 0;
+            retry = htonl(retry);
+            rep->status = STATUS_BUSY;
+            rep->length = htons(sizeof(retry));
+            memcpy(rep + 1, &retry, sizeof(retry));
+            return sizeof(*rep) + sizeof(retry);
+        }
+    }
+
+    stats_count(STAT_VALUES, *count);
+    return reply_len;
+}
+
+int process_frame(const uint8_t *frame, size_t len, uint32_t sender, uint8_t *reply){
+    /* Handle one complete frame of either version and write the reply to send back.
+
+    params:
+        frame (uint8_t *): The frame, exactly frame_length() bytes.
+        len (size_t): Its length.
+        sender (uint32_t): Who sent it, from agg_sender_of().
+        reply (uint8_t *): Where to write the reply, at least MAX_REPLY_SIZE bytes.
+
+    return:
+        Length of the reply in bytes.
+        -1 if the frame is invalid and the sender should be dropped.
+    */
+    if (frame[0] == PROTOCOL_V1){
+        TRACE_BEGIN(process);
+        process_message((struct client_message *)frame, (struct server_message *)reply);
+        uint32_t data = ntohl(((struct client_message *)frame)->data);
+        agg_values(sender, &data, 1);
+        TRACE_END(TRACE_PROCESS, process);
+        return sizeof(struct server_message);
+    }
+
+    const uint8_t *values;
+    uint32_t count;
+    TRACE_BEGIN(check);
+    int reply_len = check_frame(frame, len, sender, reply, &values, &count);
+    TRACE_END(TRACE_CHECK, check);
+    if (reply_len != -1 && count > 0){
+        process_values(values, count, sender);
+    }
+    return reply_len;
+}
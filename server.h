@@ -13,23 +13,78 @@
 #include <stdlib.h>
 #include <getopt.h>  // Input for the getopt variables
 #include <ctype.h>
+#include <pthread.h>
 
-void command_line_check(int argc, char *argv[], char **port, char **socktype);
+#include "protocol.h"
+#include "log.h"
+#include "stats.h"
+#include "blocklist.h"
+#include "pool.h"
+#include "agg.h"
+#include "kv.h"
+#include "wal.h"
+#include "recover.h"
+#include "rudp.h"
+#include "admit.h"
+#include "trace.h"
+#include "handlers.h"
 
-/* Pragma packs the struct to avoid padding which saves space and the size
-    ref: https://gcc.gnu.org/onlinedocs/gcc-4.4.4/gcc/Structure_002dPacking-Pragmas.html
-*/
-#pragma pack(1)
-struct client_message
+struct pipeline;
+
+// Upper bound for -w
+#define MAX_WORKERS 256
+
+// Everything parsed from the command line
+struct server_options
 {
-    uint8_t version; // 1-byte version field 
-    uint32_t data;  // 4-byte unsigned int of user data, this will be encoded and decoded with htonl and ntohl
+    char *port;
+    char *socktype;  // "udp" or "tcp" as typed
+    int sock_type;   // SOCK_DGRAM or SOCK_STREAM, so the loops never compare strings
+    int workers;     // -w: worker threads, each with its own SO_REUSEPORT socket
+    int batch;       // -b: max datagrams per recvmmsg()/sendmmsg() on udp
+    int use_uring;   // -u: run the receive/ack path on io_uring
+    int processors;  // -P: processing threads the workers hand values to, 0 to process inline
+    int ack_policy;  // -a: ACK_PROCESSED or ACK_RECEIPT (see pipeline.h)
+    int log_level;   // -L: LOG_* (see log.h)
+    int log_sample;  // -s: log one received value in this many, 0 for none
+    int log_summary; // -A: seconds between summaries of the received values, 0 for none
+    char *stats_port; // -m: serve the stats on this port, NULL for none
+    int bad_limit;   // -e: bad frames a peer may send before it is blocked, 0 to never block
+    int max_conns;   // -C: tcp connections each worker holds at most (sizes its pools, see pool.h)
+    int window_secs; // -W: length of the tumbling aggregate windows (see agg.h)
+    int kv_keys;     // -K: keys the key/value store holds (see kv.h)
+    char *wal_dir;   // -D: write-ahead log directory, NULL for none (see wal.h)
+    int group_usec;  // -G: longest a logged frame waits for its fdatasync()
+    int segment_mb;  // -S: size at which the log starts a new segment
+    int snapshot_secs; // -X: seconds between snapshots of the aggregates, 0 for none (see recover.h)
+    char *limits;    // -l: admission control limits file, reread on SIGHUP, NULL for none (see admit.h)
 };
 
-#pragma pack(1)
-struct server_message
+/* One worker thread. Everything a worker touches while serving clients hangs off this
+    struct (or its loop's stack), so workers never share state or locks.
+*/
+struct worker
 {
-    uint8_t version; // 1-byte version field 
+    int id;
+    int sockfd;
+    pthread_t thread;
+    struct server_options *opts;
+    struct pipeline *pipeline;  // NULL unless -P
+    struct server_stats stats;  // written only by this worker's thread
 };
 
+void command_line_check(int argc, char *argv[], struct server_options *opts);
+int open_server_socket(struct server_options *opts);
+void *worker_main(void *arg);
+
+// Room every caller of process_frame() must leave for the reply
+#define MAX_REPLY_SIZE PROTOCOL_MAX_REPLY
+
+long frame_length(const uint8_t *buf, size_t len);
+int process_frame(const uint8_t *frame, size_t len, uint32_t sender, uint8_t *reply);
+int reject_frame(const uint8_t *buf, size_t len, const struct sockaddr *peer, uint8_t *reply);
+int check_frame(const uint8_t *frame, size_t len, uint32_t sender, uint8_t *reply, const uint8_t **values, uint32_t *count);
+void process_values(const uint8_t *values, uint32_t count, uint32_t sender);
+void process_message(struct client_message *message, struct server_message *reply);
+
 #endif
\ No newline at end of file
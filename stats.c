@@ -0,0 +1,342 @@
+/* Server metrics (see stats.h).
+
+The stats thread owns the -m listening socket (bound to 127.0.0.1) and a signalfd for SIGUSR1,
+SIGUSR2 and SIGHUP, which every other thread blocks. Each request on the port gets one HTTP/1.0
+response with every metric in the Prometheus text format, SIGUSR1 writes the same text to
+stderr. SIGHUP and SIGUSR2 have nothing to do with the stats, they reread the admission limits
+(admit.c) and write out the trace points (trace.c), this thread just happens to be the one that
+takes signals.
+
+Counters are per worker and labelled with the worker's id. Latency is merged over every
+worker into one summary. Both are read while the workers keep writing, so a scrape is a
+consistent snapshot of each counter but not across counters.
+
+Reference:
+    https://prometheus.io/docs/instrumenting/exposition_formats/
+*/
+#include "stats.h"
+#include "server.h"
+#include "pipeline.h"
+
+#include <poll.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+
+__thread struct server_stats *thread_stats;
+int stats_timing;
+
+// How each counter is exported. Counters sharing a name are one metric told apart by a label.
+static const struct
+{
+    const char *name;
+    const char *label;
+    const char *help;
+} counter_info[STAT_COUNTERS] = {
+    [STAT_FRAMES] = { "server_frames_total", NULL, "Frames handled." },
+    [STAT_VALUES] = { "server_values_total", NULL, "Values carried by the frames handled." },
+    [STAT_BYTES_IN] = { "server_received_bytes_total", NULL, "Bytes received from clients." },
+    [STAT_BYTES_OUT] = { "server_sent_bytes_total", NULL, "Bytes of replies sent to clients." },
+    [STAT_BAD_VERSION] = { "server_rejected_frames_total", "reason=\"bad_version\"", "Frames rejected, by reason." },
+    [STAT_TOO_LARGE] = { "server_rejected_frames_total", "reason=\"too_large\"", NULL },
+    [STAT_BAD_LENGTH] = { "server_rejected_frames_total", "reason=\"bad_length\"", NULL },
+    [STAT_BAD_TYPE] = { "server_rejected_frames_total", "reason=\"bad_type\"", NULL },
+    [STAT_RECV_ERRORS] = { "server_errors_total", "op=\"recv\"", "Failed socket operations, by operation." },
+    [STAT_SEND_ERRORS] = { "server_errors_total", "op=\"send\"", NULL },
+    [STAT_ACCEPT_ERRORS] = { "server_errors_total", "op=\"accept\"", NULL },
+    [STAT_ACCEPTS] = { "server_connections_opened_total", NULL, "TCP connections accepted." },
+    [STAT_CLOSES] = { "server_connections_closed_total", NULL, "TCP connections closed." },
+    [STAT_RECV_CALLS] = { "server_syscalls_total", "call=\"recv\"", "Receive, send and wait calls made by the workers." },
+    [STAT_SEND_CALLS] = { "server_syscalls_total", "call=\"send\"", NULL },
+    [STAT_WAIT_CALLS] = { "server_syscalls_total", "call=\"wait\"", NULL },
+    [STAT_PIPELINE_FULL] = { "server_pipeline_full_total", NULL, "Times a worker found a processor's ring full." },
+    [STAT_PEERS_BLOCKED] = { "server_peers_blocked_total", NULL, "Peers blocked for sending too many bad frames." },
+    [STAT_BLOCKED_DROPS] = { "server_blocked_drops_total", NULL, "Connections and datagrams refused because their peer was blocked." },
+    [STAT_POOL_EMPTY] = { "server_pool_exhausted_total", NULL, "Connections refused or dropped at the -C limit." },
+    [STAT_QUERIES] = { "server_queries_total", NULL, "Aggregate queries answered." },
+    [STAT_KV_GETS] = { "server_kv_requests_total", "op=\"get\"", "Key/value requests answered, by operation." },
+    [STAT_KV_PUTS] = { "server_kv_requests_total", "op=\"put\"", NULL },
+    [STAT_KV_DELETES] = { "server_kv_requests_total", "op=\"delete\"", NULL },
+    [STAT_KV_MISSES] = { "server_kv_misses_total", NULL, "Key/value requests answered with STATUS_NOT_FOUND or STATUS_FULL." },
+    [STAT_DUPLICATES] = { "server_duplicate_frames_total", NULL, "Reliable udp retransmits of frames already received, acked or dropped without processing." },
+    [STAT_RATE_LIMITED] = { "server_busy_frames_total", "limit=\"rate\"", "Data frames answered STATUS_BUSY without being processed, by limit." },
+    [STAT_OVERLOADED] = { "server_busy_frames_total", "limit=\"queue\"", NULL },
+};
+
+// Everything the stats thread reports on
+static struct
+{
+    int listenfd;   // -1 without -m
+    int sigfd;
+    struct worker *workers;
+    int count;
+    struct pipeline *pipeline;
+    pthread_t thread;
+} stats = { .listenfd = -1, .sigfd = -1 };
+
+// Growable text buffer for one report
+struct text
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void text_printf(struct text *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_printf(struct text *t, const char *fmt, ...){
+    va_list ap;
+
+    while (1){
+        va_start(ap, fmt);
+        int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+        if (n < 0){
+            return;
+        }
+        if ((size_t)n < t->cap - t->len){
+            t->len += n;
+            return;
+        }
+        size_t cap = t->cap ? t->cap * 2 : 16384;
+        while (cap - t->len <= (size_t)n){
+            cap *= 2;
+        }
+        char *buf = realloc(t->buf, cap);
+        if (buf == NULL){
+            return;
+        }
+        t->buf = buf;
+        t->cap = cap;
+    }
+}
+
+int stats_init(struct server_stats *s){
+    /* Zero a worker's stats before its thread (or the stats thread) can see them.
+
+    return:
+        0 on success, -1 if out of memory.
+    */
+    memset(s->counters, 0, sizeof(s->counters));
+    return histogram_init(&s->latency, HISTOGRAM_DEFAULT_BITS);
+}
+
+void stats_bind(struct server_stats *s){
+    // Make s the calling thread's stats for stats_count() and stats_latency()
+    thread_stats = s;
+}
+
+static void render(struct text *t){
+    /* Write every metric into t in the Prometheus text format. The first report also turns
+    latency measurement on, so it only covers frames from then on.
+    */
+    struct histogram latency;
+
+    __atomic_store_n(&stats_timing, 1, __ATOMIC_RELAXED);
+
+    for (int c = 0; c < STAT_COUNTERS; c++){
+        if (counter_info[c].help != NULL){
+            text_printf(t, "# HELP %s %s\n# TYPE %s counter\n", counter_info[c].name, counter_info[c].help, counter_info[c].name);
+        }
+        for (int i = 0; i < stats.count; i++){
+            uint64_t value = __atomic_load_n(&stats.workers[i].stats.counters[c], __ATOMIC_RELAXED);
+            text_printf(t, "%s{worker=\"%d\"%s%s} %llu\n", counter_info[c].name, i,
+                        counter_info[c].label ? "," : "", counter_info[c].label ? counter_info[c].label : "",
+                        (unsigned long long)value);
+        }
+    }
+
+    if (stats.pipeline != NULL){
+        text_printf(t, "# HELP server_pipeline_queued_bytes Bytes waiting for each processor, by worker.\n"
+                       "# TYPE server_pipeline_queued_bytes gauge\n");
+        for (int i = 0; i < stats.count; i++){
+            for (int p = 0; p < pipeline_processors(stats.pipeline); p++){
+                text_printf(t, "server_pipeline_queued_bytes{worker=\"%d\",processor=\"%d\"} %zu\n",
+                            i, p, pipeline_queued(stats.pipeline, i, p));
+            }
+        }
+    }
+
+    text_printf(t, "# HELP server_log_dropped_lines_total Log lines dropped because a log buffer was full.\n"
+                   "# TYPE server_log_dropped_lines_total counter\n"
+                   "server_log_dropped_lines_total %llu\n", (unsigned long long)log_dropped());
+
+    if (wal_enabled()){
+        uint64_t syncs, bytes;
+        wal_counts(&syncs, &bytes);
+        text_printf(t, "# HELP server_wal_syncs_total fdatasync() calls on the write-ahead log.\n"
+                       "# TYPE server_wal_syncs_total counter\n"
+                       "server_wal_syncs_total %llu\n", (unsigned long long)syncs);
+        text_printf(t, "# HELP server_wal_bytes_written_total Bytes written to the write-ahead log.\n"
+                       "# TYPE server_wal_bytes_written_total counter\n"
+                       "server_wal_bytes_written_total %llu\n", (unsigned long long)bytes);
+    }
+
+    // The buckets are copied while the workers keep adding to them, so the counts may be a few frames apart
+    if (histogram_init(&latency, HISTOGRAM_DEFAULT_BITS) == -1){
+        return;
+    }
+    for (int i = 0; i < stats.count; i++){
+        histogram_merge(&latency, &stats.workers[i].stats.latency);
+    }
+    const double quantiles[] = { 50, 90, 99, 99.9 };
+    text_printf(t, "# HELP server_ack_latency_seconds Time from reading a frame to handing its ack to the kernel.\n"
+                   "# TYPE server_ack_latency_seconds summary\n");
+    for (int q = 0; q < 4; q++){
+        text_printf(t, "server_ack_latency_seconds{quantile=\"%g\"} %.9f\n", quantiles[q] / 100,
+                    histogram_percentile(&latency, quantiles[q]) / 1e9);
+    }
+    text_printf(t, "server_ack_latency_seconds_sum %.9f\nserver_ack_latency_seconds_count %llu\n",
+                latency.sum / 1e9, (unsigned long long)latency.count);
+    histogram_free(&latency);
+}
+
+static void write_all(int fd, const char *buf, size_t len){
+    while (len > 0){
+        ssize_t n = write(fd, buf, len);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void serve_scrape(void){
+    /* Answer one client of the -m port. Whatever it asked for it gets every metric; the request
+    is read (with a timeout) only so the client sees a clean close.
+    */
+    struct timeval timeout = { .tv_sec = 1 };
+    struct text body = { 0 };
+    char header[256];
+    char request[4096];
+
+    int fd = accept(stats.listenfd, NULL, NULL);
+    if (fd == -1){
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (recv(fd, request, sizeof(request), 0) == -1){
+        // Answer anyway, it may just be slow to ask
+    }
+
+    render(&body);
+    int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+    write_all(fd, header, len);
+    write_all(fd, body.buf, body.len);
+    free(body.buf);
+    close(fd);
+}
+
+static void dump(void){
+    // SIGUSR1: write the report to stderr
+    struct text body = { 0 };
+
+    render(&body);
+    write_all(STDERR_FILENO, body.buf, body.len);
+    free(body.buf);
+}
+
+static void *stats_main(void *arg){
+    // Thread entry point: wait for scrapes, SIGUSR1, SIGUSR2 and SIGHUP, never returns
+    struct pollfd pfds[2] = {
+        { .fd = stats.sigfd, .events = POLLIN },
+        { .fd = stats.listenfd, .events = POLLIN },
+    };
+    (void)arg;
+
+    while (1){
+        if (poll(pfds, stats.listenfd != -1 ? 2 : 1, -1) == -1){
+            continue;
+        }
+        if (pfds[0].revents & POLLIN){
+            struct signalfd_siginfo info;
+            if (read(stats.sigfd, &info, sizeof(info)) == sizeof(info)){
+                if (info.ssi_signo == SIGHUP){
+                    admit_reload();
+                }
+                else if (info.ssi_signo == SIGUSR2){
+                    trace_dump();
+                }
+                else{
+                    dump();
+                }
+            }
+        }
+        if (stats.listenfd != -1 && (pfds[1].revents & POLLIN)){
+            serve_scrape();
+        }
+    }
+    return NULL;
+}
+
+static int open_stats_socket(const char *port){
+    // Listen on 127.0.0.1:port, the metrics are for this machine only. -1 on error.
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1){
+        fprintf(stderr, "Error creating the stats socket.\n");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1){
+        fprintf(stderr, "Failed to bind the stats port %s.\n", port);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int stats_start(const char *port, struct worker *workers, int count, struct pipeline *pl){
+    /* Start the stats thread. SIGUSR1, SIGUSR2 and SIGHUP must already be blocked in every thread
+    (main() blocks them before starting any), the stats thread takes them from a signalfd.
+
+    params:
+        port (char *): -m port to serve the metrics on, NULL for SIGUSR1 only.
+        workers (worker *): Every worker, their stats must already be set up with stats_init().
+        count (int): How many workers there are.
+        pl (pipeline *): The pipeline for its queue depths, NULL without -P.
+
+    return:
+        0 on success, -1 on error.
+    */
+    sigset_t mask;
+
+    stats.workers = workers;
+    stats.count = count;
+    stats.pipeline = pl;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGHUP);
+    stats.sigfd = signalfd(-1, &mask, 0);
+    if (stats.sigfd == -1){
+        fprintf(stderr, "Error creating the signalfd.\n");
+        return -1;
+    }
+
+    if (port != NULL){
+        stats.listenfd = open_stats_socket(port);
+        if (stats.listenfd == -1){
+            return -1;
+        }
+    }
+
+    if (pthread_create(&stats.thread, NULL, stats_main, NULL) != 0){
+        fprintf(stderr, "Failed to start the stats thread.\n");
+        return -1;
+    }
+    return 0;
+}
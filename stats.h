@@ -0,0 +1,96 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "histogram.h"
+
+/* Server metrics, see stats.c.
+
+    Every worker owns a server_stats and is its only writer: a counter update is a plain add
+    published with a relaxed store, no lock and no atomic read-modify-write. The stats thread
+    reads them all when asked, from the -m port (Prometheus text format) or on SIGUSR1 (written
+    to stderr).
+
+    Receive-to-ack latency needs a clock read per batch, so it is only measured once somebody
+    has asked for the stats at least once. Until then stats_now() is a single load.
+*/
+enum stat_counter
+{
+    STAT_FRAMES,        // frames handled
+    STAT_VALUES,        // values carried by those frames
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_BAD_VERSION,   // rejected: unknown protocol version
+    STAT_TOO_LARGE,     // rejected: payload over PROTOCOL_MAX_PAYLOAD
+    STAT_BAD_LENGTH,    // answered STATUS_BAD_LENGTH, or a udp datagram that isn't one whole frame
+    STAT_BAD_TYPE,      // answered STATUS_BAD_TYPE
+    STAT_RECV_ERRORS,
+    STAT_SEND_ERRORS,
+    STAT_ACCEPT_ERRORS,
+    STAT_ACCEPTS,
+    STAT_CLOSES,
+    STAT_RECV_CALLS,    // recv()/readv()/recvmmsg() calls, or recv completions on io_uring
+    STAT_SEND_CALLS,    // send()/sendmmsg() calls, or send submissions on io_uring
+    STAT_WAIT_CALLS,    // epoll_wait()/poll()/io_uring_enter() calls
+    STAT_PIPELINE_FULL, // times a processor's ring was found full (-P)
+    STAT_PEERS_BLOCKED, // peers this worker blocked for going over -e bad frames
+    STAT_BLOCKED_DROPS, // connections closed / datagrams dropped because their peer was blocked
+    STAT_POOL_EMPTY,    // connections refused or dropped because a pool was used up (-C)
+    STAT_QUERIES,       // REQ_QUERY frames answered
+    STAT_KV_GETS,       // REQ_GET frames answered
+    STAT_KV_PUTS,       // REQ_PUT frames answered
+    STAT_KV_DELETES,    // REQ_DELETE frames answered
+    STAT_KV_MISSES,     // GETs and DELETEs of a key that wasn't stored, PUTs refused as full
+    STAT_DUPLICATES,    // reliable udp retransmits of frames already received, not processed again
+    STAT_RATE_LIMITED,  // answered STATUS_BUSY: the sender's token bucket was empty (-l rate)
+    STAT_OVERLOADED,    // answered STATUS_BUSY: the processing queue was full (-l queue)
+    STAT_COUNTERS
+};
+
+struct server_stats
+{
+    uint64_t counters[STAT_COUNTERS];
+    struct histogram latency;  // ns from a frame being read to its ack being handed to the kernel
+} __attribute__((aligned(64)));
+
+struct worker;
+struct pipeline;
+
+extern __thread struct server_stats *thread_stats;
+extern int stats_timing;
+
+static inline void stats_count(int counter, uint64_t n){
+    // Add to one of this thread's counters (no-op on threads without stats)
+    struct server_stats *s = thread_stats;
+    if (s != NULL){
+        __atomic_store_n(&s->counters[counter], s->counters[counter] + n, __ATOMIC_RELAXED);
+    }
+}
+
+static inline uint64_t stats_now(void){
+    // Monotonic ns to time a frame with, 0 while nobody has looked at the stats yet
+    struct timespec ts;
+    if (!__atomic_load_n(&stats_timing, __ATOMIC_RELAXED)){
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stats_latency(uint64_t since, uint64_t frames){
+    // 'frames' acks just went to the kernel, the oldest of them was read at 'since' (from stats_now())
+    struct server_stats *s = thread_stats;
+    uint64_t now;
+    if (since == 0 || s == NULL || (now = stats_now()) == 0){
+        return;
+    }
+    histogram_record_n(&s->latency, now > since ? now - since : 0, frames);
+}
+
+int stats_init(struct server_stats *s);
+void stats_bind(struct server_stats *s);
+int stats_start(const char *port, struct worker *workers, int count, struct pipeline *pl);
+
+#endif
@@ -0,0 +1,181 @@
+/* Trace points and their Chrome trace dump (see trace.h).
+
+Each thread that records a span gets a trace_ring the first time it does, registered in a list
+guarded by a mutex (only taken then and by a dump). The thread is the ring's only writer: an
+event is written and then published by a release store of head. A dump reads head, copies the
+ring and reads head again, anything the writer may have overwritten during the copy is left
+out, so a dump never stops the workers.
+
+Spans are timed in cycle counter ticks. trace_init() measures how many ticks there are to a
+nanosecond against CLOCK_MONOTONIC once at startup (a constant rate counter is assumed, which
+every x86_64 cpu of the last decade has), and the dump converts with that.
+
+Reference:
+    https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+*/
+#include "trace.h"
+#include "server.h"
+
+#ifdef SERVER_TRACE
+#include <stdarg.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+static const char *stage_names[TRACE_STAGES] = {
+    "accept", "recv", "decode", "check", "process", "ack"
+};
+
+__thread struct trace_ring *trace_self;
+
+static struct
+{
+    pthread_mutex_t lock;  // guards registering threads and dumps
+    struct trace_ring *rings;
+    uint64_t base;         // trace_clock() at trace_init(), timestamps are from there
+    double ns_per_tick;
+    int dumps;
+} tracer = { .lock = PTHREAD_MUTEX_INITIALIZER, .ns_per_tick = 1.0 };
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_init(void){
+    // Calibrate the cycle counter against the monotonic clock, called from main() before any thread starts
+    struct timespec pause = { 0, 20 * 1000000 };
+    uint64_t ns = now_ns();
+    uint64_t ticks = trace_clock();
+
+    nanosleep(&pause, NULL);
+    ns = now_ns() - ns;
+    ticks = trace_clock() - ticks;
+    if (ns > 0 && ticks > 0){
+        tracer.ns_per_tick = (double)ns / ticks;
+    }
+    tracer.base = trace_clock();
+    fprintf(stderr, "Trace points on, %.3f GHz cycle counter. kill -USR2 %d writes them out.\n",
+            1.0 / tracer.ns_per_tick, (int)getpid());
+}
+
+struct trace_ring *trace_register(void){
+    /* Give the calling thread its ring, the first time it records a span.
+
+    return:
+        The ring, NULL if out of memory (the thread's spans are not recorded).
+    */
+    struct trace_ring *r = calloc(1, sizeof(*r));
+    if (r == NULL || (r->events = calloc(TRACE_RING_EVENTS, sizeof(*r->events))) == NULL){
+        free(r);
+        return NULL;
+    }
+    r->tid = (int)syscall(SYS_gettid);
+    snprintf(r->name, sizeof(r->name), "thread %d", r->tid);
+
+    pthread_mutex_lock(&tracer.lock);
+    r->next = tracer.rings;
+    tracer.rings = r;
+    pthread_mutex_unlock(&tracer.lock);
+    trace_self = r;
+    return r;
+}
+
+void trace_thread(const char *fmt, ...){
+    // Name the calling thread in the dump ("worker 0", "processor 1", ...)
+    struct trace_ring *r = trace_self != NULL ? trace_self : trace_register();
+    char name[sizeof(r->name)];
+    va_list args;
+
+    if (r == NULL){
+        return;
+    }
+    va_start(args, fmt);
+    vsnprintf(name, sizeof(name), fmt, args);
+    va_end(args);
+    pthread_mutex_lock(&tracer.lock);
+    memcpy(r->name, name, sizeof(name));
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+static int dump_ring(FILE *f, struct trace_ring *r, struct trace_event *copy, int first){
+    /* Write one thread's name and spans, oldest first.
+
+    params:
+        f (FILE *): The trace file.
+        r (trace_ring *): The thread's ring.
+        copy (trace_event *): Room for TRACE_RING_EVENTS events.
+        first (int): 1 if nothing has been written to the array yet (no leading comma).
+
+    return:
+        How many spans were written.
+    */
+    int pid = (int)getpid();
+    uint64_t before = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    memcpy(copy, r->events, TRACE_RING_EVENTS * sizeof(*copy));
+    uint64_t after = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    // Slots the writer reached during the copy may be torn, start past them
+    uint64_t from = before > TRACE_RING_EVENTS ? before - TRACE_RING_EVENTS : 0;
+    if (after + 1 > TRACE_RING_EVENTS && after + 1 - TRACE_RING_EVENTS > from){
+        from = after + 1 - TRACE_RING_EVENTS;
+    }
+
+    fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",", pid, r->tid, r->name);
+    int written = 0;
+    for (uint64_t n = from; n < before; n++){
+        struct trace_event *e = &copy[n & (TRACE_RING_EVENTS - 1)];
+        if (e->stage >= TRACE_STAGES){
+            continue;
+        }
+        double ts = (double)(int64_t)(e->start - tracer.base) * tracer.ns_per_tick / 1000.0;
+        double dur = e->cycles * tracer.ns_per_tick / 1000.0;
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                stage_names[e->stage], pid, r->tid, ts, dur);
+        written++;
+    }
+    return written;
+}
+
+void trace_dump(void){
+    // SIGUSR2: write every thread's recorded spans to trace-<pid>-<n>.json
+    char path[64];
+    struct trace_event *copy = malloc(TRACE_RING_EVENTS * sizeof(*copy));
+    int spans = 0;
+    int first = 1;
+
+    if (copy == NULL){
+        log_msg(LOG_ERROR, "Out of memory for the trace dump.\n");
+        return;
+    }
+    pthread_mutex_lock(&tracer.lock);
+    snprintf(path, sizeof(path), "trace-%d-%d.json", (int)getpid(), tracer.dumps++);
+    FILE *f = fopen(path, "w");
+    if (f == NULL){
+        pthread_mutex_unlock(&tracer.lock);
+        log_msg(LOG_ERROR, "Can't write the trace to %s: %s.\n", path, strerror(errno));
+        free(copy);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (struct trace_ring *r = tracer.rings; r != NULL; r = r->next){
+        spans += dump_ring(f, r, copy, first);
+        first = 0;
+    }
+    fprintf(f, "\n]}\n");
+    pthread_mutex_unlock(&tracer.lock);
+    free(copy);
+
+    if (fclose(f) != 0){
+        log_msg(LOG_ERROR, "Writing the trace to %s failed: %s.\n", path, strerror(errno));
+        return;
+    }
+    log_msg(LOG_WARN, "Wrote %d spans to %s.\n", spans, path);
+}
+#else
+void trace_dump(void){
+    // SIGUSR2 in a build without trace points
+    log_msg(LOG_WARN, "SIGUSR2: this server was built without trace points, see make profile.\n");
+}
+#endif
@@ -0,0 +1,108 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Hot path trace points, see trace.c.
+
+    Built in only with -DSERVER_TRACE (make profile), otherwise every TRACE_* macro is empty and
+    costs nothing. Each trace point times one stage of handling frames with the cycle counter
+    (rdtsc) and writes it into the calling thread's ring of the last TRACE_RING_EVENTS spans,
+    a few stores and no lock. SIGUSR2 writes every thread's ring out as a Chrome trace
+    (trace-<pid>-<n>.json in the working directory), which chrome://tracing and
+    https://ui.perfetto.dev open.
+
+    Stages:
+        accept   accept4() of new tcp connections
+        recv     recvmmsg()/readv() of what the clients sent (a blocking recvmmsg()'s includes
+                 the wait for its first datagram)
+        decode   frame_length(): finding where a frame ends from its version and length
+        check    check_frame(): the version 2 header, type and payload checks and the reply
+        process  displaying and aggregating the values (a processor's with -P)
+        ack      sendmmsg()/send() of the replies
+
+    Usage:
+        TRACE_BEGIN(t);
+        int n = recvmmsg(...);
+        TRACE_END(TRACE_RECV, t);
+*/
+enum trace_stage
+{
+    TRACE_ACCEPT,
+    TRACE_RECV,
+    TRACE_DECODE,
+    TRACE_CHECK,
+    TRACE_PROCESS,
+    TRACE_ACK,
+    TRACE_STAGES
+};
+
+#define TRACE_RING_EVENTS (1 << 16)  // per thread, a power of two
+
+void trace_dump(void);
+
+#ifdef SERVER_TRACE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+struct trace_event
+{
+    uint64_t start;   // trace_clock() at the start of the span
+    uint32_t cycles;  // its length, saturated
+    uint32_t stage;   // TRACE_*
+};
+
+struct trace_ring
+{
+    struct trace_event *events;
+    uint64_t head;  // spans recorded so far, the last TRACE_RING_EVENTS are kept
+    int tid;
+    char name[32];
+    struct trace_ring *next;
+};
+
+extern __thread struct trace_ring *trace_self;
+
+void trace_init(void);
+void trace_thread(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+struct trace_ring *trace_register(void);
+
+static inline uint64_t trace_clock(void){
+    // Cycle counter where there is one, monotonic ns elsewhere
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void trace_record(int stage, uint64_t start, uint64_t end){
+    // Keep one span in this thread's ring, overwriting the oldest
+    struct trace_ring *r = trace_self != NULL ? trace_self : trace_register();
+    if (r == NULL){
+        return;
+    }
+    struct trace_event *e = &r->events[r->head & (TRACE_RING_EVENTS - 1)];
+    e->start = start;
+    e->cycles = end - start > UINT32_MAX ? UINT32_MAX : (uint32_t)(end - start);
+    e->stage = stage;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_BEGIN(var) uint64_t var = trace_clock()
+#define TRACE_END(stage, var) trace_record((stage), (var), trace_clock())
+#define TRACE_THREAD(...) trace_thread(__VA_ARGS__)
+#define TRACE_INIT() trace_init()
+#else
+#define TRACE_BEGIN(var) do { } while (0)
+#define TRACE_END(stage, var) do { } while (0)
+#define TRACE_THREAD(...) do { } while (0)
+#define TRACE_INIT() do { } while (0)
+#endif
+
+#endif
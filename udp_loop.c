@@ -0,0 +1,389 @@
+/* Batched UDP receive/ack loop for one worker.
+
+Every frame is its own small datagram, so doing a recvfrom() and a sendto() per message means
+two syscalls per few bytes. Instead each pass pulls up to opts->batch datagrams with one
+recvmmsg(), handles them together and sends every reply back with one sendmmsg().
+All of the message headers, buffers and peer addresses are allocated once per worker.
+
+With -P each datagram's values are handed to a processing thread instead (pipeline.c), picked
+by the sender's address so one sender's values stay in order. The socket is then read without
+blocking and the worker waits in poll() on both it and the pipeline's eventfd, so acks that
+come back from the processors (ACK_PROCESSED) go out in sendmmsg() batches of their own.
+
+Reference:
+    https://man7.org/linux/man-pages/man2/recvmmsg.2.html
+    https://man7.org/linux/man-pages/man2/sendmmsg.2.html
+*/
+#define _GNU_SOURCE  // recvmmsg() and sendmmsg()
+#include "udp_loop.h"
+#include "pipeline.h"
+
+#include <poll.h>
+
+/* Preallocated state for one batch. The ack for datagram i goes back to addrs[i], so the
+    reply headers point straight at the addresses recvmmsg() filled in.
+*/
+struct udp_batch
+{
+    int size;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *addrs;
+    uint8_t (*bufs)[UDP_DATAGRAM_SIZE];
+
+    struct mmsghdr *replies;
+    struct iovec *reply_iovs;
+    uint8_t (*reply_bufs)[MAX_REPLY_SIZE];
+};
+
+static int udp_batch_init(struct udp_batch *b, int size){
+    /* Allocate and wire up the message headers for a batch of 'size' datagrams.
+
+    return:
+        0 on success, -1 if out of memory.
+    */
+    memset(b, 0, sizeof(*b));
+    b->size = size;
+    b->msgs = calloc(size, sizeof(*b->msgs));
+    b->iovs = calloc(size, sizeof(*b->iovs));
+    b->addrs = calloc(size, sizeof(*b->addrs));
+    b->bufs = calloc(size, sizeof(*b->bufs));
+    b->replies = calloc(size, sizeof(*b->replies));
+    b->reply_iovs = calloc(size, sizeof(*b->reply_iovs));
+    b->reply_bufs = calloc(size, sizeof(*b->reply_bufs));
+    if (!b->msgs || !b->iovs || !b->addrs || !b->bufs || !b->replies || !b->reply_iovs || !b->reply_bufs){
+        return -1;
+    }
+
+    // The receive side never changes apart from the address length recvmmsg() overwrites
+    for (int i = 0; i < size; i++){
+        b->iovs[i].iov_base = b->bufs[i];
+        b->iovs[i].iov_len = UDP_DATAGRAM_SIZE;
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    }
+    return 0;
+}
+
+/* Acks handed back by the processing threads, each one copied with the address it goes to until
+    there is a batch of them to send.
+*/
+struct udp_acks
+{
+    int sockfd;
+    int size;
+    int count;
+    uint64_t since;  // stats_now() of the oldest frame acked in this batch
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *addrs;
+    uint8_t (*bufs)[MAX_REPLY_SIZE];
+};
+
+static int udp_acks_init(struct udp_acks *a, int sockfd, int size){
+    /* Allocate and wire up the ack batch for the pipeline.
+
+    return:
+        0 on success, -1 if out of memory.
+    */
+    memset(a, 0, sizeof(*a));
+    a->sockfd = sockfd;
+    a->size = size;
+    a->msgs = calloc(size, sizeof(*a->msgs));
+    a->iovs = calloc(size, sizeof(*a->iovs));
+    a->addrs = calloc(size, sizeof(*a->addrs));
+    a->bufs = calloc(size, sizeof(*a->bufs));
+    if (!a->msgs || !a->iovs || !a->addrs || !a->bufs){
+        return -1;
+    }
+    for (int i = 0; i < size; i++){
+        a->iovs[i].iov_base = a->bufs[i];
+        a->msgs[i].msg_hdr.msg_iov = &a->iovs[i];
+        a->msgs[i].msg_hdr.msg_iovlen = 1;
+        a->msgs[i].msg_hdr.msg_name = &a->addrs[i];
+    }
+    return 0;
+}
+
+static int send_replies(int sockfd, struct mmsghdr *replies, int count){
+    /* Send 'count' prepared acks, calling sendmmsg() again if the kernel takes only part of them.
+
+    return:
+        0 when all acks went out, -1 if the rest of the batch had to be dropped.
+    */
+    int sent = 0;
+    while (sent < count){
+        TRACE_BEGIN(ack);
+        int n = sendmmsg(sockfd, replies + sent, count - sent, 0);
+        TRACE_END(TRACE_ACK, ack);
+        stats_count(STAT_SEND_CALLS, 1);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            stats_count(STAT_SEND_ERRORS, count - sent);
+            // An ack lost on UDP looks like a lost datagram to the client, it will time out
+            log_msg(LOG_WARN, "Error sending confirmation messages back to clients.\n");
+            return -1;
+        }
+        for (int i = sent; i < sent + n; i++){
+            stats_count(STAT_BYTES_OUT, replies[i].msg_len);
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+static void flush_acks(struct udp_acks *a){
+    send_replies(a->sockfd, a->msgs, a->count);
+    stats_latency(a->since, a->count);
+    a->count = 0;
+}
+
+static void ack_ready(void *arg, struct pipe_msg *m){
+    // pipeline_drain() callback: a processor is done with a datagram, queue its ack
+    struct udp_acks *a = arg;
+
+    if (a->count == a->size){
+        flush_acks(a);
+    }
+    int i = a->count++;
+    if (i == 0 || m->received < a->since){
+        a->since = m->received;
+    }
+    memcpy(&a->addrs[i], pipe_msg_addr(m), m->addr_len);
+    memcpy(a->bufs[i], pipe_msg_reply(m), m->reply_len);
+    a->iovs[i].iov_len = m->reply_len;
+    a->msgs[i].msg_hdr.msg_namelen = m->addr_len;
+
+    // A reliable frame's retransmits are acked from here on, no longer dropped
+    if (m->flags & PIPE_RELIABLE){
+        rudp_done((struct sockaddr *)&a->addrs[i], ntohl(((struct reply_header *)a->bufs[i])->id));
+    }
+}
+
+static void take_acks(struct worker *w, struct udp_acks *acks){
+    // Send every ack the processors have handed back so far
+    pipeline_drain(w->pipeline, w->id, ack_ready, acks);
+    if (acks->count > 0){
+        flush_acks(acks);
+    }
+}
+
+static uint32_t peer_key(const struct sockaddr_storage *addr){
+    // Same sender, same processor
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    return ntohl(in->sin_addr.s_addr) * 31 + ntohs(in->sin_port);
+}
+
+static int queue_datagram(struct worker *w, struct udp_batch *b, int i, uint8_t *reply, struct udp_acks *acks, uint64_t received){
+    /* Check datagram i of the batch and hand its values to a processor (-P). When that
+    processor is full this waits for it to make room, sending the acks that come back meanwhile.
+
+    return:
+        Length of the reply to send now, 0 if the processor sends it back once done (ACK_PROCESSED),
+        -1 if the frame is invalid.
+    */
+    struct pipeline *pl = w->pipeline;
+    const uint8_t *values;
+    uint32_t count;
+    uint32_t sender = agg_sender_of((struct sockaddr *)&b->addrs[i]);
+    int deferred = pipeline_ack_policy(pl) == ACK_PROCESSED;
+    int reliable = rudp_reliable(b->bufs[i], b->msgs[i].msg_len);
+    uint32_t seq = reliable ? ntohl(((struct request_header *)b->bufs[i])->id) : 0;
+    struct rudp_ack ack;
+
+    // A retransmit is answered (or dropped) here, only the first copy goes to a processor
+    if (reliable){
+        switch (rudp_receive((struct sockaddr *)&b->addrs[i], seq, deferred, &ack)){
+            case RUDP_DUPLICATE:
+                return rudp_duplicate(b->bufs[i], reply, &ack);
+            case RUDP_PENDING:
+                return 0;
+        }
+    }
+
+    TRACE_BEGIN(check);
+    int reply_len = check_frame(b->bufs[i], b->msgs[i].msg_len, sender, reply, &values, &count);
+    TRACE_END(TRACE_CHECK, check);
+    if (reliable && reply_len > 0){
+        reply_len = rudp_reply(reply, reply_len, &ack);
+    }
+    if (reply_len == -1 || count == 0){
+        // Rejected frames are answered right away, order doesn't matter on udp. One refused as
+        // busy was never taken, its retransmit has to be processed.
+        if (reliable && reply_len > 0 && ((struct reply_header *)reply)->status == STATUS_BUSY){
+            rudp_forget((struct sockaddr *)&b->addrs[i], seq);
+        }
+        else if (reliable && deferred){
+            rudp_done((struct sockaddr *)&b->addrs[i], seq);
+        }
+        return reply_len;
+    }
+
+    size_t addr_len = deferred ? b->msgs[i].msg_hdr.msg_namelen : 0;
+    int proc = pipeline_processor(pl, peer_key(&b->addrs[i]));
+    struct pipe_msg *m;
+    struct pollfd pfd = { .fd = pipeline_wake_fd(pl, w->id), .events = POLLIN };
+
+    while ((m = pipeline_reserve(pl, w->id, proc, count, deferred ? reply_len : 0, addr_len)) == NULL){
+        stats_count(STAT_PIPELINE_FULL, 1);
+
+        // Backpressure, the socket isn't read until there's room (clear before looking again so no wakeup is lost)
+        pipeline_kick(pl, w->id);
+        pipeline_clear(pl, w->id);
+        take_acks(w, acks);
+        if ((m = pipeline_reserve(pl, w->id, proc, count, deferred ? reply_len : 0, addr_len)) != NULL){
+            break;
+        }
+        stats_count(STAT_WAIT_CALLS, 1);
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR){
+            log_msg(LOG_WARN, "Error waiting on the pipeline.\n");
+        }
+    }
+    m->sender = sender;
+    m->received = received;
+    if (reliable){
+        m->flags |= PIPE_RELIABLE;
+    }
+
+    if (deferred){
+        memcpy(pipe_msg_addr(m), &b->addrs[i], addr_len);
+        memcpy(pipe_msg_reply(m), reply, reply_len);
+    }
+    memcpy(pipe_msg_values(m), values, (size_t)count * sizeof(uint32_t));
+    pipeline_commit(pl, w->id, proc);
+    return deferred ? 0 : reply_len;
+}
+
+static void wait_for_work(struct worker *w, struct udp_acks *acks){
+    // Nothing left on the socket: send what came back, then sleep until a datagram or an ack shows up
+    struct pollfd pfds[2] = {
+        { .fd = w->sockfd, .events = POLLIN },
+        { .fd = pipeline_wake_fd(w->pipeline, w->id), .events = POLLIN },
+    };
+
+    pipeline_clear(w->pipeline, w->id);
+    take_acks(w, acks);
+    stats_count(STAT_WAIT_CALLS, 1);
+    if (poll(pfds, 2, -1) == -1 && errno != EINTR){
+        log_msg(LOG_WARN, "Error waiting on the socket.\n");
+    }
+}
+
+int udp_server_loop(struct worker *w){
+    /* Receive, process and ack UDP datagrams on this worker's socket, a batch at a time.
+
+    params:
+        w (worker *): Worker that owns the socket.
+
+    return:
+        -1 on a fatal error.
+    */
+    struct udp_batch batch;
+    struct udp_acks acks;
+    int sockfd = w->sockfd;
+    int flags = MSG_WAITFORONE;
+
+    if (udp_batch_init(&batch, w->opts->batch) == -1){
+        fprintf(stderr, "Out of memory for udp batch.\n");
+        return -1;
+    }
+
+    // Replies from the processors can show up at any time, so never block in recvmmsg()
+    if (w->pipeline != NULL){
+        if (udp_acks_init(&acks, sockfd, w->opts->batch) == -1){
+            fprintf(stderr, "Out of memory for udp acks.\n");
+            return -1;
+        }
+        flags = MSG_DONTWAIT;
+    }
+
+    while (1){
+        // recvmmsg() writes the sender's address length back, reset it for every slot
+        for (int i = 0; i < batch.size; i++){
+            batch.msgs[i].msg_hdr.msg_namelen = sizeof(batch.addrs[i]);
+        }
+
+        if (w->pipeline != NULL){
+            take_acks(w, &acks);
+        }
+
+        // Block for the first datagram (unless pipelined), then take whatever else is already queued
+        TRACE_BEGIN(recv);
+        int received = recvmmsg(sockfd, batch.msgs, batch.size, flags, NULL);
+        TRACE_END(TRACE_RECV, recv);
+        stats_count(STAT_RECV_CALLS, 1);
+        if (received == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (w->pipeline != NULL && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                wait_for_work(w, &acks);
+                continue;
+            }
+            stats_count(STAT_RECV_ERRORS, 1);
+            fprintf(stderr, "recvmmsg");
+            return -1;
+        }
+
+        // The -l queue limit goes by how much was waiting for the processors when the batch came in
+        if (w->pipeline != NULL && admit_queue_limited()){
+            admit_depth(pipeline_depth(w->pipeline));
+        }
+
+        uint64_t now = stats_now();
+        int replies = 0;
+        for (int i = 0; i < received; i++){
+            stats_count(STAT_BYTES_IN, batch.msgs[i].msg_len);
+
+            // Peers over the bad frame limit (-e) are ignored for a while
+            if (blocklist_blocked((struct sockaddr *)&batch.addrs[i])){
+                stats_count(STAT_BLOCKED_DROPS, 1);
+                continue;
+            }
+
+            // Anything but exactly one frame (of either version) is dropped with an error reply
+            uint8_t *reply = batch.reply_bufs[replies];
+            int reply_len;
+            TRACE_BEGIN(decode);
+            long frame_len = frame_length(batch.bufs[i], batch.msgs[i].msg_len);
+            TRACE_END(TRACE_DECODE, decode);
+            if (frame_len != (long)batch.msgs[i].msg_len){
+                reply_len = reject_frame(batch.bufs[i], batch.msgs[i].msg_len, (struct sockaddr *)&batch.addrs[i], reply);
+            }
+            else{
+                // Check the version, decode and display the message (or hand it to a processor)
+                if (w->pipeline != NULL){
+                    reply_len = queue_datagram(w, &batch, i, reply, &acks, now);
+                }
+                else{
+                    reply_len = rudp_process(batch.bufs[i], batch.msgs[i].msg_len, (struct sockaddr *)&batch.addrs[i], reply);
+                }
+                if (reply_len == -1){
+                    continue;
+                }
+                stats_count(STAT_FRAMES, 1);
+            }
+            if (reply_len == 0){
+                continue;
+            }
+
+            // Queue the reply for the address this datagram came from
+            batch.reply_iovs[replies].iov_base = reply;
+            batch.reply_iovs[replies].iov_len = reply_len;
+            batch.replies[replies].msg_hdr.msg_iov = &batch.reply_iovs[replies];
+            batch.replies[replies].msg_hdr.msg_iovlen = 1;
+            batch.replies[replies].msg_hdr.msg_name = &batch.addrs[i];
+            batch.replies[replies].msg_hdr.msg_namelen = batch.msgs[i].msg_hdr.msg_namelen;
+            replies++;
+        }
+
+        send_replies(sockfd, batch.replies, replies);
+        stats_latency(now, replies);
+        if (w->pipeline != NULL){
+            pipeline_kick(w->pipeline, w->id);
+        }
+    }
+}
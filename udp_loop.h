@@ -0,0 +1,17 @@
+#ifndef UDP_LOOP_H
+#define UDP_LOOP_H
+
+#include "server.h"
+
+// Default and max datagrams handled per recvmmsg()/sendmmsg() call (-b)
+#define UDP_DEFAULT_BATCH 64
+#define UDP_MAX_BATCH 1024
+
+/* Room for one datagram, bigger than any valid frame so oversized ones can be spotted. With
+    64KB batches allowed this is the bulk of a worker's memory: -b slots of it each.
+*/
+#define UDP_DATAGRAM_SIZE (PROTOCOL_MAX_FRAME + 1)
+
+int udp_server_loop(struct worker *w);
+
+#endif
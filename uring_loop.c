@@ -0,0 +1,1003 @@
+/* io_uring backend for the server's receive/ack path (-u).
+
+Instead of one accept/recv/send syscall per step, each worker keeps a ring where:
+    - one multishot accept keeps producing new TCP connections,
+    - one multishot recv per connection (multishot recvmsg for UDP) keeps filling buffers
+      picked by the kernel from a provided buffer ring, so nothing is preallocated per
+      connection and idle clients hold no buffers,
+    - acks go out as send/sendmsg submissions. A TCP connection has at most one send in flight
+      (so acks stay in order), and its final send is linked to the close of the socket.
+Everything is submitted and reaped with a single io_uring_enter() per loop pass.
+
+This talks to the kernel through the raw syscalls and <linux/io_uring.h> rather than liburing
+so the build doesn't pick up another dependency. uring_supported() checks the kernel has
+everything we use (5.19 for buffer rings, 6.0 for multishot recv), otherwise the server falls
+back to the epoll/recvmmsg loops.
+
+Reference:
+    https://man7.org/linux/man-pages/man7/io_uring.7.html
+    https://kernel.dk/io_uring.pdf
+*/
+#include "uring_loop.h"
+#include "pool.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+
+// What a completion belongs to, kept in the low bits of user_data (our structs are 8 byte aligned)
+enum uring_tag
+{
+    TAG_ACCEPT = 1,
+    TAG_RECV,
+    TAG_SEND,
+    TAG_CLOSE,
+    TAG_CANCEL,
+    TAG_UDP_RECV,
+    TAG_UDP_SEND
+};
+#define TAG_MASK 7ULL
+
+// Stop receiving from a client with this many acks queued, resume below the low mark
+#define URING_HIGH_WATER (64 * 1024)
+#define URING_LOW_WATER (16 * 1024)
+
+// Pooled ack buffer: fits the high water mark plus the replies to one more recv buffer
+#define URING_OUT_SIZE (URING_HIGH_WATER + URING_BUF_SIZE + MAX_REPLY_SIZE)
+
+// The ring itself, mapped from the kernel
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;  // one past the last sqe handed out, published on submit
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Provided buffers (group 0) the kernel picks from for every multishot recv
+    unsigned buf_count;  // power of two
+    size_t buf_size;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *bufs;
+};
+
+// One TCP client
+struct uring_conn
+{
+    int fd;
+    int recv_armed;      // multishot recv outstanding
+    int cancel_pending;  // asked the kernel to stop that recv
+    int paused;          // too many acks queued, not receiving until they drain
+    int closing;         // peer hung up or sent a bad frame
+    int broken;          // send failed, queued acks are dropped
+    int send_inflight;
+    int close_submitted;
+
+    uint8_t *partial;    // a frame split across two recv buffers: partial_small, or a pooled big buffer
+    size_t partial_len;
+    size_t partial_cap;
+
+    // Ack buffers come from the pool (URING_OUT_SIZE) while there are acks to hold, NULL otherwise
+    uint8_t *out;        // replies waiting for the next send
+    size_t out_len;
+    size_t out_cap;
+    uint64_t out_since;  // stats_now() of the recv that brought the oldest of them
+    uint32_t out_frames;
+    uint64_t rx_time;    // stats_now() of the last recv
+    uint32_t peer;       // agg_sender_of() the peer
+    uint8_t *sending;    // acks owned by the send in flight
+    size_t send_len;
+    size_t send_off;
+    size_t send_cap;
+
+    uint8_t partial_small[URING_PARTIAL_SIZE];
+};
+
+// One queued UDP ack, its msghdr has to live until the send completes
+struct uring_udp_send
+{
+    struct msghdr hdr;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    uint8_t reply[MAX_REPLY_SIZE];
+    struct uring_udp_send *next_free;
+};
+
+struct uring_server
+{
+    struct uring ring;
+    struct worker *w;
+
+    struct msghdr udp_recv_hdr;           // template for the multishot recvmsg
+    struct uring_udp_send *udp_sends;
+    struct uring_udp_send *udp_free;
+
+    struct pool conns;                    // -C connections
+    struct pool outs;                     // their ack buffers, two each
+    struct pool bigs;                     // URING_BIG_SIZE buffers for large split frames
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_exit(struct uring *u){
+    // Unmap and close a ring set up by uring_setup()
+    if (u->buf_ring != NULL){
+        munmap(u->buf_ring, u->buf_ring_size);
+    }
+    free(u->bufs);
+    if (u->sqes != NULL){
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring){
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring != NULL){
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    close(u->fd);
+}
+
+static int uring_setup(struct uring *u, unsigned entries){
+    /* Create a ring with 'entries' submission slots and map its queues.
+
+    return:
+        0 on success, -1 if the kernel refused (errno is set).
+    */
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd == -1){
+        return -1;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (u->cq_ring_size > u->sq_ring_size){
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED){
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        u->cq_ring = u->sq_ring;
+    }
+    else{
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED){
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED){
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = u->sq_ring;
+    uint8_t *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Slot i of the sqe array always holds sqe i, so the indirection array is set once
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++){
+        array[i] = i;
+    }
+    return 0;
+
+fail:
+    uring_exit(u);
+    return -1;
+}
+
+static int uring_submit(struct uring *u, unsigned wait_nr){
+    /* Hand every queued sqe to the kernel and optionally wait for 'wait_nr' completions.
+
+    return:
+        0 on success, -1 on error.
+    */
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (sys_io_uring_enter(u->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0) == -1){
+        // Interrupted or the completion queue is backed up, both sort themselves out next pass
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY){
+            return 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *u){
+    /* Get a zeroed submission slot, flushing the queue to the kernel if it's full.
+
+    return:
+        The sqe, or NULL if the kernel isn't taking submissions.
+    */
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local_tail - head >= u->sq_entries){
+        uring_submit(u, 0);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local_tail - head >= u->sq_entries){
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local_tail++;
+    return sqe;
+}
+
+static void uring_buf_recycle(struct uring *u, unsigned bid){
+    // Give provided buffer 'bid' back to the kernel
+    unsigned short tail = u->buf_ring->tail;
+    struct io_uring_buf *buf = &u->buf_ring->bufs[tail & (u->buf_count - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * u->buf_size);
+    buf->len = u->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&u->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_setup_buffers(struct uring *u, unsigned count, size_t size){
+    /* Register the provided buffer ring (group 0) and fill it with 'count' buffers of 'size' bytes.
+
+    return:
+        0 on success, -1 on error (errno is set).
+    */
+    struct io_uring_buf_reg reg;
+
+    u->buf_count = count;
+    u->buf_size = size;
+    u->buf_ring_size = count * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (u->buf_ring == MAP_FAILED){
+        u->buf_ring = NULL;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = 0;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+        return -1;
+    }
+
+    u->bufs = malloc((size_t)count * size);
+    if (u->bufs == NULL){
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++){
+        uring_buf_recycle(u, i);
+    }
+    return 0;
+}
+
+int uring_supported(void){
+    /* Check the running kernel has everything the io_uring loop needs: the opcodes below, a
+    provided buffer ring and multishot recv. There's no probe bit for multishot recv, it came in
+    6.0 together with IORING_OP_SEND_ZC, so that opcode stands in for it.
+
+    return:
+        1 if the io_uring loop can run, 0 if we have to fall back.
+    */
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+        IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC
+    };
+    struct uring u;
+    int ok = 1;
+
+    if (uring_setup(&u, 8) == -1){
+        return 0;
+    }
+
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (probe == NULL || sys_io_uring_register(u.fd, IORING_REGISTER_PROBE, probe, 256) == -1){
+        ok = 0;
+    }
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++){
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)){
+            ok = 0;
+        }
+    }
+    free(probe);
+
+    // Buffer rings need 5.19
+    if (ok && uring_setup_buffers(&u, 8, URING_BUF_SIZE) == -1){
+        ok = 0;
+    }
+
+    uring_exit(&u);
+    return ok;
+}
+
+static void *untag(uint64_t user_data){
+    return (void *)(uintptr_t)(user_data & ~TAG_MASK);
+}
+
+static uint64_t tag(void *ptr, enum uring_tag t){
+    return (uint64_t)(uintptr_t)ptr | t;
+}
+
+static void arm_accept(struct uring_server *s){
+    // One multishot accept keeps producing a completion per new connection
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->w->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag(NULL, TAG_ACCEPT);
+}
+
+static void arm_recv(struct uring_server *s, struct uring_conn *c){
+    // Multishot recv, the kernel picks a buffer from group 0 for every chunk it delivers
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = tag(c, TAG_RECV);
+    c->recv_armed = 1;
+}
+
+static void cancel_recv(struct uring_server *s, struct uring_conn *c){
+    // Ask the kernel to end the connection's multishot recv, its last completion clears recv_armed
+    if (!c->recv_armed || c->cancel_pending){
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(c, TAG_RECV);
+    sqe->user_data = tag(NULL, TAG_CANCEL);
+    c->cancel_pending = 1;
+}
+
+static void submit_close(struct uring_server *s, struct uring_conn *c){
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    sqe->user_data = tag(c, TAG_CLOSE);
+    c->close_submitted = 1;
+}
+
+static void submit_send(struct uring_server *s, struct uring_conn *c){
+    /* Send whatever the in-flight buffer still holds. If the connection is finished this is its
+    last send, so link the close behind it: the socket closes as soon as the acks are out. */
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->sending + c->send_off);
+    sqe->len = c->send_len - c->send_off;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = tag(c, TAG_SEND);
+    c->send_inflight = 1;
+    stats_count(STAT_SEND_CALLS, 1);
+
+    if (c->closing && !c->recv_armed && c->out_len == 0){
+        sqe->flags |= IOSQE_IO_LINK;
+        submit_close(s, c);
+    }
+}
+
+static void conn_progress(struct uring_server *s, struct uring_conn *c){
+    /* Decide the connection's next step after any of its completions: send queued acks, pause or
+    resume receiving, or close once nothing of ours is in flight anymore. */
+    if (c->close_submitted){
+        return;
+    }
+
+    if (c->closing || c->paused){
+        cancel_recv(s, c);
+    }
+
+    if (!c->send_inflight && c->out_len > 0 && !c->broken){
+        // Swap buffers, the queued acks become the in-flight send
+        uint8_t *buf = c->sending;
+        size_t cap = c->send_cap;
+        c->sending = c->out;
+        c->send_cap = c->out_cap;
+        c->send_len = c->out_len;
+        c->send_off = 0;
+        c->out = buf;
+        c->out_cap = cap;
+        c->out_len = 0;
+        submit_send(s, c);
+
+        // The acks are with the kernel as of the next submit, which is before we wait again
+        stats_latency(c->out_since, c->out_frames);
+        c->out_frames = 0;
+        return;
+    }
+
+    if (c->closing && !c->recv_armed && !c->send_inflight){
+        submit_close(s, c);
+    }
+    else if (!c->closing && !c->paused && !c->recv_armed){
+        arm_recv(s, c);
+    }
+}
+
+static void ack_buffer_put(struct uring_server *s, uint8_t *buf, size_t cap){
+    // Give back an ack buffer, to the pool unless it had to move to the heap
+    if (buf == NULL){
+        return;
+    }
+    if (cap == URING_OUT_SIZE){
+        pool_put(&s->outs, buf);
+    }
+    else{
+        free(buf);
+    }
+}
+
+static int out_reserve(struct uring_server *s, struct uring_conn *c){
+    // Make room for one more reply in the connection's queue, -1 if there is none to be had
+    if (c->out == NULL){
+        c->out = pool_get(&s->outs);
+        if (c->out == NULL){
+            log_msg(LOG_WARN, "No ack buffer left for connection %d.\n", c->fd);
+            stats_count(STAT_POOL_EMPTY, 1);
+            return -1;
+        }
+        c->out_cap = URING_OUT_SIZE;
+    }
+    if (c->out_len + MAX_REPLY_SIZE > c->out_cap){
+        // Only a client that keeps sending after being paused gets here, its acks move to the heap
+        size_t cap = c->out_cap * 2;
+        uint8_t *out = malloc(cap);
+        if (out == NULL){
+            return -1;
+        }
+        memcpy(out, c->out, c->out_len);
+        ack_buffer_put(s, c->out, c->out_cap);
+        c->out = out;
+        c->out_cap = cap;
+    }
+    return 0;
+}
+
+static void queue_reject(struct uring_server *s, struct uring_conn *c, const uint8_t *frame, size_t len){
+    /* Queue the error reply for a frame frame_length() refused. Nothing after it can be framed,
+    so the connection closes once its queued replies (this one last) are sent. */
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+
+    c->closing = 1;
+    if (getpeername(c->fd, (struct sockaddr *)&peer, &peer_len) == -1){
+        peer.ss_family = AF_UNSPEC;
+    }
+    if (out_reserve(s, c) == -1){
+        return;
+    }
+    c->out_len += reject_frame(frame, len, (struct sockaddr *)&peer, c->out + c->out_len);
+}
+
+static int queue_ack(struct uring_server *s, struct uring_conn *c, const uint8_t *frame, size_t len){
+    /* Process one frame and append its reply to the connection's queue.
+
+    return:
+        0 on success, -1 if the frame was invalid or there was no room for its reply.
+    */
+    if (out_reserve(s, c) == -1){
+        return -1;
+    }
+
+    int reply_len = process_frame(frame, len, c->peer, c->out + c->out_len);
+    if (reply_len == -1){
+        return -1;
+    }
+    c->out_len += reply_len;
+    if (c->out_frames++ == 0){
+        c->out_since = c->rx_time;
+    }
+    return 0;
+}
+
+static int partial_reserve(struct uring_server *s, struct uring_conn *c, size_t size){
+    // Make c->partial hold at least 'size' bytes (at most one frame), -1 if no big buffer is left
+    if (size <= c->partial_cap){
+        return 0;
+    }
+    uint8_t *big = pool_get(&s->bigs);
+    if (big == NULL){
+        log_msg(LOG_WARN, "No large frame buffer left for connection %d.\n", c->fd);
+        stats_count(STAT_POOL_EMPTY, 1);
+        return -1;
+    }
+    memcpy(big, c->partial, c->partial_len);
+    c->partial = big;
+    c->partial_cap = URING_BIG_SIZE;
+    return 0;
+}
+
+static void partial_release(struct uring_server *s, struct uring_conn *c){
+    // The split frame is done, hand its big buffer back (if it needed one)
+    if (c->partial != c->partial_small){
+        pool_put(&s->bigs, c->partial);
+        c->partial = c->partial_small;
+        c->partial_cap = sizeof(c->partial_small);
+    }
+}
+
+static void handle_stream(struct uring_server *s, struct uring_conn *c, uint8_t *data, size_t len){
+    /* Cut a received chunk into frames and queue a reply for each one, carrying a frame split
+    across chunks over in c->partial. */
+    long frame_len;
+
+    // Finish the frame left over from the last chunk, a header first if we don't know its length yet
+    while (c->partial_len > 0 && len > 0){
+        frame_len = frame_length(c->partial, c->partial_len);
+        if (frame_len == -1){
+            queue_reject(s, c, c->partial, c->partial_len);
+            return;
+        }
+        size_t target = frame_len ? (size_t)frame_len : sizeof(struct request_header);
+        size_t take = target - c->partial_len;
+        if (take > len){
+            take = len;
+        }
+        if (partial_reserve(s, c, c->partial_len + take) == -1){
+            c->closing = 1;
+            return;
+        }
+        memcpy(c->partial + c->partial_len, data, take);
+        c->partial_len += take;
+        data += take;
+        len -= take;
+
+        if (frame_len > 0 && c->partial_len == (size_t)frame_len){
+            c->partial_len = 0;
+            int queued = queue_ack(s, c, c->partial, frame_len);
+            partial_release(s, c);
+            if (queued == -1){
+                c->closing = 1;
+                return;
+            }
+            stats_count(STAT_FRAMES, 1);
+        }
+    }
+
+    while (len > 0){
+        frame_len = frame_length(data, len);
+        if (frame_len == -1){
+            // Drop only this client, everyone else keeps being served
+            queue_reject(s, c, data, len);
+            return;
+        }
+        if (frame_len == 0 || (size_t)frame_len > len){
+            break;
+        }
+        if (queue_ack(s, c, data, frame_len) == -1){
+            c->closing = 1;
+            return;
+        }
+        stats_count(STAT_FRAMES, 1);
+        data += frame_len;
+        len -= frame_len;
+    }
+
+    // Less than a frame is left, keep it for the next chunk
+    if (partial_reserve(s, c, c->partial_len + len) == -1){
+        c->closing = 1;
+        return;
+    }
+    memcpy(c->partial + c->partial_len, data, len);
+    c->partial_len += len;
+
+    // The client isn't reading its replies, stop taking its frames for now
+    if (c->out_len + c->send_len - c->send_off > URING_HIGH_WATER){
+        c->paused = 1;
+    }
+}
+
+static void conn_free(struct uring_server *s, struct uring_conn *c){
+    // Give the connection and whatever buffers it holds back to the worker's pools
+    partial_release(s, c);
+    ack_buffer_put(s, c->out, c->out_cap);
+    ack_buffer_put(s, c->sending, c->send_cap);
+    pool_put(&s->conns, c);
+}
+
+static void on_accept(struct uring_server *s, struct io_uring_cqe *cqe){
+    int one = 1;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)){
+        arm_accept(s);
+    }
+    if (cqe->res < 0){
+        // Out of fds or memory, the remaining clients stay queued in the backlog
+        log_msg(LOG_WARN, "Error accepting connection: %s\n", strerror(-cqe->res));
+        stats_count(STAT_ACCEPT_ERRORS, 1);
+        return;
+    }
+
+    // Peers over the bad frame limit (-e) are turned away for a while
+    if (blocklist_fd_blocked(cqe->res)){
+        stats_count(STAT_BLOCKED_DROPS, 1);
+        close(cqe->res);
+        return;
+    }
+
+    // Replies are only a few bytes each, don't let Nagle hold them back
+    setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // At the -C limit the new client is turned away, the ones already connected keep going
+    struct uring_conn *c = pool_get(&s->conns);
+    if (c == NULL){
+        log_msg(LOG_WARN, "Connection limit of %d reached.\n", s->w->opts->max_conns);
+        stats_count(STAT_POOL_EMPTY, 1);
+        close(cqe->res);
+        return;
+    }
+    stats_count(STAT_ACCEPTS, 1);
+    memset(c, 0, offsetof(struct uring_conn, partial_small));
+    c->fd = cqe->res;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(c->fd, (struct sockaddr *)&peer, &peer_len) == 0){
+        c->peer = agg_sender_of((struct sockaddr *)&peer);
+    }
+    c->partial = c->partial_small;
+    c->partial_cap = sizeof(c->partial_small);
+    arm_recv(s, c);
+}
+
+static void on_recv(struct uring_server *s, struct uring_conn *c, struct io_uring_cqe *cqe){
+    if (!(cqe->flags & IORING_CQE_F_MORE)){
+        c->recv_armed = 0;
+        c->cancel_pending = 0;
+    }
+    stats_count(STAT_RECV_CALLS, 1);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER){
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !c->closing){
+            stats_count(STAT_BYTES_IN, cqe->res);
+            c->rx_time = stats_now();
+            handle_stream(s, c, s->ring.bufs + (size_t)bid * s->ring.buf_size, cqe->res);
+        }
+        uring_buf_recycle(&s->ring, bid);
+    }
+
+    // Out of buffers (-ENOBUFS) or cancelled for backpressure just means re-arm later
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)){
+        if (cqe->res < 0){
+            stats_count(STAT_RECV_ERRORS, 1);
+        }
+        c->closing = 1;
+    }
+    conn_progress(s, c);
+}
+
+static void on_send(struct uring_server *s, struct uring_conn *c, struct io_uring_cqe *cqe){
+    c->send_inflight = 0;
+    if (cqe->res < 0){
+        if (!c->close_submitted){
+            log_msg(LOG_WARN, "Failed to send back to client.\n");
+            stats_count(STAT_SEND_ERRORS, 1);
+        }
+        c->broken = 1;
+        c->closing = 1;
+    }
+    else{
+        stats_count(STAT_BYTES_OUT, cqe->res);
+        c->send_off += cqe->res;
+        if (c->send_off < c->send_len && !c->close_submitted){
+            submit_send(s, c);
+            return;
+        }
+        c->send_len = 0;
+        c->send_off = 0;
+
+        // Idle connections hold no ack buffers
+        ack_buffer_put(s, c->sending, c->send_cap);
+        c->sending = NULL;
+        c->send_cap = 0;
+    }
+
+    // Acks drained, take frames from this client again
+    if (c->paused && c->out_len < URING_LOW_WATER){
+        c->paused = 0;
+    }
+    conn_progress(s, c);
+}
+
+static void on_close(struct uring_server *s, struct uring_conn *c, struct io_uring_cqe *cqe){
+    // The send before a linked close failed, so the close was cancelled with it
+    if (cqe->res == -ECANCELED){
+        c->close_submitted = 0;
+        conn_progress(s, c);
+        return;
+    }
+    stats_count(STAT_CLOSES, 1);
+    conn_free(s, c);
+}
+
+static void arm_udp_recv(struct uring_server *s){
+    // Multishot recvmsg, each buffer holds an io_uring_recvmsg_out header, the peer address and the datagram
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = s->w->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->udp_recv_hdr;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = tag(NULL, TAG_UDP_RECV);
+}
+
+static void on_udp_recv(struct uring_server *s, struct io_uring_cqe *cqe){
+    if (!(cqe->flags & IORING_CQE_F_MORE)){
+        arm_udp_recv(s);
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)){
+        // Running out of buffers (-ENOBUFS) only ends the multishot, it was re-armed above
+        if (cqe->res < 0 && cqe->res != -ENOBUFS){
+            stats_count(STAT_RECV_ERRORS, 1);
+        }
+        return;
+    }
+    stats_count(STAT_RECV_CALLS, 1);
+
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *buf = s->ring.bufs + (size_t)bid * s->ring.buf_size;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    uint8_t *name = buf + sizeof(*out);
+    uint8_t *payload = name + s->udp_recv_hdr.msg_namelen;
+    struct uring_udp_send *slot = s->udp_free;
+
+    if (cqe->res <= 0 || slot == NULL){
+        uring_buf_recycle(&s->ring, bid);
+        return;
+    }
+    stats_count(STAT_BYTES_IN, out->payloadlen);
+
+    // Peers over the bad frame limit (-e) are ignored for a while
+    if (blocklist_blocked((struct sockaddr *)name)){
+        stats_count(STAT_BLOCKED_DROPS, 1);
+        uring_buf_recycle(&s->ring, bid);
+        return;
+    }
+
+    // Anything but exactly one frame (of either version) is dropped with an error reply
+    uint64_t received = stats_now();
+    int reply_len;
+    if ((out->flags & MSG_TRUNC) || frame_length(payload, out->payloadlen) != (long)out->payloadlen){
+        reply_len = reject_frame(payload, out->payloadlen, (struct sockaddr *)name, slot->reply);
+    }
+    else{
+        reply_len = rudp_process(payload, out->payloadlen, (struct sockaddr *)name, slot->reply);
+        if (reply_len != -1){
+            stats_count(STAT_FRAMES, 1);
+        }
+    }
+    if (reply_len > 0){
+        slot->iov.iov_len = reply_len;
+        s->udp_free = slot->next_free;
+
+        // Send the ack back to the address the datagram came from
+        memcpy(&slot->addr, name, out->namelen < sizeof(slot->addr) ? out->namelen : sizeof(slot->addr));
+        slot->hdr.msg_namelen = out->namelen;
+        struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+        if (sqe == NULL){
+            slot->next_free = s->udp_free;
+            s->udp_free = slot;
+        }
+        else{
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = s->w->sockfd;
+            sqe->addr = (uint64_t)(uintptr_t)&slot->hdr;
+            sqe->len = 1;
+            sqe->user_data = tag(slot, TAG_UDP_SEND);
+            stats_count(STAT_SEND_CALLS, 1);
+            stats_latency(received, 1);
+        }
+    }
+    uring_buf_recycle(&s->ring, bid);
+}
+
+static void on_udp_send(struct uring_server *s, struct uring_udp_send *slot, struct io_uring_cqe *cqe){
+    if (cqe->res < 0){
+        // An ack lost on UDP looks like a lost datagram to the client, it will time out
+        log_msg(LOG_WARN, "Error sending confirmation message back to client.\n");
+        stats_count(STAT_SEND_ERRORS, 1);
+    }
+    else{
+        stats_count(STAT_BYTES_OUT, cqe->res);
+    }
+    slot->next_free = s->udp_free;
+    s->udp_free = slot;
+}
+
+static int udp_setup(struct uring_server *s){
+    // Wire up the recvmsg template and the pool of ack slots
+    s->udp_recv_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    s->udp_sends = calloc(URING_UDP_SENDS, sizeof(*s->udp_sends));
+    if (s->udp_sends == NULL){
+        return -1;
+    }
+    for (int i = 0; i < URING_UDP_SENDS; i++){
+        struct uring_udp_send *slot = &s->udp_sends[i];
+        slot->iov.iov_base = slot->reply;
+        slot->hdr.msg_name = &slot->addr;
+        slot->hdr.msg_iov = &slot->iov;
+        slot->hdr.msg_iovlen = 1;
+        slot->next_free = s->udp_free;
+        s->udp_free = slot;
+    }
+    return 0;
+}
+
+int uring_server_loop(struct worker *w){
+    /* Serve this worker's socket (tcp or udp) entirely through io_uring.
+
+    params:
+        w (worker *): Worker owning the bound socket.
+
+    return:
+        -1 on error.
+    */
+    struct uring_server server;
+    struct uring_server *s = &server;
+
+    memset(s, 0, sizeof(*s));
+    s->w = w;
+    int tcp = w->opts->sock_type == SOCK_STREAM;
+    if (uring_setup(&s->ring, URING_ENTRIES) == -1
+            || uring_setup_buffers(&s->ring, tcp ? URING_BUFFERS : URING_UDP_BUFFERS,
+                    tcp ? URING_BUF_SIZE : URING_UDP_BUF_SIZE) == -1){
+        fprintf(stderr, "Error setting up io_uring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (tcp){
+        // Every connection this worker will ever hold, and the buffers they borrow
+        int max_conns = w->opts->max_conns;
+        if (pool_init(&s->conns, sizeof(struct uring_conn), max_conns) == -1
+                || pool_init(&s->outs, URING_OUT_SIZE, 2 * max_conns) == -1
+                || pool_init(&s->bigs, URING_BIG_SIZE, max_conns / POOL_BIG_SHARE + 1) == -1){
+            return -1;
+        }
+        if (listen(w->sockfd, URING_ENTRIES) == -1){
+            fprintf(stderr, "Error seting up accept connection on socket.\n");
+            return -1;
+        }
+        arm_accept(s);
+    }
+    else{
+        if (udp_setup(s) == -1){
+            fprintf(stderr, "Out of memory for udp acks.\n");
+            return -1;
+        }
+        arm_udp_recv(s);
+    }
+
+    while (1){
+        // Submit everything queued last pass and sleep until at least one completion
+        stats_count(STAT_WAIT_CALLS, 1);
+        if (uring_submit(&s->ring, 1) == -1){
+            fprintf(stderr, "Error waiting on io_uring: %s\n", strerror(errno));
+            return -1;
+        }
+
+        unsigned head = *s->ring.cq_head;
+        unsigned tail = __atomic_load_n(s->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++){
+            struct io_uring_cqe *cqe = &s->ring.cqes[head & *s->ring.cq_mask];
+            void *ptr = untag(cqe->user_data);
+
+            switch (cqe->user_data & TAG_MASK){
+                case TAG_ACCEPT:
+                    on_accept(s, cqe);
+                    break;
+                case TAG_RECV:
+                    on_recv(s, ptr, cqe);
+                    break;
+                case TAG_SEND:
+                    on_send(s, ptr, cqe);
+                    break;
+                case TAG_CLOSE:
+                    on_close(s, ptr, cqe);
+                    break;
+                case TAG_UDP_RECV:
+                    on_udp_recv(s, cqe);
+                    break;
+                case TAG_UDP_SEND:
+                    on_udp_send(s, ptr, cqe);
+                    break;
+                default:
+                    // Cancel requests need nothing, the cancelled recv reports itself
+                    break;
+            }
+        }
+        __atomic_store_n(s->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#else
+
+// Kernel headers too old for multishot io_uring, always use the epoll/recvmmsg loops
+int uring_supported(void){
+    return 0;
+}
+
+int uring_server_loop(struct worker *w){
+    (void)w;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "server.h"
+
+/* Sizing for the io_uring backend (per worker).
+    URING_ENTRIES is the submission queue size, the completion queue gets four times that.
+    URING_BUFFERS provided buffers of URING_BUF_SIZE bytes are shared by every multishot recv.
+    UDP uses fewer, bigger buffers instead (URING_UDP_BUFFERS of URING_UDP_BUF_SIZE), since each one
+        has to hold a whole datagram of up to PROTOCOL_MAX_FRAME bytes plus the recvmsg headers.
+    URING_UDP_SENDS is how many udp acks can be in flight at once.
+    URING_PARTIAL_SIZE is kept inline in each connection for a frame split across two recv buffers,
+        a bigger one borrows a URING_BIG_SIZE buffer from the worker's pool until it is complete.
+*/
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024
+#define URING_BUF_SIZE 4096
+#define URING_UDP_BUFFERS 128
+#define URING_UDP_BUF_SIZE (PROTOCOL_MAX_FRAME + 512)
+#define URING_UDP_SENDS 1024
+#define URING_PARTIAL_SIZE 256
+#define URING_BIG_SIZE 65536  // smallest power of two >= PROTOCOL_MAX_FRAME
+
+int uring_supported(void);
+int uring_server_loop(struct worker *w);
+
+#endif
@@ -0,0 +1,427 @@
+/* Write-ahead log with group commit (see wal.h).
+
+Layout:
+    - Two batch buffers. Appenders copy records into the active one under the lock; the syncer
+      swaps them, and writes and syncs the full one without the lock while the next batch fills.
+      An appender that finds the active buffer full waits for the swap, which is what holds the
+      processing threads (and through their rings the workers) back when the disk can't keep up.
+    - wal.lsn is the end of the last record appended, wal.synced the end of the last one on
+      disk. A record's LSN is where it ends, so it is durable once wal_synced() >= its LSN.
+    - Segments only change between batches, so a record never straddles two files.
+
+A failed write() or fdatasync() ends the server: acking values that may not be on disk would
+break the one promise -D makes.
+
+Reference:
+    https://www.postgresql.org/docs/current/wal-reliability.html
+    https://wiki.postgresql.org/wiki/Fsync_Errors
+*/
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+static struct
+{
+    int enabled;
+    int dirfd;
+    int fd;                   // current segment
+    uint64_t segment_start;   // LSN the current segment starts at
+    uint64_t segment_bytes;   // -S: start a new segment once one holds this much
+    uint64_t group_ns;        // -G
+
+    pthread_mutex_t lock;     // guards everything below up to 'synced'
+    pthread_cond_t filled;    // the syncer waits on it for a batch
+    pthread_cond_t drained;   // appenders wait on it for room
+    uint8_t *bufs[2];
+    int active;               // buffer being filled
+    size_t fill;              // bytes in it
+    uint64_t first_ns;        // when its first record was appended
+    uint64_t lsn;             // end of the last record appended
+
+    uint64_t synced;          // end of the last record on disk, read without the lock
+    uint64_t syncs;
+    uint64_t bytes;
+    wal_sync_fn notify;
+    void *notify_arg;
+    pthread_t thread;
+} wal = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .dirfd = -1 };
+
+static uint32_t crc_table[256];
+static int crc_hw;
+
+__attribute__((constructor))
+static void crc_setup(void){
+    // Castagnoli polynomial (reflected), the one SSE4.2's crc32 instruction computes. Run at
+    // startup so wal_crc() works without wal_init() (recover.c, bench.c).
+    for (uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++){
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+#if defined(__x86_64__)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *p, size_t len){
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8){
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    for (; len > 0; p++, len--){
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+uint32_t wal_crc(uint32_t crc, const void *data, size_t len){
+    /* CRC-32C of a run of bytes, continuing from 'crc' (0 to start). Uses the SSE4.2
+    instruction when the CPU has it.
+    */
+    const uint8_t *p = data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc_hw){
+        return ~crc_sse42(crc, p, len);
+    }
+#endif
+    for (size_t i = 0; i < len; i++){
+        crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fail(const char *what){
+    // The log can't be trusted any more, stop before acking anything else
+    fprintf(stderr, "Write-ahead log %s failed: %s. Stopping the server.\n", what, strerror(errno));
+    exit(-1);
+}
+
+static int open_segment(uint64_t lsn){
+    /* Make 'lsn' the start of the current segment (creating it, or appending to an empty one
+    left from before) and sync the directory so the file itself survives a crash.
+
+    return:
+        0 on success, -1 on error.
+    */
+    char name[64];
+    snprintf(name, sizeof(name), "wal-%016" PRIx64 ".log", lsn);
+    int fd = openat(wal.dirfd, name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1){
+        return -1;
+    }
+    if (fsync(wal.dirfd) == -1){
+        close(fd);
+        return -1;
+    }
+    if (wal.fd != -1){
+        close(wal.fd);
+    }
+    wal.fd = fd;
+    wal.segment_start = lsn;
+    return 0;
+}
+
+static void write_batch(const uint8_t *buf, size_t len, uint64_t start){
+    // Write one batch that starts at LSN 'start' and sync it, rotating the segment first if it's full
+    if (start - wal.segment_start >= wal.segment_bytes && open_segment(start) == -1){
+        fail("segment rotation");
+    }
+    while (len > 0){
+        ssize_t n = write(wal.fd, buf, len);
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            fail("write");
+        }
+        buf += n;
+        len -= n;
+    }
+    if (fdatasync(wal.fd) == -1){
+        fail("fdatasync");
+    }
+}
+
+static void *syncer_main(void *arg){
+    // Thread entry point: write and sync batches as they fill, never returns
+    (void)arg;
+
+    pthread_mutex_lock(&wal.lock);
+    while (1){
+        while (wal.fill == 0){
+            pthread_cond_wait(&wal.filled, &wal.lock);
+        }
+
+        // Let the batch grow until it's big enough or its oldest record has waited out -G
+        while (wal.fill < WAL_GROUP_BYTES){
+            uint64_t deadline = wal.first_ns + wal.group_ns;
+            if (now_ns() >= deadline){
+                break;
+            }
+            struct timespec ts = { .tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL };
+            pthread_cond_timedwait(&wal.filled, &wal.lock, &ts);
+        }
+
+        // Swap, and let the appenders fill the other buffer while this one goes to disk
+        uint8_t *buf = wal.bufs[wal.active];
+        size_t len = wal.fill;
+        uint64_t end = wal.lsn;
+        wal.active ^= 1;
+        wal.fill = 0;
+        pthread_cond_broadcast(&wal.drained);
+        pthread_mutex_unlock(&wal.lock);
+
+        write_batch(buf, len, end - len);
+        __atomic_store_n(&wal.synced, end, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&wal.syncs, wal.syncs + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&wal.bytes, wal.bytes + len, __ATOMIC_RELAXED);
+        if (wal.notify != NULL){
+            wal.notify(wal.notify_arg);
+        }
+
+        pthread_mutex_lock(&wal.lock);
+    }
+    return NULL;
+}
+
+static int segment_order(const void *a, const void *b){
+    const struct wal_segment *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+DIR *wal_opendir(int dirfd){
+    /* Open a directory stream on a copy of dirfd, rewound to the start (the copy shares its
+    offset with dirfd, which an earlier listing left at the end). closedir() closes the copy.
+
+    return:
+        The stream, NULL on error.
+    */
+    int fd = dup(dirfd);
+    if (fd == -1){
+        return NULL;
+    }
+    DIR *d = fdopendir(fd);
+    if (d == NULL){
+        close(fd);
+        return NULL;
+    }
+    rewinddir(d);
+    return d;
+}
+
+int wal_list(int dirfd, struct wal_segment **segments){
+    /* Every segment in a log directory, oldest first.
+
+    params:
+        dirfd (int): The directory, opened O_RDONLY.
+        segments (wal_segment **): Set to a malloc()ed array (NULL when there are none).
+
+    return:
+        Number of segments, -1 on error.
+    */
+    DIR *d = wal_opendir(dirfd);
+    struct dirent *entry;
+    struct wal_segment *list = NULL;
+    int count = 0;
+    int cap = 0;
+
+    *segments = NULL;
+    if (d == NULL){
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL){
+        uint64_t start;
+        char tail;
+        struct stat st;
+        if (sscanf(entry->d_name, "wal-%16" SCNx64 ".lo%c", &start, &tail) != 2 || tail != 'g' || strlen(entry->d_name) != 24){
+            continue;
+        }
+        if (fstatat(dirfd, entry->d_name, &st, 0) == -1){
+            free(list);
+            closedir(d);
+            return -1;
+        }
+        if (count == cap){
+            cap = cap ? cap * 2 : 16;
+            struct wal_segment *grown = realloc(list, cap * sizeof(*list));
+            if (grown == NULL){
+                free(list);
+                closedir(d);
+                return -1;
+            }
+            list = grown;
+        }
+        list[count].start = start;
+        list[count].size = st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    qsort(list, count, sizeof(*list), segment_order);
+    *segments = list;
+    return count;
+}
+
+static int find_end(uint64_t *lsn){
+    /* Where the log left off: the end of the segment with the highest start LSN, 0 if there
+    are none.
+
+    return:
+        0 on success, -1 on error.
+    */
+    struct wal_segment *segments;
+    int count = wal_list(wal.dirfd, &segments);
+
+    if (count == -1){
+        return -1;
+    }
+    *lsn = count > 0 ? segments[count - 1].start + segments[count - 1].size : 0;
+    free(segments);
+    return 0;
+}
+
+int wal_init(const char *dir, int group_usec, int segment_mb){
+    /* Open (or create) the log directory, pick up where an earlier run left off and start the
+    syncer thread. Must be called before the pipeline is created.
+
+    params:
+        dir (char *): -D directory.
+        group_usec (int): -G, most microseconds a batch waits for more records before its sync.
+        segment_mb (int): -S, megabytes per segment.
+
+    return:
+        0 on success, -1 on error.
+    */
+    pthread_condattr_t attr;
+    uint64_t lsn;
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST){
+        fprintf(stderr, "Can't create the log directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    wal.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (wal.dirfd == -1 || find_end(&lsn) == -1){
+        fprintf(stderr, "Can't read the log directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if (open_segment(lsn) == -1){
+        fprintf(stderr, "Can't open a log segment in %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    wal.group_ns = (uint64_t)group_usec * 1000;
+    wal.segment_bytes = (uint64_t)segment_mb << 20;
+    wal.lsn = lsn;
+    wal.synced = lsn;
+    wal.bufs[0] = malloc(WAL_BUF_SIZE);
+    wal.bufs[1] = malloc(WAL_BUF_SIZE);
+    if (wal.bufs[0] == NULL || wal.bufs[1] == NULL){
+        fprintf(stderr, "Out of memory for the log buffers.\n");
+        return -1;
+    }
+
+    // Batch deadlines are on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal.filled, &attr);
+    pthread_cond_init(&wal.drained, NULL);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&wal.thread, NULL, syncer_main, NULL) != 0){
+        fprintf(stderr, "Failed to start the log syncer.\n");
+        return -1;
+    }
+    wal.enabled = 1;
+    return 0;
+}
+
+int wal_enabled(void){
+    return wal.enabled;
+}
+
+void wal_notify(wal_sync_fn fn, void *arg){
+    // Set the callback run after every sync (before any record is appended)
+    wal.notify_arg = arg;
+    wal.notify = fn;
+}
+
+uint64_t wal_append(uint32_t sender, const uint8_t *values, uint32_t count){
+    /* Add one frame's values to the current batch.
+
+    params:
+        sender (uint32_t): Who sent them, from agg_sender_of().
+        values (uint8_t *): 'count' network order uint32_t values, not necessarily aligned.
+        count (uint32_t): How many there are.
+
+    return:
+        The record's LSN, it is on disk once wal_synced() reaches it.
+    */
+    struct timespec ts;
+    struct wal_record rec;
+    size_t size = sizeof(rec) + (size_t)count * sizeof(uint32_t);
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec.count = count;
+    rec.sender = sender;
+    rec.time = (uint32_t)ts.tv_sec;
+    rec.crc = wal_crc(0, &rec.count, sizeof(rec) - sizeof(rec.crc));
+    rec.crc = wal_crc(rec.crc, values, (size_t)count * sizeof(uint32_t));
+
+    pthread_mutex_lock(&wal.lock);
+    while (wal.fill + size > WAL_BUF_SIZE){
+        // Both buffers are busy, wait for the syncer to take this one
+        pthread_cond_signal(&wal.filled);
+        pthread_cond_wait(&wal.drained, &wal.lock);
+    }
+    uint8_t *dst = wal.bufs[wal.active] + wal.fill;
+    memcpy(dst, &rec, sizeof(rec));
+    memcpy(dst + sizeof(rec), values, (size_t)count * sizeof(uint32_t));
+    if (wal.fill == 0){
+        wal.first_ns = now_ns();
+    }
+    wal.fill += size;
+    wal.lsn += size;
+    uint64_t lsn = wal.lsn;
+
+    // Wake the syncer for a batch's first record (it starts the -G clock) and once it's big enough
+    if (wal.fill == size || (wal.fill >= WAL_GROUP_BYTES && wal.fill - size < WAL_GROUP_BYTES)){
+        pthread_cond_signal(&wal.filled);
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+uint64_t wal_synced(void){
+    // End of the last record known to be on disk
+    return __atomic_load_n(&wal.synced, __ATOMIC_SEQ_CST);
+}
+
+void wal_counts(uint64_t *syncs, uint64_t *bytes){
+    // For the stats: syncs done and bytes written so far
+    *syncs = __atomic_load_n(&wal.syncs, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&wal.bytes, __ATOMIC_RELAXED);
+}
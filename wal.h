@@ -0,0 +1,62 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <dirent.h>
+
+/* Write-ahead log of the received values for durable mode (-D), see wal.c.
+
+    Processing threads append every frame's values to an in-memory batch and carry on. A
+    syncer thread writes each batch to the current segment and fdatasync()s it: one sync
+    covers every frame that arrived while the previous one ran (group commit), however many
+    clients sent them. A batch is synced once it holds WAL_GROUP_BYTES, or at most -G
+    microseconds after its first record. The pipeline only hands a frame's ack back to its
+    worker once wal_synced() has passed the frame's record, so an acked value is on disk.
+
+    On disk the log is a directory of segments named wal-<lsn>.log, where an LSN is a byte
+    offset into the whole log (16 hex digits) and a segment's name is the LSN it starts at. A
+    new segment is started once the current one holds -S megabytes. Every segment is a run of
+    records, a wal_record followed by its values. A crash can leave a torn record at the end
+    of the last segment: its crc won't match, and the log goes on in the next segment, which
+    starts right after the end of the file as it was found.
+
+    WAL_DEFAULT_GROUP_USEC is the -G default, WAL_DEFAULT_SEGMENT_MB the -S default.
+*/
+#define WAL_DEFAULT_GROUP_USEC 500
+#define WAL_MAX_GROUP_USEC 1000000
+#define WAL_DEFAULT_SEGMENT_MB 64
+#define WAL_MAX_SEGMENT_MB 4096
+#define WAL_BUF_SIZE (4 << 20)       // each of the two batch buffers
+#define WAL_GROUP_BYTES (1 << 20)    // a batch this big is synced without waiting out -G
+
+struct wal_record
+{
+    uint32_t crc;     // crc32c of the rest of the record, values included
+    uint32_t count;   // values that follow
+    uint32_t sender;  // agg_sender_of() the peer that sent them
+    uint32_t time;    // unix seconds they were received
+    // count uint32_t values follow, network order as they came off the wire
+};
+
+// Called by the syncer thread after every sync
+typedef void (*wal_sync_fn)(void *arg);
+
+// One segment file, as found by wal_list()
+struct wal_segment
+{
+    uint64_t start;  // LSN of its first byte
+    uint64_t size;   // file size
+};
+
+int wal_init(const char *dir, int group_usec, int segment_mb);
+int wal_enabled(void);
+void wal_notify(wal_sync_fn fn, void *arg);
+uint64_t wal_append(uint32_t sender, const uint8_t *values, uint32_t count);
+uint64_t wal_synced(void);
+void wal_counts(uint64_t *syncs, uint64_t *bytes);
+uint32_t wal_crc(uint32_t crc, const void *data, size_t len);
+int wal_list(int dirfd, struct wal_segment **segments);
+DIR *wal_opendir(int dirfd);
+
+#endif